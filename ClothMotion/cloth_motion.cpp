@@ -1,15 +1,18 @@
 #include "cloth_motion.h"
-#include "simulation\simulation.h"
-#include "simulation\separateobs.h"
-#include "simulation\io.h"
-#include "simulation\magic.h"
-#include "simulation\simulation.h"
-#include "simulation\collisionutil.h"
-#include "simulation\referenceshape.hpp"
+#include "simulation/simulation.h"
+#include "simulation/separateobs.h"
+#include "simulation/io.h"
+#include "simulation/magic.h"
+#include "simulation/simulation.h"
+#include "simulation/collisionutil.h"
+#include "simulation/referenceshape.hpp"
 #include "triangulate.h"
 #include <assert.h>
-#include <QProgressDialog>
 #include <QString>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
 
 struct Velocity
 { 
@@ -17,51 +20,142 @@ struct Velocity
 	Vec3 v, w, o; 
 };
 
-ClothHandler::ClothHandler() : frame_(0), sim_(&sim), fps_(new Timer), clothes_(sim_->cloths) {}
+ClothHandler::ClothHandler() : frame_(0), sim_(&sim), fps_(new Timer), clothes_(sim_->cloths),
+	cmfile_name_("cloth_motion.cm"), cache_encoding_(ClothMotionFormat::Float32),
+	proxy_cell_(0), proxy_margin_(0) {}
 
 const double ClothHandler::shrinkFactor = 1.f;
 
+// Vertices with equal keys share one obstacle node: the exact position, or
+// the grid cell for vertices simplified by the obstacle proxy.
+struct WeldKey
+{
+	bool cell;
+	double k[3];
+
+	bool operator<(const WeldKey & other) const
+	{
+		if(cell != other.cell)
+			return cell < other.cell;
+		for(int i = 0; i < 3; ++i)
+			if(k[i] != other.k[i])
+				return k[i] < other.k[i];
+		return false;
+	}
+};
+
+typedef std::pair<int, std::pair<int, int> > FaceKey;
+
+static bool inside_boxes(const Vec3 & x, const std::vector<Vec3> & lo, const std::vector<Vec3> & hi)
+{
+	for(size_t b = 0; b < lo.size(); ++b)
+		if(x[0] >= lo[b][0] && x[1] >= lo[b][1] && x[2] >= lo[b][2]
+			&& x[0] <= hi[b][0] && x[1] <= hi[b][1] && x[2] <= hi[b][2])
+			return true;
+	return false;
+}
+
 void ClothHandler::init_avatars_to_handler(
 	DoubleDataBuffer position, 
 	DoubleDataBuffer texcoords, 
 	IntDataBuffer indices,
+	size_t vertexNum,
 	size_t faceNum
 	)
 {
-	Obstacle obs;
-
-	for(int index = 0; index != faceNum; ++index)
+	// regions the proxy keeps at full resolution, from the cloth as it is now
+	// (frame 0); they are not updated as the cloth moves
+	std::vector<Vec3> lo, hi;
+	if(proxy_cell_ > 0)
 	{
-		for(int nindex = 0; nindex != 3; ++nindex)
+		for(size_t c = 0; c < clothes_.size(); ++c)
 		{
-			Vec3 x;
-			x[0] = position[index * 9 + nindex * 3 ];
-			x[1] = position[index * 9 + nindex * 3 + 1];
-			x[2] = position[index * 9 + nindex * 3 + 2];
-			obs.base_mesh.add(new Node(x, x, Vec3(0), 0, 0, false));
-
-			Vec2 u;
-			u[0] = texcoords[index * 6 + nindex * 2];
-			u[0] = texcoords[index * 6 + nindex * 2 + 1];
-			obs.base_mesh.add(new Vert(expand_xy(u)));
-		}	
+			const Mesh & mesh = clothes_[c]->mesh;
+			Vec3 l(infinity), h(-infinity);
+			for(size_t n = 0; n < mesh.nodes.size(); ++n)
+				for(int k = 0; k < 3; ++k)
+				{
+					l[k] = std::min(l[k], mesh.nodes[n]->x[k]);
+					h[k] = std::max(h[k], mesh.nodes[n]->x[k]);
+				}
+			lo.push_back(l - Vec3(proxy_margin_));
+			hi.push_back(h + Vec3(proxy_margin_));
+		}
 	}
 
-	for(int index = 0; index != faceNum; ++index)
+	// weld the skin vertices
+	std::map<WeldKey, int> welded;
+	std::vector<int> vertex_weld(vertexNum), weld_vertex;
+	for(size_t v = 0; v < vertexNum; ++v)
 	{
-		std::vector<Vert*> verts;
-		std::vector<Node*> nodes;
-		for(int nindex = 0; nindex < 3; ++nindex)
+		const double * x = &position[v * 3];
+		WeldKey key;
+		key.cell = proxy_cell_ > 0 && !inside_boxes(Vec3(x[0], x[1], x[2]), lo, hi);
+		for(int k = 0; k < 3; ++k)
+			key.k[k] = key.cell ? floor(x[k] / proxy_cell_) : x[k];
+		std::map<WeldKey, int>::iterator it = welded.find(key);
+		if(it == welded.end())
 		{
-			nodes.push_back(obs.base_mesh.nodes[indices[index * 3 + nindex]]);
-			verts.push_back(obs.base_mesh.verts[indices[index * 3 + nindex]]);
+			it = welded.insert(std::make_pair(key, static_cast<int>(weld_vertex.size()))).first;
+			weld_vertex.push_back(v);
 		}
+		vertex_weld[v] = it->second;
+	}
 
-		for (int v = 0; v < verts.size(); v++)
-			connect(verts[v], nodes[v]);
+	// drop the faces collapsed or duplicated by welding, and those that would
+	// make an edge non-manifold or join faces of opposite winding: an edge
+	// holds one face per direction, and Mesh::add would overwrite the other
+	std::vector<int> face_weld;
+	std::set<FaceKey> face_keys;
+	std::set<std::pair<int, int> > half_edges;
+	for(size_t f = 0; f < faceNum; ++f)
+	{
+		int w[3];
+		for(int c = 0; c < 3; ++c)
+			w[c] = vertex_weld[indices[f * 3 + c]];
+		if(w[0] == w[1] || w[1] == w[2] || w[2] == w[0])
+			continue;
+		int s[3] = {w[0], w[1], w[2]};
+		std::sort(s, s + 3);
+		if(face_keys.count(std::make_pair(s[0], std::make_pair(s[1], s[2]))))
+			continue;
+		bool taken = false;
+		for(int c = 0; c < 3; ++c)
+			taken = taken || half_edges.count(std::make_pair(w[c], w[(c + 1) % 3])) > 0;
+		if(taken)
+			continue;
+		face_keys.insert(std::make_pair(s[0], std::make_pair(s[1], s[2])));
+		for(int c = 0; c < 3; ++c)
+			half_edges.insert(std::make_pair(w[c], w[(c + 1) % 3]));
+		face_weld.insert(face_weld.end(), w, w + 3);
+	}
+
+	// one node and vert for each welded vertex some face still uses
+	Obstacle obs;
+	std::vector<int> weld_node(weld_vertex.size(), -1);
+	avatar_node_vertex_.clear();
+	for(size_t i = 0; i < face_weld.size(); ++i)
+	{
+		int & node = weld_node[face_weld[i]];
+		if(node >= 0)
+			continue;
+		node = obs.base_mesh.nodes.size();
+		int v = weld_vertex[face_weld[i]];
+		Vec3 x(position[v * 3], position[v * 3 + 1], position[v * 3 + 2]);
+		obs.base_mesh.add(new Node(x, x, Vec3(0), 0, 0, false));
+		obs.base_mesh.add(new Vert(expand_xy(Vec2(texcoords[v * 2], texcoords[v * 2 + 1]))));
+		connect(obs.base_mesh.verts.back(), obs.base_mesh.nodes.back());
+		avatar_node_vertex_.push_back(v);
+	}
+
+	for(size_t f = 0; f < face_weld.size(); f += 3)
+	{
+		std::vector<Vert*> verts;
+		for(int c = 0; c < 3; ++c)
+			verts.push_back(obs.base_mesh.verts[weld_node[face_weld[f + c]]]);
 		std::vector<Face*> faces = triangulate(verts);
-		for (int f = 0; f < faces.size(); f++)
-			obs.base_mesh.add(faces[f]);
+		for (int i = 0; i < faces.size(); i++)
+			obs.base_mesh.add(faces[i]);
 	}
 
 	mark_nodes_to_preserve(obs.base_mesh);
@@ -72,25 +166,36 @@ void ClothHandler::init_avatars_to_handler(
 	obs.end_time = infinity;
 	obs.get_mesh(0);
 	sim_->obstacles.push_back(obs);
+
+	avatar_keys_[0].assign(position, position + vertexNum * 3);
+	avatar_keys_[1] = avatar_keys_[0];
 }
 
-void ClothHandler::update_avatars_to_handler(DoubleDataBuffer position)
+double * ClothHandler::next_avatar_key()
 {
-	Mesh & mesh = sim_->obstacles[0].curr_state_mesh;
+	avatar_keys_[0].swap(avatar_keys_[1]);
+	return &avatar_keys_[1][0];
+}
 
-	for(size_t index = 0; index != mesh.nodes.size(); ++index)
+void ClothHandler::update_avatars_to_handler(double t)
+{
+	Mesh & mesh = sim_->obstacles[0].curr_state_mesh;
+	const double * prev = &avatar_keys_[0][0];
+	const double * next = &avatar_keys_[1][0];
+	const double inv_dt = 1 / sim_->step_time;
+
+	// the material space never changes, and the world space data is refreshed
+	// by update_obstacles() at the start of the step
+	const int num = mesh.nodes.size();
+#pragma omp parallel for
+	for(int index = 0; index < num; ++index)
 	{
-		Vec3 x;
-		x[0] = position[index * 3 ];
-		x[1] = position[index * 3 + 1];
-		x[2] = position[index * 3 + 2];
 		Node * node = mesh.nodes[index];
-		node->x = x;
-		node->v = (node->x - node->x0) / sim_->step_time; 
+		const int v = avatar_node_vertex_[index] * 3;
+		for(int k = 0; k < 3; ++k)
+			node->x[k] = prev[v + k] + t * (next[v + k] - prev[v + k]);
+		node->v = (node->x - node->x0) * inv_dt;
 	}
-
-	mark_nodes_to_preserve(mesh);
-	compute_ms_data(mesh);
 }
 
 // used to import obj cloth file
@@ -212,8 +317,11 @@ void ClothHandler::transform_cloth(const float * transform, size_t clothIndex)
 	trans.rotation.v = Vec3(transform[4], transform[5], transform[6]);
 	trans.rotation.s = transform[7];
 	if (abs(trans.scale - 1.0f) > 0.0001f)
+	{
 		for (int v = 0; v < cloth->mesh.verts.size(); v++)
 			cloth->mesh.verts[v]->u *= trans.scale;
+		cloth->mesh.revision++; // texcoords of the render stream changed
+	}
 
 	apply_transformation(cloth->mesh, trans);
 	compute_ms_data(cloth->mesh);
@@ -221,24 +329,11 @@ void ClothHandler::transform_cloth(const float * transform, size_t clothIndex)
 
 void ClothHandler::update_buffer()
 {
-	position_buffer_.clear();
-	normal_buffer_.clear();
-	texcoord_buffer_.clear();
-	Mesh & mesh = sim_->cloths[0]->mesh;
-	for(auto face_it = mesh.faces.begin(); face_it != mesh.faces.end(); ++face_it)
-	{
-		Face * face = *face_it;
-		for(int i = 0; i < 3; ++i)
-		{
-			for(int j = 0; j < 3; ++j)
-			{
-				position_buffer_.push_back(static_cast<float>(face->v[i]->node->x[j]));	
-				normal_buffer_.push_back(static_cast<float>(face->v[i]->node->n[j]));
-			}
-			for(int j = 0; j < 2; ++j)
-				texcoord_buffer_.push_back(static_cast<float>(face->v[i]->u[j]));
-		}
-	}
+	const Mesh & mesh = sim_->cloths[0]->mesh;
+	vertex_stream_.update_topology(mesh);
+	vertex_buffer_.resize(vertex_stream_.vertex_count() * ClothVertexStream::VertexFloats);
+	if(!vertex_buffer_.empty())
+		vertex_stream_.write_vertices(mesh, &vertex_buffer_[0]);
 }
 
 /*void ClothHandler::add_clothes_to_handler(
@@ -297,25 +392,55 @@ void ClothHandler::init_simulation()
 	sim_->enabled[Simulation::Plasticity] = false;
     sim_->enabled[Simulation::Fracture] = false;
 
+	// optional settings
+	while(fs >> label)
+	{
+		if(label == "cache_encoding")
+		{
+			std::string encoding;
+			fs >> encoding;
+			if(encoding == "float16")
+				cache_encoding_ = ClothMotionFormat::Float16;
+			else if(encoding == "delta16")
+				cache_encoding_ = ClothMotionFormat::Delta16;
+			else
+				cache_encoding_ = ClothMotionFormat::Float32;
+		}
+		else if(label == "linear_solver")
+		{
+			std::string solver;
+			fs >> solver;
+			if(solver == "cg_jacobi")
+				magic.linear_solver = Magic::JacobiCG;
+			else if(solver == "cg_ic")
+				magic.linear_solver = Magic::CholeskyCG;
+			else if(solver == "cholesky")
+				magic.linear_solver = Magic::SupernodalLLT;
+			else
+				magic.linear_solver = Magic::TaucsLLT;
+		}
+		else if(label == "cg_tolerance")
+			fs >> magic.cg_tolerance;
+		else if(label == "cg_max_iterations")
+			fs >> magic.cg_max_iterations;
+		else if(label == "proximity_margin")
+			fs >> magic.proximity_margin;
+	}
+
 	fs.close();
 }
 
 bool ClothHandler::begin_simulate()
 {
-	if(clothes_frame_.size())
-	{
-		for(size_t i = 0; i < clothes_frame_.size(); ++i)
-		{
-			clothes_frame_[i].clear();
-		}
-		clothes_frame_.clear();
-	}
-	clothes_frame_.resize(clothes_.size());
+	cm_reader_.close();
 	init_simulation();
+	if(!init_cmfile(cmfile_name_.c_str()))
+		std::cerr << "can not create cloth motion file " << cmfile_name_ << std::endl;
 	prepare(*sim_);
 	::meshes = &sim_->cloth_meshes;
 	::obs_meshes = &sim_->obstacle_meshes;
-	separate_obstacles(sim_->obstacle_meshes, sim_->cloth_meshes);
+	if(!separate_obstacles(sim_->obstacle_meshes, sim_->cloth_meshes))
+		return false;
 	return relax_initial_state(*sim_);
 }
 
@@ -334,96 +459,29 @@ bool ClothHandler::sim_next_step()
 
 bool ClothHandler::load_cmfile_to_replay(const char * fileName)
 {
-	/*std::ifstream ifs(fileName);
-	std::string tag;
-	int cloth, frame, total_frame;
-
-	clothes_frame_.clear();
-
-	ifs >> tag >> cloth;
-	if(tag.compare("cloth") != 0)
-		return false;
-
-	ifs >> tag >> total_frame;
-	if(tag.compare("total_frame") != 0)
+	if(!cm_reader_.open(fileName))
 		return false;
-
-	QProgressDialog process(NULL);  
-	process.setLabelText(QString("loading..."));  
-	process.setRange(0, total_frame);  
-	process.setModal(true);  
-	process.setCancelButtonText(QString("cancel"));
-
-	while(ifs >> tag >> frame)
+	if(cm_reader_.cloth_num() != clothes_.size())
 	{
-		process.setValue(frame);
-		if(process.wasCanceled())  
-			break;
-		if(tag.compare("frame") != 0)
-			return false;
-		for(int cloth_index = 0; cloth_index < cloth; ++cloth_index)
-		{
-			SmtClothPtr cloth(new SimCloth);
-			Mesh & mesh = cloth->mesh;
-			int vertexNum = 0;
-			ifs >> tag >> vertexNum;
-			if(tag.compare("vertex") != 0)
-				return false;
-			int faceNum = vertexNum / 3;
-			for(int face_index = 0; face_index < faceNum; ++face_index)
-			{
-				Vert * vert[3];
-				for(int face_vert_index = 0; face_vert_index < 3; ++face_vert_index)
-				{
-					double x, y, z;
-					ifs >> x >> y >> z;
-					vert[face_vert_index] = new Vert;
-					Node * node = new Node(Vec3(x, y, z));
-					vert[face_vert_index]->node = node;
-					mesh.verts.push_back(vert[face_vert_index]);
-					mesh.nodes.push_back(node);
-				}
-				Face * face = new Face(vert[0], vert[1], vert[2]);
-				vert[0]->adjf.push_back(face);
-				vert[1]->adjf.push_back(face);
-				vert[2]->adjf.push_back(face);
-				mesh.faces.push_back(face);
-			}	
-			compute_ws_data(cloth->mesh);
-			clothes_frame_.push_back(cloth);
-		}
+		cm_reader_.close();
+		return false;
 	}
-	sim_->cloths.resize(1);*/
 	return true;
 }
 
-void ClothHandler::init_cmfile(const char * fileName, int totalFrame)
+bool ClothHandler::init_cmfile(const char * fileName)
 {
-	// abandonded
-
-	/*clothMotionFile_.open(fileName);
-	clothMotionFile_ << "cloth " << clothes_.size() << std::endl;
-	clothMotionFile_ << "total_frame " << totalFrame << std::endl;*/
+	return cm_writer_.open(fileName, clothes_.size(), cache_encoding_);
 }
 
 void ClothHandler::write_frame(int frame)
 {
-	for(size_t i = 0; i < clothes_.size(); i++)
-	{
-		SmtClothPtr copy_cloth(new SimCloth);
-		copy_cloth->mesh = deep_copy(clothes_[i]->mesh);
-		clothes_frame_[i].push_back(copy_cloth);
-	}
+	cm_writer_.write_frame(frame, clothes_);
 }
 
 void ClothHandler::save_cmfile()
 {
-	// abandonded
-
-	/*if(clothMotionFile_.is_open())
-	{
-		clothMotionFile_.close();
-	}*/
+	cm_writer_.close();
 }
 
 void ClothHandler::apply_velocity(Mesh &mesh, const Velocity &vel)
@@ -438,10 +496,10 @@ size_t ClothHandler::cloth_num() { return clothes_.size(); }
 
 void ClothHandler::load_frame(int frame)
 {
-	if(frame > static_cast<int>(clothes_frame_[0].size()) - 1)
-		frame = static_cast<int>(clothes_frame_[0].size()) - 1;
-	for(size_t i = 0; i < sim_->cloths.size(); ++i)
-		clothes_[i]->mesh = clothes_frame_[i][frame]->mesh;
+	if(!cm_reader_.is_open())
+		return;
+	for(size_t i = 0; i < clothes_.size(); ++i)
+		cm_reader_.load_frame(frame, i, *clothes_[i]);
 }
 
 void ClothHandler::init_cloth(SimCloth &cloth)
@@ -4,7 +4,10 @@
 #include <memory>
 #include <vector>
 #include <fstream>
-#include "simulation\simcloth.h"
+#include <string>
+#include "simulation/simcloth.h"
+#include "cloth_motion_cache.h"
+#include "cloth_vertex_stream.h"
 
 struct Simulation;
 struct Mesh;
@@ -24,35 +27,53 @@ public:
 
 	ClothHandler();
 
+	// position and texcoords are given per skin vertex, indices per face
+	// corner. Coincident vertices are welded into one obstacle node.
 	void init_avatars_to_handler(
 		DoubleDataBuffer position, 
 		DoubleDataBuffer texcoords, 
 		IntDataBuffer indices,
+		size_t vertexNum,
 		size_t faceNum
 		);
+	// Simplified collision proxy for the avatar: skin vertices farther than
+	// margin from the bounding box of every cloth are clustered on a grid of
+	// the given cell size. A cell size of 0 keeps the full skin. The boxes
+	// are taken from the cloth when the avatar is added (frame 0) and are not
+	// updated as the cloth moves, so the margin must cover its travel.
+	void set_obstacle_proxy(double cell, double margin) { proxy_cell_ = cell; proxy_margin_ = margin; }
 	/*void add_clothes_to_handler(
 	DoubleDataBuffer position, 
 	DoubleDataBuffer texcoords, 
 	IntDataBuffer indices,
 	size_t faceNum
 	);*/
-	void update_avatars_to_handler(DoubleDataBuffer position);
+	// The avatar is skinned only at sampled animation frames, straight into a
+	// key pose buffer owned by the handler; the simulation steps in between
+	// interpolate the previous and the next key.
+	double * next_avatar_key();
+	void update_avatars_to_handler(double t);
 
 	// Temporary used to import obj cloth file
 	void add_clothes_to_handler(const char * filename);
 	void add_clothes_to_handler(SimCloth * cloth) {clothes_.push_back(cloth);}
+	// indexed stream of the first cloth, see ClothVertexStream
 	void update_buffer();
-	std::vector<float> get_position() { return position_buffer_; }
-	std::vector<float> get_normal() { return normal_buffer_; }
-	std::vector<float> get_texcoord() { return texcoord_buffer_; }
+	const std::vector<float> & get_vertices() const { return vertex_buffer_; }
+	const std::vector<float> & get_texcoord() const { return vertex_stream_.texcoords(); }
+	const std::vector<unsigned int> & get_indices() const { return vertex_stream_.indices(); }
 
 	bool begin_simulate();
 	bool sim_next_step();
 	bool load_cmfile_to_replay(const char * fileName);
+	int replay_frame_count() const { return cm_reader_.frame_count(); }
 	void load_frame(int frame);
 	void transform_cloth(const float * transform, size_t clothIndex);
 
-	void init_cmfile(const char * fileName, int totalFrame);
+	// cloth motion cache, written while simulating and mapped for replay
+	void set_cmfile(const char * fileName) { cmfile_name_ = fileName; }
+	const std::string & cmfile_name() const { return cmfile_name_; }
+	bool init_cmfile(const char * fileName);
 	void write_frame(int frame);
 	void save_cmfile();
 
@@ -71,11 +92,15 @@ private:
 	int frame_;
 	std::tr1::shared_ptr<Timer> fps_;
 	std::vector<SimCloth*> & clothes_;
-	std::vector<std::vector<SmtClothPtr > > clothes_frame_;
-	std::vector<float> position_buffer_;
-	std::vector<float> normal_buffer_;
-	std::vector<float> texcoord_buffer_;
-	std::ofstream clothMotionFile_;
+	ClothVertexStream vertex_stream_;
+	std::vector<float> vertex_buffer_; // interleaved position and normal per vert
+	std::vector<double> avatar_keys_[2]; // previous and next obstacle key poses, xyz per skin vertex
+	std::vector<int> avatar_node_vertex_; // skin vertex each obstacle node follows
+	double proxy_cell_, proxy_margin_;
+	ClothMotionWriter cm_writer_;
+	ClothMotionReader cm_reader_;
+	std::string cmfile_name_;
+	int cache_encoding_;
 
 	static const double shrinkFactor;
 };
@@ -0,0 +1,479 @@
+#include "cloth_motion_cache.h"
+#include "simulation/simcloth.h"
+#include <string.h>
+#include <QFile>
+
+const char ClothMotionFormat::magic[4] = { 'V', 'S', 'C', 'M' };
+
+unsigned short ClothMotionFormat::float_to_half(float value)
+{
+	unsigned int f;
+	memcpy(&f, &value, sizeof(f));
+	unsigned int sign = (f >> 16) & 0x8000;
+	int exponent = static_cast<int>((f >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = f & 0x7fffff;
+
+	if(((f >> 23) & 0xff) == 0xff) // inf or nan
+		return static_cast<unsigned short>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	if(exponent >= 0x1f) // overflow
+		return static_cast<unsigned short>(sign | 0x7c00);
+	if(exponent <= 0) // subnormal or zero
+	{
+		if(exponent < -10)
+			return static_cast<unsigned short>(sign);
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if((mantissa >> (shift - 1)) & 1)
+			++half;
+		return static_cast<unsigned short>(sign | half);
+	}
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if(mantissa & 0x1000) // round to nearest, carry into the exponent is intended
+		++half;
+	return static_cast<unsigned short>(half);
+}
+
+float ClothMotionFormat::half_to_float(unsigned short value)
+{
+	unsigned int sign = (value & 0x8000) << 16;
+	unsigned int exponent = (value >> 10) & 0x1f;
+	unsigned int mantissa = value & 0x3ff;
+	unsigned int f;
+
+	if(exponent == 0)
+	{
+		if(mantissa == 0)
+			f = sign;
+		else // subnormal
+		{
+			exponent = 127 - 15 + 1;
+			while(!(mantissa & 0x400))
+			{
+				mantissa <<= 1;
+				--exponent;
+			}
+			f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if(exponent == 0x1f)
+		f = sign | 0x7f800000 | (mantissa << 13);
+	else
+		f = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+	float result;
+	memcpy(&result, &f, sizeof(result));
+	return result;
+}
+
+namespace
+{
+	template <typename T> void put(std::vector<char> & buffer, const T & value)
+	{
+		const char * p = reinterpret_cast<const char *>(&value);
+		buffer.insert(buffer.end(), p, p + sizeof(T));
+	}
+
+	template <typename T> T get(const char *& p)
+	{
+		T value;
+		memcpy(&value, p, sizeof(T));
+		p += sizeof(T);
+		return value;
+	}
+
+	int frame_mode(const char * payload)
+	{
+		return get<int>(payload);
+	}
+
+	const size_t record_header_size = 4 * sizeof(int);
+	const size_t file_header_size = sizeof(ClothMotionFormat::magic) + 3 * sizeof(int);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// ClothMotionWriter
+
+ClothMotionWriter::ClothMotionWriter() : encoding_(ClothMotionFormat::Float32) {}
+
+ClothMotionWriter::~ClothMotionWriter() { close(); }
+
+bool ClothMotionWriter::open(const char * fileName, size_t clothNum, int encoding)
+{
+	close();
+	ofs_.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if(!ofs_.is_open())
+		return false;
+
+	encoding_ = encoding;
+	states_.assign(clothNum, ClothState());
+	for(size_t i = 0; i < states_.size(); ++i)
+	{
+		states_[i].has_topology = false;
+		states_[i].nnodes = 0;
+		states_[i].frames_since_key = 0;
+	}
+
+	int header[3] = { ClothMotionFormat::Version, static_cast<int>(clothNum), encoding };
+	ofs_.write(ClothMotionFormat::magic, sizeof(ClothMotionFormat::magic));
+	ofs_.write(reinterpret_cast<const char *>(header), sizeof(header));
+	return ofs_.good();
+}
+
+void ClothMotionWriter::close()
+{
+	if(ofs_.is_open())
+		ofs_.close();
+	states_.clear();
+}
+
+void ClothMotionWriter::write_frame(int frame, const std::vector<SimCloth*> & clothes)
+{
+	if(!ofs_.is_open())
+		return;
+
+	for(size_t i = 0; i < clothes.size() && i < states_.size(); ++i)
+	{
+		Mesh & mesh = clothes[i]->mesh;
+		set_indices(mesh);
+
+		// flips keep every count, so the connectivity itself is compared
+		ClothState & state = states_[i];
+		gather_topology(mesh, vert_nodes_, face_verts_);
+		bool changed = !state.has_topology || state.nnodes != mesh.nodes.size()
+			|| state.vert_nodes != vert_nodes_ || state.face_verts != face_verts_;
+		if(changed)
+		{
+			write_topology(static_cast<int>(i), frame, mesh);
+			state.has_topology = true;
+			state.nnodes = mesh.nodes.size();
+			state.vert_nodes.swap(vert_nodes_);
+			state.face_verts.swap(face_verts_);
+		}
+
+		bool keyframe = changed || state.frames_since_key >= ClothMotionFormat::KeyframeInterval;
+		write_positions(static_cast<int>(i), frame, mesh, keyframe);
+		state.frames_since_key = keyframe ? 1 : state.frames_since_key + 1;
+	}
+	// keep what has been simulated so far readable if the process dies
+	ofs_.flush();
+}
+
+void ClothMotionWriter::gather_topology(const Mesh & mesh, std::vector<int> & vertNodes, std::vector<int> & faceVerts)
+{
+	vertNodes.resize(mesh.verts.size());
+	for(size_t v = 0; v < mesh.verts.size(); ++v)
+		vertNodes[v] = mesh.verts[v]->node->index;
+	faceVerts.resize(mesh.faces.size() * 3);
+	for(size_t f = 0; f < mesh.faces.size(); ++f)
+		for(int i = 0; i < 3; ++i)
+			faceVerts[f * 3 + i] = mesh.faces[f]->v[i]->index;
+}
+
+void ClothMotionWriter::write_topology(int cloth, int frame, const Mesh & mesh)
+{
+	payload_.clear();
+	put(payload_, static_cast<int>(mesh.verts.size()));
+	put(payload_, static_cast<int>(mesh.nodes.size()));
+	put(payload_, static_cast<int>(mesh.faces.size()));
+	for(size_t v = 0; v < mesh.verts.size(); ++v)
+	{
+		const Vert * vert = mesh.verts[v];
+		for(int j = 0; j < 3; ++j)
+			put(payload_, static_cast<float>(vert->u[j]));
+		put(payload_, vert->node->index);
+	}
+	for(size_t f = 0; f < mesh.faces.size(); ++f)
+	{
+		const Face * face = mesh.faces[f];
+		for(int j = 0; j < 3; ++j)
+			put(payload_, face->v[j]->index);
+		put(payload_, face->flag);
+	}
+	write_record(ClothMotionFormat::Topology, cloth, frame);
+}
+
+void ClothMotionWriter::write_positions(int cloth, int frame, const Mesh & mesh, bool keyframe)
+{
+	ClothState & state = states_[cloth];
+	size_t nnodes = mesh.nodes.size();
+	int mode = encoding_;
+	if(encoding_ == ClothMotionFormat::Delta16 && keyframe)
+		mode = ClothMotionFormat::Float32;
+
+	payload_.clear();
+	put(payload_, mode);
+	switch(mode)
+	{
+	case ClothMotionFormat::Float32:
+		if(encoding_ == ClothMotionFormat::Delta16)
+			state.last_x.resize(nnodes * 3);
+		for(size_t n = 0; n < nnodes; ++n)
+			for(int j = 0; j < 3; ++j)
+			{
+				float x = static_cast<float>(mesh.nodes[n]->x[j]);
+				put(payload_, x);
+				if(encoding_ == ClothMotionFormat::Delta16)
+					state.last_x[n * 3 + j] = x;
+			}
+		break;
+	case ClothMotionFormat::Float16:
+		for(size_t n = 0; n < nnodes; ++n)
+			for(int j = 0; j < 3; ++j)
+				put(payload_, ClothMotionFormat::float_to_half(static_cast<float>(mesh.nodes[n]->x[j])));
+		break;
+	case ClothMotionFormat::Delta16:
+		// quantize against the reconstructed previous frame so error does not drift
+		for(size_t n = 0; n < nnodes; ++n)
+			for(int j = 0; j < 3; ++j)
+			{
+				float & last = state.last_x[n * 3 + j];
+				unsigned short delta = ClothMotionFormat::float_to_half(static_cast<float>(mesh.nodes[n]->x[j]) - last);
+				put(payload_, delta);
+				last += ClothMotionFormat::half_to_float(delta);
+			}
+		break;
+	}
+
+	for(size_t n = 0; n < nnodes; ++n)
+		for(int j = 0; j < 3; ++j)
+		{
+			float normal = static_cast<float>(mesh.nodes[n]->n[j]);
+			if(encoding_ == ClothMotionFormat::Float32)
+				put(payload_, normal);
+			else
+				put(payload_, ClothMotionFormat::float_to_half(normal));
+		}
+	write_record(ClothMotionFormat::Frame, cloth, frame);
+}
+
+void ClothMotionWriter::write_record(int type, int cloth, int frame)
+{
+	int header[4] = { type, cloth, frame, static_cast<int>(payload_.size()) };
+	ofs_.write(reinterpret_cast<const char *>(header), sizeof(header));
+	if(!payload_.empty())
+		ofs_.write(&payload_[0], payload_.size());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// ClothMotionReader
+
+ClothMotionReader::ClothMotionReader() : file_(NULL), data_(NULL), cloth_num_(0), encoding_(ClothMotionFormat::Float32) {}
+
+ClothMotionReader::~ClothMotionReader() { close(); }
+
+bool ClothMotionReader::open(const char * fileName)
+{
+	close();
+	file_ = new QFile(QString::fromLocal8Bit(fileName));
+	if(!file_->open(QIODevice::ReadOnly) || file_->size() < static_cast<qint64>(file_header_size))
+	{
+		close();
+		return false;
+	}
+	size_t size = static_cast<size_t>(file_->size());
+	data_ = reinterpret_cast<const char *>(file_->map(0, file_->size()));
+	if(!data_ || memcmp(data_, ClothMotionFormat::magic, sizeof(ClothMotionFormat::magic)) != 0)
+	{
+		close();
+		return false;
+	}
+
+	const char * p = data_ + sizeof(ClothMotionFormat::magic);
+	int version = get<int>(p);
+	cloth_num_ = static_cast<size_t>(get<int>(p));
+	encoding_ = get<int>(p);
+	if(version != ClothMotionFormat::Version)
+	{
+		close();
+		return false;
+	}
+
+	// index records; a trailing partial record or frame is ignored
+	const char * end = data_ + size;
+	std::vector<int> topology(cloth_num_, -1);
+	std::vector<int> frame_numbers;
+	while(static_cast<size_t>(end - p) >= record_header_size)
+	{
+		const char * q = p;
+		int type = get<int>(q);
+		int cloth = get<int>(q);
+		int frame = get<int>(q);
+		int length = get<int>(q);
+		if(length < 0 || static_cast<size_t>(end - q) < static_cast<size_t>(length)
+			|| cloth < 0 || static_cast<size_t>(cloth) >= cloth_num_)
+			break;
+
+		if(type == ClothMotionFormat::Topology)
+		{
+			topology[cloth] = static_cast<int>(topologies_.size());
+			topologies_.push_back(q);
+		}
+		else if(type == ClothMotionFormat::Frame)
+		{
+			if(frames_.empty() || frame_numbers.back() != frame)
+			{
+				FrameEntry entry;
+				entry.data.assign(cloth_num_, NULL);
+				frames_.push_back(entry);
+				frame_numbers.push_back(frame);
+			}
+			frames_.back().data[cloth] = q;
+			frames_.back().topology = topology;
+		}
+		p = q + length;
+	}
+	if(!frames_.empty())
+		for(size_t i = 0; i < cloth_num_; ++i)
+			if(!frames_.back().data[i])
+			{
+				frames_.pop_back();
+				break;
+			}
+
+	loaded_topology_.assign(cloth_num_, -1);
+	decoded_frame_.assign(cloth_num_, -1);
+	decoded_x_.assign(cloth_num_, std::vector<float>());
+	return !frames_.empty();
+}
+
+void ClothMotionReader::close()
+{
+	if(file_)
+	{
+		if(data_)
+			file_->unmap(reinterpret_cast<uchar *>(const_cast<char *>(data_)));
+		file_->close();
+		delete file_;
+	}
+	file_ = NULL;
+	data_ = NULL;
+	cloth_num_ = 0;
+	topologies_.clear();
+	frames_.clear();
+	loaded_topology_.clear();
+	decoded_frame_.clear();
+	decoded_x_.clear();
+}
+
+bool ClothMotionReader::load_frame(int frame, size_t clothIndex, SimCloth & cloth)
+{
+	if(!data_ || frames_.empty() || clothIndex >= cloth_num_)
+		return false;
+	if(frame < 0)
+		frame = 0;
+	if(frame >= frame_count())
+		frame = frame_count() - 1;
+
+	Mesh & mesh = cloth.mesh;
+	int topology = frames_[frame].topology[clothIndex];
+	bool rebuilt = topology != loaded_topology_[clothIndex];
+	if(rebuilt)
+	{
+		build_topology(topologies_[topology], cloth);
+		loaded_topology_[clothIndex] = topology;
+	}
+
+	decode_positions(frame, clothIndex, mesh);
+	if(rebuilt)
+		compute_ms_data(mesh);
+
+	// normals follow the positions in the frame payload
+	size_t nnodes = mesh.nodes.size();
+	const char * p = frames_[frame].data[clothIndex];
+	int mode = get<int>(p);
+	p += nnodes * 3 * (mode == ClothMotionFormat::Float32 ? sizeof(float) : sizeof(unsigned short));
+	for(size_t n = 0; n < nnodes; ++n)
+		for(int j = 0; j < 3; ++j)
+		{
+			if(encoding_ == ClothMotionFormat::Float32)
+				mesh.nodes[n]->n[j] = get<float>(p);
+			else
+				mesh.nodes[n]->n[j] = ClothMotionFormat::half_to_float(get<unsigned short>(p));
+		}
+	return true;
+}
+
+void ClothMotionReader::build_topology(const char * payload, SimCloth & cloth)
+{
+	Mesh & mesh = cloth.mesh;
+	delete_mesh(mesh);
+
+	const char * p = payload;
+	int nverts = get<int>(p);
+	int nnodes = get<int>(p);
+	int nfaces = get<int>(p);
+
+	for(int n = 0; n < nnodes; ++n)
+		mesh.add(new Node(Vec3(0), Vec3(0), Vec3(0), 0, 0, false));
+	for(int v = 0; v < nverts; ++v)
+	{
+		Vec3 u;
+		for(int j = 0; j < 3; ++j)
+			u[j] = get<float>(p);
+		Vert * vert = new Vert(u);
+		mesh.add(vert);
+		connect(vert, mesh.nodes[get<int>(p)]);
+	}
+	for(int f = 0; f < nfaces; ++f)
+	{
+		Vert * verts[3];
+		for(int j = 0; j < 3; ++j)
+			verts[j] = mesh.verts[get<int>(p)];
+		int flag = get<int>(p);
+		SimMaterial * material = cloth.materials.empty() ? NULL
+			: cloth.materials[flag < static_cast<int>(cloth.materials.size()) ? flag : 0];
+		Face * face = new Face(verts[0], verts[1], verts[2], Mat3x3(1), Mat3x3(0), material, 0);
+		face->flag = flag;
+		mesh.add(face);
+	}
+}
+
+int ClothMotionReader::node_count(int frame, size_t clothIndex) const
+{
+	const char * p = topologies_[frames_[frame].topology[clothIndex]] + sizeof(int);
+	return get<int>(p);
+}
+
+void ClothMotionReader::decode_positions(int frame, size_t clothIndex, Mesh & mesh)
+{
+	std::vector<float> & x = decoded_x_[clothIndex];
+	int first = frame;
+	if(encoding_ == ClothMotionFormat::Delta16)
+	{
+		// continue from the last decoded frame when seeking forward,
+		// otherwise restart from the preceding keyframe
+		int decoded = decoded_frame_[clothIndex];
+		if(decoded >= 0 && decoded < frame)
+			first = decoded + 1;
+		else
+			while(first > 0 && frame_mode(frames_[first].data[clothIndex]) == ClothMotionFormat::Delta16)
+				--first;
+	}
+
+	for(int f = first; f <= frame; ++f)
+	{
+		const char * p = frames_[f].data[clothIndex];
+		int mode = get<int>(p);
+		size_t count = node_count(f, clothIndex) * 3;
+		if(mode != ClothMotionFormat::Delta16)
+			x.resize(count);
+		for(size_t i = 0; i < count; ++i)
+		{
+			switch(mode)
+			{
+			case ClothMotionFormat::Float32: x[i] = get<float>(p); break;
+			case ClothMotionFormat::Float16: x[i] = ClothMotionFormat::half_to_float(get<unsigned short>(p)); break;
+			case ClothMotionFormat::Delta16: x[i] += ClothMotionFormat::half_to_float(get<unsigned short>(p)); break;
+			}
+		}
+	}
+	decoded_frame_[clothIndex] = frame;
+
+	for(size_t n = 0; n < mesh.nodes.size(); ++n)
+	{
+		Node * node = mesh.nodes[n];
+		node->x = Vec3(x[n * 3], x[n * 3 + 1], x[n * 3 + 2]);
+		node->x0 = node->x;
+	}
+}
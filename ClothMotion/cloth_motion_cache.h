@@ -0,0 +1,114 @@
+#ifndef CLOTH_MOTION_CACHE_H
+#define CLOTH_MOTION_CACHE_H
+
+#include <vector>
+#include <fstream>
+
+struct Mesh;
+struct SimCloth;
+class QFile;
+
+// Binary append-only cloth motion cache (*.cm)
+//
+//   header : "VSCM" version cloth_num encoding
+//   record : type cloth frame size payload[size]
+//
+// A topology record is written for a cloth on its first frame and again
+// only when remeshing changed it; every other frame stores node positions
+// and normals. Records are self-delimiting, so a file cut short by a crash
+// still replays up to its last complete frame.
+struct ClothMotionFormat
+{
+	enum Encoding
+	{
+		Float32,	// positions and normals as float
+		Float16,	// positions and normals as half
+		Delta16		// half position deltas between float keyframes
+	};
+
+	enum RecordType { Topology = 1, Frame = 2 };
+
+	enum { Version = 1, KeyframeInterval = 32 };
+
+	static const char magic[4];
+
+	static unsigned short float_to_half(float value);
+	static float half_to_float(unsigned short value);
+};
+
+class ClothMotionWriter
+{
+public:
+	ClothMotionWriter();
+	~ClothMotionWriter();
+
+	bool open(const char * fileName, size_t clothNum, int encoding);
+	void close();
+	bool is_open() const { return ofs_.is_open(); }
+
+	// appends one frame of every cloth; meshes are only read
+	void write_frame(int frame, const std::vector<SimCloth*> & clothes);
+
+private:
+	struct ClothState
+	{
+		bool has_topology;
+		size_t nnodes;
+		std::vector<int> vert_nodes;	// node index of each vert
+		std::vector<int> face_verts;	// vert index of each face corner
+		int frames_since_key;
+		std::vector<float> last_x;	// reconstructed positions, Delta16 only
+	};
+
+	static void gather_topology(const Mesh & mesh, std::vector<int> & vertNodes, std::vector<int> & faceVerts);
+	void write_topology(int cloth, int frame, const Mesh & mesh);
+	void write_positions(int cloth, int frame, const Mesh & mesh, bool keyframe);
+	void write_record(int type, int cloth, int frame);
+
+	std::ofstream ofs_;
+	int encoding_;
+	std::vector<ClothState> states_;
+	std::vector<char> payload_;
+	std::vector<int> vert_nodes_, face_verts_;	// topology of the frame being written
+};
+
+class ClothMotionReader
+{
+public:
+	ClothMotionReader();
+	~ClothMotionReader();
+
+	bool open(const char * fileName);
+	void close();
+	bool is_open() const { return data_ != NULL; }
+
+	int frame_count() const { return static_cast<int>(frames_.size()); }
+	size_t cloth_num() const { return cloth_num_; }
+
+	// brings cloth.mesh to the given frame; the mesh is rebuilt only when
+	// the frame refers to a different topology than the one last loaded
+	bool load_frame(int frame, size_t clothIndex, SimCloth & cloth);
+
+private:
+	struct FrameEntry
+	{
+		std::vector<const char *> data;	// frame payload per cloth
+		std::vector<int> topology;		// topology record per cloth
+	};
+
+	int node_count(int frame, size_t clothIndex) const;
+	void build_topology(const char * payload, SimCloth & cloth);
+	void decode_positions(int frame, size_t clothIndex, Mesh & mesh);
+
+	QFile * file_;
+	const char * data_;
+	size_t cloth_num_;
+	int encoding_;
+	std::vector<const char *> topologies_;
+	std::vector<FrameEntry> frames_;
+	std::vector<int> loaded_topology_;
+	std::vector<int> decoded_frame_;
+	std::vector<std::vector<float> > decoded_x_;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "cloth_vertex_stream.h"
+#include "simulation/mesh.h"
+#include <map>
+
+ClothVertexStream::ClothVertexStream()
+	: mesh_(0), revision_(0), vertex_count_(0)
+{
+}
+
+bool ClothVertexStream::update_topology(const Mesh & mesh)
+{
+	if(mesh_ == &mesh && revision_ == mesh.revision && vertex_count_ == mesh.verts.size())
+		return false;
+
+	mesh_ = &mesh;
+	revision_ = mesh.revision;
+	vertex_count_ = mesh.verts.size();
+
+	texcoords_.resize(vertex_count_ * TexcoordFloats);
+	bool indexed = true;	// Vert::index is only reliable after set_indices()
+	for(size_t v = 0; v < vertex_count_; ++v)
+	{
+		const Vert * vert = mesh.verts[v];
+		texcoords_[v * 2] = static_cast<float>(vert->u[0]);
+		texcoords_[v * 2 + 1] = static_cast<float>(vert->u[1]);
+		indexed = indexed && vert->index == static_cast<int>(v);
+	}
+
+	std::map<const Vert *, unsigned int> vert_index;
+	if(!indexed)
+		for(size_t v = 0; v < vertex_count_; ++v)
+			vert_index[mesh.verts[v]] = static_cast<unsigned int>(v);
+
+	indices_.resize(mesh.faces.size() * 3);
+	for(size_t f = 0; f < mesh.faces.size(); ++f)
+	{
+		const Face * face = mesh.faces[f];
+		for(int i = 0; i < 3; ++i)
+			indices_[f * 3 + i] = indexed ? face->v[i]->index : vert_index[face->v[i]];
+	}
+	return true;
+}
+
+void ClothVertexStream::write_vertices(const Mesh & mesh, float * dst) const
+{
+	const int num = static_cast<int>(vertex_count_);
+#pragma omp parallel for
+	for(int v = 0; v < num; ++v)
+	{
+		const Node * node = mesh.verts[v]->node;
+		float * out = dst + v * VertexFloats;
+		for(int j = 0; j < 3; ++j)
+		{
+			out[j] = static_cast<float>(node->x[j]);
+			out[3 + j] = static_cast<float>(node->n[j]);
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef CLOTH_VERTEX_STREAM_H
+#define CLOTH_VERTEX_STREAM_H
+
+#include <vector>
+#include <stddef.h>
+
+struct Mesh;
+
+// Indexed render stream of a cloth mesh.
+//
+// Every Vert is one vertex, so seams keep their own texcoords while sharing
+// the node position. Positions and normals are interleaved and rewritten on
+// every frame; texcoords and triangle indices only change with the topology
+// and are rebuilt when Mesh::revision moved since the last update.
+class ClothVertexStream
+{
+public:
+	enum { VertexFloats = 6, TexcoordFloats = 2 };	// x y z nx ny nz | u v
+
+	ClothVertexStream();
+
+	// Rebuild texcoords and indices if the mesh was remeshed since the last
+	// call, or is a different mesh. Returns whether they were rebuilt.
+	bool update_topology(const Mesh & mesh);
+	// Force the next update_topology() to rebuild, e.g. after the material
+	// space was scaled without touching the topology.
+	void invalidate() { mesh_ = 0; }
+
+	// Write the interleaved positions and normals of every vert to dst,
+	// which holds vertex_count() * VertexFloats floats. dst may be a mapped
+	// GPU buffer; it is written sequentially and never read.
+	void write_vertices(const Mesh & mesh, float * dst) const;
+
+	size_t vertex_count() const { return vertex_count_; }
+	const std::vector<float> & texcoords() const { return texcoords_; }
+	const std::vector<unsigned int> & indices() const { return indices_; }
+
+private:
+	const Mesh * mesh_;
+	int revision_;
+	size_t vertex_count_;
+	std::vector<float> texcoords_;
+	std::vector<unsigned int> indices_;
+};
+
+#endif
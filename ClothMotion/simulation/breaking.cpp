@@ -234,15 +234,15 @@ void local_physics_step(MeshSubset& subset) {
     const double dt = min(1e-4, sim.step_time);
 
     // TODO: local constraints
-    vector<Constraint*> cons;
+    Constraints cons;
     vector<Node*>& nodes = subset.active_nodes;
     vector<Edge*> edges = subset.get_edges();
     vector<Face*> faces = subset.get_faces();
 
     // could be optimized, so it only applies to nodes subset
     if (::magic.relax_method == 1)
-        cons = proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
-                                    sim.friction, sim.obs_friction);
+        proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
+                              sim.friction, sim.obs_friction, cons);
 
     // save old position, and advance boundaries
     for (size_t i=0; i<nodes.size(); i++)
@@ -50,6 +50,11 @@
 #include "mesh.h"
 #include <climits>
 #include <utility>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BVH_SSE
+#include <xmmintrin.h>
+#endif
 using namespace std;
 
 BOX node_box (const Node *node, bool ccd) {
@@ -96,56 +101,6 @@ bool overlap (const BOX &box0, const BOX &box1, float thickness) {
 	return box0.overlaps(dilate(box1, thickness));
 }
 
-float
-DeformBVHTree::refit()
-{
-	getRoot()->refit(_ccd);
-
-	return 0.f;
-}
-
-BOX
-DeformBVHTree::box()
-{
-	return getRoot()->_box;
-}
-
-inline vec3f norm(vec3f &p1, vec3f &p2, vec3f &p3)
-{
-	vec3f s = p2-p1;
-	vec3f t = p3-p1;
-	vec3f n = cross(s,t);
-	return n;
-}
-
-void
-DeformBVHNode::refit(bool ccd)
-{
-	if (isLeaf()) {
-		_box = face_box(getFace(), ccd);
-	} else {
-		getLeftChild()->refit(ccd);
-		getRightChild()->refit(ccd);
-
-		_box = getLeftChild()->_box + getRightChild()->_box;
-	}
-}
-
-bool
-DeformBVHNode::find(Face *face)
-{
-	if (isLeaf())
-		return getFace() == face;
-
-	if (getLeftChild()->find(face))
-		return true;
-
-	if (getRightChild()->find(face))
-		return true;
-
-	return false;
-}
-
 inline float middle_xyz(char xyz, const vec3f &p1, const vec3f &p2, const vec3f &p3)
 {
 	float t0, t1;
@@ -189,40 +144,21 @@ DeformBVHTree::DeformBVHTree(DeformModel &mdl, bool ccd)
 	_mdl = &mdl;
 	_ccd = ccd;
 
-	if (!mdl.verts.empty())
+	if (!mdl.faces.empty())
 		Construct();
-	else
-		_root = NULL;
 }
 
 void
 DeformBVHTree::Construct()
 {
-	BOX total;
-	int count;
-
-    int num_vtx = _mdl->verts.size(),
-        num_tri = _mdl->faces.size();
-
-    for (int i=0; i<num_vtx; i++) {
-        total += _mdl->verts[i]->node->x;
-        if (_ccd)
-            total += _mdl->verts[i]->node->x0;
-    }
-
-    count = num_tri;
+	int num_tri = _mdl->faces.size();
+	int num_nodes = 2*num_tri-1;
 
-    std::map<Face*, BOX> tri_boxes;
-    std::map<Face*, vec3f> tri_centers;
-	
-	aap  pln(total);
+	vector<BOX> tri_boxes(num_tri);
+	vector<vec3f> tri_centers(num_tri);
+	vector<int> lst(num_tri);
 
-	face_buffer = new Face*[count];
-	int left_idx = 0, right_idx = count;
-	
 	for (int i=0; i<num_tri; i++) {
-    	Face* face = _mdl->faces[i];
-		
 		vec3f &p1 = _mdl->faces[i]->v[0]->node->x;
 		vec3f &p2 = _mdl->faces[i]->v[1]->node->x;
 		vec3f &p3 = _mdl->faces[i]->v[2]->node->x;
@@ -231,133 +167,198 @@ DeformBVHTree::Construct()
 		vec3f &pp3 = _mdl->faces[i]->v[2]->node->x0;
 
 		if (_ccd) {
-			tri_centers[face] = vec3f(
+			tri_centers[i] = vec3f(
 				(middle_xyz(0, p1, p2, p3)+middle_xyz(0, pp1, pp2, pp3))*0.5f,
 				(middle_xyz(1, p1, p2, p3)+middle_xyz(1, pp1, pp2, pp3))*0.5f,
 				(middle_xyz(2, p1, p2, p3)+middle_xyz(2, pp1, pp2, pp3))*0.5f);
 		} else {
-			tri_centers[face] = vec3f(
+			tri_centers[i] = vec3f(
 				middle_xyz(0, p1, p2, p3),
 				middle_xyz(1, p1, p2, p3),
 				middle_xyz(2, p1, p2, p3));
 		}
 
-		if (pln.inside(tri_centers[face]))
-			face_buffer[left_idx++] = _mdl->faces[i];
-		else
-			face_buffer[--right_idx] = _mdl->faces[i];
-
-		tri_boxes[face] += p1;
-		tri_boxes[face] += p2;
-		tri_boxes[face] += p3;
+		tri_boxes[i] += p1;
+		tri_boxes[i] += p2;
+		tri_boxes[i] += p3;
 
 		if (_ccd) {
-			tri_boxes[face] += pp1;
-			tri_boxes[face] += pp2;
-			tri_boxes[face] += pp3;
+			tri_boxes[i] += pp1;
+			tri_boxes[i] += pp2;
+			tri_boxes[i] += pp3;
 		}
-	}
 
-	_root = new DeformBVHNode();
-	_root->_box = total;
-	//_root->_count = count;
+		lst[i] = i;
+	}
 
-	if (count == 1) {
-		_root->_face = _mdl->faces[0];
-		_root->_left = _root->_right = NULL;
-	} else {
-		if (left_idx == 0 || left_idx == count)
-			left_idx = count/2;
+	_face.assign(num_nodes, NULL);
+	_left.assign(num_nodes, -1);
+	_parent.assign(num_nodes, -1);
+	_active.assign(num_nodes, true);
+	_bounds.assign(18*num_nodes, 0.f);
 
-		_root->_left = new DeformBVHNode(_root, face_buffer, left_idx, tri_boxes, tri_centers);
-		_root->_right = new DeformBVHNode(_root, face_buffer+left_idx, count-left_idx, tri_boxes, tri_centers);
-	}
+	int next = 1;
+	build(0, &lst[0], num_tri, tri_boxes, tri_centers, next);
+	assert(next == num_nodes);
 }
 
-DeformBVHTree::~DeformBVHTree()
+// Nodes are allocated in sibling pairs in the order they are reached
+// depth-first, so children always come after their parent.
+void
+DeformBVHTree::build(int node, int *lst, int lst_num, const vector<BOX> &tri_boxes, const vector<vec3f> &tri_centers, int &next)
 {
-	if (!_root)
+	assert(lst_num > 0);
+	int n = size();
+
+	if (lst_num == 1) {
+		_face[node] = _mdl->faces[lst[0]];
+		const BOX &box = tri_boxes[lst[0]];
+		for (int k = 0; k < 18; k++)
+			_bounds[k*n+node] = box._dist[k];
 		return;
-	delete _root;
-	delete [] face_buffer;
-}
+	}
 
-//#################################################################
-// called by root
-DeformBVHNode::DeformBVHNode()
-{
-	_face = NULL;
-	_left = _right = NULL;
-	_parent = NULL;
-	//_count = 0;
-	_active = true;
+	int left_num = 1;
+	if (lst_num > 2) { // try to split them
+		BOX box;
+		for (int t=0; t<lst_num; t++)
+			box += tri_boxes[lst[t]];
+
+		aap pln(box);
+		int left_idx = 0, right_idx = lst_num-1;
+
+		for (int t=0; t<lst_num; t++) {
+			if (pln.inside(tri_centers[lst[left_idx]]))
+				left_idx++;
+			else {// swap it
+				swap(lst[left_idx], lst[right_idx--]);
+			}
+		}
+
+		left_num = (left_idx == 0 || left_idx == lst_num) ? lst_num/2 : left_idx;
+	}
+
+	int child = next;
+	next += 2;
+	_left[node] = child;
+	_parent[child] = _parent[child+1] = node;
+
+	build(child, lst, left_num, tri_boxes, tri_centers, next);
+	build(child+1, lst+left_num, lst_num-left_num, tri_boxes, tri_centers, next);
+
+	for (int k = 0; k < 18; k++) {
+		const float *b = &_bounds[k*n];
+		_bounds[k*n+node] = k < 9 ? MIN(b[child], b[child+1]) : MAX(b[child], b[child+1]);
+	}
 }
 
-DeformBVHNode::~DeformBVHNode()
+static inline float box_extent (const float *bounds, int n, int node)
 {
-	if (_left) delete _left;
-	if (_right) delete _right;
+	return bounds[9*n+node] - bounds[node]
+	     + bounds[10*n+node] - bounds[n+node]
+	     + bounds[11*n+node] - bounds[2*n+node];
 }
 
-// called by leaf
-DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, Face *face, std::map<Face*,BOX>& tri_boxes)
+float
+DeformBVHTree::refit()
 {
-	_left = _right = NULL;
-	_parent = parent;
-	_face = face;
-    _box = tri_boxes[face];
-	//_count = 1;
-	_active = true;
+	if (empty())
+		return 0.f;
+
+	int n = size();
+	float *bounds = &_bounds[0];
+	float cost = 0.f;
+
+	// children follow their parent, so a reverse sweep visits them first
+	for (int node = n-1; node >= 0; node--) {
+		if (isLeaf(node)) {
+			BOX box = face_box(getFace(node), _ccd);
+			for (int k = 0; k < 18; k++)
+				bounds[k*n+node] = box._dist[k];
+		} else {
+			int child = getLeftChild(node);
+			for (int k = 0; k < 9; k++) {
+				float *lo = bounds+k*n, *hi = bounds+(k+9)*n;
+				lo[node] = MIN(lo[child], lo[child+1]);
+				hi[node] = MAX(hi[child], hi[child+1]);
+			}
+			cost += box_extent(bounds, n, node);
+		}
+	}
+
+	float root = box_extent(bounds, n, 0);
+	return root > 0 ? cost/root : 0.f;
 }
 
-// called by nodes
-DeformBVHNode::DeformBVHNode(DeformBVHNode *parent, Face **lst, unsigned int lst_num, std::map<Face*,BOX>& tri_boxes, std::map<Face*,vec3f>& tri_centers)
+BOX
+DeformBVHTree::box(int node) const
 {
-	assert(lst_num > 0);
-	_left = _right = NULL;
-	_parent = parent;
-	_face = NULL;
-	//_count = lst_num;
-	_active = true;
+	BOX box;
+	if (empty())
+		return box;
 
-	if (lst_num == 1) {
-		_face = lst[0];
-		_box = tri_boxes[lst[0]];
+	for (int k = 0; k < 9; k++) {
+		box._dist[k] = lower(k)[node];
+		box._dist[k+9] = upper(k)[node];
 	}
-	else { // try to split them
-		for (unsigned int t=0; t<lst_num; t++) {
-			_box += tri_boxes[lst[t]];
-		}
-
-		if (lst_num == 2) { // must split it!
-			_left = new DeformBVHNode(this, lst[0], tri_boxes);
-			_right = new DeformBVHNode(this, lst[1], tri_boxes);
-		} else {
-			aap pln(_box);
-			unsigned int left_idx = 0, right_idx = lst_num-1;
-
-			for (unsigned int t=0; t<lst_num; t++) {
-				if (pln.inside(tri_centers[lst[left_idx]]))
-					left_idx++;
-				else {// swap it
-					Face *tmp = lst[left_idx];
-					lst[left_idx] = lst[right_idx];
-					lst[right_idx--] = tmp;
-				}
-			}
+	return box;
+}
 
-			int hal = lst_num/2;
-			if (left_idx == 0 || left_idx == lst_num)
-			{
-				_left = new DeformBVHNode(this, lst, hal, tri_boxes, tri_centers);
-				_right = new DeformBVHNode(this, lst+hal, lst_num-hal, tri_boxes, tri_centers);
+#ifdef BVH_SSE
+// [p0, p0, p1, p1]
+static inline __m128 load_pair (const float *p)
+{
+	__m128 x = _mm_loadl_pi(_mm_setzero_ps(), (const __m64*)p);
+	return _mm_unpacklo_ps(x, x);
+}
 
-			}
-			else {
-				_left = new DeformBVHNode(this, lst, left_idx, tri_boxes, tri_centers);
-				_right = new DeformBVHNode(this, lst+left_idx, lst_num-left_idx, tri_boxes, tri_centers);
-			}
+// [p0, p1, p0, p1]
+static inline __m128 load_interleaved (const float *p)
+{
+	__m128 x = _mm_loadl_pi(_mm_setzero_ps(), (const __m64*)p);
+	return _mm_movelh_ps(x, x);
+}
+#endif
 
+// same test as overlap(box0, box1, thickness), on up to four pairs at once
+int overlap_children (const DeformBVHTree &tree0, int node0, bool split0,
+                      const DeformBVHTree &tree1, int node1, bool split1,
+                      float thickness)
+{
+	static const float sqrt2 = sqrt(2.0f);
+	int i0 = split0 ? tree0.getLeftChild(node0) : node0;
+	int i1 = split1 ? tree1.getLeftChild(node1) : node1;
+
+#ifdef BVH_SSE
+	__m128 separated = _mm_setzero_ps();
+	for (int k = 0; k < 9; k++) {
+		const float *lo0 = tree0.lower(k)+i0, *hi0 = tree0.upper(k)+i0;
+		const float *lo1 = tree1.lower(k)+i1, *hi1 = tree1.upper(k)+i1;
+		__m128 d = _mm_set1_ps(k < 3 ? thickness : sqrt2*thickness);
+
+		__m128 l0 = split0 ? load_pair(lo0) : _mm_set1_ps(*lo0);
+		__m128 h0 = split0 ? load_pair(hi0) : _mm_set1_ps(*hi0);
+		__m128 l1 = split1 ? load_interleaved(lo1) : _mm_set1_ps(*lo1);
+		__m128 h1 = split1 ? load_interleaved(hi1) : _mm_set1_ps(*hi1);
+
+		separated = _mm_or_ps(separated, _mm_cmpgt_ps(l0, _mm_add_ps(h1, d)));
+		separated = _mm_or_ps(separated, _mm_cmplt_ps(h0, _mm_sub_ps(l1, d)));
+	}
+	return ~_mm_movemask_ps(separated) & 15;
+#else
+	int result = 0;
+	for (int i = 0; i < 4; i++) {
+		int n0 = i0 + (split0 ? i>>1 : 0);
+		int n1 = i1 + (split1 ? i&1 : 0);
+		bool separated = false;
+		for (int k = 0; k < 9 && !separated; k++) {
+			float d = k < 3 ? thickness : sqrt2*thickness;
+			separated = tree0.lower(k)[n0] > tree1.upper(k)[n1] + d
+			         || tree0.upper(k)[n0] < tree1.lower(k)[n1] - d;
 		}
+		if (!separated)
+			result |= 1 << i;
 	}
+	return result;
+#endif
 }
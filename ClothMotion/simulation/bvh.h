@@ -267,63 +267,58 @@ bool overlap (const BOX &box0, const BOX &box1, float thickness);
 
 // ostream &operator<< (ostream &out, const BOX &box) {out << "["<<box._dist[0]<<", "<<box._dist[9]<<"] x ["<<box._dist[1]<<", "<<box._dist[10]<<"] x ["<<box._dist[2]<<", "<<box._dist[11]<<"]"; return out;}
 
-class DeformBVHNode;
 typedef Mesh DeformModel;
 
-class DeformBVHNode {
-public:
-	BOX _box;
-
-	Face *_face;
-
-	DeformBVHNode *_parent;
-	DeformBVHNode *_left;
-	DeformBVHNode *_right;
-
-	bool _active;
-
-public:
-	DeformBVHNode();
-	DeformBVHNode(DeformBVHNode *, Face *, std::map<Face*,BOX>&);
-	DeformBVHNode(DeformBVHNode *, Face **, unsigned int, std::map<Face*,BOX>&, std::map<Face*,vec3f>&);
-
-	~DeformBVHNode();
-
-	void refit(bool=false);
-	bool find(Face *);
-
-	FORCEINLINE DeformBVHNode *getLeftChild() { return _left; }
-	FORCEINLINE DeformBVHNode *getRightChild() { return _right; }
-	FORCEINLINE DeformBVHNode *getParent() { return _parent; }
-
-	FORCEINLINE Face *getFace() { return _face; }
-	FORCEINLINE bool isLeaf() { return _left == NULL; }
-	FORCEINLINE bool isRoot() { return _parent == NULL;}
-
-friend class DeformBVHTree;
-};
-
+// The tree is stored as flat arrays in depth-first order. Siblings are kept
+// next to each other, so an inner node only records the index of its left
+// child and the right child follows it. Bounds are stored plane by plane
+// (structure of arrays), which lets overlap_children() load both children
+// of a node with one SIMD load per plane.
 class DeformBVHTree {
 public:
 	DeformModel		*_mdl;
-	DeformBVHNode	*_root;
-	Face **face_buffer;
-
 	bool _ccd;
 
+	// per node, cleared for subtrees that need not be traversed
+	std::vector<char> _active;
+
 public:
 	DeformBVHTree(DeformModel &, bool);
-	~DeformBVHTree();
 
 	void Construct();
 
+	// returns the summed extents of the inner boxes over those of the root,
+	// which grows as the tree degrades under deformation
 	float refit();
 
-	void do_task_1();
-	void do_task_2();
+	BOX box(int node = 0) const;
 
-	BOX box();
-	FORCEINLINE DeformBVHNode *getRoot() { return _root; }
+	FORCEINLINE bool empty() const { return _face.empty(); }
+	FORCEINLINE int size() const { return (int)_face.size(); }
 
-friend class DeformBVHNode;
+	FORCEINLINE int getLeftChild(int node) const { return _left[node]; }
+	FORCEINLINE int getRightChild(int node) const { return _left[node]+1; }
+	FORCEINLINE int getParent(int node) const { return _parent[node]; }
+
+	FORCEINLINE Face *getFace(int node) const { return _face[node]; }
+	FORCEINLINE bool isLeaf(int node) const { return _left[node] < 0; }
+	FORCEINLINE bool isRoot(int node) const { return node == 0; }
+
+	// lower and upper bounds of all nodes along one of the 9 kDOP axes
+	FORCEINLINE const float *lower(int axis) const { return &_bounds[axis*size()]; }
+	FORCEINLINE const float *upper(int axis) const { return &_bounds[(axis+9)*size()]; }
+
+private:
+	std::vector<Face*> _face;
+	std::vector<int> _left, _parent;
+	std::vector<float> _bounds;
+
+	void build(int node, int *lst, int lst_num, const std::vector<BOX> &tri_boxes, const std::vector<vec3f> &tri_centers, int &next);
 };
+
+// Tests the boxes of node0 against those of node1, where a node marked as
+// split stands for its two children instead. Bit 2*i+j of the result is set
+// if child i of node0 overlaps child j of node1 (child 0 if not split).
+int overlap_children (const DeformBVHTree &tree0, int node0, bool split0,
+                      const DeformBVHTree &tree1, int node1, bool split1,
+                      float thickness);
@@ -0,0 +1,492 @@
+#include "cholesky.h"
+#include <algorithm>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+using namespace std;
+
+static int max_threads () {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static int thread_num () {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+// Nested dissection on the graph (xadj, adj). Each part is split at the
+// middle level of a breadth-first level structure rooted at a
+// pseudo-peripheral vertex; the level becomes the separator and is ordered
+// after both halves. Disconnected parts are split into their components.
+namespace {
+
+struct Dissection {
+    const vector<int> &xadj, &adj;
+    vector<int> label, level, order;
+    int nlabels;
+    static const int leaf_size = 64;
+    Dissection (const vector<int> &xadj, const vector<int> &adj):
+        xadj(xadj), adj(adj), label(xadj.size()-1, 0),
+        level(xadj.size()-1, -1), order(xadj.size()-1), nlabels(1) {}
+    // breadth-first levels of the part containing root; returns the number
+    // of levels and the visited vertices in visit order
+    int bfs (int root, vector<int> &visit) {
+        int l = label[root];
+        visit.clear();
+        visit.push_back(root);
+        level[root] = 0;
+        int nlevels = 1;
+        for (size_t k = 0; k < visit.size(); k++) {
+            int v = visit[k];
+            for (int e = xadj[v]; e < xadj[v+1]; e++) {
+                int w = adj[e];
+                if (label[w] == l && level[w] < 0) {
+                    level[w] = level[v] + 1;
+                    nlevels = level[w] + 1;
+                    visit.push_back(w);
+                }
+            }
+        }
+        return nlevels;
+    }
+    void reset (const vector<int> &visit) {
+        for (size_t k = 0; k < visit.size(); k++)
+            level[visit[k]] = -1;
+    }
+    // orders part (all vertices of one label) into order[lo...]
+    void dissect (const vector<int> &part, int lo, vector< pair<vector<int>,int> > &stack) {
+        if ((int)part.size() <= leaf_size) {
+            copy(part.begin(), part.end(), order.begin()+lo);
+            return;
+        }
+        vector<int> visit;
+        int nlevels = bfs(part[0], visit);
+        if (visit.size() < part.size()) {
+            // split off the components
+            reset(visit);
+            int whole = label[part[0]], pos = lo;
+            for (size_t k = 0; k < part.size(); k++) {
+                if (label[part[k]] != whole)
+                    continue;
+                vector<int> comp;
+                bfs(part[k], comp);
+                reset(comp);
+                int l = nlabels++;
+                for (size_t c = 0; c < comp.size(); c++)
+                    label[comp[c]] = l;
+                stack.push_back(make_pair(comp, pos));
+                pos += comp.size();
+            }
+            return;
+        }
+        // pseudo-peripheral root
+        for (int iter = 0; iter < 8; iter++) {
+            int root = visit.back();
+            reset(visit);
+            vector<int> next;
+            int n = bfs(root, next);
+            visit.swap(next);
+            if (n <= nlevels) {
+                nlevels = n;
+                break;
+            }
+            nlevels = n;
+        }
+        if (nlevels < 3) {
+            reset(visit);
+            copy(part.begin(), part.end(), order.begin()+lo);
+            return;
+        }
+        vector<int> count(nlevels, 0);
+        for (size_t k = 0; k < visit.size(); k++)
+            count[level[visit[k]]]++;
+        int m = 1, below = count[0];
+        while (m < nlevels-2 && 2*(below + count[m]) < (int)part.size())
+            below += count[m++];
+        vector<int> a, b, s;
+        for (size_t k = 0; k < visit.size(); k++) {
+            int v = visit[k], lv = level[v];
+            if (lv < m)
+                a.push_back(v);
+            else if (lv > m)
+                b.push_back(v);
+            else {
+                // separator vertices not touching the far side go to a
+                bool far = false;
+                for (int e = xadj[v]; e < xadj[v+1] && !far; e++)
+                    far = label[adj[e]] == label[v] && level[adj[e]] == m+1;
+                (far ? s : a).push_back(v);
+            }
+        }
+        reset(visit);
+        int la = nlabels++, lb = nlabels++, ls = nlabels++;
+        for (size_t k = 0; k < a.size(); k++)
+            label[a[k]] = la;
+        for (size_t k = 0; k < b.size(); k++)
+            label[b[k]] = lb;
+        for (size_t k = 0; k < s.size(); k++)
+            label[s[k]] = ls;
+        copy(s.begin(), s.end(), order.begin()+lo+a.size()+b.size());
+        stack.push_back(make_pair(a, lo));
+        stack.push_back(make_pair(b, lo+(int)a.size()));
+    }
+    void run () {
+        int n = label.size();
+        vector< pair<vector<int>,int> > stack;
+        vector<int> all(n);
+        for (int v = 0; v < n; v++)
+            all[v] = v;
+        stack.push_back(make_pair(all, 0));
+        while (!stack.empty()) {
+            pair<vector<int>,int> part;
+            part.first.swap(stack.back().first);
+            part.second = stack.back().second;
+            stack.pop_back();
+            if (!part.first.empty())
+                dissect(part.first, part.second, stack);
+        }
+    }
+};
+
+}
+
+SupernodalCholesky::SupernodalCholesky (): n(0) {}
+
+void SupernodalCholesky::analyze (int n, const int *colptr,
+                                  const int *rowind, int block) {
+    this->n = n;
+    int nnz = colptr[n];
+    // ordering on the graph of the blocks
+    int nb = n/block;
+    vector<int> xadj(nb+1, 0), adj;
+    {
+        vector< vector<int> > nbrs(nb);
+        for (int j = 0; j < n; j++)
+            for (int p = colptr[j]; p < colptr[j+1]; p++) {
+                int bi = rowind[p]/block, bj = j/block;
+                if (bi != bj) {
+                    nbrs[bi].push_back(bj);
+                    nbrs[bj].push_back(bi);
+                }
+            }
+        for (int v = 0; v < nb; v++) {
+            sort(nbrs[v].begin(), nbrs[v].end());
+            nbrs[v].erase(unique(nbrs[v].begin(), nbrs[v].end()), nbrs[v].end());
+            xadj[v+1] = xadj[v] + nbrs[v].size();
+            adj.insert(adj.end(), nbrs[v].begin(), nbrs[v].end());
+        }
+    }
+    Dissection nd(xadj, adj);
+    nd.run();
+    perm.resize(n);
+    iperm.resize(n);
+    for (int k = 0; k < nb; k++)
+        for (int c = 0; c < block; c++)
+            perm[k*block+c] = nd.order[k]*block+c;
+    for (int k = 0; k < n; k++)
+        iperm[perm[k]] = k;
+
+    // permuted lower triangle, rows sorted in each column
+    pcolptr.assign(n+1, 0);
+    for (int j = 0; j < n; j++)
+        for (int p = colptr[j]; p < colptr[j+1]; p++)
+            pcolptr[min(iperm[rowind[p]], iperm[j])+1]++;
+    for (int j = 0; j < n; j++)
+        pcolptr[j+1] += pcolptr[j];
+    vector< pair<int,int> > entries(nnz);
+    {
+        vector<int> next(pcolptr.begin(), pcolptr.end()-1);
+        for (int j = 0; j < n; j++)
+            for (int p = colptr[j]; p < colptr[j+1]; p++) {
+                int pi = iperm[rowind[p]], pj = iperm[j];
+                entries[next[min(pi,pj)]++] = make_pair(max(pi,pj), p);
+            }
+    }
+    prowind.resize(nnz);
+    value_map.resize(nnz);
+    for (int j = 0; j < n; j++) {
+        sort(entries.begin()+pcolptr[j], entries.begin()+pcolptr[j+1]);
+        for (int p = pcolptr[j]; p < pcolptr[j+1]; p++) {
+            prowind[p] = entries[p].first;
+            value_map[p] = entries[p].second;
+        }
+    }
+    pvalues.resize(nnz);
+
+    // elimination tree
+    vector<int> row_start(n+1, 0), row_cols(nnz);
+    for (int p = 0; p < nnz; p++)
+        row_start[prowind[p]+1]++;
+    for (int i = 0; i < n; i++)
+        row_start[i+1] += row_start[i];
+    {
+        vector<int> next(row_start.begin(), row_start.end()-1);
+        for (int j = 0; j < n; j++)
+            for (int p = pcolptr[j]; p < pcolptr[j+1]; p++)
+                row_cols[next[prowind[p]]++] = j;
+    }
+    vector<int> parent(n, -1), ancestor(n, -1);
+    for (int k = 0; k < n; k++)
+        for (int p = row_start[k]; p < row_start[k+1]; p++)
+            for (int i = row_cols[p], next; i != -1 && i < k; i = next) {
+                next = ancestor[i];
+                ancestor[i] = k;
+                if (next == -1)
+                    parent[i] = k;
+            }
+
+    // column structures of L, diagonal first, and fundamental supernodes
+    vector< vector<int> > structs(n), children(n);
+    vector<int> mark(n, -1);
+    for (int j = 0; j < n; j++)
+        if (parent[j] >= 0)
+            children[parent[j]].push_back(j);
+    super_ptr.clear();
+    for (int j = 0; j < n; j++) {
+        vector<int> &s = structs[j];
+        mark[j] = j;
+        s.push_back(j);
+        for (int p = pcolptr[j]; p < pcolptr[j+1]; p++)
+            if (mark[prowind[p]] != j) {
+                mark[prowind[p]] = j;
+                s.push_back(prowind[p]);
+            }
+        for (size_t c = 0; c < children[j].size(); c++) {
+            const vector<int> &cs = structs[children[j][c]];
+            for (size_t k = 1; k < cs.size(); k++)
+                if (mark[cs[k]] != j) {
+                    mark[cs[k]] = j;
+                    s.push_back(cs[k]);
+                }
+        }
+        sort(s.begin(), s.end());
+        bool joins = j > 0 && parent[j-1] == j && children[j].size() == 1
+                  && structs[j-1].size() == s.size()+1;
+        // only the last column of a supernode keeps its structure
+        if (joins)
+            vector<int>().swap(structs[j-1]);
+        else
+            super_ptr.push_back(j);
+    }
+    super_ptr.push_back(n);
+    int ns = super_ptr.size()-1;
+
+    // rows, panels and tree of the supernodes
+    vector<int> col_super(n);
+    row_ptr.assign(1, 0);
+    rows.clear();
+    panel_ptr.assign(1, 0);
+    for (int s = 0; s < ns; s++) {
+        int f = super_ptr[s], l = super_ptr[s+1]-1;
+        for (int j = f; j < l; j++) {
+            col_super[j] = s;
+            rows.push_back(j);
+        }
+        col_super[l] = s;
+        rows.insert(rows.end(), structs[l].begin(), structs[l].end());
+        row_ptr.push_back(rows.size());
+        int nr = row_ptr[s+1]-row_ptr[s], nc = l-f+1;
+        panel_ptr.push_back(panel_ptr[s] + nr*nc);
+    }
+    vector< vector<int> >().swap(structs);
+    panels.resize(panel_ptr[ns]);
+    vector<int> sparent(ns, -1), height(ns, 0);
+    update_ptr.assign(ns+1, 0);
+    for (int d = 0; d < ns; d++) {
+        int nc = super_ptr[d+1]-super_ptr[d];
+        int begin = row_ptr[d]+nc, end = row_ptr[d+1];
+        if (begin < end)
+            sparent[d] = col_super[rows[begin]];
+        for (int r = begin; r < end; ) {
+            int s = col_super[rows[r]];
+            while (r < end && col_super[rows[r]] == s)
+                r++;
+            update_ptr[s+1]++;
+        }
+    }
+    for (int s = 0; s < ns; s++)
+        update_ptr[s+1] += update_ptr[s];
+    updates.resize(update_ptr[ns]);
+    {
+        vector<int> next(update_ptr.begin(), update_ptr.end()-1);
+        for (int d = 0; d < ns; d++) {
+            int nc = super_ptr[d+1]-super_ptr[d];
+            int begin = row_ptr[d]+nc, end = row_ptr[d+1];
+            for (int r = begin; r < end; ) {
+                int s = col_super[rows[r]], r0 = r;
+                while (r < end && col_super[rows[r]] == s)
+                    r++;
+                Update u = {d, r0-row_ptr[d], r-row_ptr[d]};
+                updates[next[s]++] = u;
+            }
+        }
+    }
+
+    // supernodes of equal height share no dependencies
+    for (int s = 0; s < ns; s++)
+        if (sparent[s] >= 0)
+            height[sparent[s]] = max(height[sparent[s]], height[s]+1);
+    int nlevels = ns ? *max_element(height.begin(), height.end())+1 : 0;
+    level_ptr.assign(nlevels+1, 0);
+    for (int s = 0; s < ns; s++)
+        level_ptr[height[s]+1]++;
+    for (int l = 0; l < nlevels; l++)
+        level_ptr[l+1] += level_ptr[l];
+    level_order.resize(ns);
+    {
+        vector<int> next(level_ptr.begin(), level_ptr.end()-1);
+        for (int s = 0; s < ns; s++)
+            level_order[next[height[s]]++] = s;
+    }
+}
+
+// left-looking: gathers the updates of all descendants into the panel of
+// s, then factors the panel densely. Only the panel of s is written.
+bool SupernodalCholesky::factor_supernode (int s, vector<int> &map,
+                                           bool parallel) {
+    int f = super_ptr[s], nc = super_ptr[s+1]-f;
+    int nr = row_ptr[s+1]-row_ptr[s];
+    const int *srows = &rows[row_ptr[s]];
+    double *P = &panels[panel_ptr[s]];
+    for (int i = 0; i < nr; i++)
+        map[srows[i]] = i;
+    fill(P, P+nr*nc, 0.);
+    for (int j = 0; j < nc; j++)
+        for (int p = pcolptr[f+j]; p < pcolptr[f+j+1]; p++)
+            P[j*nr + map[prowind[p]]] = pvalues[p];
+    int ubegin = update_ptr[s], uend = update_ptr[s+1];
+#pragma omp parallel for schedule(dynamic) if(parallel && nc > 1)
+    for (int j = 0; j < nc; j++) {
+        double *Pj = P + j*nr;
+        for (int u = ubegin; u < uend; u++) {
+            const Update &up = updates[u];
+            const int *drows = &rows[row_ptr[up.d]];
+            const int *jj = lower_bound(drows+up.begin, drows+up.end, f+j);
+            if (jj == drows+up.end || *jj != f+j)
+                continue;
+            int dr = row_ptr[up.d+1]-row_ptr[up.d];
+            int dc = super_ptr[up.d+1]-super_ptr[up.d];
+            const double *Ld = &panels[panel_ptr[up.d]];
+            for (int k = 0; k < dc; k++) {
+                const double *Ldk = Ld + k*dr;
+                double a = Ldk[jj-drows];
+                if (a == 0)
+                    continue;
+                for (int i = jj-drows; i < dr; i++)
+                    Pj[map[drows[i]]] -= Ldk[i]*a;
+            }
+        }
+    }
+    for (int k = 0; k < nc; k++) {
+        double *Pk = P + k*nr;
+        double d = Pk[k];
+        if (!(d > 0))
+            return false;
+        d = sqrt(d);
+        Pk[k] = d;
+        for (int i = k+1; i < nr; i++)
+            Pk[i] /= d;
+#pragma omp parallel for if(parallel && nc-k > 32)
+        for (int j = k+1; j < nc; j++) {
+            double *Pj = P + j*nr;
+            double a = Pk[j];
+            for (int i = j; i < nr; i++)
+                Pj[i] -= Pk[i]*a;
+        }
+    }
+    return true;
+}
+
+bool SupernodalCholesky::factor (const double *values) {
+    int nnz = value_map.size();
+    for (int p = 0; p < nnz; p++)
+        pvalues[p] = values[value_map[p]];
+    if ((int)maps.size() < max_threads())
+        maps.resize(max_threads());
+    for (size_t t = 0; t < maps.size(); t++)
+        maps[t].resize(n);
+    int nlevels = (int)level_ptr.size()-1;
+    for (int l = 0; l < nlevels; l++) {
+        int begin = level_ptr[l], end = level_ptr[l+1];
+        if (end - begin == 1) {
+            // near the root the tree narrows; split the supernode instead
+            if (!factor_supernode(level_order[begin], maps[0], true))
+                return false;
+            continue;
+        }
+        bool ok = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+        for (int k = begin; k < end; k++)
+            ok = factor_supernode(level_order[k], maps[thread_num()], false) && ok;
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+void SupernodalCholesky::solve (const double *b, double *x) const {
+    vector<double> y(n);
+    for (int i = 0; i < n; i++)
+        y[iperm[i]] = b[i];
+    int ns = (int)super_ptr.size()-1;
+    for (int s = 0; s < ns; s++) {
+        int f = super_ptr[s], nc = super_ptr[s+1]-f;
+        int nr = row_ptr[s+1]-row_ptr[s];
+        const int *srows = &rows[row_ptr[s]];
+        const double *P = &panels[panel_ptr[s]];
+        for (int k = 0; k < nc; k++) {
+            const double *Pk = P + k*nr;
+            double yk = y[f+k] /= Pk[k];
+            for (int i = k+1; i < nr; i++)
+                y[srows[i]] -= Pk[i]*yk;
+        }
+    }
+    for (int s = ns-1; s >= 0; s--) {
+        int f = super_ptr[s], nc = super_ptr[s+1]-f;
+        int nr = row_ptr[s+1]-row_ptr[s];
+        const int *srows = &rows[row_ptr[s]];
+        const double *P = &panels[panel_ptr[s]];
+        for (int k = nc-1; k >= 0; k--) {
+            const double *Pk = P + k*nr;
+            double sum = y[f+k];
+            for (int i = k+1; i < nr; i++)
+                sum -= Pk[i]*y[srows[i]];
+            y[f+k] = sum/Pk[k];
+        }
+    }
+    for (int i = 0; i < n; i++)
+        x[i] = y[iperm[i]];
+}
+
+bool CholeskySolver::solve (const BsrMat<3> &A, const vector<Vec3> &b,
+                            vector<Vec3> &x) {
+    int n = A.n*3;
+    if (matrix != &A || version != A.version) {
+        timers[Analyze].tick();
+        L.analyze(n, &A.colptr[0], &A.rowind[0], 3);
+        timers[Analyze].tock();
+        counts[Analyze]++;
+        matrix = &A;
+        version = A.version;
+    }
+    timers[Factorize].tick();
+    bool ok = L.factor(&A.values[0]);
+    timers[Factorize].tock();
+    counts[Factorize]++;
+    if (!ok)
+        return false;
+    timers[Solve].tick();
+    x.resize(b.size());
+    L.solve((const double*)&b[0], (double*)&x[0]);
+    timers[Solve].tock();
+    counts[Solve]++;
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef CHOLESKY_H
+#define CHOLESKY_H
+
+#include "linear_solver.h"
+
+// Supernodal sparse Cholesky factorization built from source, for
+// platforms without the prebuilt TAUCS and METIS libraries. The input is
+// the lower triangle in CCS form, as TAUCS takes it. analyze() computes a
+// nested dissection ordering, the elimination tree and the supernodes;
+// factor() then runs the supernodes of each tree level in parallel.
+struct SupernodalCholesky {
+    SupernodalCholesky ();
+    // block > 1 orders the graph of block x block submatrices
+    void analyze (int n, const int *colptr, const int *rowind, int block = 1);
+    bool factor (const double *values);
+    void solve (const double *b, double *x) const;
+    int size () const {return n;}
+    int factor_nnz () const {return panel_ptr.empty() ? 0 : panel_ptr.back();}
+private:
+    struct Update { int d, begin, end; }; // rows [begin,end) of d fall in s
+    int n;
+    std::vector<int> perm, iperm; // new -> old, old -> new
+    std::vector<int> pcolptr, prowind, value_map; // permuted matrix
+    std::vector<double> pvalues;
+    std::vector<int> super_ptr; // first column of each supernode
+    std::vector<int> row_ptr, rows; // row structure of each supernode
+    std::vector<int> panel_ptr; // dense column-major panel of each supernode
+    std::vector<double> panels;
+    std::vector<int> update_ptr; // descendants updating each supernode
+    std::vector<Update> updates;
+    std::vector<int> level_ptr, level_order; // supernodes by tree height
+    std::vector< std::vector<int> > maps; // row -> panel row, per thread
+    bool factor_supernode (int s, std::vector<int> &map, bool parallel);
+};
+
+struct CholeskySolver: public LinearSolver {
+    CholeskySolver (): matrix(0), version(0) {}
+    const char *name () const {return "cholesky";}
+    bool solve (const BsrMat<3> &A, const std::vector<Vec3> &b,
+                std::vector<Vec3> &x);
+private:
+    const void *matrix; // pattern the symbolic factor was built for
+    int version;
+    SupernodalCholesky L;
+};
+
+#endif
@@ -30,12 +30,13 @@
 #include "geometry.h"
 #include "magic.h"
 #include "optimization.hpp"
+#include "profile.h"
 #include "simulation.h"
 #include "../timer.h"
 #include <algorithm>
 #include <fstream>
+#include <iostream>
 #include <omp.h>
-#include <QMessageBox>
 using namespace std;
 
 static const int max_iter = 30;
@@ -82,14 +83,12 @@ vector<Impact> independent_impacts (const vector<Impact> &impacts);
 void add_impacts (const vector<Impact> &impacts, vector<ImpactZone*> &zones);
 
 void apply_inelastic_projection (ImpactZone *zone,
-                                 const vector<Constraint*> &cons);
-
-vector<Constraint> impact_constraints (const vector<ImpactZone*> &zones);
+                                 const Constraints &cons);
 
 ostream &operator<< (ostream &out, const Impact &imp);
 ostream &operator<< (ostream &out, const ImpactZone *zone);
 
-bool collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
+bool collision_response (vector<Mesh*> &meshes, const Constraints &cons,
                          const vector<Mesh*> &obs_meshes) {
     xold.clear();
     build_node_lookup(xold, meshes);
@@ -104,6 +103,7 @@ bool collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
         ::deform_obstacles = deform;
         zones.clear();
         for (iter = 0; iter < max_iter; iter++) {
+            profile_count(StepProfile::ImpactZoneIterations);
             if (!zones.empty())
                 update_active(accs, obs_accs, zones);
             vector<Impact> impacts = find_impacts(accs, obs_accs);
@@ -126,8 +126,12 @@ bool collision_response (vector<Mesh*> &meshes, const vector<Constraint*> &cons,
             break;
     }
     if (iter == max_iter) {
-	QMessageBox::critical(0, "error", "Collision resolution failed to converge!");
-	return false;
+        cerr << "Collision resolution failed to converge!" << endl;
+        for (int z = 0; z < (int)zones.size(); z++)
+            delete zones[z];
+        destroy_accel_structs(accs);
+        destroy_accel_structs(obs_accs);
+        return false;
         // vector<Impact> impacts = find_impacts(accs, obs_accs);
         // for (size_t i = 0; i < impacts.size(); i++)
         //     for (int n = 0; n < 4; n++)
@@ -187,23 +191,17 @@ void update_active (const vector<AccelStruct*> &accs,
 
 // Impacts
 
-static int nthreads = 0;
-static vector<Impact> *impacts = NULL;
+static OverlapBuffer<Impact> impacts;
 
 void find_face_impacts (const Face *face0, const Face *face1);
 
 vector<Impact> find_impacts (const vector<AccelStruct*> &accs,
                              const vector<AccelStruct*> &obs_accs) {
-    if (!impacts) {
-        ::nthreads = omp_get_max_threads();
-        ::impacts = new vector<Impact>[::nthreads];
-    }
-    for (int t = 0; t < ::nthreads; t++)
-        ::impacts[t].clear();
+    ::impacts.clear();
     for_overlapping_faces(accs, obs_accs, ::thickness, find_face_impacts);
     vector<Impact> impacts;
-    for (int t = 0; t < ::nthreads; t++)
-        append(impacts, ::impacts[t]);
+    ::impacts.merge(impacts);
+    profile_count(StepProfile::Impacts, impacts.size());
     return impacts;
 }
 
@@ -211,18 +209,17 @@ bool vf_collision_test (const Vert *vert, const Face *face, Impact &impact);
 bool ee_collision_test (const Edge *edge0, const Edge *edge1, Impact &impact);
 
 void find_face_impacts (const Face *face0, const Face *face1) {
-    int t = omp_get_thread_num();
     Impact impact;
     for (int v = 0; v < 3; v++)
         if (vf_collision_test(face0->v[v], face1, impact))
-            ::impacts[t].push_back(impact);
+            ::impacts.push_back(impact);
     for (int v = 0; v < 3; v++)
         if (vf_collision_test(face1->v[v], face0, impact))
-            ::impacts[t].push_back(impact);
+            ::impacts.push_back(impact);
     for (int e0 = 0; e0 < 3; e0++)
         for (int e1 = 0; e1 < 3; e1++)
             if (ee_collision_test(face0->adje[e0], face1->adje[e1], impact))
-                ::impacts[t].push_back(impact);
+                ::impacts.push_back(impact);
 }
 
 bool collision_test (Impact::Type type, const Node *node0, const Node *node1,
@@ -449,7 +446,7 @@ struct NormalOpt: public NLConOpt {
 };
 
 void apply_inelastic_projection (ImpactZone *zone,
-                                 const vector<Constraint*> &cons) {
+                                 const Constraints &cons) {
     if (!zone->active)
         return;
     augmented_lagrangian_method(NormalOpt(zone));
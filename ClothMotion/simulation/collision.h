@@ -31,7 +31,7 @@
 #include "constraint.h"
 
 bool collision_response (std::vector<Mesh*> &meshes,
-                         const std::vector<Constraint*> &cons,
+                         const Constraints &cons,
                          const std::vector<Mesh*> &obs_meshes);
 
 #endif
@@ -26,164 +26,301 @@
 
 #include "collisionutil.h"
 
+#include "profile.h"
 #include "simulation.h"
+#include <map>
 #include <omp.h>
 using namespace std;
 
-void collect_leaves (BVHNode *node, vector<BVHNode*> &leaves);
-
 AccelStruct::AccelStruct (const Mesh &mesh, bool ccd):
-	tree((Mesh&)mesh, ccd), root(tree._root), leaves(mesh.faces.size()) {
-	if (root)
-		collect_leaves(root, leaves);
-}
-
-void collect_leaves (BVHNode *node, vector<BVHNode*> &leaves) {
-	if (node->isLeaf()) {
-		int f = node->getFace()->index;
+	tree((Mesh&)mesh, ccd), leaves(mesh.faces.size(), -1),
+	cost(0), users(0), revision(mesh.revision), shared(true) {
+	for (int node = 0; node < tree.size(); node++) {
+		if (!tree.isLeaf(node))
+			continue;
+		int f = tree.getFace(node)->index;
 		if (f >= leaves.size())
-			leaves.resize(f+1);
+			leaves.resize(f+1, -1);
 		leaves[f] = node;
-	} else {
-		collect_leaves(node->getLeftChild(), leaves);
-		collect_leaves(node->getRightChild(), leaves);
 	}
+	cost = tree.refit();
 }
 
 void update_accel_struct (AccelStruct &acc) {
-	if (acc.root)
-		acc.tree.refit();
+	acc.tree.refit();
 }
 
-void mark_descendants (BVHNode *node, bool active);
-void mark_ancestors (BVHNode *node, bool active);
+static void mark_all (AccelStruct &acc, bool active) {
+	acc.tree._active.assign(acc.tree.size(), active);
+}
 
 void mark_all_inactive (AccelStruct &acc) {
-	if (acc.root)
-		mark_descendants(acc.root, false);
+	mark_all(acc, false);
 }
 
+// active nodes always have active ancestors, so the walk up stops early
 void mark_active (AccelStruct &acc, const Face *face) {
-	if (acc.root)
-		mark_ancestors(acc.leaves[face->index], true);
+	if (acc.tree.empty())
+		return;
+	for (int node = acc.leaves[face->index];
+		 node >= 0 && !acc.tree._active[node];
+		 node = acc.tree.getParent(node))
+		acc.tree._active[node] = true;
 }
 
-void mark_descendants (BVHNode *node, bool active) {
-	node->_active = active;
-	if (!node->isLeaf()) {
-		mark_descendants(node->_left, active);
-		mark_descendants(node->_right, active);
-	}
+// A pair is worth visiting if one of its nodes is active and their boxes
+// overlap; node1 < 0 stands for node0 tested against itself.
+struct NodePair {
+	int node0, node1;
+	NodePair (int node0, int node1=-1): node0(node0), node1(node1) {}
+};
+
+static bool overlapping (const BVHTree &tree0, int node0,
+						 const BVHTree &tree1, int node1, float thickness) {
+	return (tree0._active[node0] || tree1._active[node1])
+		&& (overlap_children(tree0, node0, false, tree1, node1, false,
+							 thickness) & 1);
 }
 
-void mark_ancestors (BVHNode *node, bool active) {
-	node->_active = active;
-	if (!node->isRoot())
-		mark_ancestors(node->_parent, active);
+// Depth-first with an explicit stack. Pairs are tested before they are
+// pushed, and the children of both nodes are tested against each other in
+// one call, so popping a pair of leaves means their faces overlap.
+static void traverse (const BVHTree &tree0, const BVHTree &tree1,
+					  NodePair pair, float thickness, BVHCallback callback) {
+	vector<NodePair> stack;
+	stack.reserve(64);
+	if (pair.node1 >= 0 && !overlapping(tree0, pair.node0, tree1, pair.node1,
+										thickness))
+		return;
+	stack.push_back(pair);
+	int visited = 0;
+	while (!stack.empty()) {
+		int node0 = stack.back().node0, node1 = stack.back().node1;
+		stack.pop_back();
+		visited++;
+		if (node1 < 0) {
+			if (tree0.isLeaf(node0) || !tree0._active[node0])
+				continue;
+			int left = tree0.getLeftChild(node0),
+				right = tree0.getRightChild(node0);
+			if (overlapping(tree0, left, tree0, right, thickness))
+				stack.push_back(NodePair(left, right));
+			stack.push_back(NodePair(right));
+			stack.push_back(NodePair(left));
+			continue;
+		}
+		bool leaf0 = tree0.isLeaf(node0), leaf1 = tree1.isLeaf(node1);
+		if (leaf0 && leaf1) {
+			callback(tree0.getFace(node0), tree1.getFace(node1));
+			continue;
+		}
+		int hits = overlap_children(tree0, node0, !leaf0, tree1, node1, !leaf1,
+									thickness);
+		// pushed last to first so that they are popped in order
+		for (int i = 3; i >= 0; i--) {
+			if (!(hits & (1 << i)) || (leaf0 && (i >> 1)) || (leaf1 && (i & 1)))
+				continue;
+			int child0 = leaf0 ? node0 : tree0.getLeftChild(node0) + (i >> 1),
+				child1 = leaf1 ? node1 : tree1.getLeftChild(node1) + (i & 1);
+			if (tree0._active[child0] || tree1._active[child1])
+				stack.push_back(NodePair(child0, child1));
+		}
+	}
+	profile_count(StepProfile::BVHNodes, visited);
 }
 
-void for_overlapping_faces (BVHNode *node, float thickness,
+void for_overlapping_faces (const BVHTree &tree, int node, float thickness,
 							BVHCallback callback) {
-	if (node->isLeaf() || !node->_active)
-		return;
-	for_overlapping_faces(node->getLeftChild(), thickness, callback);
-	for_overlapping_faces(node->getRightChild(), thickness, callback);
-	for_overlapping_faces(node->getLeftChild(), node->getRightChild(),
-						  thickness, callback);
+	traverse(tree, tree, NodePair(node), thickness, callback);
 }
 
-void for_overlapping_faces (BVHNode *node0, BVHNode *node1, float thickness,
+void for_overlapping_faces (const BVHTree &tree0, int node0,
+							const BVHTree &tree1, int node1, float thickness,
 							BVHCallback callback) {
-	if (!node0->_active && !node1->_active)
-		return;
-	if (!overlap(node0->_box, node1->_box, thickness))
-		return;
-	if (node0->isLeaf() && node1->isLeaf()) {
-		Face *face0 = node0->getFace(),
-			 *face1 = node1->getFace();
-		callback(face0, face1);
-	} else if (node0->isLeaf()) {
-		for_overlapping_faces(node0, node1->getLeftChild(), thickness,callback);
-		for_overlapping_faces(node0, node1->getRightChild(),thickness,callback);
+	traverse(tree0, tree1, NodePair(node0, node1), thickness, callback);
+}
+
+// A task is a node pair, or a single node (node1 < 0) whose faces are
+// tested against each other. Tasks are split breadth-first, dropping pairs
+// that cannot overlap, until there are enough of them to balance; the
+// dynamic schedule then hands them out to whichever thread is free.
+struct BVHTask {
+	const BVHTree *tree0, *tree1;
+	NodePair pair;
+	BVHTask (const BVHTree &tree0, const BVHTree &tree1, NodePair pair):
+		tree0(&tree0), tree1(&tree1), pair(pair) {}
+};
+
+static const int min_tasks = 256;
+
+static int current_task = 0;
+#pragma omp threadprivate(current_task)
+
+int overlap_workers () {
+	return omp_get_max_threads();
+}
+
+int overlap_worker () {
+	return omp_get_thread_num();
+}
+
+int overlap_task () {
+	return current_task;
+}
+
+static bool split_task (const BVHTask &task, float thickness,
+						vector<BVHTask> &tasks) {
+	const BVHTree &tree0 = *task.tree0, &tree1 = *task.tree1;
+	int node0 = task.pair.node0, node1 = task.pair.node1;
+	if (node1 < 0) {
+		if (tree0.isLeaf(node0) || !tree0._active[node0])
+			return true;
+		int left = tree0.getLeftChild(node0), right = tree0.getRightChild(node0);
+		tasks.push_back(BVHTask(tree0, tree0, NodePair(left)));
+		tasks.push_back(BVHTask(tree0, tree0, NodePair(right)));
+		tasks.push_back(BVHTask(tree0, tree0, NodePair(left, right)));
+		return true;
+	}
+	if (!overlapping(tree0, node0, tree1, node1, thickness))
+		return true;
+	if (tree0.isLeaf(node0) && tree1.isLeaf(node1)) {
+		tasks.push_back(task);
+		return false;
+	} else if (tree0.isLeaf(node0)) {
+		tasks.push_back(BVHTask(tree0, tree1,
+								NodePair(node0, tree1.getLeftChild(node1))));
+		tasks.push_back(BVHTask(tree0, tree1,
+								NodePair(node0, tree1.getRightChild(node1))));
 	} else {
-		for_overlapping_faces(node0->getLeftChild(), node1, thickness,callback);
-		for_overlapping_faces(node0->getRightChild(), node1,thickness,callback);
+		tasks.push_back(BVHTask(tree0, tree1,
+								NodePair(tree0.getLeftChild(node0), node1)));
+		tasks.push_back(BVHTask(tree0, tree1,
+								NodePair(tree0.getRightChild(node0), node1)));
 	}
+	return true;
 }
 
-vector<BVHNode*> collect_upper_nodes (const vector<AccelStruct*> &accs, int n);
+static void for_overlapping_faces (vector<BVHTask> &tasks, float thickness,
+								   BVHCallback callback, bool parallel) {
+	bool split = true;
+	while (split && tasks.size() < min_tasks) {
+		vector<BVHTask> children;
+		split = false;
+		for (int t = 0; t < tasks.size(); t++)
+			split |= split_task(tasks[t], thickness, children);
+		tasks.swap(children);
+	}
+	int ntasks = tasks.size();
+#pragma omp parallel for schedule(dynamic) if(parallel)
+	for (int t = 0; t < ntasks; t++) {
+		current_task = t;
+		traverse(*tasks[t].tree0, *tasks[t].tree1, tasks[t].pair, thickness,
+				 callback);
+	}
+}
 
 void for_overlapping_faces (const vector<AccelStruct*> &accs,
 							const vector<AccelStruct*> &obs_accs,
 							double thickness, BVHCallback callback,
 							bool parallel) {
-	int nnodes = (int)ceil(sqrt(double(2*omp_get_max_threads())));
-	vector<BVHNode*> nodes = collect_upper_nodes(accs, nnodes);
-	int nthreads = omp_get_max_threads();
-	omp_set_num_threads(parallel ? omp_get_max_threads() : 1);
-#pragma omp parallel for
-	for (int n = 0; n < nodes.size(); n++) {
-		for_overlapping_faces(nodes[n], thickness, callback);
-		for (int m = 0; m < n; m++)
-			for_overlapping_faces(nodes[n], nodes[m], thickness, callback);
+	vector<BVHTask> tasks;
+	for (int a = 0; a < accs.size(); a++) {
+		const BVHTree &tree = accs[a]->tree;
+		if (tree.empty())
+			continue;
+		tasks.push_back(BVHTask(tree, tree, NodePair(0)));
+		for (int b = 0; b < a; b++)
+			if (!accs[b]->tree.empty())
+				tasks.push_back(BVHTask(tree, accs[b]->tree, NodePair(0, 0)));
 		for (int o = 0; o < obs_accs.size(); o++)
-			if (obs_accs[o]->root)
-				for_overlapping_faces(nodes[n], obs_accs[o]->root, thickness,
-									  callback);
+			if (!obs_accs[o]->tree.empty())
+				tasks.push_back(BVHTask(tree, obs_accs[o]->tree,
+										NodePair(0, 0)));
 	}
-	omp_set_num_threads(nthreads);
+	for_overlapping_faces(tasks, thickness, callback, parallel);
 }
 
 void for_faces_overlapping_obstacles (const vector<AccelStruct*> &accs,
 									  const vector<AccelStruct*> &obs_accs,
 									  double thickness, BVHCallback callback,
 									  bool parallel) {
-	int nnodes = omp_get_max_threads();
-	vector<BVHNode*> nodes = collect_upper_nodes(accs, nnodes);
-	int nthreads = omp_get_max_threads();
-	omp_set_num_threads(parallel ? omp_get_max_threads() : 1);
-#pragma omp parallel for
-	for (int n = 0; n < nodes.size(); n++)
-		for (int o = 0; o < obs_accs.size(); o++)
-			if (obs_accs[o]->root)
-				for_overlapping_faces(nodes[n], obs_accs[o]->root, thickness,
-									  callback);
-	omp_set_num_threads(nthreads);
+	vector<BVHTask> tasks;
+	for (int a = 0; a < accs.size(); a++)
+		if (!accs[a]->tree.empty())
+			for (int o = 0; o < obs_accs.size(); o++)
+				if (!obs_accs[o]->tree.empty())
+					tasks.push_back(BVHTask(accs[a]->tree, obs_accs[o]->tree,
+											NodePair(0, 0)));
+	for_overlapping_faces(tasks, thickness, callback, parallel);
 }
 
-vector<BVHNode*> collect_upper_nodes (const vector<AccelStruct*> &accs,
-									  int nnodes) {
-	vector<BVHNode*> nodes;
-	for (int a = 0; a < accs.size(); a++)
-		if (accs[a]->root)
-			nodes.push_back(accs[a]->root);
-	while (nodes.size() < nnodes) {
-		vector<BVHNode*> children;
-		for (int n = 0; n < nodes.size(); n++)
-			if (nodes[n]->isLeaf())
-				children.push_back(nodes[n]);
-			else {
-				children.push_back(nodes[n]->_left);
-				children.push_back(nodes[n]->_right);
-			}
-		if (children.size() == nodes.size())
-			break;
-		nodes = children;
+void for_face_pairs (const vector<FacePair> &pairs, BVHCallback callback,
+					 bool parallel) {
+	int npairs = pairs.size();
+	int ntasks = min(npairs, min_tasks);
+#pragma omp parallel for schedule(dynamic) if(parallel)
+	for (int t = 0; t < ntasks; t++) {
+		current_task = t;
+		int begin = (long long)npairs*t/ntasks,
+			end = (long long)npairs*(t+1)/ntasks;
+		for (int p = begin; p < end; p++)
+			callback(pairs[p].first, pairs[p].second);
 	}
-	return nodes;
 }
 
+static map<const Mesh*, AccelStruct*> accel_structs;
+
+// rebuild once refitting has made the boxes this much looser
+static const float max_degradation = 2;
+
 vector<AccelStruct*> create_accel_structs (const vector<Mesh*> &meshes,
 										   bool ccd) {
 	vector<AccelStruct*> accs(meshes.size());
-	for (int m = 0; m < meshes.size(); m++)
-		accs[m] = new AccelStruct(*meshes[m], ccd);
+	for (int m = 0; m < meshes.size(); m++) {
+		AccelStruct *&acc = accel_structs[meshes[m]];
+		if (acc && acc->revision != meshes[m]->revision) {
+			if (acc->users) {
+				// the leaves of the shared tree may point at removed faces,
+				// but an outer caller is still traversing it
+				accs[m] = new AccelStruct(*meshes[m], ccd);
+				accs[m]->shared = false;
+				accs[m]->users++;
+				continue;
+			}
+			delete acc;
+			acc = NULL;
+		}
+		if (acc && !acc->tree.empty()) {
+			acc->tree._ccd = ccd;
+			if (acc->tree.refit() > max_degradation*acc->cost && !acc->users) {
+				delete acc;
+				acc = NULL;
+			} else
+				mark_all(*acc, true);
+		}
+		if (!acc)
+			acc = new AccelStruct(*meshes[m], ccd);
+		acc->users++;
+		accs[m] = acc;
+	}
 	return accs;
 }
 
 void destroy_accel_structs (vector<AccelStruct*> &accs) {
 	for (int a = 0; a < accs.size(); a++)
-		delete accs[a];
+		if (!--accs[a]->users && !accs[a]->shared)
+			delete accs[a];
+	accs.clear();
+}
+
+void clear_accel_structs () {
+	map<const Mesh*, AccelStruct*>::iterator it = accel_structs.begin();
+	while (it != accel_structs.end())
+		if (!it->second->users) {
+			delete it->second;
+			accel_structs.erase(it++);
+		} else
+			++it;
 }
 
 template <typename Prim>
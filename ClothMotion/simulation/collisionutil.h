@@ -29,13 +29,15 @@
 
 #include "bvh.h"
 
-typedef DeformBVHNode BVHNode;
 typedef DeformBVHTree BVHTree;
 
 struct AccelStruct {
     BVHTree tree;
-    BVHNode *root;
-    std::vector<BVHNode*> leaves;
+    std::vector<int> leaves; // leaf node of each face
+    float cost; // DeformBVHTree::refit() right after building
+    int users; // create_accel_structs() not yet matched by destroy
+    int revision; // Mesh::revision the tree was built for
+    bool shared; // kept per mesh between calls, else private to one caller
     AccelStruct (const Mesh &mesh, bool ccd);
 };
 
@@ -47,9 +49,53 @@ void mark_active (AccelStruct &acc, const Face *face);
 // callback must be safe to parallelize via OpenMP
 typedef void (*BVHCallback) (const Face *face0, const Face *face1);
 
-void for_overlapping_faces (BVHNode *node, float thickness,
+// The traversals below split the tree pairs into a fixed list of tasks that
+// depends only on the trees. Inside a callback, overlap_worker() is the
+// calling thread and overlap_task() the task being traversed.
+int overlap_workers ();
+int overlap_worker ();
+int overlap_task ();
+
+// Callback results buffered per worker thread and merged in task order, so
+// they come out the same for any number of threads
+template <typename T> struct OverlapBuffer {
+    std::vector< std::vector<T> > items;
+    std::vector< std::vector<int> > tasks;
+    void clear () {
+        items.resize(overlap_workers());
+        tasks.resize(items.size());
+        for (size_t w = 0; w < items.size(); w++) {
+            items[w].clear();
+            tasks[w].clear();
+        }
+    }
+    void push_back (const T &item) {
+        int w = overlap_worker();
+        items[w].push_back(item);
+        tasks[w].push_back(overlap_task());
+    }
+    void merge (std::vector<T> &out) const {
+        std::vector<int> start;
+        for (size_t w = 0; w < items.size(); w++)
+            for (size_t i = 0; i < tasks[w].size(); i++) {
+                if (tasks[w][i]+2 > (int)start.size())
+                    start.resize(tasks[w][i]+2, 0);
+                start[tasks[w][i]+1]++;
+            }
+        for (size_t k = 1; k < start.size(); k++)
+            start[k] += start[k-1];
+        size_t base = out.size();
+        out.resize(base + (start.empty() ? 0 : start.back()));
+        for (size_t w = 0; w < items.size(); w++)
+            for (size_t i = 0; i < items[w].size(); i++)
+                out[base + start[tasks[w][i]]++] = items[w][i];
+    }
+};
+
+void for_overlapping_faces (const BVHTree &tree, int node, float thickness,
                             BVHCallback callback);
-void for_overlapping_faces (BVHNode *node0, BVHNode *node1, float thickness,
+void for_overlapping_faces (const BVHTree &tree0, int node0,
+                            const BVHTree &tree1, int node1, float thickness,
                             BVHCallback callback);
 void for_overlapping_faces (const std::vector<AccelStruct*> &accs,
                             const std::vector<AccelStruct*> &obs_accs,
@@ -60,9 +106,23 @@ void for_faces_overlapping_obstacles (const std::vector<AccelStruct*> &accs,
                                       double thickness, BVHCallback callback,
                                       bool parallel=true);
 
+// Calls back on a list of face pairs kept from an earlier traversal. The
+// list is split into tasks by position only, so OverlapBuffer merges the
+// results in list order.
+typedef std::pair<const Face*, const Face*> FacePair;
+void for_face_pairs (const std::vector<FacePair> &pairs, BVHCallback callback,
+                     bool parallel=true);
+
+// The structure of each mesh persists between calls and passes: it is
+// refitted to the current positions, with every node active, and rebuilt
+// only when Mesh::revision moved or refitting degraded it. If the faces
+// changed while an outer caller still holds the structure, this caller
+// gets a private one instead. destroy_accel_structs() releases them again.
 std::vector<AccelStruct*> create_accel_structs
     (const std::vector<Mesh*> &meshes, bool ccd);
 void destroy_accel_structs (std::vector<AccelStruct*> &accs);
+// frees the released structures, e.g. before the meshes are replaced
+void clear_accel_structs ();
 
 // find index of mesh containing specified element
 template <typename Prim>
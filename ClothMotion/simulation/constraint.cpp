@@ -29,36 +29,34 @@
 #include "magic.h"
 using namespace std;
 
-double EqCon::value (int *sign) {
+double EqCon::value (int *sign) const {
     if (sign) *sign = 0;
     return dot(n, node->x - x);
 }
-MeshGrad EqCon::gradient () {MeshGrad grad; grad.push_back(MeshGradV(node,n)); return grad;}
-MeshGrad EqCon::project () {return MeshGrad();}
-double EqCon::energy (double value) {return stiff*sq(value)/2.;}
-double EqCon::energy_grad (double value) {return stiff*value;}
-double EqCon::energy_hess (double value) {return stiff;}
-MeshGrad EqCon::friction (double dt, MeshHess &jac) {return MeshGrad();}
-bool EqCon::contains(Node* _node) { return node == _node; }
-
-double GlueCon::value (int *sign) {
+void EqCon::gradient (MeshGrad &grad) const {grad.add(node, n);}
+void EqCon::project (MeshGrad &dx) const {}
+double EqCon::energy (double value) const {return stiff*sq(value)/2.;}
+double EqCon::energy_grad (double value) const {return stiff*value;}
+double EqCon::energy_hess (double value) const {return stiff;}
+void EqCon::friction (double dt, MeshGrad &force, MeshHess &jac) const {}
+bool EqCon::contains (const Node* _node) const { return node == _node; }
+
+double GlueCon::value (int *sign) const {
     if (sign) *sign = 0;
     return dot(n, nodes[1]->x - nodes[0]->x);
 }
-MeshGrad GlueCon::gradient () {
-    MeshGrad grad;
-    grad.push_back(MeshGradV(nodes[0],-n));
-    grad.push_back(MeshGradV(nodes[1],n));
-    return grad;
+void GlueCon::gradient (MeshGrad &grad) const {
+    grad.add(nodes[0], -n);
+    grad.add(nodes[1], n);
 }
-MeshGrad GlueCon::project () {return MeshGrad();}
-double GlueCon::energy (double value) {return stiff*sq(value)/2.;}
-double GlueCon::energy_grad (double value) {return stiff*value;}
-double GlueCon::energy_hess (double value) {return stiff;}
-MeshGrad GlueCon::friction (double dt, MeshHess &jac) {return MeshGrad();}
-bool GlueCon::contains(Node* _node) { return nodes[0] == _node || nodes[1] == _node; }
-
-double IneqCon::value (int *sign) {
+void GlueCon::project (MeshGrad &dx) const {}
+double GlueCon::energy (double value) const {return stiff*sq(value)/2.;}
+double GlueCon::energy_grad (double value) const {return stiff*value;}
+double GlueCon::energy_hess (double value) const {return stiff;}
+void GlueCon::friction (double dt, MeshGrad &force, MeshHess &jac) const {}
+bool GlueCon::contains (const Node* _node) const { return nodes[0] == _node || nodes[1] == _node; }
+
+double IneqCon::value (int *sign) const {
     if (sign)
         *sign = 1;
     double d = 0;
@@ -69,48 +67,44 @@ double IneqCon::value (int *sign) {
     return d;
 }
 
-MeshGrad IneqCon::gradient () {
-    MeshGrad grad;
+void IneqCon::gradient (MeshGrad &grad) const {
     for (int i = 0; i < 4; i++)
         if (nodes[i])
-            grad.push_back(MeshGradV(nodes[i], w[i]*n));
-    return grad;
+            grad.add(nodes[i], w[i]*n);
 }
 
-MeshGrad IneqCon::project () {
+void IneqCon::project (MeshGrad &dx) const {
     double d = value() + ::magic.repulsion_thickness - ::magic.projection_thickness;
     if (d >= 0)
-        return MeshGrad();
+        return;
     double inv_mass = 0;
     for (int i = 0; i < 4; i++)
         if (nodes[i] && free[i])
             inv_mass += sq(w[i])/nodes[i]->m;
-    MeshGrad dx;
     for (int i = 0; i < 4; i++)
         if (nodes[i] && free[i])
-            dx.push_back(MeshGradV(nodes[i], -(w[i]/nodes[i]->m)/inv_mass*n*d));
-    return dx;
+            dx.add(nodes[i], -(w[i]/nodes[i]->m)/inv_mass*n*d);
 }
 
 double violation (double value) {return std::max(-value, 0.);}
 
-double IneqCon::energy (double value) {
+double IneqCon::energy (double value) const {
     double v = violation(value);
     return stiff*v*v*v/::magic.repulsion_thickness/6;
 }
-double IneqCon::energy_grad (double value) {
+double IneqCon::energy_grad (double value) const {
     return -stiff*sq(violation(value))/::magic.repulsion_thickness/2;
 }
-double IneqCon::energy_hess (double value) {
+double IneqCon::energy_hess (double value) const {
     return stiff*violation(value)/::magic.repulsion_thickness;
 }
 
-MeshGrad IneqCon::friction (double dt, MeshHess &jac) {
+void IneqCon::friction (double dt, MeshGrad &force, MeshHess &jac) const {
     if (mu == 0)
-        return MeshGrad();
+        return;
     double fn = abs(energy_grad(value()));
     if (fn == 0)
-        return MeshGrad();
+        return;
     Vec3 v = Vec3(0);
     double inv_mass = 0;
     for (int i = 0; i < 4; i++) {
@@ -124,27 +118,39 @@ MeshGrad IneqCon::friction (double dt, MeshHess &jac) {
     double vt = norm(T*v);
     double f_by_v = min(mu*fn/vt, 1/(dt*inv_mass));
     // double f_by_v = mu*fn/max(vt, 1e-1);
-    MeshGrad force;
     for (int i = 0; i < 4; i++) {
         if (nodes[i] && free[i]) {
-            force.push_back(MeshGradV(nodes[i], -w[i]*f_by_v*T*v));
+            force.add(nodes[i], -w[i]*f_by_v*T*v);
             for (int j = 0; j < 4; j++) {
                 if (free[j]) {
-                    jac.push_back(MeshHessV(nodes[i], nodes[j], -w[i]*w[j]*f_by_v*T));
+                    jac.add(nodes[i], nodes[j], -w[i]*w[j]*f_by_v*T);
                 }
             }
         }
     }
-    return force;
 }
 
-bool IneqCon::contains(Node *_node) {
+bool IneqCon::contains (const Node *_node) const {
 	for (int i=0; i<4; i++) {
 		if (w[i] && nodes[i] == _node)
 			return true;
 	}
 	return false;
 }
+
+void Constraints::clear () {
+    eq.clear();
+    glue.clear();
+    node_face.clear();
+    edge_edge.clear();
+    edge_node.clear();
+}
+
+int Constraints::size () const {
+    return eq.size() + glue.size() + node_face.size() + edge_edge.size()
+         + edge_node.size();
+}
+
 /*
 // SERIALIZER 
 template<> void serializer<vector<Constraint*> >(vector<Constraint*>& x, Serialize& s, const string& n) { 
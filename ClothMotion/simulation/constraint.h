@@ -35,59 +35,78 @@
 #include <map>
 #include <vector>
 
-struct MeshGradV { Node* node; Vec3 f; MeshGradV(Node* i, const Vec3& f) : node(i), f(f) {} };
-struct MeshHessV { Node* i; Node* j; Mat3x3 J; MeshHessV(Node *i, Node* j, const Mat3x3& J) : i(i), j(j), J(J) {}};
-
-typedef std::vector<MeshGradV> MeshGrad;
-typedef std::vector<MeshHessV> MeshHess;
-
-struct Constraint {
-    virtual ~Constraint () {};
-    virtual double value (int *sign=NULL) = 0;
-    virtual MeshGrad gradient () = 0;
-    virtual MeshGrad project () = 0;
-    virtual bool contains(Node* node) = 0;
-    // energy function
-    virtual double energy (double value) = 0;
-    virtual double energy_grad (double value) = 0;
-    virtual double energy_hess (double value) = 0;
-    // frictional force
-    virtual MeshGrad friction (double dt, MeshHess &jac) = 0;
+// Per-node vectors of one constraint -- its gradient, projection or
+// friction force -- and the blocks of its friction Jacobian. A constraint
+// touches at most four nodes, so the entries live in fixed slots and no
+// call allocates.
+struct MeshGrad {
+    int n;
+    Node *node[4];
+    Vec3 f[4];
+    MeshGrad (): n(0) {}
+    void add (Node *node, const Vec3 &f) {
+        this->node[n] = node;
+        this->f[n] = f;
+        n++;
+    }
+};
 
-    // useful for debugging
-    //virtual void serializer(Serialize& s, const std::string& name) {};
+struct MeshHess {
+    int n;
+    Node *i[16], *j[16];
+    Mat3x3 J[16];
+    MeshHess (): n(0) {}
+    void add (Node *i, Node *j, const Mat3x3 &J) {
+        this->i[n] = i;
+        this->j[n] = j;
+        this->J[n] = J;
+        n++;
+    }
 };
 
-struct EqCon: public Constraint {
+// Every constraint type has the same non-virtual interface, so code over
+// Constraints is written once as a template and instantiated per type:
+//     double value (int *sign=NULL) const;
+//     void gradient (MeshGrad &grad) const;
+//     void project (MeshGrad &dx) const;
+//     bool contains (const Node *node) const;
+//     // energy function
+//     double energy (double value) const;
+//     double energy_grad (double value) const;
+//     double energy_hess (double value) const;
+//     // frictional force
+//     void friction (double dt, MeshGrad &force, MeshHess &jac) const;
+
+struct EqCon {
     // n . (node->x - x) = 0
     Node *node;
     Vec3 x, n;
     double stiff;
-    double value (int *sign=NULL);
-    bool contains(Node *node);
-    MeshGrad gradient ();
-    MeshGrad project ();
-    double energy (double value);
-    double energy_grad (double value);
-    double energy_hess (double value);
-    MeshGrad friction (double dt, MeshHess &jac);
+    double value (int *sign=NULL) const;
+    bool contains (const Node *node) const;
+    void gradient (MeshGrad &grad) const;
+    void project (MeshGrad &dx) const;
+    double energy (double value) const;
+    double energy_grad (double value) const;
+    double energy_hess (double value) const;
+    void friction (double dt, MeshGrad &force, MeshHess &jac) const;
 };
 
-struct GlueCon: public Constraint {
+struct GlueCon {
     Node *nodes[2];
     Vec3 n;
     double stiff;
-    double value (int *sign=NULL);
-    bool contains(Node *node);    
-    MeshGrad gradient ();
-    MeshGrad project ();
-    double energy (double value);
-    double energy_grad (double value);
-    double energy_hess (double value);
-    MeshGrad friction (double dt, MeshHess &jac);
+    double value (int *sign=NULL) const;
+    bool contains (const Node *node) const;
+    void gradient (MeshGrad &grad) const;
+    void project (MeshGrad &dx) const;
+    double energy (double value) const;
+    double energy_grad (double value) const;
+    double energy_hess (double value) const;
+    void friction (double dt, MeshGrad &force, MeshHess &jac) const;
 };
 
-struct IneqCon: public Constraint {
+struct IneqCon {
     // n . sum(w[i] verts[i]->x) >= 0
     Node *nodes[4];
     double w[4];
@@ -96,14 +115,68 @@ struct IneqCon: public Constraint {
     double a; // area
     double mu; // friction
     double stiff;
-    double value (int *sign=NULL);
-    bool contains(Node *node);    
-    MeshGrad gradient ();
-    MeshGrad project ();
-    double energy (double value);
-    double energy_grad (double value);
-    double energy_hess (double value);
-    MeshGrad friction (double dt, MeshHess &jac);
+    double value (int *sign=NULL) const;
+    bool contains (const Node *node) const;
+    void gradient (MeshGrad &grad) const;
+    void project (MeshGrad &dx) const;
+    double energy (double value) const;
+    double energy_grad (double value) const;
+    double energy_hess (double value) const;
+    void friction (double dt, MeshGrad &force, MeshHess &jac) const;
 };
 
+// The constraints of a solve, stored by value in one array per kind.
+// clear() keeps the capacity, so a set reused from step to step (see
+// Simulation) stops allocating once it has grown to the working set.
+struct Constraints {
+    std::vector<EqCon> eq; // handles
+    std::vector<GlueCon> glue;
+    // proximity; node_face also holds the obstacle proxy constraints
+    std::vector<IneqCon> node_face, edge_edge, edge_node;
+    void clear ();
+    int size () const;
+    bool empty () const {return size() == 0;}
+};
+
+// op(con) for every constraint, kind by kind in the order of Constraints
+template <typename Op> void for_each_constraint (const Constraints &cons,
+                                                 Op &op) {
+    for (size_t c = 0; c < cons.eq.size(); c++)
+        op(cons.eq[c]);
+    for (size_t c = 0; c < cons.glue.size(); c++)
+        op(cons.glue[c]);
+    for (size_t c = 0; c < cons.node_face.size(); c++)
+        op(cons.node_face[c]);
+    for (size_t c = 0; c < cons.edge_edge.size(); c++)
+        op(cons.edge_edge[c]);
+    for (size_t c = 0; c < cons.edge_node.size(); c++)
+        op(cons.edge_node[c]);
+}
+
+// op(con) for constraint j in the order of for_each_constraint
+template <typename Op> void visit_constraint (const Constraints &cons, int j,
+                                              Op &op) {
+    if (j < (int)cons.eq.size()) {
+        op(cons.eq[j]);
+        return;
+    }
+    j -= cons.eq.size();
+    if (j < (int)cons.glue.size()) {
+        op(cons.glue[j]);
+        return;
+    }
+    j -= cons.glue.size();
+    if (j < (int)cons.node_face.size()) {
+        op(cons.node_face[j]);
+        return;
+    }
+    j -= cons.node_face.size();
+    if (j < (int)cons.edge_edge.size()) {
+        op(cons.edge_edge[j]);
+        return;
+    }
+    j -= cons.edge_edge.size();
+    op(cons.edge_node[j]);
+}
+
 #endif
@@ -28,6 +28,7 @@
 #include "geometry.h"
 #include "sepstrength.hpp"
 #include "physics.h"
+#include "profile.h"
 #include "magic.h"
 #include "remesh.h"
 #include "simulation.h"
@@ -39,20 +40,38 @@
 #include <algorithm>
 #include <cstdlib>
 #include <map>
+#include <queue>
+#include <set>
 using namespace std;
 
 static const bool verbose = false;
+static const int batch_size = 64; // splits or collapses built at once
 
 void create_vert_sizing (vector<Vert*>& verts, const map<Node*,Plane> &planes);
 
 // The algorithm
+//
+// Mesh operations are applied one at a time, since each edits the shared
+// mesh arrays and relaxes its neighbourhood against the simulation state.
+// Splits and collapses are taken from their queues in batches whose
+// neighbourhoods share no node; the ops of a batch are built and checked in
+// parallel, as none of them reads what another one changes, then applied in
+// queue order, and the flips they call for are made once the batch is done.
+// What is evaluated per element in between (sizing, edge metrics, flip
+// tests) also runs in parallel, and the work is kept in queues that
+// operations update locally, so no pass rescans or resorts the whole mesh.
+// Queue order and batches never depend on pointer values or the number of
+// threads, which keeps the result reproducible.
+
+struct EdgeQueue;
+struct FaceQueue;
 
 void flip_edges (MeshSubset* subset, vector<Face*>& active_faces, 
-				 vector<Edge*>* update_edges, vector<Face*>* update_faces);
+				 EdgeQueue* update_edges, FaceQueue* update_faces);
 
-bool split_worst_edge (MeshSubset* subset, const vector<Edge*>& edges);
+void split_bad_edges (MeshSubset* subset, const vector<Edge*>& edges);
 
-bool improve_some_face (MeshSubset* subset, vector<Face*>& active);
+void collapse_edges (MeshSubset* subset, const vector<Face*>& faces);
 
 void delete_spaced_out (Mesh& mesh);
 
@@ -60,10 +79,8 @@ void static_remesh (Mesh& mesh) {
     for (size_t i=0; i<mesh.verts.size(); i++) {
         mesh.verts[i]->sizing = Mat3x3(1.f/sq(mesh.parent->remeshing.size_min));
     }
-    vector<Edge*> active_edges = mesh.edges;
-    while (split_worst_edge(0, active_edges)) active_edges = mesh.edges;
-    vector<Face*> active_faces = mesh.faces;
-    while (improve_some_face(0, active_faces));
+    split_bad_edges(0, mesh.edges);
+    collapse_edges(0, mesh.faces);
     compute_ms_data(mesh);
 }
 
@@ -72,9 +89,8 @@ void dynamic_remesh (Mesh& mesh, const map<Node*,Plane> &planes) {
     create_vert_sizing(mesh.verts, planes);
     vector<Face*> active_faces = mesh.faces;
     flip_edges(0, active_faces, 0, 0);
-    while (split_worst_edge(0, mesh.edges));
-    active_faces = mesh.faces;
-    while (improve_some_face(0, active_faces));    
+    split_bad_edges(0, mesh.edges);
+    collapse_edges(0, mesh.faces);
     compute_ms_data(mesh);
 }
 
@@ -83,9 +99,8 @@ void dynamic_remesh (MeshSubset& subset, const map<Node*,Plane> &planes) {
 	create_vert_sizing(verts, planes);
     vector<Face*> active_faces = subset.get_faces();
     flip_edges(&subset, active_faces, 0, 0);
-    while (split_worst_edge(&subset, subset.get_edges()));
-    active_faces = subset.get_faces();
-    while (improve_some_face(&subset, active_faces));
+    split_bad_edges(&subset, subset.get_edges());
+    collapse_edges(&subset, subset.get_faces());
     active_faces = subset.get_faces();
     compute_ms_data(subset.active_nodes);
     compute_ms_data(active_faces);
@@ -224,17 +239,28 @@ Mat3x3 compute_face_sizing (Remeshing& remeshing, const Face *face, const map<No
 
 void create_vert_sizing (vector<Vert*>& verts, const map<Node*,Plane> &planes) {
     Remeshing& remeshing = verts[0]->node->mesh->parent->remeshing;
-    map<Face*,Mat3x3> face_sizing;
-    for (size_t i=0; i<verts.size(); i++) {
+    // number the faces first, then size each of them once
+    map<Face*,int> face_index;
+    vector<Face*> faces;
+    for (size_t i=0; i<verts.size(); i++)
+    	for (size_t f=0; f<verts[i]->adjf.size(); f++) {
+    		Face *face = verts[i]->adjf[f];
+    		if (face && face_index.insert(make_pair(face, (int)faces.size())).second)
+    			faces.push_back(face);
+    	}
+    vector<Mat3x3> face_sizing(faces.size());
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int f=0; f<(int)faces.size(); f++)
+    	face_sizing[f] = compute_face_sizing(remeshing, faces[f], planes);
+#pragma omp parallel for
+    for (int i=0; i<(int)verts.size(); i++) {
     	Mat3x3 sizing(0);
     	Vert* vert = verts[i];
         double wsum = 0;
     	for (size_t f=0; f<vert->adjf.size(); f++) {
     		Face *face = vert->adjf[f];
     		if (!face) continue;
-    		if (face_sizing.find(face) == face_sizing.end())
-    			face_sizing[face] = compute_face_sizing(remeshing, face, planes);
-    		sizing += face->a * face_sizing[face];    		
+    		sizing += face->a * face_sizing[face_index.find(face)->second];
             wsum += face->a;
     	}
     	vert->sizing = sizing / wsum;
@@ -253,12 +279,162 @@ double edge_metric (const Edge *edge) {
                edge_metric(edge_vert(edge,1,0), edge_vert(edge,1,1)));
 }
 
+// Work queues
+
+// the nodes of the faces around an edge, which splitting it reads and changes
+void split_nodes (const Edge *edge, vector<const Node*> &nodes) {
+    nodes.push_back(edge->n[0]);
+    nodes.push_back(edge->n[1]);
+    for (int s = 0; s < 2; s++)
+        if (edge->adjf[s])
+            nodes.push_back(edge_opp_vert(edge, s)->node);
+}
+
+// the nodes of the faces around a face's nodes, which collapsing any of its
+// edges reads and changes
+void collapse_nodes (const Face *face, vector<const Node*> &nodes) {
+    for (int i = 0; i < 3; i++) {
+        const Node *node = face->v[i]->node;
+        for (size_t v = 0; v < node->verts.size(); v++) {
+            const Vert *vert = node->verts[v];
+            for (size_t f = 0; f < vert->adjf.size(); f++)
+                for (int j = 0; j < 3; j++)
+                    nodes.push_back(vert->adjf[f]->v[j]->node);
+        }
+    }
+}
+
+// adds the nodes to used unless one of them is already there
+bool claim (set<const Node*> &used, const vector<const Node*> &nodes) {
+    for (size_t n = 0; n < nodes.size(); n++)
+        if (used.count(nodes[n]))
+            return false;
+    used.insert(nodes.begin(), nodes.end());
+    return true;
+}
+
+// Bad edges, worst first. Operations report the edges they remove and add
+// instead of the mesh being searched and sorted again; ties go to the edge
+// queued first.
+struct EdgeQueue {
+    struct Entry {
+        double metric;
+        int order;
+        Edge *edge;
+        bool operator< (const Entry &entry) const {
+            return metric < entry.metric
+                || (metric == entry.metric && order > entry.order);
+        }
+    };
+    priority_queue<Entry> heap;
+    map<const Edge*,int> live; // order of the current entry of queued edges
+    int order;
+    EdgeQueue (): order(0) {}
+    void push (const vector<Edge*> &edges);
+    void update (const RemeshOp &op);
+    vector<Edge*> pop_independent (int n);
+};
+
+void EdgeQueue::push (const vector<Edge*> &edges) {
+    vector<double> metric(edges.size());
+#pragma omp parallel for if(edges.size() > 256)
+    for (int e = 0; e < (int)edges.size(); e++)
+        metric[e] = edge_metric(edges[e]);
+    for (size_t e = 0; e < edges.size(); e++) {
+        if (metric[e] <= 1)
+            continue;
+        Entry entry = {metric[e], order++, edges[e]};
+        heap.push(entry);
+        live[edges[e]] = entry.order;
+    }
+}
+
+void EdgeQueue::update (const RemeshOp &op) {
+    for (size_t e = 0; e < op.removed_edges.size(); e++)
+        live.erase(op.removed_edges[e]);
+    push(op.added_edges);
+}
+
+// the next edges in queue order, at most n, whose splits share no node; the
+// edges passed over stay queued as they were. A deleted edge's address may
+// come back as a new edge, so entries are matched by order rather than by
+// pointer
+vector<Edge*> EdgeQueue::pop_independent (int n) {
+    vector<Edge*> edges;
+    vector<Entry> skipped;
+    set<const Node*> used;
+    vector<const Node*> nodes;
+    for (int tried = 0; (int)edges.size() < n && tried < 4*n && !heap.empty();) {
+        Entry entry = heap.top();
+        heap.pop();
+        map<const Edge*,int>::iterator it = live.find(entry.edge);
+        if (it == live.end() || it->second != entry.order)
+            continue;
+        tried++;
+        nodes.clear();
+        split_nodes(entry.edge, nodes);
+        if (!claim(used, nodes)) {
+            skipped.push_back(entry);
+            continue;
+        }
+        live.erase(it);
+        edges.push_back(entry.edge);
+    }
+    for (size_t e = 0; e < skipped.size(); e++)
+        heap.push(skipped[e]);
+    return edges;
+}
+
+// Faces in the order they were queued; the faces an operation removes are
+// dropped and the ones it adds go to the back.
+struct FaceQueue {
+    vector<Face*> faces;
+    map<const Face*,int> live; // position of the queued faces
+    size_t next;
+    FaceQueue (): next(0) {}
+    void push (Face *face) {
+        if (live.insert(make_pair((const Face*)face, (int)faces.size())).second)
+            faces.push_back(face);
+    }
+    void update (const RemeshOp &op) {
+        for (size_t f = 0; f < op.removed_faces.size(); f++)
+            live.erase(op.removed_faces[f]);
+        for (size_t f = 0; f < op.added_faces.size(); f++)
+            push(op.added_faces[f]);
+    }
+    bool queued (size_t f) const {
+        map<const Face*,int>::const_iterator it = live.find(faces[f]);
+        return it != live.end() && it->second == (int)f;
+    }
+    // the next faces in queue order, at most n, whose collapses share no
+    // node; the faces passed over stay queued where they were
+    vector<Face*> pop_independent (int n) {
+        while (next < faces.size() && !queued(next))
+            next++;
+        vector<Face*> batch;
+        set<const Node*> used;
+        vector<const Node*> nodes;
+        for (size_t f = next; f < faces.size() && f < next + 4*n
+                              && (int)batch.size() < n; f++) {
+            if (!queued(f))
+                continue;
+            nodes.clear();
+            collapse_nodes(faces[f], nodes);
+            if (!claim(used, nodes))
+                continue;
+            live.erase(faces[f]);
+            batch.push_back(faces[f]);
+        }
+        return batch;
+    }
+};
+
 // Fixing-upping
 vector<Edge*> find_edges_to_flip (vector<Face*>& active_faces);
 vector<Edge*> independent_edges (const vector<Edge*> &edges);
 
 bool flip_some_edges (MeshSubset* subset, vector<Face*>& active_faces, 
-					  vector<Edge*>* update_edges, vector<Face*>* update_faces) {
+					  EdgeQueue* update_edges, FaceQueue* update_faces) {
     static int n_edges_prev = 0;
     vector<Edge*> edges = independent_edges(find_edges_to_flip(active_faces));
     if ((int)edges.size() == n_edges_prev) // probably infinite loop
@@ -266,25 +442,37 @@ bool flip_some_edges (MeshSubset* subset, vector<Face*>& active_faces,
 
     bool did_flip = false;
     n_edges_prev = edges.size();
+    set<const Face*> removed_faces;
+    vector<Face*> added_faces;
     for (size_t e = 0; e < edges.size(); e++) {
         RemeshOp op = flip_edge(edges[e]);
         if (op.empty()) continue;
         
         did_flip = true;
+        profile_count(StepProfile::RemeshFlips);
         if (subset)
         	op.update(subset->active_nodes);
         if (update_edges)
-        	op.set_null(*update_edges);
+        	update_edges->update(op);
         if (update_faces)
-        	op.update(*update_faces);
-        op.update(active_faces);
+        	update_faces->update(op);
+        removed_faces.insert(op.removed_faces.begin(), op.removed_faces.end());
+        append(added_faces, op.added_faces);
 		op.done();
     }
+    // the flipped edges share no nodes, so none of them removed a face
+    // another one added
+    size_t kept = 0;
+    for (size_t f = 0; f < active_faces.size(); f++)
+        if (!removed_faces.count(active_faces[f]))
+            active_faces[kept++] = active_faces[f];
+    active_faces.resize(kept);
+    append(active_faces, added_faces);
     return did_flip;
 }
 
 void flip_edges (MeshSubset* subset, vector<Face*>& active_faces, 
-	             vector<Edge*>* update_edges, vector<Face*>* update_faces) {
+	             EdgeQueue* update_edges, FaceQueue* update_faces) {
     int N = 3*active_faces.size();
     for (int i = 0; i < N; i++) {// don't loop without bound
         if (!flip_some_edges(subset, active_faces, update_edges, update_faces))
@@ -297,35 +485,38 @@ bool should_flip (const Edge *edge);
 
 vector<Edge*> find_edges_to_flip (vector<Face*>& active_faces){
     vector<Edge*> edges;
+    set<const Edge*> seen;
     for (size_t i=0; i < active_faces.size(); i++)
     	for (int j=0; j<3; j++)
-    		include(active_faces[i]->adje[j], edges);
-
-    vector<Edge*> fedges;
-    for (size_t e = 0; e < edges.size(); e++) {
-        Edge *edge = edges[e];
-        if (is_seam_or_boundary(edge) || edge->preserve != 0 || !should_flip(edge))
-            continue;
-        fedges.push_back(edge);
+    		if (seen.insert(active_faces[i]->adje[j]).second)
+    			edges.push_back(active_faces[i]->adje[j]);
+
+    vector<char> flip(edges.size());
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int e = 0; e < (int)edges.size(); e++) {
+        const Edge *edge = edges[e];
+        flip[e] = !is_seam_or_boundary(edge) && edge->preserve == 0
+                  && should_flip(edge);
     }
+    vector<Edge*> fedges;
+    for (size_t e = 0; e < edges.size(); e++)
+        if (flip[e])
+            fedges.push_back(edges[e]);
     return fedges;
 }
 
-bool independent (const Edge *edge, const vector<Edge*> &edges) {
-    for (int i = 0; i < (int)edges.size(); i++) {
-        Edge *edge1 = edges[i];
-        if (edge->n[0] == edge1->n[0] || edge->n[0] == edge1->n[1]
-            || edge->n[1] == edge1->n[0] || edge->n[1] == edge1->n[1])
-            return false;
-    }
-    return true;
-}
-
+// greedily, in order: the edges that share no node with an earlier one
 vector<Edge*> independent_edges (const vector<Edge*> &edges) {
     vector<Edge*> iedges;
-    for (int e = 0; e < (int)edges.size(); e++)
-        if (independent(edges[e], iedges))
-            iedges.push_back(edges[e]);
+    set<const Node*> used;
+    for (int e = 0; e < (int)edges.size(); e++) {
+        Edge *edge = edges[e];
+        if (used.count(edge->n[0]) || used.count(edge->n[1]))
+            continue;
+        used.insert(edge->n[0]);
+        used.insert(edge->n[1]);
+        iedges.push_back(edge);
+    }
     return iedges;
 }
 
@@ -368,54 +559,45 @@ bool should_flip (const Edge *edge) {
 
 // Splitting
 
-vector<Edge*> find_bad_edges (const vector<Edge*>& edges);
-
 Vert *adjacent_vert (const Node *node, const Vert *vert);
 
-bool split_worst_edge (MeshSubset* subset, const vector<Edge*>& edges) {
-    vector<Edge*> bad_edges = find_bad_edges(edges);
-    for (size_t e = 0; e < bad_edges.size(); e++) {
-        Edge *edge = bad_edges[e];
-        if (!edge) continue;
-        Node *node0 = edge->n[0], *node1 = edge->n[1];
-        RemeshOp op = split_edge(edge, 0.5);        
-        for (size_t v = 0; v < op.added_verts.size(); v++) {
-            Vert *vertnew = op.added_verts[v];
-            Vert *v0 = adjacent_vert(node0, vertnew),
-                 *v1 = adjacent_vert(node1, vertnew);
-            vertnew->sizing = 0.5 * (v0->sizing + v1->sizing);
+// until no edge is too long; the edges that splits and the flips after
+// them create are queued as they appear, and as operations only move nodes
+// in world space no other edge's metric changes
+void split_bad_edges (MeshSubset* subset, const vector<Edge*>& edges) {
+    EdgeQueue bad_edges;
+    bad_edges.push(edges);
+    for (;;) {
+        vector<Edge*> batch = bad_edges.pop_independent(batch_size);
+        if (batch.empty())
+            break;
+        vector<RemeshOp> ops(batch.size());
+#pragma omp parallel for schedule(dynamic, 4)
+        for (int e = 0; e < (int)batch.size(); e++)
+            ops[e] = build_split_edge(batch[e], 0.5);
+        vector<Face*> active;
+        for (size_t e = 0; e < batch.size(); e++) {
+            RemeshOp &op = ops[e];
+            if (op.empty()) continue; // would have made a degenerate face
+            Node *node0 = batch[e]->n[0], *node1 = batch[e]->n[1];
+            apply_split_edge(op, 0.5);
+            for (size_t v = 0; v < op.added_verts.size(); v++) {
+                Vert *vertnew = op.added_verts[v];
+                Vert *v0 = adjacent_vert(node0, vertnew),
+                     *v1 = adjacent_vert(node1, vertnew);
+                vertnew->sizing = 0.5 * (v0->sizing + v1->sizing);
+            }
+            if (subset)
+                op.update(subset->active_nodes);
+            bad_edges.update(op);
+            op.done();
+            profile_count(StepProfile::RemeshSplits);
+            if (verbose)
+                cout << "Split " << node0 << " and " << node1 << endl;
+            append(active, op.added_faces);
         }
-        if (subset)
-        	op.update(subset->active_nodes);
-        op.set_null(bad_edges);
-        op.done();
-        if (verbose)
-            cout << "Split " << node0 << " and " << node1 << endl;
-        vector<Face*> active = op.added_faces;
         flip_edges(subset, active, &bad_edges, 0);
     }
-    return !bad_edges.empty();
-}
-
-// don't use edge pointer as secondary sort key, otherwise not reproducible
-struct Deterministic_sort {
-    inline bool operator()(const std::pair<double,Edge*> &left, const std::pair<double,Edge*> &right) {
-        return left.first < right.first;
-    }
-} deterministic_sort;
-
-vector<Edge*> find_bad_edges (const vector<Edge*>& edges) {
-    vector< pair<double,Edge*> > edgems;
-    for (size_t e = 0; e < edges.size(); e++) {
-        double m = edge_metric(edges[e]);
-        if (m > 1)
-            edgems.push_back(make_pair(m, edges[e]));
-    }
-    sort(edgems.begin(), edgems.end(), deterministic_sort);
-    vector<Edge*> bad_edges(edgems.size());
-    for (int e = 0; e < (int)edgems.size(); e++)
-        bad_edges[e] = edgems[edgems.size()-e-1].second;
-    return bad_edges;
 }
 
 Vert *adjacent_vert (const Node *node, const Vert *vert) {
@@ -431,28 +613,43 @@ Vert *adjacent_vert (const Node *node, const Vert *vert) {
 
 vector<int> sort_edges_by_length (const Face *face);
 
+// builds the collapse without applying it; empty if it isn't allowed
 RemeshOp try_edge_collapse (Edge *edge, int which);
 
-bool improve_some_face (MeshSubset* subset, vector<Face*>& active) {
-    for (size_t f=0; f<active.size(); f++) {
-        Face *face = active[f];
-        for (int e = 0; e < 3; e++) {
-            Edge *edge = face->adje[e];
-            RemeshOp op;
-            if (op.empty()) op = try_edge_collapse(edge, 0);
-            if (op.empty()) op = try_edge_collapse(edge, 1);
+// each face is tried once, and again only if an operation recreates it
+void collapse_edges (MeshSubset* subset, const vector<Face*>& faces) {
+    FaceQueue active;
+    for (size_t f=0; f<faces.size(); f++)
+        active.push(faces[f]);
+    for (;;) {
+        vector<Face*> batch = active.pop_independent(batch_size);
+        if (batch.empty())
+            break;
+        vector<RemeshOp> ops(batch.size());
+#pragma omp parallel for schedule(dynamic, 4)
+        for (int f = 0; f < (int)batch.size(); f++) {
+            for (int e = 0; e < 3 && ops[f].empty(); e++) {
+                Edge *edge = batch[f]->adje[e];
+                ops[f] = try_edge_collapse(edge, 0);
+                if (ops[f].empty()) ops[f] = try_edge_collapse(edge, 1);
+            }
+        }
+        vector<Face*> fix_active;
+        for (size_t f = 0; f < batch.size(); f++) {
+            RemeshOp &op = ops[f];
             if (op.empty()) continue;
-            op.update(active);
+            if (verbose)
+                cout << "Collapsed " << op.removed_nodes[0] << endl;
+            apply_collapse_edge(op);
+            active.update(op);
             if (subset)
                 op.update(subset->active_nodes);
             op.done();
-            vector<Face*> fix_active = op.added_faces;
-            flip_edges(subset, fix_active, 0, &active);
-            return true;
+            profile_count(StepProfile::RemeshCollapses);
+            append(fix_active, op.added_faces);
         }
-        remove(f--, active);
+        flip_edges(subset, fix_active, 0, &active);
     }
-    return false;
 }
 
 bool has_labeled_edges (const Node *node);
@@ -464,19 +661,14 @@ bool any_nearly_invalid (const vector<Edge*> edges) {
 }
 
 RemeshOp try_edge_collapse (Edge *edge, int which) {
-    Node *node0 = edge->n[which], *node1 = edge->n[1-which];
+    Node *node0 = edge->n[which];
     if (node0->preserve || node0->label != 0
         || (is_seam_or_boundary(node0) && !is_seam_or_boundary(edge))
         || (has_labeled_edges(node0) && !edge->preserve))
         return RemeshOp();
     if (!can_collapse(node0->mesh->parent->remeshing, edge, which))
         return RemeshOp();
-    RemeshOp op = collapse_edge(edge, which);
-    if (op.empty())
-        return op;
-    if (verbose)
-        cout << "Collapsed " << node0 << " into " << node1 << endl;
-    return op;
+    return build_collapse_edge(edge, which);
 }
 
 bool has_labeled_edges (const Node *node) {
@@ -31,7 +31,7 @@ using namespace std;
 static Vec3 directions[3] = {Vec3(1,0,0), Vec3(0,1,0), Vec3(0,0,1)};
 
 void add_position_constraints (const Node *node, const Vec3 &x, double stiff,
-                               vector<Constraint*> &cons);
+                               Constraints &cons);
 
 Transformation normalize (const Transformation &T) {
     Transformation T1 = T;
@@ -39,26 +39,23 @@ Transformation normalize (const Transformation &T) {
     return T1;
 }
 
-vector<Constraint*> NodeHandle::get_constraints (double t) {
+void NodeHandle::add_constraints (double t, Constraints &cons) {
     double s = strength(t);
     if (!s)
-        return vector<Constraint*>();
+        return;
     if (!activated) {
         // handle just got started, fill in its original position
         x0 = motion ? inverse(normalize(motion->pos(t))).apply(node->x) : node->x;
         activated = true;
     }
     Vec3 x = motion ? normalize(motion->pos(t)).apply(x0) : x0;
-    vector<Constraint*> cons;
     add_position_constraints(node, x, s*::magic.handle_stiffness, cons);
-    return cons;
 }
 
-vector<Constraint*> CircleHandle::get_constraints (double t) {
+void CircleHandle::add_constraints (double t, Constraints &cons) {
     double s = strength(t);
     if (!s)
-        return vector<Constraint*>();
-    vector<Constraint*> cons;
+        return;
     for (int n = 0; n < (int)mesh->nodes.size(); n++) {
         Node *node = mesh->nodes[n];
         if (node->label != label)
@@ -76,27 +73,23 @@ vector<Constraint*> CircleHandle::get_constraints (double t) {
         }
         add_position_constraints(node, x, s*::magic.handle_stiffness*l, cons);
     }
-    return cons;
 }
 
-vector<Constraint*> GlueHandle::get_constraints (double t) {
+void GlueHandle::add_constraints (double t, Constraints &cons) {
     double s = strength(t);
     if (!s)
-        return vector<Constraint*>();
-    vector<Constraint*> cons;
+        return;
     for (int i = 0; i < 3; i++) {
-        GlueCon *con = new GlueCon;
-        con->nodes[0] = nodes[0];
-        con->nodes[1] = nodes[1];
-        con->n = directions[i];
-        con->stiff = s*::magic.handle_stiffness;
-        cons.push_back(con);
+        GlueCon con;
+        con.nodes[0] = nodes[0];
+        con.nodes[1] = nodes[1];
+        con.n = directions[i];
+        con.stiff = s*::magic.handle_stiffness;
+        cons.glue.push_back(con);
     }
-    return cons;
 }
 
-vector<Constraint*> SoftHandle::get_constraints (double t) {
-    return vector<Constraint*>();
+void SoftHandle::add_constraints (double t, Constraints &cons) {
 }
     
 void SoftHandle::add_forces(double t, vector<Vec3> &fext, vector<Mat3x3>& Jext) {
@@ -136,13 +129,13 @@ vector<Node*> SoftHandle::get_nodes() {
 }
 
 void add_position_constraints (const Node *node, const Vec3 &x, double stiff,
-                               vector<Constraint*> &cons) {
+                               Constraints &cons) {
     for (int i = 0; i < 3; i++) {
-        EqCon *con = new EqCon;
-        con->node = (Node*)node;
-        con->x = x;
-        con->n = directions[i];
-        con->stiff = stiff;
-        cons.push_back(con);
+        EqCon con;
+        con.node = (Node*)node;
+        con.x = x;
+        con.n = directions[i];
+        con.stiff = stiff;
+        cons.eq.push_back(con);
     }
 }
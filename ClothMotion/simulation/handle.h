@@ -34,7 +34,8 @@
 struct Handle {
     double start_time, end_time, fade_time;
     virtual ~Handle () {};
-    virtual std::vector<Constraint*> get_constraints (double t) = 0;
+    // appends the handle's constraints at time t
+    virtual void add_constraints (double t, Constraints &cons) = 0;
     virtual std::vector<Node*> get_nodes () = 0;
     bool active (double t) {return t >= start_time && t <= end_time;}
     double strength (double t) {
@@ -53,7 +54,7 @@ struct NodeHandle: public Handle {
     bool activated;
     Vec3 x0;
     NodeHandle (): activated(false) {}
-    std::vector<Constraint*> get_constraints (double t);
+    void add_constraints (double t, Constraints &cons);
     std::vector<Node*> get_nodes () {return std::vector<Node*>(1, node);}
 };
 
@@ -64,13 +65,13 @@ struct CircleHandle: public Handle {
     double c; // circumference
     Vec2 u;
     Vec3 xc, dx0, dx1;
-    std::vector<Constraint*> get_constraints (double t);
+    void add_constraints (double t, Constraints &cons);
     std::vector<Node*> get_nodes () {return std::vector<Node*>();}
 };
 
 struct GlueHandle: public Handle {
     Node* nodes[2];
-    std::vector<Constraint*> get_constraints (double t);
+    void add_constraints (double t, Constraints &cons);
     std::vector<Node*> get_nodes () {
         std::vector<Node*> ns;
         ns.push_back(nodes[0]);
@@ -84,7 +85,7 @@ struct SoftHandle: public Handle {
     Vec3 center;
     double radius;
     const Motion *motion;
-    std::vector<Constraint*> get_constraints (double t);
+    void add_constraints (double t, Constraints &cons);
     std::vector<Node*> get_nodes ();
     void add_forces(double t, std::vector<Vec3> &fext, std::vector<Mat3x3>& Jext);
 };
@@ -29,7 +29,7 @@
 
 #include "mesh.h"
 #include "util.h"
-#include "..\triangulate.h"
+#include "triangulate.h"
 
 void triangle_to_obj (const std::string &infile, const std::string &outfile);
 
@@ -40,8 +40,6 @@ void load_objs (std::vector<Mesh*> &meshes, const std::string &prefix);
 void save_obj (const Mesh &mesh, const std::string &filename);
 void save_objs (const std::vector<Mesh*> &meshes, const std::string &prefix);
 
-template<class T>
-void test_state (T& state, const std::string &prefix);
 template<class T>
 void save_state (T& state, const std::string &prefix);
 template<class T>
@@ -62,32 +60,6 @@ void ensure_existing_directory (const std::string &path);
 
 // IMPLEMENTATION
 
-std::string obtain_subframe_id();
-//void serialize_header(Serialize& s);
-
-template<class T>
-void test_state (T& state, const std::string& prefix) {
-	// build consistent subframe indice
-	std::string id = obtain_subframe_id();
-	std::string cname = prefix + "_" + id + ".chk";
-	
-	Serialize s;
-    s.mode = Serialize::Check;
-    s.fp = gzopen(cname.c_str(), "r");
-    if (!s.fp) {
-    	s.mode = Serialize::Save;
-    	s.fp = gzopen(cname.c_str(), "w3");
-    	if (!s.fp) {
-    		std::cout << "can't write check file " << cname << std::endl;
-    		exit(1);
-    	}
-    }	
-    std::cout << "CHECK: frame " << id << " [" << (s.save() ? "WRITE" : "READ") << "]\n";
-    serialize_header(s);
-    serializer(state, s);    
-    gzclose(s.fp);
-}
-
 std::vector<Face*> triangulate (const std::vector<Vert*> &verts);
 
 
@@ -0,0 +1,45 @@
+#include "linear_solver.h"
+#include "cholesky.h"
+#include "magic.h"
+#include "pcg.h"
+#include "profile.h"
+#include "taucs_util.h"
+using namespace std;
+
+LinearSolver::LinearSolver () {
+    for (int p = 0; p < nPhases; p++)
+        counts[p] = 0;
+}
+
+LinearSolver *new_linear_solver (int type) {
+    switch (type) {
+    case Magic::JacobiCG:
+        return new PcgSolver(PcgSolver::BlockJacobi, ::magic.cg_tolerance,
+                             ::magic.cg_max_iterations);
+    case Magic::CholeskyCG:
+        return new PcgSolver(PcgSolver::IncompleteCholesky,
+                             ::magic.cg_tolerance, ::magic.cg_max_iterations);
+    case Magic::SupernodalLLT:
+        return new CholeskySolver;
+    default:
+#ifdef NO_TAUCS
+        return new CholeskySolver;
+#else
+        return new TaucsFactor;
+#endif
+    }
+}
+
+bool linear_solve (LinearSolver &solver, const BsrMat<3> &A,
+                   const vector<Vec3> &b, vector<Vec3> &x) {
+    if (b.size() < 6) {
+        x = alglib_linear_solve_vec(A, b);
+        return true;
+    }
+    double factor_time = solver.timers[LinearSolver::Factorize].total;
+    bool solved = solver.solve(A, b, x);
+    profile_count(StepProfile::SolverNonzeros, A.values.size());
+    profile_count(StepProfile::FactorTime,
+        (solver.timers[LinearSolver::Factorize].total - factor_time)*1e3);
+    return solved;
+}
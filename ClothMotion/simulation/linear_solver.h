@@ -0,0 +1,34 @@
+#ifndef LINEAR_SOLVER_H
+#define LINEAR_SOLVER_H
+
+#include "sparse.hpp"
+#include "vectors.h"
+#include "../timer.h"
+
+// Solver for the symmetric positive definite block systems of
+// implicit_update. Implementations keep what depends only on the pattern
+// of A (orderings, symbolic factors) until BsrMat::version changes.
+struct LinearSolver {
+    enum Phase {Analyze, Factorize, Solve, nPhases};
+    Timer timers[nPhases];
+    int counts[nPhases];
+    LinearSolver ();
+    virtual ~LinearSolver () {}
+    virtual const char *name () const = 0;
+    virtual bool iterative () const {return false;}
+    // x holds the initial guess on entry; false if the solve failed
+    virtual bool solve (const BsrMat<3> &A, const std::vector<Vec3> &b,
+                        std::vector<Vec3> &x) = 0;
+private:
+    LinearSolver (const LinearSolver&);
+    LinearSolver &operator= (const LinearSolver&);
+};
+
+// type is a Magic::LinearSolver
+LinearSolver *new_linear_solver (int type);
+
+// solves tiny systems densely, everything else with solver
+bool linear_solve (LinearSolver &solver, const BsrMat<3> &A,
+                   const std::vector<Vec3> &b, std::vector<Vec3> &x);
+
+#endif
@@ -31,17 +31,31 @@
 #include <map>
 using namespace std;
 
+// copy the constraints that touch any of the nodes
+template <typename Con>
+void reduce_constraints (const vector<Con> &pcons, const vector<Node*> &nodes,
+                         vector<Con> &cons) {
+    for (size_t n=0; n<pcons.size(); n++) {
+        for (size_t i=0; i<nodes.size(); i++) {
+            if (pcons[n].contains(nodes[i])) {
+                cons.push_back(pcons[n]);
+                break;
+            }
+        }
+    }
+}
+
 template<Space s>
 struct LocalOpt: public NLOpt {
 	vector<Node*>& nodes;
     vector<Vec3> x0;
-    vector<Constraint*> cons;    
+    Constraints cons;
     mutable vector<Vec3> F;
     mutable SpMat<Mat3x3> J;
     const vector<Face*>& faces;
     const vector<Edge*>& edges;    
     LocalOpt (vector<Node*>& nodes, const vector<Face*>& faces, const vector<Edge*>& edges,
-              const vector<Constraint*>& pcons);
+              const Constraints& pcons);
     void update(const double* x) const;
     void initialize (double *x) const;
     void precompute (const double *x) const;
@@ -53,7 +67,7 @@ struct LocalOpt: public NLOpt {
 
 template<Space s>
 LocalOpt<s>::LocalOpt(vector<Node*>& nodes, const vector<Face*>& faces, const vector<Edge*>& edges, 
-                       const vector<Constraint*>& pcons) :
+                       const Constraints& pcons) :
 	nodes(nodes), faces(faces), edges(edges)
 {
     int nn = nodes.size();
@@ -66,14 +80,11 @@ LocalOpt<s>::LocalOpt(vector<Node*>& nodes, const vector<Face*>& faces, const ve
         nodes[i]->index = i;
     }
     // reduce constraints
-    for (size_t n=0; n<pcons.size(); n++) {
-        for (size_t i=0; i<nn; i++) {
-            if (pcons[n]->contains(nodes[i])) {
-                cons.push_back(pcons[n]);
-                break;
-            }
-        }
-    }
+    reduce_constraints(pcons.eq, nodes, cons.eq);
+    reduce_constraints(pcons.glue, nodes, cons.glue);
+    reduce_constraints(pcons.node_face, nodes, cons.node_face);
+    reduce_constraints(pcons.edge_edge, nodes, cons.edge_edge);
+    reduce_constraints(pcons.edge_node, nodes, cons.edge_node);
 }
 
 template<Space s>
@@ -155,7 +166,7 @@ void LocalOpt<s>::finalize (const double *x) const {
 
 template<Space s>
 void local_opt(vector<Node*>& nodes, vector<Face*>& faces, vector<Edge*>& edges,
-        const vector<Constraint*>& cons) 
+        const Constraints& cons) 
 {
 	// mark nodes active for physics
     activate_nodes(nodes);
@@ -168,7 +179,7 @@ void local_opt(vector<Node*>& nodes, vector<Face*>& faces, vector<Edge*>& edges,
 
 template void local_opt<PS>(vector<Node*>& nodes, vector<Face*>& faces,
                             vector<Edge*>& edges,
-                            const vector<Constraint*>& cons);
+                            const Constraints& cons);
 template void local_opt<WS>(vector<Node*>& nodes, vector<Face*>& faces,
                             vector<Edge*>& edges,
-                            const vector<Constraint*>& cons);
+                            const Constraints& cons);
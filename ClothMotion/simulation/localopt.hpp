@@ -6,6 +6,6 @@
 
 template<Space s>
 void local_opt(std::vector<Node*>& nodes, std::vector<Face*>& faces, std::vector<Edge*>& edges,
-               const std::vector<Constraint*>& cons);
+               const Constraints& cons);
 
 #endif
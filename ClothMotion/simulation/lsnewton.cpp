@@ -29,8 +29,6 @@
 #include "taucs_util.h"
 #include "util.h"
 
-#include <QMessageBox>
-
 using namespace std;
 
 static bool verbose;
@@ -67,7 +65,7 @@ void line_search_newtons_method (const NLOpt &problem, OptOptions opt,
         if (norm(g) < opt.eps_g())
             break;
         if (!problem.hessian(&x[0], H)) {
-            QMessageBox::critical(0, "error", "Can't run Newton's method if Hessian of objective is not available!");
+            cerr << "Can't run Newton's method if Hessian of objective is not available!" << endl;
             //exit(1);
         }
         vector<double> p = taucs_linear_solve(H, g);
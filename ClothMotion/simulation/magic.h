@@ -33,6 +33,10 @@ struct Magic {
     bool fixed_high_res_mesh;
     double handle_stiffness, collision_stiffness;
     double repulsion_thickness, projection_thickness;
+    // how far faces may move before proximity sweeps them again; 0 sweeps
+    // everything every time. Off by default, since any remeshing drops what
+    // was kept and the app remeshes every frame
+    double proximity_margin;
     double edge_flip_threshold;
     double rib_stiffening;
     bool combine_tensors;
@@ -40,12 +44,17 @@ struct Magic {
     bool add_jitter;
     double separation_step_size;
     int relax_method, max_cracks;
+    // linear solver of implicit_update
+    enum LinearSolver {TaucsLLT, SupernodalLLT, JacobiCG, CholeskyCG};
+    int linear_solver, cg_max_iterations;
+    double cg_tolerance;
     Magic ():
         fixed_high_res_mesh(false),
         handle_stiffness(1e3),
         collision_stiffness(1e9),
         repulsion_thickness(1e-3),
         projection_thickness(1e-4),
+        proximity_margin(0),
         edge_flip_threshold(1e-2),
         rib_stiffening(1),
         combine_tensors(true),
@@ -53,7 +62,10 @@ struct Magic {
         add_jitter(false),
         separation_step_size(1e-2),
         relax_method(0),
-        max_cracks(100) {}
+        max_cracks(100),
+        linear_solver(TaucsLLT),
+        cg_max_iterations(500),
+        cg_tolerance(1e-6) {}
 };
 
 extern Magic magic;
@@ -253,6 +253,7 @@ void connect (Vert *vert, Node *node) {
 
 void Mesh::add (Vert *vert) {
     verts.push_back(vert);
+    revision++;
     vert->node = NULL;
     vert->adjf.clear();
     vert->index = verts.size()-1;
@@ -265,9 +266,12 @@ void Mesh::remove (Vert* vert) {
         return;
     }
     exclude(vert, verts);
+    revision++;
 }
 
 void Mesh::add (Node *node) {
+    if (node->uuid < 0)
+        node->uuid = uuid_src++;
     nodes.push_back(node);
     node->index = nodes.size()-1;
     node->adje.clear();
@@ -317,6 +321,7 @@ void add_edges_if_needed (Mesh &mesh, const Face *face) {
 
 void Mesh::add (Face *face) {
     faces.push_back(face);
+    revision++;
     face->index = faces.size()-1;
     // adjacency
     add_edges_if_needed(*this, face);
@@ -332,6 +337,7 @@ void Mesh::add (Face *face) {
 
 void Mesh::remove (Face* face) {
     exclude(face, faces);
+    revision++;
     // adjacency
     for (int i = 0; i < 3; i++) {
         Vert *v0 = face->v[NEXT(i)];
@@ -465,6 +471,7 @@ void delete_mesh (Mesh &mesh) {
     if (mesh.proxy)
         delete mesh.proxy;
     mesh.proxy = 0;
+    mesh.revision++;
 }
 
 void reorient_MS(Mesh& mesh) {
@@ -71,7 +71,7 @@ struct Node {
 	enum NodeFlags { FlagNone = 0, FlagActive = 1, FlagMayBreak = 2, 
                      FlagResolveUni = 4, FlagResolveMax = 8 };
 
-    int uuid;
+    int uuid; // given when first added to a mesh, so nodes can be created in parallel
 
 	Mesh* mesh;
 
@@ -94,10 +94,10 @@ struct Node {
     Mat3x3 curvature; // filtered curvature for bending fracture
     // pop filter data
     Vec3 acceleration;
-    Node () : uuid(uuid_src++), sep(0),label(0),flag(0),preserve(false),index(-1),a(0),m(0) {}
+    Node () : uuid(-1), sep(0),label(0),flag(0),preserve(false),index(-1),a(0),m(0) {}
     explicit Node (const Vec3 &y, const Vec3 &x, const Vec3 &v, int label, int flag, 
     	bool preserve) :
-        uuid(uuid_src++), mesh(0), sep(0), label(label), flag(flag), y(y), x(x), x0(x), v(v), preserve(preserve), 
+        uuid(-1), mesh(0), sep(0), label(label), flag(flag), y(y), x(x), x0(x), v(v), preserve(preserve), 
         curvature(0) {}
 
     inline bool active() const { return flag & FlagActive; }
@@ -170,8 +170,12 @@ struct Mesh {
     void remove (Node *node);
     void remove (Edge *edge);
     void remove (Face *face);
+    // bumped by every add/remove of a vert or face and by delete_mesh, so
+    // that consumers such as the render stream and the collision BVH can
+    // tell a remesh from a plain time step
+    int revision;
 
-    Mesh() : ref(0), parent(0), proxy(0) {};
+    Mesh() : ref(0), parent(0), proxy(0), revision(0) {};
 
 };
 
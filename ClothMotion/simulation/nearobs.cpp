@@ -73,37 +73,40 @@ struct NearPoint {
     NearPoint (double d, const Vec3 &x): d(d), x(x) {}
 };
 
-void update_nearest_point (const Vec3 &x, BVHNode *node, NearPoint &p);
+void update_nearest_point (const Vec3 &x, const BVHTree &tree, NearPoint &p);
 
 Vec3 nearest_point (const Vec3 &x, const vector<AccelStruct*> &accs,
                     double dmin) {
     NearPoint p(dmin, x);
     for (int a = 0; a < (int)accs.size(); a++)
-        if (accs[a]->root)
-            update_nearest_point(x, accs[a]->root, p);
+        if (!accs[a]->tree.empty())
+            update_nearest_point(x, accs[a]->tree, p);
     return p.x;
 }
 
 void update_nearest_point (const Vec3 &x, const Face *face, NearPoint &p);
 
-double point_box_distance (const Vec3 &x, const BOX &box);
+double point_box_distance (const Vec3 &x, const BVHTree &tree, int node);
 
-void update_nearest_point (const Vec3 &x, BVHNode *node, NearPoint &p) {
-    if (node->isLeaf())
-        update_nearest_point(x, node->getFace(), p);
-    else {
-        double d = point_box_distance(x, node->_box);
-        if (d >= p.d)
-            return;
-        update_nearest_point(x, node->getLeftChild(), p);
-        update_nearest_point(x, node->getRightChild(), p);
+void update_nearest_point (const Vec3 &x, const BVHTree &tree, NearPoint &p) {
+    vector<int> stack(1, 0);
+    while (!stack.empty()) {
+        int node = stack.back();
+        stack.pop_back();
+        if (tree.isLeaf(node))
+            update_nearest_point(x, tree.getFace(node), p);
+        else if (point_box_distance(x, tree, node) < p.d) {
+            stack.push_back(tree.getRightChild(node));
+            stack.push_back(tree.getLeftChild(node));
+        }
     }
 }
 
-double point_box_distance (const Vec3 &x, const BOX &box) {
-    Vec3 xp = Vec3(clamp(x[0], (double)box._dist[0], (double)box._dist[9]),
-                   clamp(x[1], (double)box._dist[1], (double)box._dist[10]),
-                   clamp(x[2], (double)box._dist[2], (double)box._dist[11]));
+double point_box_distance (const Vec3 &x, const BVHTree &tree, int node) {
+    Vec3 xp;
+    for (int i = 0; i < 3; i++)
+        xp[i] = clamp(x[i], (double)tree.lower(i)[node],
+                            (double)tree.upper(i)[node]);
     return norm(x - xp);
 }
 
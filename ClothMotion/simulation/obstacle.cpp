@@ -25,11 +25,25 @@
 */
 
 #include "obstacle.h"
+#include "geometry.h"
 #include "util.h"
 #include <cstdio>
 
 using namespace std;
 
+// Collision and proximity only read the face and node normals of an
+// obstacle; the node curvature compute_ws_data() adds is used by fracture,
+// which only applies to cloth.
+static void compute_obstacle_ws_data (Mesh &mesh) {
+    int nf = mesh.faces.size(), nn = mesh.nodes.size();
+#pragma omp parallel for
+    for (int f = 0; f < nf; f++)
+        mesh.faces[f]->n = normal<WS>(mesh.faces[f]);
+#pragma omp parallel for
+    for (int n = 0; n < nn; n++)
+        mesh.nodes[n]->n = normal<WS>(mesh.nodes[n]);
+}
+
 Mesh& Obstacle::get_mesh() {
     return curr_state_mesh;
 }
@@ -43,15 +57,19 @@ Mesh& Obstacle::get_mesh(double time) {
         delete_mesh(curr_state_mesh);
     if (time < start_time || time > end_time)
         return curr_state_mesh;
-    if (!activated)
+    if (!activated) {
+        // keep the revision moving so the old faces' BVH is not reused
+        int revision = curr_state_mesh.revision;
         curr_state_mesh = deep_copy(base_mesh);
+        curr_state_mesh.revision += revision + 1;
+    }
     if (transform_spline) {
         DTransformation dtrans = get_dtrans(*transform_spline, time);
         Mesh &mesh = curr_state_mesh;
         for (int n = 0; n < curr_state_mesh.nodes.size(); n++)
             mesh.nodes[n]->x = apply_dtrans(dtrans, base_mesh.nodes[n]->x,
                                             &mesh.nodes[n]->v);
-        compute_ws_data(mesh);
+        compute_obstacle_ws_data(mesh);
     }
     if (!activated)
         update_x0(curr_state_mesh);
@@ -71,5 +89,5 @@ void Obstacle::blend_with_previous (double t, double dt, double blend) {
         Vec3 x0 = trans.apply(node->x0);
         node->x = x0 + blend*(node->x - x0);
     }
-    compute_ws_data(mesh);
+    compute_obstacle_ws_data(mesh);
 }
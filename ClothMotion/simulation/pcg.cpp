@@ -0,0 +1,193 @@
+#include "pcg.h"
+#include <cmath>
+using namespace std;
+
+PcgSolver::PcgSolver (int preconditioner, double tol, int max_iter):
+    preconditioner(preconditioner), tol(tol), max_iter(max_iter),
+    iterations(0), residual(0), matrix(0), version(0), cholesky(false) {}
+
+const char *PcgSolver::name () const {
+    return preconditioner == IncompleteCholesky ? "cg_ic" : "cg_jacobi";
+}
+
+static double dot (const vector<Vec3> &a, const vector<Vec3> &b) {
+    int n = a.size();
+    double sum = 0;
+#pragma omp parallel for reduction(+:sum)
+    for (int i = 0; i < n; i++)
+        sum += dot(a[i], b[i]);
+    return sum;
+}
+
+// D = U^T U with U upper triangular
+static bool cholesky3 (const Mat3x3 &D, Mat3x3 &U) {
+    U = Mat3x3(0);
+    double d0 = D(0,0);
+    if (d0 <= 0)
+        return false;
+    U(0,0) = sqrt(d0);
+    U(0,1) = D(0,1)/U(0,0);
+    U(0,2) = D(0,2)/U(0,0);
+    double d1 = D(1,1) - sq(U(0,1));
+    if (d1 <= 0)
+        return false;
+    U(1,1) = sqrt(d1);
+    U(1,2) = (D(1,2) - U(0,1)*U(0,2))/U(1,1);
+    double d2 = D(2,2) - sq(U(0,2)) - sq(U(1,2));
+    if (d2 <= 0)
+        return false;
+    U(2,2) = sqrt(d2);
+    return true;
+}
+
+void PcgSolver::analyze (const BsrMat<3> &A) {
+    int n = A.n;
+    lower_ptr.assign(n+1, 0);
+    for (int j = 0; j < n; j++)
+        for (int b = A.rowptr[j]+1; b < A.rowptr[j+1]; b++)
+            lower_ptr[A.cols[b]+1]++;
+    for (int i = 0; i < n; i++)
+        lower_ptr[i+1] += lower_ptr[i];
+    lower_row.resize(lower_ptr[n]);
+    lower_block.resize(lower_ptr[n]);
+    vector<int> next(lower_ptr.begin(), lower_ptr.end()-1);
+    for (int j = 0; j < n; j++)
+        for (int b = A.rowptr[j]+1; b < A.rowptr[j+1]; b++) {
+            int k = next[A.cols[b]]++;
+            lower_row[k] = j;
+            lower_block[k] = b;
+        }
+    matrix = &A;
+    version = A.version;
+}
+
+void PcgSolver::multiply (const BsrMat<3> &A, const vector<Vec3> &x,
+                          vector<Vec3> &y) const {
+    int n = A.n;
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        Vec3 yi(0);
+        for (int b = A.rowptr[i]; b < A.rowptr[i+1]; b++)
+            yi += blocks[b]*x[A.cols[b]];
+        for (int k = lower_ptr[i]; k < lower_ptr[i+1]; k++)
+            yi += blocks[lower_block[k]].t()*x[lower_row[k]];
+        y[i] = yi;
+    }
+}
+
+// block IC(0): the factor keeps the block pattern of A
+bool PcgSolver::factor_cholesky (const BsrMat<3> &A) {
+    int n = A.n;
+    factor = blocks;
+    for (int i = 0; i < n; i++) {
+        Mat3x3 Uii;
+        if (!cholesky3(factor[A.rowptr[i]], Uii))
+            return false;
+        factor[A.rowptr[i]] = Uii;
+        diag_inv[i] = inverse(Uii);
+        Mat3x3 Linv = diag_inv[i].t();
+        for (int b = A.rowptr[i]+1; b < A.rowptr[i+1]; b++)
+            factor[b] = Linv*factor[b];
+        for (int b1 = A.rowptr[i]+1; b1 < A.rowptr[i+1]; b1++) {
+            int j = A.cols[b1];
+            for (int b2 = b1; b2 < A.rowptr[i+1]; b2++) {
+                int t = A.find(j, A.cols[b2]);
+                if (t >= 0)
+                    factor[t] -= factor[b1].t()*factor[b2];
+            }
+        }
+    }
+    return true;
+}
+
+void PcgSolver::precondition (const BsrMat<3> &A, const vector<Vec3> &r,
+                              vector<Vec3> &z) const {
+    int n = A.n;
+    if (!cholesky) {
+#pragma omp parallel for
+        for (int i = 0; i < n; i++)
+            z[i] = diag_inv[i]*r[i];
+        return;
+    }
+    // U^T y = r, then U z = y
+    vector<Vec3> w = r;
+    for (int i = 0; i < n; i++) {
+        w[i] = diag_inv[i].t()*w[i];
+        for (int b = A.rowptr[i]+1; b < A.rowptr[i+1]; b++)
+            w[A.cols[b]] -= factor[b].t()*w[i];
+    }
+    for (int i = n-1; i >= 0; i--) {
+        Vec3 s = w[i];
+        for (int b = A.rowptr[i]+1; b < A.rowptr[i+1]; b++)
+            s -= factor[b]*z[A.cols[b]];
+        z[i] = diag_inv[i]*s;
+    }
+}
+
+bool PcgSolver::solve (const BsrMat<3> &A, const vector<Vec3> &b,
+                       vector<Vec3> &x) {
+    int n = A.n;
+    if (matrix != &A || version != A.version) {
+        timers[Analyze].tick();
+        analyze(A);
+        timers[Analyze].tock();
+        counts[Analyze]++;
+    }
+    timers[Factorize].tick();
+    blocks.resize(A.cols.size());
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        for (int k = A.rowptr[i]; k < A.rowptr[i+1]; k++)
+            blocks[k] = A.block(i, k);
+    diag_inv.resize(n);
+    cholesky = preconditioner == IncompleteCholesky && factor_cholesky(A);
+    if (!cholesky) // block-Jacobi, also when IC(0) breaks down
+        for (int i = 0; i < n; i++)
+            diag_inv[i] = inverse(blocks[A.rowptr[i]]);
+    timers[Factorize].tock();
+    counts[Factorize]++;
+
+    timers[Solve].tick();
+    counts[Solve]++;
+    x.resize(n);
+    vector<Vec3> r(n), z(n), p(n), q(n);
+    multiply(A, x, q);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        r[i] = b[i] - q[i];
+    double bnorm = sqrt(dot(b, b));
+    if (bnorm == 0) {
+        x.assign(n, Vec3(0));
+        iterations = 0;
+        residual = 0;
+        timers[Solve].tock();
+        return true;
+    }
+    precondition(A, r, z);
+    p = z;
+    double rz = dot(r, z);
+    for (iterations = 0; iterations < max_iter; iterations++) {
+        residual = sqrt(dot(r, r))/bnorm;
+        if (residual <= tol) {
+            timers[Solve].tock();
+            return true;
+        }
+        multiply(A, p, q);
+        double alpha = rz/dot(p, q);
+#pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            x[i] += alpha*p[i];
+            r[i] -= alpha*q[i];
+        }
+        precondition(A, r, z);
+        double rz_new = dot(r, z);
+        double beta = rz_new/rz;
+        rz = rz_new;
+#pragma omp parallel for
+        for (int i = 0; i < n; i++)
+            p[i] = z[i] + beta*p[i];
+    }
+    residual = sqrt(dot(r, r))/bnorm;
+    timers[Solve].tock();
+    return residual <= tol;
+}
@@ -0,0 +1,38 @@
+#ifndef PCG_H
+#define PCG_H
+
+#include "linear_solver.h"
+
+// Preconditioned conjugate gradient for the symmetric 3x3-block systems of
+// implicit_update. The transposed block lookup depends only on the pattern
+// and is kept between solves; the preconditioner is rebuilt every solve.
+struct PcgSolver: public LinearSolver {
+    enum Preconditioner {BlockJacobi, IncompleteCholesky};
+    int preconditioner;
+    double tol;
+    int max_iter;
+    int iterations; // of the last solve
+    double residual; // relative residual of the last solve
+    PcgSolver (int preconditioner, double tol, int max_iter);
+    const char *name () const;
+    bool iterative () const {return true;}
+    // false if tol was not reached within max_iter iterations
+    bool solve (const BsrMat<3> &A, const std::vector<Vec3> &b,
+                std::vector<Vec3> &x);
+private:
+    void analyze (const BsrMat<3> &A);
+    void multiply (const BsrMat<3> &A, const std::vector<Vec3> &x,
+                   std::vector<Vec3> &y) const;
+    bool factor_cholesky (const BsrMat<3> &A);
+    void precondition (const BsrMat<3> &A, const std::vector<Vec3> &r,
+                       std::vector<Vec3> &z) const;
+    const void *matrix; // pattern the lookup was built for
+    int version;
+    std::vector<int> lower_ptr, lower_row, lower_block; // blocks (j,i), j < i, by i
+    std::vector<Mat3x3> blocks; // A unpacked, diagonal blocks made symmetric
+    std::vector<Mat3x3> factor; // IC(0) factor U with A ~ U^T U
+    std::vector<Mat3x3> diag_inv; // inverse diagonal blocks of A or of U
+    bool cholesky;
+};
+
+#endif
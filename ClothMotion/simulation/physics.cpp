@@ -28,6 +28,7 @@
 
 #include "blockvectors.hpp"
 #include "collisionutil.h"
+#include "magic.h"
 #include "sparse.hpp"
 #include "taucs_util.h"
 #include "io.h"
@@ -250,12 +251,35 @@ template <int n> Vec<3> subvec3 (const Vec<n> &b, int i) {
     return bsub;
 }
 
-template <int m> void add_submat (const Mat<m*3,m*3> &Asub, const Vec<m,int> &ix, SpMat<Mat3x3> &A) {
+// constraint couplings of one step, staged before they go into a BsrMat
+// so its pattern can be checked first
+struct BlockList {
+    vector<int> i, j;
+    vector<Mat3x3> blocks;
+};
+
+inline void add_block (SpMat<Mat3x3> &A, int i, int j, const Mat3x3 &Aij) {
+    A(i,j) += Aij;
+}
+
+inline void add_block (BsrMat<3> &A, int i, int j, const Mat3x3 &Aij) {
+    A.add(i, j, Aij);
+}
+
+inline void add_block (BlockList &A, int i, int j, const Mat3x3 &Aij) {
+    if (j < i)
+        return;
+    A.i.push_back(i);
+    A.j.push_back(j);
+    A.blocks.push_back(Aij);
+}
+
+template <int m, typename Matrix> void add_submat (const Mat<m*3,m*3> &Asub, const Vec<m,int> &ix, Matrix &A) {
     for (int i = 0; i < m; i++) {
         if (ix[i] < 0) continue;
         for (int j = 0; j < m; j++) {
             if (ix[j] < 0) continue;
-            A(ix[i],ix[j]) += submat3(Asub, i,j);
+            add_block(A, ix[i], ix[j], submat3(Asub, i,j));
         }
     }
 }
@@ -301,154 +325,770 @@ template double internal_energy<WS> (const vector<Face*>&, const vector<Edge*>&)
 // A = dt^2 J + dt damp J
 // b = dt f + dt^2 J v + dt damp J v
 
+// element contributions, scaled as described in physics.h
 template <Space s>
-void add_internal_forces (const vector<Face*>& faces, const vector<Edge*>& edges,
-						  SpMat<Mat3x3> &A, vector<Vec3> &b, double dt) {
-    
-    for (size_t f = 0; f < faces.size(); f++) {
-        const Face* face = faces[f];
-        const Node *n0 = face->v[0]->node, *n1 = face->v[1]->node,
-                   *n2 = face->v[2]->node;
-        Vec9 vs = mat_to_vec(Mat3x3(n0->v, n1->v, n2->v));
-        pair<Mat9x9,Vec9> membF = stretching_force<s>(face);
-        Mat9x9 J = membF.first;
-        Vec9 F = membF.second;
-        if (dt == 0) {
-            add_submat(-J, indices(n0,n1,n2), A);
-            add_subvec(F, indices(n0,n1,n2), b);
+static void face_forces (const Face *face, double dt, Mat9x9 &J, Vec9 &F) {
+    const Node *n0 = face->v[0]->node, *n1 = face->v[1]->node,
+               *n2 = face->v[2]->node;
+    Vec9 vs = mat_to_vec(Mat3x3(n0->v, n1->v, n2->v));
+    pair<Mat9x9,Vec9> membF = stretching_force<s>(face);
+    if (dt == 0) {
+        J = -membF.first;
+        F = membF.second;
+    } else {
+        double damping = face->material->damping;
+        J = -dt*(dt+damping)*membF.first;
+        F = dt*(membF.second + (dt+damping)*membF.first*vs);
+    }
+}
+
+template <Space s>
+static void edge_forces (const Edge *edge, double dt, Mat12x12 &J, Vec12 &F) {
+    pair<Mat12x12,Vec12> bendF = bending_force<s>(edge);
+    const Node *n0 = edge->n[0],
+               *n1 = edge->n[1],
+               *n2 = edge_opp_vert(edge, 0)->node,
+               *n3 = edge_opp_vert(edge, 1)->node;
+    Vec12 vs = mat_to_vec(Mat3x4(n0->v, n1->v, n2->v, n3->v));
+    if (dt == 0) {
+        J = -bendF.first;
+        F = bendF.second;
+    } else {
+        double damping = (edge->adjf[0]->material->damping +
+                          edge->adjf[1]->material->damping) * 0.5;
+        J = -dt*(dt+damping)*bendF.first;
+        F = dt*(bendF.second + (dt+damping)*bendF.first*vs);
+    }
+}
+
+static Vec<3,int> indices (const Face *face) {
+    return indices(face->v[0]->node, face->v[1]->node, face->v[2]->node);
+}
+
+static Vec<4,int> indices (const Edge *edge) {
+    return indices(edge->n[0], edge->n[1], edge_opp_vert(edge, 0)->node,
+                   edge_opp_vert(edge, 1)->node);
+}
+
+// Batched element kernels, used by the implicit system. A batch holds
+// ElementBatch elements in structure-of-arrays form with the lane index
+// innermost, so the arithmetic vectorizes across elements. Unused lanes
+// repeat the last element: every lane loop runs at full width and each
+// element takes the same instruction path whatever batch it lands in.
+// Their output is the element's J and F as face_forces/edge_forces
+// define them, written as 3x3 blocks and 3-vectors.
+enum {ElementBatch = 4};
+
+// Stretching derivatives are sums of DD[c] = D.col(c)^T (x) I terms, so
+// with p[r] the strain gradients (one 3-vector per vertex) the Hessian is
+//   H(a,b) = sum_rt C(r,t) p[r]_a p[t]_b^T + sum_c S(c) D(a,c) D(b,c) I
+// and grad_a = sum_r g[r] p[r]_a; neither needs a dense 9x9 intermediate.
+// The DDE model has R = 3 gradients (uu, vv, uv), the alternative model
+// one per entry of the symmetric strain, R = 6.
+template <Space s, bool dde>
+static void stretching_batch (const Face *const *faces, int count, double dt,
+                              Mat3x3 *const *blocks, Vec3 *const *forces) {
+    const int W = ElementBatch, R = dde ? 3 : 6;
+    double D[3][3][W], x[3][3][W], v[3][3][W];
+    double C[R][R][W], S[3][W], g[R][W], js[W], fs[W], hs[W];
+    for (int l = 0; l < W; l++) {
+        const Face *face = faces[min(l, count-1)];
+        const SimMaterial *mat = face->material;
+        Mat3x3 F = deformation_gradient<s>(face);
+        Mat3x3 G = (F.t()*F - Mat3x3(1)) * 0.5;
+        Mat3x3 Y = face->invDm * face->Sp_str;
+        for (int a = 0; a < 3; a++) {
+            const Node *node = face->v[a]->node;
+            Vec3 xa = pos<s>(node);
+            for (int c = 0; c < 3; c++) {
+                D[a][c][l] = a == 0 ? -Y(0,c)-Y(1,c) : Y(a-1,c);
+                x[a][c][l] = xa[c];
+                v[a][c][l] = node->v[c];
+            }
+        }
+        for (int r = 0; r < R; r++)
+            for (int t = 0; t < R; t++)
+                C[r][t][l] = 0;
+        if (dde) {
+            // stress of the DDE model, see stretching_force
+            double weakening_mult = 1/(1 + mat->weakening * face->damage);
+            Vec4 k = stretching_stiffness(reduce_xy(G), mat->stretching)
+                   * (-face->a * weakening_mult);
+            double g0 = max(G(0,0),0.), g1 = max(G(1,1),0.);
+            C[0][0][l] = k[0];
+            C[1][1][l] = k[2];
+            C[0][1][l] = C[1][0][l] = k[1];
+            C[2][2][l] = 2*k[3];
+            S[0][l] = k[0]*g0 + k[1]*g1;
+            S[1][l] = k[2]*g1 + k[1]*g0;
+            S[2][l] = 0;
+            g[0][l] = k[0]*G(0,0) + k[1]*G(1,1);
+            g[1][l] = k[2]*G(1,1) + k[1]*G(0,0);
+            g[2][l] = 2*k[3]*G(0,1);
         } else {
-            double damping = face->material->damping;
-            add_submat(-dt*(dt+damping)*J, indices(n0,n1,n2), A);
-            add_subvec(dt*(F + (dt+damping)*J*vs), indices(n0,n1,n2), b);
+            double gf = -face->a * mat->alt_stretching,
+                   nu = mat->alt_poisson;
+            Mat3x3 Gc = matmax(G,Mat3x3(0));
+            for (int i = 0; i < 3; i++) {
+                C[i][i][l] = gf*(1-nu) + 0.5*gf*nu;
+                S[i][l] = gf*(1-nu)*Gc(i,i) + gf*nu*trace(Gc);
+                g[i][l] = gf*(1-nu)*G(i,i) + gf*nu*trace(G);
+            }
+            for (int r = 3; r < R; r++) {
+                int i = r == 3 ? 1 : 2, j = r == 3 ? 0 : r - 4;
+                C[r][r][l] = 2*gf*(1-nu);
+                g[r][l] = 2*gf*(1-nu)*G(i,j);
+            }
         }
+        double damping = mat->damping;
+        js[l] = dt == 0 ? -1 : -dt*(dt+damping);
+        fs[l] = dt == 0 ? 1 : dt;
+        hs[l] = dt == 0 ? 0 : -js[l];
+    }
+    // f[c] = F.col(c) = DD[c] x, the deformed tangents
+    double f[3][3][W];
+    for (int c = 0; c < 3; c++)
+        for (int k = 0; k < 3; k++)
+            for (int l = 0; l < W; l++)
+                f[c][k][l] = D[0][c][l]*x[0][k][l] + D[1][c][l]*x[1][k][l]
+                           + D[2][c][l]*x[2][k][l];
+    // strain gradients p[r]_a
+    double p[R][3][3][W];
+    for (int a = 0; a < 3; a++)
+        for (int k = 0; k < 3; k++)
+            for (int l = 0; l < W; l++) {
+                if (dde) {
+                    p[0][a][k][l] = D[a][0][l]*f[0][k][l];
+                    p[1][a][k][l] = D[a][1][l]*f[1][k][l];
+                    p[2][a][k][l] = (D[a][0][l]*f[1][k][l]
+                                   + D[a][1][l]*f[0][k][l])/2.;
+                } else {
+                    for (int r = 0; r < R; r++) {
+                        int i = r < 3 ? r : r == 3 ? 1 : 2,
+                            j = r < 3 ? r : r == 3 ? 0 : r - 4;
+                        p[r][a][k][l] = 0.5*(D[a][i][l]*f[j][k][l]
+                                           + D[a][j][l]*f[i][k][l]);
+                    }
+                }
+            }
+    // q[r]_b = sum_t C(r,t) p[t]_b, and the projections of v on p and D
+    double q[R][3][3][W], pv[R][W], dv[3][3][W];
+    for (int r = 0; r < R; r++)
+        for (int b = 0; b < 3; b++)
+            for (int k = 0; k < 3; k++)
+                for (int l = 0; l < W; l++) {
+                    double sum = 0;
+                    for (int t = 0; t < R; t++)
+                        sum += C[r][t][l]*p[t][b][k][l];
+                    q[r][b][k][l] = sum;
+                }
+    for (int r = 0; r < R; r++)
+        for (int l = 0; l < W; l++) {
+            double sum = 0;
+            for (int b = 0; b < 3; b++)
+                for (int k = 0; k < 3; k++)
+                    sum += p[r][b][k][l]*v[b][k][l];
+            pv[r][l] = sum;
+        }
+    for (int c = 0; c < 3; c++)
+        for (int k = 0; k < 3; k++)
+            for (int l = 0; l < W; l++)
+                dv[c][k][l] = D[0][c][l]*v[0][k][l] + D[1][c][l]*v[1][k][l]
+                            + D[2][c][l]*v[2][k][l];
+    // F_a = fs grad_a + hs sum_b H(a,b) v_b
+    double fa[3][3][W];
+    for (int a = 0; a < 3; a++)
+        for (int k = 0; k < 3; k++)
+            for (int l = 0; l < W; l++) {
+                double sum = 0;
+                for (int r = 0; r < R; r++) {
+                    double cv = 0;
+                    for (int t = 0; t < R; t++)
+                        cv += C[r][t][l]*pv[t][l];
+                    sum += (fs[l]*g[r][l] + hs[l]*cv)*p[r][a][k][l];
+                }
+                for (int c = 0; c < 3; c++)
+                    sum += hs[l]*S[c][l]*D[a][c][l]*dv[c][k][l];
+                fa[a][k][l] = sum;
+            }
+    // J(a,b) = js H(a,b)
+    double ja[3][3][3][3][W];
+    for (int a = 0; a < 3; a++)
+        for (int b = 0; b < 3; b++)
+            for (int k = 0; k < 3; k++)
+                for (int m = 0; m < 3; m++)
+                    for (int l = 0; l < W; l++) {
+                        double sum = k == m ? S[0][l]*D[a][0][l]*D[b][0][l]
+                                            + S[1][l]*D[a][1][l]*D[b][1][l]
+                                            + S[2][l]*D[a][2][l]*D[b][2][l]
+                                            : 0;
+                        for (int r = 0; r < R; r++)
+                            sum += p[r][a][k][l]*q[r][b][m][l];
+                        ja[a][b][k][m][l] = js[l]*sum;
+                    }
+    for (int l = 0; l < count; l++)
+        for (int a = 0; a < 3; a++) {
+            for (int k = 0; k < 3; k++)
+                forces[l][a][k] = fa[a][k][l];
+            for (int b = 0; b < 3; b++)
+                for (int k = 0; k < 3; k++)
+                    for (int m = 0; m < 3; m++)
+                        blocks[l][a*3+b](k,m) = ja[a][b][k][m][l];
+        }
+}
+
+// The bending Hessian is the rank-one outer(dtheta, dtheta) scaled, so
+// the blocks are formed directly from the four per-vertex gradients.
+template <Space s>
+static void bending_batch (const Edge *const *edges, int count, double dt,
+                           Mat3x3 *const *blocks, Vec3 *const *forces) {
+    const int W = ElementBatch;
+    double t[4][3][W], v[4][3][W], c[W], e[W], js[W], fs[W], hs[W];
+    for (int l = 0; l < W; l++) {
+        const Edge *edge = edges[min(l, count-1)];
+        const Face *face0 = edge->adjf[0], *face1 = edge->adjf[1];
+        double theta = dihedral_angle<s>(edge);
+        const Node *node[4] = {edge->n[0], edge->n[1],
+                               edge_opp_vert(edge, 0)->node,
+                               edge_opp_vert(edge, 1)->node};
+        Vec3 x0 = pos<s>(node[0]), x1 = pos<s>(node[1]),
+             x2 = pos<s>(node[2]), x3 = pos<s>(node[3]);
+        double h0 = distance(x2, x0, x1), h1 = distance(x3, x0, x1);
+        Vec3 n0 = normal<s>(face0)/h0, n1 = normal<s>(face1)/h1;
+        Vec2 w_f0 = barycentric_weights(x2, x0, x1),
+             w_f1 = barycentric_weights(x3, x0, x1);
+        Vec3 dtheta[4] = {-(w_f0[0]*n0 + w_f1[0]*n1),
+                          -(w_f0[1]*n0 + w_f1[1]*n1), n0, n1};
+        for (int a = 0; a < 4; a++)
+            for (int k = 0; k < 3; k++) {
+                t[a][k][l] = dtheta[a][k];
+                v[a][k][l] = node[a]->v[k];
+            }
+        c[l] = -bending_coeff(edge, theta)/2.;
+        e[l] = theta - edge->theta_ideal;
+        double damping = (face0->material->damping +
+                          face1->material->damping) * 0.5;
+        js[l] = dt == 0 ? -1 : -dt*(dt+damping);
+        fs[l] = dt == 0 ? 1 : dt;
+        hs[l] = dt == 0 ? 0 : -js[l];
+    }
+    double tv[W], s0[W];
+    for (int l = 0; l < W; l++) {
+        double sum = 0;
+        for (int a = 0; a < 4; a++)
+            for (int k = 0; k < 3; k++)
+                sum += t[a][k][l]*v[a][k][l];
+        tv[l] = sum;
+    }
+    // F_a = (fs c e + hs c dtheta.v) dtheta_a, J(a,b) = js c dtheta_a dtheta_b^T
+    for (int l = 0; l < W; l++) {
+        s0[l] = c[l]*(fs[l]*e[l] + hs[l]*tv[l]);
+        c[l] *= js[l];
+    }
+    double fa[4][3][W], ja[4][4][3][3][W];
+    for (int a = 0; a < 4; a++)
+        for (int k = 0; k < 3; k++)
+            for (int l = 0; l < W; l++)
+                fa[a][k][l] = s0[l]*t[a][k][l];
+    for (int a = 0; a < 4; a++)
+        for (int b = 0; b < 4; b++)
+            for (int k = 0; k < 3; k++)
+                for (int m = 0; m < 3; m++)
+                    for (int l = 0; l < W; l++)
+                        ja[a][b][k][m][l] = c[l]*t[a][k][l]*t[b][m][l];
+    for (int l = 0; l < count; l++)
+        for (int a = 0; a < 4; a++) {
+            for (int k = 0; k < 3; k++)
+                forces[l][a][k] = fa[a][k][l];
+            for (int b = 0; b < 4; b++)
+                for (int k = 0; k < 3; k++)
+                    for (int m = 0; m < 3; m++)
+                        blocks[l][a*4+b](k,m) = ja[a][b][k][m][l];
+        }
+}
+
+// Evaluates faces [begin,end) into the plan layout of
+// build_assembly_plan, split by material model since that is a
+// compile-time choice of the kernel
+template <Space s>
+static void stretching_batches (const vector<Face*>& faces, int begin, int end,
+                                double dt, vector<Mat3x3> &blocks,
+                                vector<Vec3> &forces) {
+    const Face *batch[2][ElementBatch];
+    Mat3x3 *block[2][ElementBatch];
+    Vec3 *force[2][ElementBatch];
+    int count[2] = {0, 0};
+    for (int f = begin; f < end; f++) {
+        int m = faces[f]->material->use_dde ? 1 : 0;
+        batch[m][count[m]] = faces[f];
+        block[m][count[m]] = &blocks[f*9];
+        force[m][count[m]] = &forces[f*3];
+        count[m]++;
+    }
+    if (count[1])
+        stretching_batch<s,true>(batch[1], count[1], dt, block[1], force[1]);
+    if (count[0])
+        stretching_batch<s,false>(batch[0], count[0], dt, block[0], force[0]);
+}
+
+// bending edges [begin,end) of the given list, at block0/force0 onwards
+template <Space s>
+static void bending_batches (const vector<Edge*>& edges,
+                             const vector<int> &bending, int begin, int end,
+                             double dt, Mat3x3 *block0, Vec3 *force0) {
+    const Edge *batch[ElementBatch];
+    Mat3x3 *block[ElementBatch];
+    Vec3 *force[ElementBatch];
+    for (int k = begin; k < end; k++) {
+        batch[k-begin] = edges[bending[k]];
+        block[k-begin] = block0 + k*16;
+        force[k-begin] = force0 + k*4;
+    }
+    bending_batch<s>(batch, end - begin, dt, block, force);
+}
+
+template <Space s, typename Matrix>
+void add_internal_forces (const vector<Face*>& faces, const vector<Edge*>& edges,
+						  Matrix &A, vector<Vec3> &b, double dt) {
+    for (size_t f = 0; f < faces.size(); f++) {
+        Mat9x9 J;
+        Vec9 F;
+        face_forces<s>(faces[f], dt, J, F);
+        add_submat(J, indices(faces[f]), A);
+        add_subvec(F, indices(faces[f]), b);
     }
     for (size_t e = 0; e < edges.size(); e++) {
         const Edge *edge = edges[e];
         if (!edge->adjf[0] || !edge->adjf[1])
             continue;
-        pair<Mat12x12,Vec12> bendF = bending_force<s>(edge);
-        const Node *n0 = edge->n[0],
-                   *n1 = edge->n[1],
-                   *n2 = edge_opp_vert(edge, 0)->node,
-                   *n3 = edge_opp_vert(edge, 1)->node;
-        Vec12 vs = mat_to_vec(Mat3x4(n0->v, n1->v, n2->v, n3->v));
-        Mat12x12 J = bendF.first;
-        Vec12 F = bendF.second;
-        
-        if (dt == 0) {
-            add_submat(-J, indices(n0,n1,n2,n3), A);
-            add_subvec(F, indices(n0,n1,n2,n3), b);
-        } else {
-            double damping = (edge->adjf[0]->material->damping +
-							  edge->adjf[1]->material->damping) * 0.5;
-            add_submat(-dt*(dt+damping)*J, indices(n0,n1,n2,n3), A);
-            add_subvec(dt*(F + (dt+damping)*J*vs), indices(n0,n1,n2,n3), b);
-        }
+        Mat12x12 J;
+        Vec12 F;
+        edge_forces<s>(edge, dt, J, F);
+        add_submat(J, indices(edge), A);
+        add_subvec(F, indices(edge), b);
     }
 }
 template void add_internal_forces<PS> (const vector<Face*>&, const vector<Edge*>&, 
                                        SpMat<Mat3x3> &, vector<Vec3>&, double);
 template void add_internal_forces<WS> (const vector<Face*>&, const vector<Edge*>&, 
                                        SpMat<Mat3x3> &, vector<Vec3>&, double);
+template void add_internal_forces<PS> (const vector<Face*>&, const vector<Edge*>&, 
+                                       BsrMat<3> &, vector<Vec3>&, double);
+template void add_internal_forces<WS> (const vector<Face*>&, const vector<Edge*>&, 
+                                       BsrMat<3> &, vector<Vec3>&, double);
 
-double constraint_energy (const vector<Constraint*> &cons) {
-    double E = 0;
-    for (int c = 0; c < (int)cons.size(); c++) {
-        double value = cons[c]->value();
-        double e = cons[c]->energy(value);
-        E += e;
+// (destination, source) pairs of one element; sources are numbered as
+// plan.blocks and plan.forces are laid out
+template <int m>
+static void plan_element (const Vec<m,int> &ix, int block0, int force0,
+                          const BsrMat<3> &A, vector< pair<int,int> > &slots,
+                          vector< pair<int,int> > &nodes) {
+    for (int i = 0; i < m; i++) {
+        if (ix[i] < 0) continue;
+        nodes.push_back(make_pair(ix[i], force0 + i));
+        for (int j = 0; j < m; j++) {
+            if (ix[j] < ix[i]) continue; // implied by symmetry, see BsrMat::add
+            int slot = A.find(ix[i], ix[j]);
+            if (slot >= 0)
+                slots.push_back(make_pair(slot, block0 + i*m + j));
+        }
     }
-    return E;
 }
 
-void add_constraint_forces (const vector<Constraint*> &cons,
-                            SpMat<Mat3x3> &A, vector<Vec3> &b, double dt) {
-    for (int c = 0; c < (int)cons.size(); c++) {
-        double value = cons[c]->value();
-        double g = cons[c]->energy_grad(value);
-        double h = cons[c]->energy_hess(value);
-        MeshGrad grad = cons[c]->gradient();
+// stable counting sort of (destination, source) pairs into ptr/src
+static void bucket_sources (const vector< pair<int,int> > &pairs, int n,
+                            vector<int> &ptr, vector<int> &src) {
+    ptr.assign(n+1, 0);
+    for (size_t p = 0; p < pairs.size(); p++)
+        ptr[pairs[p].first+1]++;
+    for (int i = 0; i < n; i++)
+        ptr[i+1] += ptr[i];
+    vector<int> next(ptr.begin(), ptr.end()-1);
+    src.resize(pairs.size());
+    for (size_t p = 0; p < pairs.size(); p++)
+        src[next[pairs[p].first]++] = pairs[p].second;
+}
+
+static void build_assembly_plan (AssemblyPlan &plan,
+                                 const vector<Face*>& faces,
+                                 const vector<Edge*>& edges,
+                                 const BsrMat<3> &A) {
+    plan.bending.clear();
+    for (size_t e = 0; e < edges.size(); e++)
+        if (edges[e]->adjf[0] && edges[e]->adjf[1])
+            plan.bending.push_back(e);
+    int nf = faces.size(), nb = plan.bending.size();
+    vector< pair<int,int> > slots, nodes;
+    for (int f = 0; f < nf; f++)
+        plan_element(indices(faces[f]), f*9, f*3, A, slots, nodes);
+    for (int k = 0; k < nb; k++)
+        plan_element(indices(edges[plan.bending[k]]), nf*9 + k*16,
+                     nf*3 + k*4, A, slots, nodes);
+    bucket_sources(slots, A.cols.size(), plan.slot_ptr, plan.slot_src);
+    bucket_sources(nodes, A.n, plan.node_ptr, plan.node_src);
+    plan.blocks.resize(nf*9 + nb*16);
+    plan.forces.resize(nf*3 + nb*4);
+    plan.version = A.version;
+}
+
+// Parallel version of the above for the implicit system. Elements are
+// evaluated concurrently into the plan by the batched kernels, then each
+// block of A and entry of b is owned by one thread and sums its sources in
+// element order, so the result does not depend on the number of threads
+// and needs no locks or atomics. It is not bit-identical to the serial
+// loop: the batched kernels round differently from face_forces and
+// edge_forces, within a few ulps.
+template <Space s>
+static void add_internal_forces (AssemblyPlan &plan,
+                                 const vector<Face*>& faces,
+                                 const vector<Edge*>& edges, BsrMat<3> &A,
+                                 vector<Vec3> &b, double dt) {
+    if (plan.version != A.version)
+        build_assembly_plan(plan, faces, edges, A);
+    int nf = faces.size(), nb = plan.bending.size();
+#pragma omp parallel
+    {
+        const int W = ElementBatch;
+#pragma omp for schedule(static) nowait
+        for (int f = 0; f < nf; f += W)
+            stretching_batches<s>(faces, f, min(f + W, nf), dt, plan.blocks,
+                                  plan.forces);
+#pragma omp for schedule(static)
+        for (int k = 0; k < nb; k += W)
+            bending_batches<s>(edges, plan.bending, k, min(k + W, nb), dt,
+                               &plan.blocks[nf*9], &plan.forces[nf*3]);
+#pragma omp for schedule(static) nowait
+        for (int i = 0; i < A.n; i++)
+            for (int k = A.rowptr[i]; k < A.rowptr[i+1]; k++)
+                for (int p = plan.slot_ptr[k]; p < plan.slot_ptr[k+1]; p++)
+                    A.add_at(i, k, plan.blocks[plan.slot_src[p]]);
+#pragma omp for schedule(static)
+        for (int n = 0; n < A.n; n++)
+            for (int p = plan.node_ptr[n]; p < plan.node_ptr[n+1]; p++)
+                b[n] += plan.forces[plan.node_src[p]];
+    }
+}
+
+static double magnitude (const Vec3 &v) {return norm(v);}
+static double magnitude (const Mat3x3 &A) {return norm_F(A);}
+
+// largest difference over [begin,end), relative to the largest reference
+template <typename T>
+static double relative_error (const vector<T> &ref, const vector<T> &val,
+                              int begin, int end) {
+    double diff = 0, scale = 0;
+    for (int i = begin; i < end; i++) {
+        diff = max(diff, magnitude(ref[i] - val[i]));
+        scale = max(scale, magnitude(ref[i]));
+    }
+    return scale ? diff/scale : diff;
+}
+
+KernelBenchmark benchmark_internal_forces (const vector<Face*>& faces,
+                                           const vector<Edge*>& edges,
+                                           double dt, int repetitions) {
+    vector<int> bending;
+    for (size_t e = 0; e < edges.size(); e++)
+        if (edges[e]->adjf[0] && edges[e]->adjf[1])
+            bending.push_back(e);
+    int nf = faces.size(), nb = bending.size();
+    repetitions = max(repetitions, 1);
+    vector<Mat3x3> ref_blocks(nf*9 + nb*16), blocks(ref_blocks.size());
+    vector<Vec3> ref_forces(nf*3 + nb*4), forces(ref_forces.size());
+    KernelBenchmark bench;
+    bench.faces = nf;
+    bench.hinges = nb;
+    double begin = Timer::now();
+    for (int r = 0; r < repetitions; r++)
+        for (int f = 0; f < nf; f++) {
+            Mat9x9 J;
+            Vec9 F;
+            face_forces<WS>(faces[f], dt, J, F);
+            for (int i = 0; i < 3; i++) {
+                ref_forces[f*3 + i] = subvec3(F, i);
+                for (int j = 0; j < 3; j++)
+                    ref_blocks[f*9 + i*3 + j] = submat3(J, i, j);
+            }
+        }
+    double end = Timer::now();
+    bench.stretching_reference = (end - begin)/repetitions;
+    begin = end;
+    for (int r = 0; r < repetitions; r++)
+        for (int k = 0; k < nb; k++) {
+            Mat12x12 J;
+            Vec12 F;
+            edge_forces<WS>(edges[bending[k]], dt, J, F);
+            for (int i = 0; i < 4; i++) {
+                ref_forces[nf*3 + k*4 + i] = subvec3(F, i);
+                for (int j = 0; j < 4; j++)
+                    ref_blocks[nf*9 + k*16 + i*4 + j] = submat3(J, i, j);
+            }
+        }
+    end = Timer::now();
+    bench.bending_reference = (end - begin)/repetitions;
+    begin = end;
+    for (int r = 0; r < repetitions; r++)
+        for (int f = 0; f < nf; f += ElementBatch)
+            stretching_batches<WS>(faces, f, min(f + ElementBatch, nf), dt,
+                                   blocks, forces);
+    end = Timer::now();
+    bench.stretching_batched = (end - begin)/repetitions;
+    begin = end;
+    for (int r = 0; r < repetitions; r++)
+        for (int k = 0; k < nb; k += ElementBatch)
+            bending_batches<WS>(edges, bending, k, min(k + ElementBatch, nb),
+                                dt, &blocks[nf*9], &forces[nf*3]);
+    end = Timer::now();
+    bench.bending_batched = (end - begin)/repetitions;
+    int nblocks = blocks.size(), nforces = forces.size();
+    bench.stretching_error = max(relative_error(ref_blocks, blocks, 0, nf*9),
+                                 relative_error(ref_forces, forces, 0, nf*3));
+    bench.bending_error = max(relative_error(ref_blocks, blocks, nf*9, nblocks),
+                              relative_error(ref_forces, forces, nf*3, nforces));
+    return bench;
+}
+
+struct ConstraintEnergy {
+    double E;
+    ConstraintEnergy (): E(0) {}
+    template <typename Con> void operator() (const Con &con) {
+        E += con.energy(con.value());
+    }
+};
+
+double constraint_energy (const Constraints &cons) {
+    ConstraintEnergy energy;
+    for_each_constraint(cons, energy);
+    return energy.E;
+}
+
+template <typename Matrix>
+struct ConstraintForces {
+    Matrix &A;
+    vector<Vec3> &b;
+    double dt;
+    ConstraintForces (Matrix &A, vector<Vec3> &b, double dt):
+        A(A), b(b), dt(dt) {}
+    template <typename Con> void operator() (const Con &con) {
+        double value = con.value();
+        double g = con.energy_grad(value);
+        double h = con.energy_hess(value);
+        MeshGrad grad;
+        con.gradient(grad);
         // f = -g*grad
         // J = -h*outer(grad,grad)
         double v_dot_grad = 0;
-        for (MeshGrad::iterator it = grad.begin(); it != grad.end(); it++) {
-            v_dot_grad += dot(it->f, it->node->v);
+        for (int i = 0; i < grad.n; i++) {
+            v_dot_grad += dot(grad.f[i], grad.node[i]->v);
         }
-        for (MeshGrad::iterator it = grad.begin(); it != grad.end(); it++) {
-            const Node *nodei = it->node;
+        for (int i = 0; i < grad.n; i++) {
+            const Node *nodei = grad.node[i];
             if (!nodei->active())
                 continue;
             int ni = nodei->index;
-            for (MeshGrad::iterator jt = grad.begin(); jt != grad.end(); jt++) {
-                const Node *nodej = jt->node;
+            for (int j = 0; j < grad.n; j++) {
+                const Node *nodej = grad.node[j];
                 if (!nodej->active())
                     continue;
                 int nj = nodej->index;
                 if (dt == 0)
-                    A(ni,nj) += h*outer(it->f, jt->f);
+                    add_block(A, ni, nj, h*outer(grad.f[i], grad.f[j]));
                 else
-                    A(ni,nj) += dt*dt*h*outer(it->f, jt->f);
+                    add_block(A, ni, nj, dt*dt*h*outer(grad.f[i], grad.f[j]));
             }
             if (dt == 0)
-                b[ni] -= g*it->f;
+                b[ni] -= g*grad.f[i];
             else
-                b[ni] -= dt*(g + dt*h*v_dot_grad)*it->f;
+                b[ni] -= dt*(g + dt*h*v_dot_grad)*grad.f[i];
         }
     }
+};
+
+template <typename Matrix>
+void add_constraint_forces (const Constraints &cons,
+                            Matrix &A, vector<Vec3> &b, double dt) {
+    ConstraintForces<Matrix> forces(A, b, dt);
+    for_each_constraint(cons, forces);
 }
 
-void add_friction_forces (const vector<Constraint*> cons,
-                          SpMat<Mat3x3> &A, vector<Vec3> &b, double dt) {
-    for (int c = 0; c < (int)cons.size(); c++) {
+template void add_constraint_forces (const Constraints &,
+                                     SpMat<Mat3x3> &, vector<Vec3>&, double);
+
+template <typename Matrix>
+struct FrictionForces {
+    Matrix &A;
+    vector<Vec3> &b;
+    double dt;
+    FrictionForces (Matrix &A, vector<Vec3> &b, double dt):
+        A(A), b(b), dt(dt) {}
+    template <typename Con> void operator() (const Con &con) {
+        MeshGrad force;
         MeshHess jac;
-        MeshGrad force = cons[c]->friction(dt, jac);
-        for (MeshGrad::iterator it = force.begin(); it != force.end(); it++) {
-            const Node *node = it->node;
+        con.friction(dt, force, jac);
+        for (int i = 0; i < force.n; i++) {
+            const Node *node = force.node[i];
             if (!node->active())
                 continue;
-            b[node->index] += dt*it->f;
+            b[node->index] += dt*force.f[i];
         }
-        for (MeshHess::iterator it = jac.begin(); it != jac.end(); it++) {
-            const Node *nodei = it->i, *nodej = it->j;
+        for (int k = 0; k < jac.n; k++) {
+            const Node *nodei = jac.i[k], *nodej = jac.j[k];
             if (!nodei->active() || !nodej->active())
                 continue;
-            A(nodei->index, nodej->index) -= dt*it->J;
+            add_block(A, nodei->index, nodej->index, -dt*jac.J[k]);
         }
     }
+};
+
+template <typename Matrix>
+void add_friction_forces (const Constraints &cons,
+                          Matrix &A, vector<Vec3> &b, double dt) {
+    FrictionForces<Matrix> forces(A, b, dt);
+    for_each_constraint(cons, forces);
 }
 
-vector<Vec3> implicit_update (vector<Node*>& nodes, const vector<Edge*>& edges, const vector<Face*>& faces,
+// Node couplings of every face and edge in mesh order, with -2 in place of
+// the opposite nodes of a boundary edge. Equal stencils give the same block
+// pattern and the same assembly plan
+static void mesh_stencil (const vector<Edge*>& edges,
+                          const vector<Face*>& faces, vector<int> &stencil) {
+    stencil.clear();
+    stencil.reserve(faces.size()*3 + edges.size()*4);
+    for (size_t f = 0; f < faces.size(); f++) {
+        Vec<3,int> ix = indices(faces[f]);
+        stencil.insert(stencil.end(), &ix[0], &ix[0] + 3);
+    }
+    for (size_t e = 0; e < edges.size(); e++) {
+        const Edge *edge = edges[e];
+        if (edge->adjf[0] && edge->adjf[1]) {
+            Vec<4,int> ix = indices(edge);
+            stencil.insert(stencil.end(), &ix[0], &ix[0] + 4);
+        } else {
+            for (int i = 0; i < 2; i++)
+                stencil.push_back(edge->n[i]->active() ? edge->n[i]->index : -1);
+            stencil.insert(stencil.end(), 2, -2);
+        }
+    }
+}
+
+template <int m> void add_stencil (const Vec<m,int> &ix,
+                                   vector< vector<int> > &adj) {
+    for (int i = 0; i < m; i++) {
+        if (ix[i] < 0) continue;
+        for (int j = 0; j < m; j++)
+            if (ix[j] >= ix[i])
+                adj[ix[i]].push_back(ix[j]);
+    }
+}
+
+static void add_stencil (const vector<Edge*>& edges, const vector<Face*>& faces,
+                         vector< vector<int> > &adj) {
+    for (size_t f = 0; f < faces.size(); f++) {
+        const Face *face = faces[f];
+        add_stencil(indices(face->v[0]->node, face->v[1]->node,
+                            face->v[2]->node), adj);
+    }
+    for (size_t e = 0; e < edges.size(); e++) {
+        const Edge *edge = edges[e];
+        if (!edge->adjf[0] || !edge->adjf[1])
+            continue;
+        add_stencil(indices(edge->n[0], edge->n[1],
+                            edge_opp_vert(edge, 0)->node,
+                            edge_opp_vert(edge, 1)->node), adj);
+    }
+}
+
+vector<Vec3> implicit_update (ImplicitSystem &system,
+                      vector<Node*>& nodes, const vector<Edge*>& edges, const vector<Face*>& faces,
 					  const vector<Vec3> &fext, const vector<Mat3x3> &Jext,
-                      const vector<Constraint*> &cons, double dt) {
-    vector<Vert*>::iterator vert_it;
-    vector<Face*>::iterator face_it;
+                      const Constraints &cons, double dt) {
     int nn = nodes.size();
 
     // M Dv/Dt = F (x + Dx) = F (x + Dt (v + Dv))
     // Dv = Dt (M - Dt2 F)i F (x + Dt v)
     // A = M - Dt2 F
     // b = Dt F (x + Dt v)
-    SpMat<Mat3x3> A(nn,nn);
+    BsrMat<3> &A = system.A;
     vector<Vec3> b(nn, Vec3(0));
-    for (size_t n = 0; n < nodes.size(); n++) {
-        A(n,n) += Mat3x3(nodes[n]->m) - dt*dt*Jext[n];
-        b[n] += dt*fext[n];        
-    }
+    for (size_t n = 0; n < nodes.size(); n++)
+        b[n] += dt*fext[n];
     consistency((vector<Vec3>&)fext, "fext");
     consistency(b, "init");
-    add_internal_forces<WS>(faces, edges, A, b, dt);
-    consistency(b, "internal forces");
-    add_constraint_forces(cons, A, b, dt);
+    // constraints couple different nodes every step, so they are staged
+    // first and the pattern only grows when they leave it
+    BlockList C;
+    add_constraint_forces(cons, C, b, dt);
     consistency(b, "constraints");
-    add_friction_forces(cons, A, b, dt);
+    add_friction_forces(cons, C, b, dt);
     consistency(b, "friction");
+
+    vector<int> stencil;
+    mesh_stencil(edges, faces, stencil);
+    bool same_mesh = A.n == nn && system.stencil == stencil;
+    bool rebuild = !same_mesh;
+    for (size_t c = 0; c < C.blocks.size() && !rebuild; c++)
+        rebuild = A.find(C.i[c], C.j[c]) < 0;
+    if (rebuild) {
+        vector< vector<int> > adj(nn);
+        if (same_mesh) {
+            for (int i = 0; i < nn; i++)
+                adj[i].assign(A.cols.begin() + A.rowptr[i],
+                              A.cols.begin() + A.rowptr[i+1]);
+        } else
+            add_stencil(edges, faces, adj);
+        for (size_t c = 0; c < C.blocks.size(); c++)
+            adj[C.i[c]].push_back(C.j[c]);
+        A.set_pattern(adj);
+        system.stencil.swap(stencil);
+    } else
+        A.zero();
+
+    for (size_t n = 0; n < nodes.size(); n++)
+        A.add(n, n, Mat3x3(nodes[n]->m) - dt*dt*Jext[n]);
+    add_internal_forces<WS>(system.plan, faces, edges, A, b, dt);
+    consistency(b, "internal forces");
+    for (size_t c = 0; c < C.blocks.size(); c++)
+        A.add(C.i[c], C.j[c], C.blocks[c]);
     ::debug_nodes = &nodes;
-    vector<Vec3> dv = taucs_linear_solve(A, b);
+    if (!system.solver || system.solver_type != ::magic.linear_solver) {
+        delete system.solver;
+        system.solver = new_linear_solver(::magic.linear_solver);
+        system.solver_type = ::magic.linear_solver;
+    }
+    // warm start from the velocity change of the last step
+    vector<Vec3> dv(nn);
+    for (int n = 0; n < nn; n++)
+        dv[n] = nodes[n]->acceleration*dt;
+    LinearSolver *solver = system.solver;
+    bool solved = linear_solve(*solver, A, b, dv);
+    if (!solved && solver->iterative()) {
+        cerr << "Warning: " << solver->name() << " did not converge"
+             << ", falling back to a direct solver" << endl;
+        if (!system.fallback)
+            system.fallback = new_linear_solver(Magic::TaucsLLT);
+        solver = system.fallback;
+        solved = linear_solve(*solver, A, b, dv);
+    }
+    if (!solved) {
+        cerr << "Error: " << solver->name() << " factorization failed" << endl;
+        segfault();
+        //exit(EXIT_FAILURE);
+	//crash
+	int * a;
+	*a = 1;
+    }
     ::debug_nodes = 0;
     consistency(dv, "taucs");
     return dv;    
 }
 
+vector<Vec3> implicit_update (vector<Node*>& nodes, const vector<Edge*>& edges, const vector<Face*>& faces,
+					  const vector<Vec3> &fext, const vector<Mat3x3> &Jext,
+                      const Constraints &cons, double dt) {
+    ImplicitSystem system;
+    return implicit_update(system, nodes, edges, faces, fext, Jext, cons, dt);
+}
+
 Vec3 wind_force (const Face *face, const Wind &wind) {
     Vec3 vface = (face->v[0]->node->v + face->v[1]->node->v
                   + face->v[2]->node->v)/3.;
@@ -493,22 +1133,31 @@ void add_morph_forces (const SimCloth &cloth, const Morph &morph, double t,
     }
 }
 
-void project_outside (vector<Node*>& nodes, const vector<Constraint*> &cons) {
-    int nn = nodes.size();
-    vector<double> w(nn, 0);
-    vector<Vec3> dx(nn, Vec3(0));
-    for (int c = 0; c < (int)cons.size(); c++) {
-        MeshGrad dxc = cons[c]->project();
-        for (MeshGrad::iterator it = dxc.begin(); it != dxc.end(); it++) {
-            const Node *node = it->node;
+struct ConstraintProjection {
+    vector<double> &w;
+    vector<Vec3> &dx;
+    ConstraintProjection (vector<double> &w, vector<Vec3> &dx): w(w), dx(dx) {}
+    template <typename Con> void operator() (const Con &con) {
+        MeshGrad dxc;
+        con.project(dxc);
+        for (int i = 0; i < dxc.n; i++) {
+            const Node *node = dxc.node[i];
             if (!node->active())
                 continue;
-            double wn = norm2(it->f);
+            double wn = norm2(dxc.f[i]);
             int n = node->index;
             w[n] += wn;
-            dx[n] += wn*it->f;
+            dx[n] += wn*dxc.f[i];
         }
     }
+};
+
+void project_outside (vector<Node*>& nodes, const Constraints &cons) {
+    int nn = nodes.size();
+    vector<double> w(nn, 0);
+    vector<Vec3> dx(nn, Vec3(0));
+    ConstraintProjection projection(w, dx);
+    for_each_constraint(cons, projection);
     for (int n = 0; n < nn; n++) {
         if (w[n] == 0)
             continue;
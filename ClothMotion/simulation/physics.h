@@ -39,7 +39,7 @@ Mat3x3 material_model (const Face *face, const Mat3x3& G);
 template <Space s> 
 double internal_energy (const std::vector<Face*>& faces, const std::vector<Edge*>& edges);
 
-double constraint_energy (const std::vector<Constraint*> &cons);
+double constraint_energy (const Constraints &cons);
 
 double external_energy (const SimCloth &cloth, const Vec3 &gravity,
                         const Wind &wind);
@@ -47,12 +47,28 @@ double external_energy (const SimCloth &cloth, const Vec3 &gravity,
 // A += dt^2 dF/dx; b += dt F + dt^2 dF/dx v
 // also adds damping terms
 // if dt == 0, just does A += dF/dx; b += F instead, no damping
-template <Space s>
+// Matrix is SpMat<Mat3x3> or BsrMat<3>
+template <Space s, typename Matrix>
 void add_internal_forces (const std::vector<Face*>& faces, const std::vector<Edge*>& edges,
-						  SpMat<Mat3x3> &A, std::vector<Vec3> &b, double dt);
-
-void add_constraint_forces (const std::vector<Constraint*> &cons,
-                            SpMat<Mat3x3> &A, std::vector<Vec3> &b, double dt);
+						  Matrix &A, std::vector<Vec3> &b, double dt);
+
+// Times the reference element kernels of add_internal_forces against
+// the batched ones implicit_update uses, on one thread; the errors are
+// the largest difference relative to the largest reference entry
+struct KernelBenchmark {
+    int faces, hinges;
+    double stretching_reference, stretching_batched; // seconds per pass
+    double bending_reference, bending_batched;
+    double stretching_error, bending_error;
+};
+
+KernelBenchmark benchmark_internal_forces (const std::vector<Face*>& faces,
+                                           const std::vector<Edge*>& edges,
+                                           double dt, int repetitions);
+
+template <typename Matrix>
+void add_constraint_forces (const Constraints &cons,
+                            Matrix &A, std::vector<Vec3> &b, double dt);
 
 void add_external_forces (const std::vector<Node*>& nodes, const std::vector<Face*>& faces, 
 						  const Vec3 &gravity, const Wind &wind, std::vector<Vec3> &fext,
@@ -62,11 +78,18 @@ void add_morph_forces (const SimCloth &cloth, const Morph &morph, double t,
                        double dt,
                        std::vector<Vec3> &fext, std::vector<Mat3x3> &Jext);
 
+// reuses the matrix pattern kept in system while the mesh stencil is unchanged
+std::vector<Vec3> implicit_update (ImplicitSystem &system,
+                      std::vector<Node*>& nodes, const std::vector<Edge*>& edges, 
+					  const std::vector<Face*>& faces,
+					  const std::vector<Vec3> &fext, const std::vector<Mat3x3> &Jext,
+                      const Constraints &cons, double dt);
+
 std::vector<Vec3> implicit_update (std::vector<Node*>& nodes, const std::vector<Edge*>& edges, 
 					  const std::vector<Face*>& faces,
 					  const std::vector<Vec3> &fext, const std::vector<Mat3x3> &Jext,
-                      const std::vector<Constraint*> &cons, double dt);
+                      const Constraints &cons, double dt);
 
-void project_outside (std::vector<Node*>& nodes, const std::vector<Constraint*> &cons);
+void project_outside (std::vector<Node*>& nodes, const Constraints &cons);
 
 #endif
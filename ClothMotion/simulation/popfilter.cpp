@@ -45,11 +45,11 @@ struct PopOpt: public NLOpt {
     // hessian: -J(x) + mu
     SimCloth &cloth;
     Mesh &mesh;
-    const vector<Constraint*> &cons;
+    const Constraints &cons;
     vector<Vec3> x0, a0;
     mutable vector<Vec3> f;
     mutable SpMat<Mat3x3> J;
-    PopOpt (SimCloth &cloth, const vector<Constraint*> &cons):
+    PopOpt (SimCloth &cloth, const Constraints &cons):
         cloth(cloth), mesh(cloth.mesh), cons(cons) {
         int nn = mesh.nodes.size();
         nvar = nn*3;
@@ -73,7 +73,7 @@ struct PopOpt: public NLOpt {
 
 void subtract_rigid_acceleration (const Mesh &mesh);
 
-void apply_pop_filter (SimCloth &cloth, const vector<Constraint*> &cons,
+void apply_pop_filter (SimCloth &cloth, const Constraints &cons,
                        double regularization) {
     ::mu = regularization;
     // mark nodes active for physics
@@ -30,7 +30,7 @@
 #include "simcloth.h"
 #include "constraint.h"
 
-void apply_pop_filter (SimCloth &cloth, const std::vector<Constraint*> &cons,
+void apply_pop_filter (SimCloth &cloth, const Constraints &cons,
                        double regularization=1e3);
 
 #endif
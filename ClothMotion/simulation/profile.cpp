@@ -0,0 +1,179 @@
+#include "profile.h"
+#include "simulation.h"
+#include "../timer.h"
+#include <fstream>
+#include <iomanip>
+using namespace std;
+
+static bool profiling = false;
+static double origin = 0;
+static vector<StepProfile> steps;
+static vector<ProfileInterval> intervals;
+static StepProfile current;
+static vector<double> totals; // module timer totals when the step began
+
+void enable_profile (bool enabled) {
+    if (enabled && !profiling)
+        clear_profile();
+    profiling = enabled;
+}
+
+bool profile_enabled () {
+    return profiling;
+}
+
+void clear_profile () {
+    origin = Timer::now();
+    steps.clear();
+    intervals.clear();
+}
+
+void profile_begin_step (const Simulation &sim) {
+    if (!profiling)
+        return;
+    current.frame = sim.frame;
+    current.step = sim.step;
+    current.begin = Timer::now() - origin;
+    for (int c = 0; c < StepProfile::nCounters; c++)
+        current.counters[c] = 0;
+    totals.resize(Simulation::nModules);
+    for (int m = 0; m < Simulation::nModules; m++)
+        totals[m] = sim.timers[m].total;
+}
+
+void profile_end_step (const Simulation &sim) {
+    if (!profiling)
+        return;
+    current.end = Timer::now() - origin;
+    current.module_time.resize(Simulation::nModules);
+    for (int m = 0; m < Simulation::nModules; m++)
+        current.module_time[m] = sim.timers[m].total - totals[m];
+    steps.push_back(current);
+}
+
+void profile_module (int module, const Timer &timer) {
+    if (!profiling)
+        return;
+    ProfileInterval interval;
+    interval.step = steps.size();
+    interval.module = module;
+    interval.end = timer.then - origin;
+    interval.begin = interval.end - timer.last;
+    intervals.push_back(interval);
+}
+
+void profile_count (StepProfile::Counter counter, double amount) {
+    if (!profiling)
+        return;
+#pragma omp atomic
+    current.counters[counter] += amount;
+}
+
+const char *module_name (int module) {
+    static const char *names[Simulation::nModules] = {"proximity", "physics",
+        "strainlimiting", "collision", "remeshing", "separation", "popfilter",
+        "plasticity", "fracture"};
+    return names[module];
+}
+
+const char *counter_name (int counter) {
+    static const char *names[StepProfile::nCounters] = {"bvh_nodes",
+        "impacts", "impact_zone_iterations", "solver_nnz", "factor_ms",
+        "remesh_splits", "remesh_flips", "remesh_collapses",
+        "proximity_swept_faces"};
+    return names[counter];
+}
+
+const vector<StepProfile> &profile_steps () {
+    return steps;
+}
+
+const vector<ProfileInterval> &profile_intervals () {
+    return intervals;
+}
+
+// digits written for a counter; all but the factor time are counts
+static int precision (int counter) {
+    return counter == StepProfile::FactorTime ? 3 : 0;
+}
+
+bool write_profile_csv (const string &filename) {
+    ofstream out(filename.c_str());
+    if (!out)
+        return false;
+    out << "frame,step,begin_ms,wall_ms";
+    for (int m = 0; m < Simulation::nModules; m++)
+        out << "," << module_name(m) << "_ms";
+    for (int c = 0; c < StepProfile::nCounters; c++)
+        out << "," << counter_name(c);
+    out << endl << fixed << setprecision(3);
+    for (size_t s = 0; s < steps.size(); s++) {
+        const StepProfile &step = steps[s];
+        out << step.frame << "," << step.step << "," << step.begin*1e3 << ","
+            << (step.end - step.begin)*1e3;
+        for (int m = 0; m < Simulation::nModules; m++)
+            out << "," << step.module_time[m]*1e3;
+        for (int c = 0; c < StepProfile::nCounters; c++)
+            out << "," << setprecision(precision(c)) << step.counters[c]
+                << setprecision(3);
+        out << endl;
+    }
+    return out.good();
+}
+
+bool write_profile_json (const string &filename) {
+    ofstream out(filename.c_str());
+    if (!out)
+        return false;
+    out << fixed << setprecision(3);
+    out << "{\"steps\": [" << endl;
+    for (size_t s = 0; s < steps.size(); s++) {
+        const StepProfile &step = steps[s];
+        out << "  {\"frame\": " << step.frame << ", \"step\": " << step.step
+            << ", \"begin_ms\": " << step.begin*1e3
+            << ", \"wall_ms\": " << (step.end - step.begin)*1e3
+            << ", \"modules_ms\": {";
+        for (int m = 0; m < Simulation::nModules; m++)
+            out << (m ? ", " : "") << "\"" << module_name(m) << "\": "
+                << step.module_time[m]*1e3;
+        out << "}, \"counters\": {";
+        for (int c = 0; c < StepProfile::nCounters; c++)
+            out << (c ? ", " : "") << "\"" << counter_name(c) << "\": "
+                << setprecision(precision(c)) << step.counters[c]
+                << setprecision(3);
+        out << "}}" << (s+1 < steps.size() ? "," : "") << endl;
+    }
+    out << "]}" << endl;
+    return out.good();
+}
+
+bool write_profile_trace (const string &filename) {
+    ofstream out(filename.c_str());
+    if (!out)
+        return false;
+    out << fixed << setprecision(1);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+    for (size_t s = 0; s < steps.size(); s++) {
+        const StepProfile &step = steps[s];
+        out << "  {\"name\": \"step " << step.step << "\", \"cat\": \"step\", "
+            << "\"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": "
+            << step.begin*1e6 << ", \"dur\": " << (step.end - step.begin)*1e6
+            << ", \"args\": {\"frame\": " << step.frame;
+        for (int c = 0; c < StepProfile::nCounters; c++)
+            out << ", \"" << counter_name(c) << "\": "
+                << setprecision(precision(c)) << step.counters[c]
+                << setprecision(1);
+        out << "}}" << (s+1 < steps.size() || !intervals.empty() ? "," : "")
+            << endl;
+    }
+    for (size_t i = 0; i < intervals.size(); i++) {
+        const ProfileInterval &interval = intervals[i];
+        out << "  {\"name\": \"" << module_name(interval.module)
+            << "\", \"cat\": \"module\", \"ph\": \"X\", \"pid\": 0, "
+            << "\"tid\": 0, \"ts\": " << interval.begin*1e6 << ", \"dur\": "
+            << (interval.end - interval.begin)*1e6 << "}"
+            << (i+1 < intervals.size() ? "," : "") << endl;
+    }
+    out << "]}" << endl;
+    return out.good();
+}
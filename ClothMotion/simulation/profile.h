@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <string>
+#include <vector>
+
+struct Simulation;
+struct Timer;
+
+// Per-step record of where advance_step() spends its time and how much
+// work each stage did. Nothing is recorded until enable_profile(true).
+struct StepProfile {
+    enum Counter {BVHNodes, Impacts, ImpactZoneIterations, SolverNonzeros,
+                  FactorTime, RemeshSplits, RemeshFlips, RemeshCollapses,
+                  SweptFaces, nCounters};
+    int frame, step;
+    double begin, end; // seconds since profiling was enabled
+    std::vector<double> module_time; // seconds per Simulation module
+    double counters[nCounters];
+};
+
+// one tick()/tock() of a module timer, for the timeline
+struct ProfileInterval {
+    int step, module;
+    double begin, end;
+};
+
+void enable_profile (bool enabled);
+bool profile_enabled ();
+void clear_profile ();
+
+void profile_begin_step (const Simulation &sim);
+void profile_end_step (const Simulation &sim);
+
+// call right after timer.tock() of the given module
+void profile_module (int module, const Timer &timer);
+
+// safe to call from parallel code
+void profile_count (StepProfile::Counter counter, double amount=1);
+
+const char *module_name (int module);
+const char *counter_name (int counter);
+
+const std::vector<StepProfile> &profile_steps ();
+const std::vector<ProfileInterval> &profile_intervals ();
+
+// one row per step
+bool write_profile_csv (const std::string &filename);
+bool write_profile_json (const std::string &filename);
+// Chrome trace event format, for chrome://tracing
+bool write_profile_trace (const std::string &filename);
+
+#endif
@@ -31,7 +31,9 @@
 #include "magic.h"
 #include "io.h"
 #include "proxy.hpp"
+#include "profile.h"
 #include "simulation.h"
+#include <algorithm>
 #include <vector>
 using namespace std;
 
@@ -68,21 +70,226 @@ static vector< Min<Node*> > face_prox[2];
 static vector< Min<Node*> > edge_node_prox;
 static vector< Min<Edge*> > node_edge_prox;
 
+// Closest-primitive candidates found by the parallel traversal. They are
+// buffered per thread and folded into the tables above in task order, which
+// keeps the result, ties included, independent of the thread schedule.
+struct ProxCandidate {
+    enum Table {NodeFace, EdgeEdge = 2, FaceNode = 4, EdgeNode = 6, NodeEdge};
+    int table, index; // table + side for the two-sided ones
+    double key;
+    const void *val;
+    ProxCandidate () {}
+    ProxCandidate (int table, int index, double key, const void *val):
+        table(table), index(index), key(key), val(val) {}
+};
+
+static OverlapBuffer<ProxCandidate> candidates;
+
+static void push_candidate (int table, int index, double key, const void *val) {
+    // farther ones never become constraints
+    if (key < 2*::magic.repulsion_thickness)
+        ::candidates.push_back(ProxCandidate(table, index, key, val));
+}
+
+static void add_candidate (const ProxCandidate &c) {
+    switch (c.table) {
+    case ProxCandidate::NodeFace: case ProxCandidate::NodeFace+1:
+        ::node_prox[c.table-ProxCandidate::NodeFace][c.index].add(c.key, (Face*)c.val);
+        break;
+    case ProxCandidate::EdgeEdge: case ProxCandidate::EdgeEdge+1:
+        ::edge_prox[c.table-ProxCandidate::EdgeEdge][c.index].add(c.key, (Edge*)c.val);
+        break;
+    case ProxCandidate::FaceNode: case ProxCandidate::FaceNode+1:
+        ::face_prox[c.table-ProxCandidate::FaceNode][c.index].add(c.key, (Node*)c.val);
+        break;
+    case ProxCandidate::EdgeNode:
+        ::edge_node_prox[c.index].add(c.key, (Node*)c.val);
+        break;
+    case ProxCandidate::NodeEdge:
+        ::node_edge_prox[c.index].add(c.key, (Edge*)c.val);
+        break;
+    }
+}
+
+// Temporal coherence of the sweep. The face pairs whose boxes come within
+// dmin + 3*margin are kept, along with where each face was when it was last
+// swept. A box moves no farther than the nodes of its face, so while a face
+// stays within margin of that position its partners within dmin are among
+// the kept pairs: since the later of the two sweeps the face has moved up to
+// margin and its partner up to 2*margin. Faces that moved farther are swept
+// again against everything. Of the kept pairs, those whose boxes are within
+// dmin now are evaluated exactly, so the constraints are the ones a full
+// sweep would find.
+struct SweptFace {
+    const Face *face;
+    const Node *node[3];
+    Vec3 x[3]; // node positions at the last sweep of the face
+    SweptFace (const Face *face): face(face) {
+        for (int i = 0; i < 3; i++)
+            node[i] = face->v[i]->node;
+    }
+    void update () {
+        for (int i = 0; i < 3; i++)
+            x[i] = node[i]->x;
+    }
+    bool moved (double margin) const {
+        for (int i = 0; i < 3; i++)
+            if (norm2(node[i]->x - x[i]) > sq(margin))
+                return true;
+        return false;
+    }
+};
+
+static vector<const Mesh*> swept_meshes; // cloth meshes, then obstacles
+static vector<SweptFace> swept_faces; // of all swept meshes in order
+static vector< pair<const Face*, int> > swept_slots; // sorted by face
+static vector<FacePair> swept_pairs;
+static vector<int> swept_pair_slots; // two per pair, into swept_faces
+static vector<BOX> swept_boxes;
+static vector<FacePair> near_pairs;
+static OverlapBuffer<FacePair> found_pairs;
+
+static bool same_swept_faces (const vector<Mesh*> &meshes) {
+    if (meshes.size() != ::swept_meshes.size())
+        return false;
+    size_t slot = 0;
+    for (size_t m = 0; m < meshes.size(); m++) {
+        const vector<Face*> &faces = meshes[m]->faces;
+        if (meshes[m] != ::swept_meshes[m]
+            || slot + faces.size() > ::swept_faces.size())
+            return false;
+        for (size_t f = 0; f < faces.size(); f++, slot++) {
+            const SweptFace &swept = ::swept_faces[slot];
+            if (faces[f] != swept.face)
+                return false;
+            for (int i = 0; i < 3; i++)
+                if (faces[f]->v[i]->node != swept.node[i])
+                    return false;
+        }
+    }
+    return slot == ::swept_faces.size();
+}
+
+static void reset_swept_faces (const vector<Mesh*> &meshes) {
+    ::swept_meshes.assign(meshes.begin(), meshes.end());
+    ::swept_faces.clear();
+    ::swept_slots.clear();
+    for (size_t m = 0; m < meshes.size(); m++)
+        for (size_t f = 0; f < meshes[m]->faces.size(); f++) {
+            ::swept_slots.push_back(make_pair((const Face*)meshes[m]->faces[f],
+                                              (int)::swept_faces.size()));
+            ::swept_faces.push_back(SweptFace(meshes[m]->faces[f]));
+        }
+    sort(::swept_slots.begin(), ::swept_slots.end());
+    ::swept_pairs.clear();
+    ::swept_pair_slots.clear();
+}
+
+static int swept_slot (const Face *face) {
+    return lower_bound(::swept_slots.begin(), ::swept_slots.end(),
+                       make_pair(face, -1))->second;
+}
+
+static void sweep_proximities (const Face *face0, const Face *face1) {
+    ::found_pairs.push_back(FacePair(face0, face1));
+}
+
+// brings swept_pairs up to date with the current positions
+static void update_swept_pairs (vector<Mesh*> &meshes,
+                                const vector<Mesh*> &obs_meshes, double dmin) {
+    double margin = max(::magic.proximity_margin, 0.);
+    vector<Mesh*> all_meshes(meshes);
+    all_meshes.insert(all_meshes.end(), obs_meshes.begin(), obs_meshes.end());
+    bool valid = ::magic.proximity_margin > 0 && same_swept_faces(all_meshes);
+    if (!valid)
+        reset_swept_faces(all_meshes);
+    int nf = ::swept_faces.size(), nmoved = 0;
+    vector<bool> moved(nf);
+    for (int f = 0; f < nf; f++) {
+        moved[f] = !valid || ::swept_faces[f].moved(margin);
+        nmoved += moved[f];
+    }
+    if (!nmoved)
+        return;
+    profile_count(StepProfile::SweptFaces, nmoved);
+    // keep the pairs of the faces that stayed
+    size_t kept = 0;
+    for (size_t p = 0; p < ::swept_pairs.size(); p++) {
+        int slot0 = ::swept_pair_slots[2*p], slot1 = ::swept_pair_slots[2*p+1];
+        if (moved[slot0] || moved[slot1])
+            continue;
+        ::swept_pairs[kept] = ::swept_pairs[p];
+        ::swept_pair_slots[2*kept] = slot0;
+        ::swept_pair_slots[2*kept+1] = slot1;
+        kept++;
+    }
+    ::swept_pairs.resize(kept);
+    ::swept_pair_slots.resize(2*kept);
+    // and sweep the others again
+    vector<AccelStruct*> accs = create_accel_structs(meshes, false),
+                         obs_accs = create_accel_structs(obs_meshes, false);
+    int slot = 0;
+    for (size_t m = 0; m < all_meshes.size(); m++) {
+        AccelStruct &acc = m < accs.size() ? *accs[m]
+                                           : *obs_accs[m - accs.size()];
+        const vector<Face*> &faces = all_meshes[m]->faces;
+        if (valid)
+            mark_all_inactive(acc);
+        for (size_t f = 0; f < faces.size(); f++, slot++) {
+            if (!moved[slot])
+                continue;
+            if (valid)
+                mark_active(acc, faces[f]);
+            ::swept_faces[slot].update();
+        }
+    }
+    ::found_pairs.clear();
+    for_overlapping_faces(accs, obs_accs, dmin + 3*margin, sweep_proximities);
+    vector<FacePair> found;
+    ::found_pairs.merge(found);
+    for (size_t p = 0; p < found.size(); p++) {
+        ::swept_pairs.push_back(found[p]);
+        ::swept_pair_slots.push_back(swept_slot(found[p].first));
+        ::swept_pair_slots.push_back(swept_slot(found[p].second));
+    }
+    destroy_accel_structs(accs);
+    destroy_accel_structs(obs_accs);
+}
+
+// the kept pairs that a sweep at dmin would visit
+static void find_near_pairs (double dmin) {
+    ::swept_boxes.resize(::swept_faces.size());
+    for (size_t f = 0; f < ::swept_faces.size(); f++)
+        ::swept_boxes[f] = face_box(::swept_faces[f].face, false);
+    ::near_pairs.clear();
+    for (size_t p = 0; p < ::swept_pairs.size(); p++)
+        if (overlap(::swept_boxes[::swept_pair_slots[2*p]],
+                    ::swept_boxes[::swept_pair_slots[2*p+1]], dmin))
+            ::near_pairs.push_back(::swept_pairs[p]);
+}
+
+void clear_proximity_cache () {
+    vector<Mesh*> no_meshes;
+    reset_swept_faces(no_meshes);
+    ::swept_boxes.clear();
+    ::near_pairs.clear();
+}
+
 void find_proximities (const Face *face0, const Face *face1);
-Constraint *make_constraint (const Node *node, const Face *face,
-                             double mu, double mu_obs);
-Constraint *make_constraint (const Edge *edge0, const Edge *edge1,
-                             double mu, double mu_obs);
-Constraint *make_constraint (const Edge *edge, const Node *node,
-                             double mu, double mu_obs);
-void make_proxy_constraints (Mesh& mesh, CollisionProxy& proxy, vector<Constraint*>& cons);
-
-vector<Constraint*> proximity_constraints (vector<Mesh*> &meshes,
-                                           const vector<Mesh*> &obs_meshes,
-                                           double mu, double mu_obs, bool proxy_only) {
+IneqCon make_constraint (const Node *node, const Face *face,
+                         double mu, double mu_obs);
+IneqCon make_constraint (const Edge *edge0, const Edge *edge1,
+                         double mu, double mu_obs);
+bool make_constraint (const Edge *edge, const Node *node,
+                      double mu, double mu_obs, IneqCon &con);
+void make_proxy_constraints (Mesh& mesh, CollisionProxy& proxy, Constraints& cons);
+
+void proximity_constraints (vector<Mesh*> &meshes,
+                            const vector<Mesh*> &obs_meshes,
+                            double mu, double mu_obs, Constraints &cons,
+                            bool proxy_only) {
     ::meshes = &meshes;
     const double dmin = 2*::magic.repulsion_thickness;
-    vector<Constraint*> cons;
     
     if (proxy_only) {
         for (size_t m = 0; m<meshes.size(); m++) {
@@ -91,11 +298,11 @@ vector<Constraint*> proximity_constraints (vector<Mesh*> &meshes,
                     make_proxy_constraints(*meshes[m], * (CollisionProxy*)(obs_meshes[i]->proxy), cons);
             }
         }
-        return cons;
+        return;
     }
 
-    vector<AccelStruct*> accs = create_accel_structs(meshes, false),
-                         obs_accs = create_accel_structs(obs_meshes, false);
+    update_swept_pairs(meshes, obs_meshes, dmin);
+    find_near_pairs(dmin);
 
     set_indices(meshes);
     int nn=0, ne=0, nf=0;
@@ -112,7 +319,14 @@ vector<Constraint*> proximity_constraints (vector<Mesh*> &meshes,
     ::edge_node_prox.assign(ne, Min<Node*>());
     ::node_edge_prox.assign(nn, Min<Edge*>());
 
-    for_overlapping_faces(accs, obs_accs, dmin, find_proximities);
+    ::candidates.clear();
+    for_face_pairs(::near_pairs, find_proximities);
+    {
+        vector<ProxCandidate> candidates;
+        ::candidates.merge(candidates);
+        for (size_t c = 0; c < candidates.size(); c++)
+            add_candidate(candidates[c]);
+    }
 
     for (size_t m = 0; m<meshes.size(); m++) {
     	Mesh& mesh = *meshes[m];
@@ -122,29 +336,31 @@ vector<Constraint*> proximity_constraints (vector<Mesh*> &meshes,
 	        for (int i = 0; i < 2; i++) {
 	            Min<Face*> &m = ::node_prox[i][idx];
 	            if (m.key < dmin)
-	                cons.push_back(make_constraint(mesh.nodes[n], m.val, mu, mu_obs));
+	                cons.node_face.push_back(make_constraint(mesh.nodes[n], m.val, mu, mu_obs));
             }
             Min<Edge*> &me = ::node_edge_prox[idx];
-            if (me.key < dmin)
-                cons.push_back(make_constraint(me.val, mesh.nodes[n], mu, mu_obs));	        
+            IneqCon con;
+            if (me.key < dmin && make_constraint(me.val, mesh.nodes[n], mu, mu_obs, con))
+                cons.edge_node.push_back(con);
 	    }
 	    for (size_t e = 0; e < mesh.edges.size(); e++) {
 	        int idx = mesh.edges[e]->index;
 	        for (int i = 0; i < 2; i++) {
 	            Min<Edge*> &m = ::edge_prox[i][idx];
 	            if (m.key < dmin)
-	                cons.push_back(make_constraint(mesh.edges[e], m.val, mu, mu_obs));
+	                cons.edge_edge.push_back(make_constraint(mesh.edges[e], m.val, mu, mu_obs));
             }
             Min<Node*> &me = ::edge_node_prox[idx];
-            if (me.key < dmin)
-                cons.push_back(make_constraint(mesh.edges[e], me.val, mu, mu_obs));            
+            IneqCon con;
+            if (me.key < dmin && make_constraint(mesh.edges[e], me.val, mu, mu_obs, con))
+                cons.edge_node.push_back(con);
 	    }
 	    for (size_t f = 0; f < mesh.faces.size(); f++) {
 	        int idx = mesh.faces[f]->index;
 	        for (int i = 0; i < 2; i++) {
 	            Min<Node*> &m = ::face_prox[i][idx];
 	            if (m.key < dmin)
-	                cons.push_back(make_constraint(m.val, mesh.faces[f], mu, mu_obs));
+	                cons.node_face.push_back(make_constraint(m.val, mesh.faces[f], mu, mu_obs));
 	        }
 	    }
 
@@ -159,10 +375,6 @@ vector<Constraint*> proximity_constraints (vector<Mesh*> &meshes,
 		cout << "> proximity2: " << endl;
 		test_state(cons, "/tmp/cs");
 	}*/
-
-    destroy_accel_structs(accs);
-    destroy_accel_structs(obs_accs);
-    return cons;
 }
 
 void add_proximity (const Node *node, const Face *face);
@@ -196,8 +408,9 @@ static inline Vec3 get_outwards_normal(const Edge *e) {
 
 // half-cylinder test
 void add_proximity(Node *node, Edge* edge) {
+    // the edge test is one edge, the node test all edges around the node
     if (node == edge->n[0] || node == edge->n[1] ||
-        !is_seam_or_boundary(node) || !is_seam_or_boundary(edge) ||
+        !is_seam_or_boundary(edge) || !is_seam_or_boundary(node) ||
         (edge->adjf[0] && has_node(edge->adjf[0], node)) ||
         (edge->adjf[1] && has_node(edge->adjf[1], node))) return;
     
@@ -213,9 +426,9 @@ void add_proximity(Node *node, Edge* edge) {
     double w0 = 1.0-d, w1 = d;
     double dist = norm(w0*p0 + w1*p1 - x);
     if (is_free(node))
-        ::node_edge_prox[node->index].add(dist, edge);
+        push_candidate(ProxCandidate::NodeEdge, node->index, dist, edge);
     if (is_free(edge))
-        ::edge_node_prox[edge->index].add(dist, node);
+        push_candidate(ProxCandidate::EdgeNode, edge->index, dist, node);
 }
 
 void add_proximity (const Node *node, const Face *face) {
@@ -231,11 +444,11 @@ void add_proximity (const Node *node, const Face *face) {
         return;
     if (is_free(node)) {
         int side = dot(n, node->n)>=0 ? 0 : 1;
-        ::node_prox[side][node->index].add(d, (Face*)face);
+        push_candidate(ProxCandidate::NodeFace+side, node->index, d, face);
     }
     if (is_free(face)) {
         int side = dot(-n, face->n)>=0 ? 0 : 1;
-        ::face_prox[side][face->index].add(d, (Node*)node);
+        push_candidate(ProxCandidate::FaceNode+side, face->index, d, node);
     }
 }
 
@@ -271,12 +484,12 @@ void add_proximity (const Edge *edge0, const Edge *edge1) {
     if (is_free(edge0)) {
         Vec3 edge0n = edge0->n[0]->n + edge0->n[1]->n;
         int side = dot(n, edge0n)>=0 ? 0 : 1;
-        ::edge_prox[side][edge0->index].add(d, (Edge*)edge1);
+        push_candidate(ProxCandidate::EdgeEdge+side, edge0->index, d, edge1);
     }
     if (is_free(edge1)) {
         Vec3 edge1n = edge1->n[0]->n + edge1->n[1]->n;
         int side = dot(-n, edge1n)>=0 ? 0 : 1;
-        ::edge_prox[side][edge1->index].add(d, (Edge*)edge0);
+        push_candidate(ProxCandidate::EdgeEdge+side, edge1->index, d, edge0);
     }
 }
 
@@ -284,72 +497,72 @@ double area_cached (const Node *node);
 double area_cached (const Edge *edge);
 double area_cached (const Face *face);
 
-Constraint *make_constraint (const Node *node, const Face *face,
-                             double mu, double mu_obs) {
-    IneqCon *con = new IneqCon;
-    con->nodes[0] = (Node*)node;
-    con->nodes[1] = (Node*)face->v[0]->node;
-    con->nodes[2] = (Node*)face->v[1]->node;
-    con->nodes[3] = (Node*)face->v[2]->node;
+IneqCon make_constraint (const Node *node, const Face *face,
+                         double mu, double mu_obs) {
+    IneqCon con;
+    con.nodes[0] = (Node*)node;
+    con.nodes[1] = (Node*)face->v[0]->node;
+    con.nodes[2] = (Node*)face->v[1]->node;
+    con.nodes[3] = (Node*)face->v[2]->node;
     for (int n = 0; n < 4; n++)
-        con->free[n] = is_free(con->nodes[n]);
+        con.free[n] = is_free(con.nodes[n]);
     double a = min(area_cached(node), area_cached(face));
-    con->stiff = ::magic.collision_stiffness*a;
-    double d = signed_vf_distance(con->nodes[0]->x, con->nodes[1]->x,
-                                  con->nodes[2]->x, con->nodes[3]->x,
-                                  &con->n, con->w);
+    con.stiff = ::magic.collision_stiffness*a;
+    double d = signed_vf_distance(con.nodes[0]->x, con.nodes[1]->x,
+                                  con.nodes[2]->x, con.nodes[3]->x,
+                                  &con.n, con.w);
     if (d < 0)
-        con->n = -con->n;
-    con->mu = (!is_free(node) || !is_free(face)) ? mu_obs : mu;
+        con.n = -con.n;
+    con.mu = (!is_free(node) || !is_free(face)) ? mu_obs : mu;
     return con;
 }
 
-Constraint *make_constraint (const Edge *edge0, const Edge *edge1,
-                             double mu, double mu_obs) {
-    IneqCon *con = new IneqCon;
-    con->nodes[0] = (Node*)edge0->n[0];
-    con->nodes[1] = (Node*)edge0->n[1];
-    con->nodes[2] = (Node*)edge1->n[0];
-    con->nodes[3] = (Node*)edge1->n[1];
+IneqCon make_constraint (const Edge *edge0, const Edge *edge1,
+                         double mu, double mu_obs) {
+    IneqCon con;
+    con.nodes[0] = (Node*)edge0->n[0];
+    con.nodes[1] = (Node*)edge0->n[1];
+    con.nodes[2] = (Node*)edge1->n[0];
+    con.nodes[3] = (Node*)edge1->n[1];
     for (int n = 0; n < 4; n++)
-        con->free[n] = is_free(con->nodes[n]);
+        con.free[n] = is_free(con.nodes[n]);
     double a = min(area_cached(edge0), area_cached(edge1));
-    con->stiff = ::magic.collision_stiffness*a;
-    double d = signed_ee_distance(con->nodes[0]->x, con->nodes[1]->x,
-                                  con->nodes[2]->x, con->nodes[3]->x,
-                                  &con->n, con->w);
+    con.stiff = ::magic.collision_stiffness*a;
+    double d = signed_ee_distance(con.nodes[0]->x, con.nodes[1]->x,
+                                  con.nodes[2]->x, con.nodes[3]->x,
+                                  &con.n, con.w);
     if (d < 0)
-        con->n = -con->n;
-    con->mu = (!is_free(edge0) || !is_free(edge1)) ? mu_obs : mu;
+        con.n = -con.n;
+    con.mu = (!is_free(edge0) || !is_free(edge1)) ? mu_obs : mu;
     return con;
 }
 
-Constraint *make_constraint (const Edge* edge, const Node* node, double mu, double mu_obs) {
-    IneqCon *con = new IneqCon;
-    con->nodes[0] = (Node*)node;
-    con->nodes[1] = (Node*)edge->n[0];
-    con->nodes[2] = (Node*)edge->n[1];
-    con->nodes[3] = 0;
+bool make_constraint (const Edge* edge, const Node* node, double mu, double mu_obs,
+                      IneqCon &con) {
+    con.nodes[0] = (Node*)node;
+    con.nodes[1] = (Node*)edge->n[0];
+    con.nodes[2] = (Node*)edge->n[1];
+    con.nodes[3] = 0;
     for (int n = 0; n < 4; n++)
-        con->free[n] = con->nodes[n] ? is_free(con->nodes[n]) : false;
+        con.free[n] = con.nodes[n] ? is_free(con.nodes[n]) : false;
     
     double a = min(area_cached(edge), area_cached(node));
-    con->stiff = ::magic.collision_stiffness*a;
-    con->n = get_outwards_normal(edge);
-    double d = signed_ve_distance(con->nodes[0]->x,con->nodes[1]->x,con->nodes[2]->x,
-                                  &con->n, con->w);
+    con.stiff = ::magic.collision_stiffness*a;
+    con.n = get_outwards_normal(edge);
+    double d = signed_ve_distance(con.nodes[0]->x,con.nodes[1]->x,con.nodes[2]->x,
+                                  &con.n, con.w);
     
-    if (fabs(d) > 2.0* ::magic.repulsion_thickness) return 0;
+    if (fabs(d) > 2.0* ::magic.repulsion_thickness) return false;
     
-    con->mu = (!is_free(node) || !is_free(edge)) ? mu_obs : mu;
-    return con;
+    con.mu = (!is_free(node) || !is_free(edge)) ? mu_obs : mu;
+    return true;
 }
 
-void make_proxy_constraints (Mesh& mesh, CollisionProxy& proxy, vector<Constraint*>& cons) {
+void make_proxy_constraints (Mesh& mesh, CollisionProxy& proxy, Constraints& cons) {
     for (size_t i=0; i<mesh.nodes.size(); i++) {
-        Constraint* c = proxy.constraint(mesh.nodes[i]);
-        if (c)
-            cons.push_back(c);
+        IneqCon con;
+        if (proxy.constraint(mesh.nodes[i], con))
+            cons.node_face.push_back(con);
     }
 }
 
@@ -30,8 +30,16 @@
 #include "simcloth.h"
 #include "constraint.h"
 
-std::vector<Constraint*> proximity_constraints
+// appends to cons
+void proximity_constraints
     (std::vector<Mesh*> &meshes, const std::vector<Mesh*> &obs_meshes,
-     double friction, double obs_friction, bool proxy_only = false);
+     double friction, double obs_friction, Constraints &cons,
+     bool proxy_only = false);
+
+// With magic.proximity_margin set, the face pairs near each other are
+// carried over from the previous call while the meshes keep their faces, and
+// only the faces that moved more than the margin since are swept again.
+// Drops them, e.g. before the meshes are replaced.
+void clear_proximity_cache ();
 
 #endif
@@ -41,27 +41,26 @@ CollisionProxy* FloorProxy::clone(Mesh& mesh) {
     return new FloorProxy(mesh);
 }
 
-Constraint* FloorProxy::constraint(const Node* node) {
+bool FloorProxy::constraint(const Node* node, IneqCon &con) {
     if (!is_free(node) || node->x[1] - center.x[1] > ::magic.repulsion_thickness)
-        return 0;
+        return false;
 
-    IneqCon *con = new IneqCon;
-    con->nodes[0] = (Node*)node;
-    con->nodes[1] = &center;
-    con->nodes[2] = 0;
-    con->nodes[3] = 0;
+    con.nodes[0] = (Node*)node;
+    con.nodes[1] = &center;
+    con.nodes[2] = 0;
+    con.nodes[3] = 0;
     for (int n = 0; n < 4; n++)
-        con->free[n] = n == 0;
-    con->w[0] = 1;
-    con->w[1] = -1;
-    con->w[2] = 0;
-    con->w[3] = 0;
+        con.free[n] = n == 0;
+    con.w[0] = 1;
+    con.w[1] = -1;
+    con.w[2] = 0;
+    con.w[3] = 0;
     
-    con->stiff = ::magic.collision_stiffness * node->a;
-    con->n = Vec3(0,1,0);
+    con.stiff = ::magic.collision_stiffness * node->a;
+    con.n = Vec3(0,1,0);
     
-    con->mu = sim.obs_friction;
-    return con;
+    con.mu = sim.obs_friction;
+    return true;
 }
 
 void FloorProxy::update(Mesh& mesh) {
@@ -30,7 +30,7 @@
 #include "mesh.h"
 #include "util.h"
 
-struct Constraint;
+struct IneqCon;
 
 // Proxy for obstacle collisions. Helpful for fast-moving
 class CollisionProxy {
@@ -38,14 +38,15 @@ public:
     virtual ~CollisionProxy() {};
     virtual CollisionProxy* clone(Mesh& mesh) = 0;
     virtual void update(Mesh& mesh) = 0;
-    virtual Constraint* constraint(const Node* node) = 0;
+    // fills con and returns true if the node is close to the proxy
+    virtual bool constraint(const Node* node, IneqCon &con) = 0;
 };
 
 class FloorProxy : public CollisionProxy {
 public:
     FloorProxy(Mesh& mesh);
 
-    Constraint* constraint(const Node* node);
+    bool constraint(const Node* node, IneqCon &con);
     CollisionProxy* clone(Mesh& mesh);
     void update(Mesh& mesh);
 private:
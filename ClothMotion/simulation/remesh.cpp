@@ -180,7 +180,7 @@ void embedding_from_plasticity (const vector<Face*> &fs) {
     }
     for (size_t n = 0; n < nodes.size(); n++)
         nodes[n]->y = nodes[n]->x;
-    vector<Constraint*> no_cons;
+    Constraints no_cons;
     local_opt<PS>(nodes, faces, edges, no_cons);
 }
 
@@ -246,7 +246,7 @@ void optimize_node (Node *node) {
         for (int i = 0; i < 3; i++)
             include(face->adje[i], edges);
     }
-    vector<Constraint*> no_cons;
+    Constraints no_cons;
     PlasticityStash stash(faces, edges);
     local_opt<PS>(nodes, faces, edges, no_cons);
     stash.apply(faces, edges);
@@ -270,16 +270,22 @@ void local_pop_filter (const vector<Face*> &fs) {
     for (size_t f = 0; f < faces.size(); f++)
         for (int i = 0; i < 3; i++)
             include(faces[f]->adje[i], edges);
-    vector<Constraint*> cons;
-    cons = proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
-                                 sim.friction, sim.obs_friction, true);
+    Constraints cons;
+    proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
+                          sim.friction, sim.obs_friction, cons, true);
     local_opt<WS>(nodes, faces, edges, cons);
 }
 
 // The actual operations
 
 RemeshOp split_edge (Edge* edge, double d) {
-    Mesh& mesh = *edge->n[0]->mesh;
+    RemeshOp op = build_split_edge(edge, d);
+    if (!op.empty())
+        apply_split_edge(op, d);
+    return op;
+}
+
+RemeshOp build_split_edge (Edge* edge, double d) {
 	RemeshOp op;
     Node *node0 = edge->n[0],
          *node1 = edge->n[1],
@@ -322,16 +328,29 @@ RemeshOp split_edge (Edge* edge, double d) {
         op.added_faces.push_back(nf0);
         op.added_faces.push_back(nf1);
     }
+    return op;
+}
+
+void apply_split_edge (RemeshOp &op, double d) {
+    Node *node0 = op.removed_edges[0]->n[0],
+         *node1 = op.removed_edges[0]->n[1],
+         *node = op.added_nodes[0];
     embedding_from_plasticity(op.removed_faces);
-    op.apply(mesh);
+    op.apply(*node0->mesh);
     node->y = (1-d)*node0->y + d*node1->y;
     optimize_node(node);
     plasticity_from_embedding(op.added_faces);
     local_pop_filter(op.added_faces);
-    return op;
 }
 
 RemeshOp collapse_edge (Edge* edge, int i) {
+    RemeshOp op = build_collapse_edge(edge, i);
+    if (!op.empty())
+        apply_collapse_edge(op);
+    return op;
+}
+
+RemeshOp build_collapse_edge (Edge* edge, int i) {
 	/*if (is_seam_or_boundary(edge)) {
 		Annotation::add(edge);
 		cout << "collapse" << endl;
@@ -381,11 +400,14 @@ RemeshOp collapse_edge (Edge* edge, int i) {
         }
     }
     //wait_key();
+    return op;
+}
+
+void apply_collapse_edge (RemeshOp &op) {
     embedding_from_plasticity(op.removed_faces);
-    op.apply(mesh);
+    op.apply(*op.removed_nodes[0]->mesh);
     plasticity_from_embedding(op.added_faces);
     local_pop_filter(op.added_faces);
-    return op;
 }
 
 RemeshOp flip_edge (Edge* edge) {
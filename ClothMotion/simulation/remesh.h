@@ -61,4 +61,15 @@ RemeshOp collapse_edge (Edge *edge, int which); // which end to delete
 
 RemeshOp flip_edge (Edge *edge);
 
+// split_edge and collapse_edge in two halves: build_* only reads the mesh
+// and returns an empty op if the result would be degenerate or inverted, so
+// ops that share no face can be built at the same time; apply_* changes the
+// mesh and relaxes the new faces, one op at a time
+
+RemeshOp build_split_edge (Edge *edge, double d);
+void apply_split_edge (RemeshOp &op, double d);
+
+RemeshOp build_collapse_edge (Edge *edge, int which);
+void apply_collapse_edge (RemeshOp &op);
+
 #endif
@@ -32,10 +32,9 @@
 #include "optimization.hpp"
 #include "simulation.h"
 #include "util.h"
-#include <windows.h>
 #include <omp.h>
 #include <set>
-#include <QMessageBox>
+#include <algorithm>
 #include <cassert>
 
 using namespace std;
@@ -406,23 +405,16 @@ void update_active (const vector<AccelStruct*> &accs,
     //     }
 }
 
-static int nthreads = 0;
-static vector<Ixn> *ixns = NULL;
+static OverlapBuffer<Ixn> ixns;
 
 void find_face_intersection (const Face *face0, const Face *face1);
 
 vector<Ixn> find_intersections (const vector<AccelStruct*> &accs,
                                 const vector<AccelStruct*> &obs_accs) {
-    if (!::ixns) {
-        ::nthreads = omp_get_max_threads();
-        ::ixns = new vector<Ixn>[::nthreads];
-    }
-    for (int t = 0; t < ::nthreads; t++)
-        ::ixns[t].clear();
+    ::ixns.clear();
     for_overlapping_faces(accs, obs_accs, ::thickness, find_face_intersection);
     vector<Ixn> ixns;
-    for (int t = 0; t < ::nthreads; t++)
-        append(ixns, ::ixns[t]);
+    ::ixns.merge(ixns);
     return ixns;
 }
 
@@ -431,16 +423,10 @@ void find_face_overlappings (const Face *face0, const Face *face1);
 // Find all the pairs of faces that might be intersections between them.
 vector<Ixn> find_overlappings (const vector<AccelStruct*> &accs,
         const vector<AccelStruct*> &obs_accs) {
-    if (!::ixns) {
-        ::nthreads = omp_get_max_threads();
-        ::ixns = new vector<Ixn>[::nthreads];
-    }
-    for (int t = 0; t < ::nthreads; t++)
-        ::ixns[t].clear();
+    ::ixns.clear();
     for_overlapping_faces(accs, obs_accs, ::thickness, find_face_overlappings);
     vector<Ixn> ixns;
-    for (int t = 0; t < ::nthreads; t++)
-        append(ixns, ::ixns[t]);
+    ::ixns.merge(ixns);
     return ixns;
 }
 
@@ -452,19 +438,17 @@ bool intersection_midpoint (const Face *face0, const Face *face1,
 void find_face_intersection (const Face *face0, const Face *face1) {
     if (adjacent(face0, face1))
         return;
-    int t = omp_get_thread_num();
     Ixn ixn(face0, face1);
     compute_length_and_gradient(ixn);
     if (ixn.l == 0)
         return;
-    ::ixns[t].push_back(ixn);
+    ::ixns.push_back(ixn);
 }
 
 void find_face_overlappings (const Face *face0, const Face *face1) {
     if (adjacent(face0, face1))
         return;
-    int t = omp_get_thread_num();
-    ::ixns[t].push_back(Ixn(face0, face1));
+    ::ixns.push_back(Ixn(face0, face1));
 }
 
 bool adjacent (const Face *face0, const Face *face1) {
@@ -34,7 +34,7 @@
 #include "util.h"
 #include <omp.h>
 #include <assert.h>
-#include <QMessageBox>
+#include <iostream>
 using namespace std;
 
 namespace SO {
@@ -97,8 +97,10 @@ bool separate_obstacles (vector<Mesh*> &obs_meshes,
         }
     }
     if (iter == max_iter) {
-	QMessageBox::critical(0, "error", "Initial separation failed to converge!");
-	return false;
+        cerr << "Initial separation failed to converge!" << endl;
+        destroy_accel_structs(accs);
+        destroy_accel_structs(obs_accs);
+        return false;
     }
     for (int m = 0; m < (int)obs_meshes.size(); m++) {
         compute_ws_data(*obs_meshes[m]);
@@ -127,23 +129,16 @@ void update_active (const vector<AccelStruct*> &accs, const vector<Ixn> &ixns) {
     //     }
 }
 
-static int nthreads = 0;
-static vector<Ixn> *ixns = NULL;
+static OverlapBuffer<Ixn> ixns;
 
 void find_face_intersection (const Face *face0, const Face *face1);
 
 vector<Ixn> find_intersections (const vector<AccelStruct*> &accs,
                                 const vector<AccelStruct*> &obs_accs) {
-    if (!SO::ixns) {
-        SO::nthreads = omp_get_max_threads();
-        SO::ixns = new vector<Ixn>[SO::nthreads];
-    }
-    for (int t = 0; t < SO::nthreads; t++)
-        SO::ixns[t].clear();
+    SO::ixns.clear();
     for_overlapping_faces(obs_accs, accs, 1e-3, find_face_intersection);
     vector<Ixn> ixns;
-    for (int t = 0; t < SO::nthreads; t++)
-        append(ixns, SO::ixns[t]);
+    SO::ixns.merge(ixns);
     return ixns;
 }
 
@@ -157,14 +152,15 @@ bool farthest_points (const Face *face0, const Face *face1, const Vec3 &d,
 void find_face_intersection (const Face *face0, const Face *face1) {
     if (!is_free(face0) && !is_free(face1))
         return;
-    int t = omp_get_thread_num();
     Bary b0, b1;
     bool is_ixn = intersection_midpoint(face0, face1, b0, b1);
     if (!is_ixn)
         return;
-    Vec3 n = -normalize(face0->n/2. + SO::nold[face0]);
+    // find() rather than [], which would insert from several threads
+    map<const Face*,Vec3>::const_iterator old = SO::nold.find(face0);
+    Vec3 n = -normalize(face0->n/2. + (old != SO::nold.end() ? old->second : Vec3(0)));
     farthest_points(face0, face1, n, b0, b1);
-    SO::ixns[t].push_back(Ixn(face0, b0, face1, b1, n));
+    SO::ixns.push_back(Ixn(face0, b0, face1, b1, n));
 }
 
 bool adjacent (const Face *face0, const Face *face1) {
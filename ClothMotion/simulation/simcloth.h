@@ -29,6 +29,7 @@
 
 #include "dde.hpp"
 #include "mesh.h"
+#include "linear_solver.h"
 
 struct SimMaterial {
     double density; // area density
@@ -51,10 +52,42 @@ struct Remeshing {
     double refine_fracture;
 };
 
+// Where the element blocks of the internal forces land in the implicit
+// system: for every block of A and every node of b, the contributing
+// element blocks in element order. Built once per block pattern; see
+// add_internal_forces in physics.cpp
+struct AssemblyPlan {
+    int version; // BsrMat::version the plan was built for
+    std::vector<int> bending; // edges with two faces, in element order
+    std::vector<int> slot_ptr, slot_src; // sources of each block of A
+    std::vector<int> node_ptr, node_src; // sources of each entry of b
+    std::vector<Mat3x3> blocks; // evaluated element blocks
+    std::vector<Vec3> forces; // evaluated element forces
+    AssemblyPlan (): version(-1) {}
+};
+
+// Implicit system of a cloth, kept across time steps so the block pattern
+// of A and its symbolic factorization are rebuilt only when remeshing or
+// new constraint couplings need it
+struct ImplicitSystem {
+    BsrMat<3> A;
+    AssemblyPlan plan;
+    std::vector<int> stencil; // mesh stencil the pattern was built for
+    int solver_type; // Magic::LinearSolver the solver was created for
+    LinearSolver *solver;
+    LinearSolver *fallback; // direct solver behind an iterative one
+    ImplicitSystem (): solver_type(-1), solver(0), fallback(0) {}
+    ~ImplicitSystem () {delete solver; delete fallback;}
+private:
+    ImplicitSystem (const ImplicitSystem&);
+    ImplicitSystem &operator= (const ImplicitSystem&);
+};
+
 struct SimCloth {
     Mesh mesh;
     std::vector<SimMaterial*> materials;    
     Remeshing remeshing;
+    ImplicitSystem system;
 };
 
 void compute_material (SimMaterial& mat, double Y);
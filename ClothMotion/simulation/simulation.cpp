@@ -35,6 +35,7 @@
 #include "physics.h"
 #include "plasticity.h"
 #include "popfilter.h"
+#include "profile.h"
 #include "proximity.h"
 #include "separate.h"
 #include "strainlimiting.h"
@@ -57,16 +58,26 @@ static const int proximity = Simulation::Proximity,
                  plasticity = Simulation::Plasticity,
                  fracture = Simulation::Fracture;
 
-void physics_step (Simulation &sim, const vector<Constraint*> &cons);
+void physics_step (Simulation &sim, const Constraints &cons);
 void plasticity_step (Simulation &sim);
-void strainlimiting_step (Simulation &sim, const vector<Constraint*> &cons);
+void strainlimiting_step (Simulation &sim, const Constraints &cons);
 void strainzeroing_step (Simulation &sim);
-void equilibration_step (Simulation &sim);
-void collision_step (Simulation &sim);
+bool equilibration_step (Simulation &sim);
+bool collision_step (Simulation &sim);
 void remeshing_step (Simulation &sim, bool initializing=false);
 
 void validate_handles (const Simulation &sim);
 
+static void start_timer (Simulation &sim, int module) {
+    sim.timers[module].tick();
+}
+
+// also puts the interval on the profile timeline
+static void stop_timer (Simulation &sim, int module) {
+    sim.timers[module].tock();
+    profile_module(module, sim.timers[module]);
+}
+
 static void consistency(const char* text) {
 	/*if (consistency_check) {
 		cout << "> " << text << " ";
@@ -94,6 +105,9 @@ void prepare (Simulation &sim) {
         sim.obstacle_meshes[o] = &sim.obstacles[o].get_mesh();
         update_x0(*sim.obstacle_meshes[o]);
     }
+    // drop trees and proximities of meshes from an earlier simulation
+    clear_accel_structs();
+    clear_proximity_cache();
 }
 
 bool relax_initial_state (Simulation &sim) {
@@ -103,10 +117,11 @@ bool relax_initial_state (Simulation &sim) {
             reset_plasticity(*sim.cloths[c]);
     
     bool equilibrate = true;
+    bool converged = true;
     if (equilibrate) {
-        equilibration_step(sim);
+        converged &= equilibration_step(sim);
         remeshing_step(sim, true);
-        equilibration_step(sim);
+        converged &= equilibration_step(sim);
     } else {
         remeshing_step(sim, true);
         strainzeroing_step(sim);
@@ -119,7 +134,7 @@ bool relax_initial_state (Simulation &sim) {
     ::magic.preserve_creases = false;
     if (::magic.fixed_high_res_mesh)
         sim.enabled[remeshing] = false;
-    return true;
+    return converged;
 }
 
 void validate_handles (const Simulation &sim) {
@@ -134,8 +149,8 @@ void validate_handles (const Simulation &sim) {
     }
 }
 
-vector<Constraint*> get_constraints (Simulation &sim, bool include_proximity);
-void delete_constraints (const vector<Constraint*> &cons);
+void get_constraints (Simulation &sim, bool include_proximity,
+                      Constraints &cons);
 void update_obstacles (Simulation &sim, bool update_positions=true);
 
 bool advance_step (Simulation &sim);
@@ -150,6 +165,7 @@ bool advance_step (Simulation &sim) {
 	cout << "Sim frame " << sim.frame << " [" << sim.step << "]" << endl;
     sim.time += sim.step_time;
     sim.step++;
+    profile_begin_step(sim);
 
     if (::magic.add_jitter && sim.frame % 10 == 0 && sim.frame < 100)
     	add_jitter(sim);
@@ -161,7 +177,8 @@ bool advance_step (Simulation &sim) {
     }
    // Annotation::list.clear();
     update_obstacles(sim, false);
-    vector<Constraint*> cons = get_constraints(sim, true);
+    Constraints &cons = sim.step_cons;
+    get_constraints(sim, true, cons);
     consistency("init step");
     physics_step(sim, cons);
     //cout << "phys" << endl;wait_key();
@@ -170,7 +187,7 @@ bool advance_step (Simulation &sim) {
     consistency("plasticity");
     strainlimiting_step(sim, cons);
     consistency("strainlimit");
-    collision_step(sim);
+    bool converged = collision_step(sim);
     consistency("collision");
     //cout << "coll" << endl;wait_key();
     if (sim.step % sim.frame_steps == 0) {
@@ -180,27 +197,22 @@ bool advance_step (Simulation &sim) {
     }
     //cout << "rem" << endl;wait_key();
     
-    delete_constraints(cons);
-    return true;
+    profile_end_step(sim);
+    return converged;
 }
 
-vector<Constraint*> get_constraints (Simulation &sim, bool include_proximity) {
-    vector<Constraint*> cons;
+// refills cons, keeping its storage
+void get_constraints (Simulation &sim, bool include_proximity,
+                      Constraints &cons) {
+    cons.clear();
     for (int h = 0; h < (int)sim.handles.size(); h++)
-        append(cons, sim.handles[h]->get_constraints(sim.time));
+        sim.handles[h]->add_constraints(sim.time, cons);
     if (include_proximity && sim.enabled[proximity]) {
-        sim.timers[proximity].tick();
-        append(cons, proximity_constraints(sim.cloth_meshes,
-                                           sim.obstacle_meshes,
-                                           sim.friction, sim.obs_friction));
-        sim.timers[proximity].tock();
+        start_timer(sim, proximity);
+        proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
+                              sim.friction, sim.obs_friction, cons);
+        stop_timer(sim, proximity);
     }
-    return cons;
-}
-
-void delete_constraints (const vector<Constraint*> &cons) {
-    for (int c = 0; c < (int)cons.size(); c++)
-        delete cons[c];
 }
 
 // Steps
@@ -209,10 +221,10 @@ void update_velocities (vector<Mesh*> &meshes, vector<Vec3> &xold, double dt);
 
 void step_mesh (Mesh &mesh, double dt);
 
-void physics_step (Simulation &sim, const vector<Constraint*> &cons) {
+void physics_step (Simulation &sim, const Constraints &cons) {
     if (!sim.enabled[physics])
         return;
-    sim.timers[physics].tick();
+    start_timer(sim, physics);
     for (size_t c = 0; c < sim.cloths.size(); c++) {
     	Mesh& mesh = sim.cloths[c]->mesh;
         int nn = mesh.nodes.size();
@@ -228,7 +240,8 @@ void physics_step (Simulation &sim, const vector<Constraint*> &cons) {
             if (sim.morphs[m].mesh == &sim.cloths[c]->mesh)
                 add_morph_forces(*sim.cloths[c], sim.morphs[m], sim.time,
                                  sim.step_time, fext, Jext);
-        vector<Vec3> dv = implicit_update(mesh.nodes, mesh.edges, mesh.faces, 
+        vector<Vec3> dv = implicit_update(sim.cloths[c]->system,
+                                          mesh.nodes, mesh.edges, mesh.faces, 
                                           fext, Jext, cons, sim.step_time);
         for (size_t n = 0; n < mesh.nodes.size(); n++) {
             mesh.nodes[n]->v += dv[n];
@@ -244,7 +257,7 @@ void physics_step (Simulation &sim, const vector<Constraint*> &cons) {
     }
     for (size_t o = 0; o < sim.obstacle_meshes.size(); o++)
         step_mesh(*sim.obstacle_meshes[o], sim.step_time);
-    sim.timers[physics].tock();
+    stop_timer(sim, physics);
 }
 
 void step_mesh (Mesh &mesh, double dt) {
@@ -255,77 +268,78 @@ void step_mesh (Mesh &mesh, double dt) {
 void plasticity_step (Simulation &sim) {
     if (!sim.enabled[plasticity])
         return;
-    sim.timers[plasticity].tick();
+    start_timer(sim, plasticity);
     for (int c = 0; c < (int)sim.cloths.size(); c++) {
         plastic_update(*sim.cloths[c]);
         optimize_plastic_embedding(*sim.cloths[c]);
     }
-    sim.timers[plasticity].tock();
+    stop_timer(sim, plasticity);
 }
 
 vector<Vec3> node_positions (const vector<Mesh*> &meshes);
 
-void strainlimiting_step (Simulation &sim, const vector<Constraint*> &cons) {
+void strainlimiting_step (Simulation &sim, const Constraints &cons) {
     if (!sim.enabled[strainlimiting])
         return;
-    sim.timers[strainlimiting].tick();
+    start_timer(sim, strainlimiting);
     vector<Vec3> xold = node_positions(sim.cloth_meshes);
     strain_limiting(sim.cloth_meshes, get_strain_limits(sim.cloths), cons);
     update_velocities(sim.cloth_meshes, xold, sim.step_time);
-    sim.timers[strainlimiting].tock();
+    stop_timer(sim, strainlimiting);
 }
 
-void equilibration_step (Simulation &sim) {
-    sim.timers[remeshing].tick();
-    vector<Constraint*> cons;// = get_constraints(sim, true);
+bool equilibration_step (Simulation &sim) {
+    start_timer(sim, remeshing);
+    Constraints no_cons;
     // double stiff = 1;
     // swap(stiff, ::magic.handle_stiffness);
     for (int c = 0; c < (int)sim.cloths.size(); c++) {
         Mesh &mesh = sim.cloths[c]->mesh;
         for (int n = 0; n < (int)mesh.nodes.size(); n++)
             mesh.nodes[n]->acceleration = Vec3(0);
-        apply_pop_filter(*sim.cloths[c], cons, 1);
+        apply_pop_filter(*sim.cloths[c], no_cons, 1);
     }
     // swap(stiff, ::magic.handle_stiffness);
-    sim.timers[remeshing].tock();
-    delete_constraints(cons);
-    cons = get_constraints(sim, false);
+    stop_timer(sim, remeshing);
+    Constraints &cons = sim.solve_cons;
+    get_constraints(sim, false, cons);
+    bool converged = true;
     if (sim.enabled[collision]) {
-        sim.timers[collision].tick();
-        collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes);
-        sim.timers[collision].tock();
+        start_timer(sim, collision);
+        converged = collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes);
+        stop_timer(sim, collision);
     }
-    
-    delete_constraints(cons);
+    return converged;
 }
 
 void strainzeroing_step (Simulation &sim) {
-    sim.timers[strainlimiting].tick();
+    start_timer(sim, strainlimiting);
     vector<StrainLimit> strain_limits(count_elements<Face>(sim.cloth_meshes), StrainLimit(1,1));
-    vector<Constraint*> cons =
-        proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
-                              sim.friction, sim.obs_friction);
+    Constraints &cons = sim.solve_cons;
+    cons.clear();
+    proximity_constraints(sim.cloth_meshes, sim.obstacle_meshes,
+                          sim.friction, sim.obs_friction, cons);
     strain_limiting(sim.cloth_meshes, strain_limits, cons);
-    delete_constraints(cons);
-    sim.timers[strainlimiting].tock();
+    stop_timer(sim, strainlimiting);
     if (sim.enabled[collision]) {
-        sim.timers[collision].tock();
-        collision_response(sim.cloth_meshes, vector<Constraint*>(),
+        start_timer(sim, collision);
+        collision_response(sim.cloth_meshes, Constraints(),
                            sim.obstacle_meshes);
-        sim.timers[collision].tock();
+        stop_timer(sim, collision);
     }
 }
 
-void collision_step (Simulation &sim) {
+bool collision_step (Simulation &sim) {
     if (!sim.enabled[collision])
-        return;
-    sim.timers[collision].tick();
+        return true;
+    start_timer(sim, collision);
     vector<Vec3> xold = node_positions(sim.cloth_meshes);
-    vector<Constraint*> cons = get_constraints(sim, false);
-    collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes);
-    delete_constraints(cons);
+    Constraints &cons = sim.solve_cons;
+    get_constraints(sim, false, cons);
+    bool converged = collision_response(sim.cloth_meshes, cons, sim.obstacle_meshes);
     update_velocities(sim.cloth_meshes, xold, sim.step_time);
-    sim.timers[collision].tock();
+    stop_timer(sim, collision);
+    return converged;
 }
 
 void remeshing_step (Simulation &sim, bool initializing) {
@@ -333,7 +347,7 @@ void remeshing_step (Simulation &sim, bool initializing) {
         return;
     
     // remesh
-    sim.timers[remeshing].tick();
+    start_timer(sim, remeshing);
     for (size_t c = 0; c < sim.cloths.size(); c++) {
         if (::magic.fixed_high_res_mesh)
             static_remesh(sim.cloths[c]->mesh);
@@ -344,7 +358,7 @@ void remeshing_step (Simulation &sim, bool initializing) {
             dynamic_remesh(sim.cloths[c]->mesh, planes);
         }
     }
-    sim.timers[remeshing].tock();
+    stop_timer(sim, remeshing);
 
     // breaking
     if (sim.enabled[fracture] && sim.frame > 1) {
@@ -356,20 +370,20 @@ void remeshing_step (Simulation &sim, bool initializing) {
     
     // separate
     if (sim.enabled[separation]) {
-        sim.timers[separation].tick();
+        start_timer(sim, separation);
         separate(sim.cloth_meshes, sim.obstacle_meshes);
-        sim.timers[separation].tock();
+        stop_timer(sim, separation);
     }
     consistency("separation");
 
     // apply pop filter
     if (sim.enabled[popfilter] && !initializing) {
-        sim.timers[popfilter].tick();
-        vector<Constraint*> cons = get_constraints(sim, true);
+        start_timer(sim, popfilter);
+        Constraints &cons = sim.solve_cons;
+        get_constraints(sim, true, cons);
         for (size_t c = 0; c < sim.cloths.size(); c++)
             apply_pop_filter(*sim.cloths[c], cons);
-        delete_constraints(cons);
-        sim.timers[popfilter].tock();
+        stop_timer(sim, popfilter);
     }    
 }
 
@@ -66,6 +66,9 @@ struct Simulation {
     Timer timers[nModules];
     // handy pointers
     std::vector<Mesh*> cloth_meshes, obstacle_meshes;
+    // constraint storage reused every step: the constraints of the step,
+    // and those of the collision and pop filter solves made during it
+    Constraints step_cons, solve_cons;
 };
 
 extern Simulation sim;
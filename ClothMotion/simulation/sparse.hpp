@@ -28,6 +28,7 @@
 #define SPARSE_HPP
 
 #include "util.h"
+#include <algorithm>
 #include <fstream>
 #include <utility>
 #include <vector>
@@ -102,6 +103,93 @@ std::ostream &operator<< (std::ostream &out, const SpMat<T> &A) {
     return out;
 }
 
+// Symmetric matrix of m x m blocks, stored as block-CSR of its upper
+// triangle. The block pattern is built once with set_pattern() and only
+// refilled with zero() and add() on later steps. Values are laid out in
+// the lower-triangular CCS form TAUCS expects (diagonal blocks keep their
+// upper half), so colptr/rowind/values go to the solver without a copy.
+template <int m> struct BsrMat {
+    int n; // block rows
+    std::vector<int> rowptr, cols; // block pattern, diagonal first per row
+    std::vector<int> colptr, rowind; // scalar pattern
+    std::vector<double> values;
+    int version; // bumped whenever the pattern changes
+    BsrMat (): n(0), version(0) {}
+    // adj[i] lists the block columns j >= i of row i; sorted in place
+    void set_pattern (std::vector< std::vector<int> > &adj) {
+        n = adj.size();
+        rowptr.assign(n+1, 0);
+        cols.clear();
+        for (int i = 0; i < n; i++) {
+            adj[i].push_back(i);
+            std::sort(adj[i].begin(), adj[i].end());
+            adj[i].erase(std::unique(adj[i].begin(), adj[i].end()),
+                         adj[i].end());
+            rowptr[i] = cols.size();
+            cols.insert(cols.end(), adj[i].begin(), adj[i].end());
+        }
+        rowptr[n] = cols.size();
+        colptr.resize(n*m+1);
+        rowind.clear();
+        for (int i = 0; i < n; i++) {
+            for (int k = 0; k < m; k++) {
+                colptr[i*m+k] = rowind.size();
+                for (int l = k; l < m; l++)
+                    rowind.push_back(i*m+l);
+                for (int b = rowptr[i]+1; b < rowptr[i+1]; b++)
+                    for (int l = 0; l < m; l++)
+                        rowind.push_back(cols[b]*m+l);
+            }
+        }
+        colptr[n*m] = rowind.size();
+        values.assign(rowind.size(), 0.);
+        version++;
+    }
+    int find (int i, int j) const {// block index, or -1 if not in pattern
+        std::vector<int>::const_iterator begin = cols.begin() + rowptr[i],
+                                         end = cols.begin() + rowptr[i+1];
+        std::vector<int>::const_iterator it = std::lower_bound(begin, end, j);
+        return (it != end && *it == j) ? (int)(it - cols.begin()) : -1;
+    }
+    // position of entry (k,l) of block b in row i; l >= k on the diagonal
+    int offset (int i, int b, int k, int l) const {
+        int r = b - rowptr[i];
+        return r == 0 ? colptr[i*m+k] + l - k
+                      : colptr[i*m+k] + m - k + (r-1)*m + l;
+    }
+    void zero () {
+        std::fill(values.begin(), values.end(), 0.);
+    }
+    // the lower triangle is implied by symmetry, so those blocks are
+    // skipped; returns false if the block is missing from the pattern
+    bool add (int i, int j, const Mat<m,m> &Aij) {
+        if (j < i)
+            return true;
+        int b = find(i, j);
+        if (b < 0)
+            return false;
+        add_at(i, b, Aij);
+        return true;
+    }
+    // adds to block b of row i, as found by find()
+    void add_at (int i, int b, const Mat<m,m> &Aij) {
+        bool diagonal = b == rowptr[i];
+        for (int k = 0; k < m; k++) {
+            double *row = &values[offset(i, b, k, diagonal ? k : 0)];
+            for (int l = diagonal ? k : 0; l < m; l++)
+                *row++ += Aij(k,l);
+        }
+    }
+    Mat<m,m> block (int i, int b) const {
+        Mat<m,m> Aij;
+        for (int k = 0; k < m; k++)
+            for (int l = 0; l < m; l++)
+                Aij(k,l) = cols[b] != i ? values[offset(i, b, k, l)]
+                         : values[offset(i, b, std::min(k,l), std::max(k,l))];
+        return Aij;
+    }
+};
+
 inline void debug_save_spmat (const SpMat<double> &A) {
     static int n = 0;
     std::fstream file(stringf("tmp/spmat%d", n++).c_str(), std::ios::out);
@@ -115,7 +203,7 @@ inline void debug_save_spmat (const SpMat<double> &A) {
                  << "} -> " << aij;
         }
     }
-    file << "}]" << file;
+    file << "}]" << std::endl;
 }
 
 #endif
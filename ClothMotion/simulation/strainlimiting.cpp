@@ -61,18 +61,26 @@ T* get(int n, const vector<Mesh*>& meshes) {
 	return 0;
 }
 
+struct ConstraintValues {
+    vector<double> &values;
+    ConstraintValues (vector<double> &values): values(values) {}
+    template <typename Con> void operator() (const Con &con) {
+        values.push_back(con.value());
+    }
+};
+
 struct SLOpt: public NLConOpt {
     vector<Mesh*> meshes;
     int nn, nf;
     const vector<StrainLimit> &strain_limits;
-    const vector<Constraint*> &cons;
+    const Constraints &cons;
     vector<Vec3> xold;
     vector<double> conold;
     mutable vector<double> s;
     mutable vector<Mat3x3> sg;
     double inv_m;
     SLOpt (vector<Mesh*> &meshes, const vector<StrainLimit> &strain_limits,
-           const vector<Constraint*> &cons):
+           const Constraints &cons):
           meshes(meshes), nn(count_elements<Node>(meshes)), nf(count_elements<Face>(meshes)),
           strain_limits(strain_limits), cons(cons),
           xold(nn), s(3*nf), sg(3*nf) 
@@ -91,9 +99,9 @@ struct SLOpt: public NLConOpt {
        	inv_m /= nn;
        	nvar = nn * 3;
         ncon = cons.size() + nf*6;
-        conold.resize(cons.size());
-        for (int j = 0; j < (int)cons.size(); j++)
-            conold[j] = cons[j]->value();        
+        conold.reserve(cons.size());
+        ConstraintValues values(conold);
+        for_each_constraint(cons, values);
     }
     void initialize (double *x) const;
     double objective (const double *x) const;
@@ -105,7 +113,7 @@ struct SLOpt: public NLConOpt {
 };
 
 void strain_limiting (vector<Mesh*> &meshes, const vector<StrainLimit> &strain_limits,
-                      const vector<Constraint*> &cons) {
+                      const Constraints &cons) {
     augmented_lagrangian_method(SLOpt(meshes, strain_limits, cons));
 }
 
@@ -164,9 +172,29 @@ double strain_con (const SLOpt &sl, const double *x, int j, int &sign);
 void strain_con_grad (const SLOpt &sl, const double *x, int j, double factor,
                       double *grad);
 
+struct ConstraintValue {
+    int &sign;
+    double value;
+    ConstraintValue (int &sign): sign(sign), value(0) {}
+    template <typename Con> void operator() (const Con &con) {
+        value = con.value(&sign);
+    }
+};
+
+struct ConstraintGradient {
+    MeshGrad &grad;
+    ConstraintGradient (MeshGrad &grad): grad(grad) {}
+    template <typename Con> void operator() (const Con &con) {
+        con.gradient(grad);
+    }
+};
+
 double SLOpt::constraint (const double *x, int j, int &sign) const {
-    if (j < (int)cons.size())
-        return cons[j]->value(&sign) - conold[j];
+    if (j < (int)cons.size()) {
+        ConstraintValue value(sign);
+        visit_constraint(cons, j, value);
+        return value.value - conold[j];
+    }
     else
         return strain_con(*this, x, j-cons.size(), sign);
 }
@@ -174,13 +202,14 @@ double SLOpt::constraint (const double *x, int j, int &sign) const {
 void SLOpt::con_grad (const double *x, int j, double factor,
                       double *grad) const {
     if (j < (int)cons.size()) {
-        MeshGrad mgrad = cons[j]->gradient();
-        for (MeshGrad::iterator it=mgrad.begin(); it!=mgrad.end(); it++) {
-            
-            if (!is_free(it->node))
+        MeshGrad mgrad;
+        ConstraintGradient gradient(mgrad);
+        visit_constraint(cons, j, gradient);
+        for (int k = 0; k < mgrad.n; k++) {
+            if (!is_free(mgrad.node[k]))
             	continue;
-            int n = it->node->index;
-            const Vec3 &g = it->f;
+            int n = mgrad.node[k]->index;
+            const Vec3 &g = mgrad.f[k];
             for (int i = 0; i < 3; i++)
                 grad[n*3+i] += factor*g[i];
         }
@@ -259,7 +288,7 @@ void debug (const vector<string> &args) {
 	vector<Mesh*> meshes(1, &mesh);
 	vector<Vec2> strain_limits(mesh.faces.size(), Vec2(0.95, 1.05));
 	Timer timer;
-	strain_limiting(meshes, strain_limits, vector<Constraint*>());
+	strain_limiting(meshes, strain_limits, Constraints());
 	timer.tock();
 	cout << "total time: " << timer.total << endl;
 	save_obj(mesh, "tmp/debug.obj");*/
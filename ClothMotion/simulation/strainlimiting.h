@@ -41,6 +41,6 @@ std::vector<StrainLimit> get_strain_limits (const std::vector<SimCloth*> &cloths
 
 void strain_limiting (std::vector<Mesh*> &meshes,
                       const std::vector<StrainLimit> &strain_limits,
-                      const std::vector<Constraint*> &cons);
+                      const Constraints &cons);
 
 #endif
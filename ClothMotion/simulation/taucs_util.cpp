@@ -25,7 +25,7 @@
 */
 
 #include "taucs_util.h"
-#include "../timer.h"
+#include "cholesky.h"
 #include "../alglib/solvers.h"
 #include <cstdlib>
 #include <iostream>
@@ -34,6 +34,46 @@ using namespace alglib;
 
 vector<Node*>* debug_nodes = 0;
 
+#ifdef NO_TAUCS
+// Built without the TAUCS libraries: the matrix type and the one-shot
+// solver used below are stood in for by SupernodalCholesky
+enum {TAUCS_SUCCESS = 0, TAUCS_ERROR = -1};
+enum {TAUCS_LOWER = 1, TAUCS_SYMMETRIC = 8, TAUCS_DOUBLE = 2048};
+
+struct taucs_ccs_matrix {
+    int n, m, flags;
+    int *colptr, *rowind;
+    struct {double *d;} values;
+};
+
+static taucs_ccs_matrix *taucs_ccs_create (int m, int n, int nnz, int flags) {
+    taucs_ccs_matrix *A = new taucs_ccs_matrix;
+    A->m = m;
+    A->n = n;
+    A->flags = flags;
+    A->colptr = new int[n+1];
+    A->rowind = new int[nnz];
+    A->values.d = new double[nnz];
+    return A;
+}
+
+static void taucs_ccs_free (taucs_ccs_matrix *A) {
+    delete[] A->colptr;
+    delete[] A->rowind;
+    delete[] A->values.d;
+    delete A;
+}
+
+static int taucs_linsolve (taucs_ccs_matrix *A, void **, int, void *X, void *B,
+                           char *[], void *[]) {
+    SupernodalCholesky L;
+    L.analyze(A->n, A->colptr, A->rowind);
+    if (!L.factor(A->values.d))
+        return TAUCS_ERROR;
+    L.solve((double*)B, (double*)X);
+    return TAUCS_SUCCESS;
+}
+#else
 extern "C" {
 #include <taucs.h>
 int taucs_linsolve (taucs_ccs_matrix* A, // input matrix
@@ -44,6 +84,7 @@ int taucs_linsolve (taucs_ccs_matrix* A, // input matrix
                     char* options[], // options (what to do and how)
                     void* arguments[]); // option arguments
 }
+#endif
 
 ostream &operator<< (ostream &out, taucs_ccs_matrix *A) {
     out << "n: " << A->n << endl;
@@ -187,6 +228,42 @@ vector<Vec<C> > alglib_linear_solve_vec(const SpMat<Mat<C,C> >& A, const vector<
     return ret;
 }
 
+template<int C>
+vector<Vec<C> > alglib_linear_solve_vec(const BsrMat<C>& A, const vector<Vec<C> >& b) {
+    const int n = b.size()*C;
+    real_2d_array M;
+    real_1d_array x,c;
+    M.setlength(n,n);
+    x.setlength(n);
+    c.setlength(n);
+    for (int i=0; i<n; i++)
+        c[i] = b[i/C][i%C];
+    for (int i=0; i<n; i++)
+        for (int j=0; j<n; j++)
+            M(i,j) = 0;
+    for (int i = 0; i < A.n; i++) {
+        for (int jj = A.rowptr[i]; jj < A.rowptr[i+1]; jj++) {
+            int j = A.cols[jj];
+            Mat<C,C> Aij = A.block(i, jj);
+            for (int si=0; si<C; si++)
+                for (int sj=0; sj<C; sj++) {
+                    M(i*C+si,j*C+sj) = Aij(si,sj);
+                    M(j*C+sj,i*C+si) = Aij(si,sj);
+                }
+        }
+    }
+
+    ae_int_t info;
+    densesolverreport rep;    
+    rmatrixsolve(M,n,c,info,rep,x);
+    
+    vector<Vec<C> > ret(b.size());
+    for (int i=0; i<n; i++)
+        ret[i/C][i%C] = x[i];
+    
+    return ret;
+}
+
 vector<double> taucs_linear_solve (const SpMat<double> &A, const vector<double> &b) {
     if (b.size() < 20) 
         return alglib_linear_solve(A,b);
@@ -205,13 +282,19 @@ vector<double> taucs_linear_solve (const SpMat<double> &A, const vector<double>
     return x;
 }
 
-template <int m> vector< Vec<m> > taucs_linear_solve
-    (const SpMat< Mat<m,m> > &A, const vector< Vec<m> > &b) {
-    if (b.size() < 6) 
-        return alglib_linear_solve_vec(A,b);
-    
-    // taucs_logfile("stdout");
-    taucs_ccs_matrix *Ataucs = sparse_to_taucs(A);
+// A already holds the lower CCS arrays, so TAUCS reads them in place
+template <int m> taucs_ccs_matrix bsr_to_taucs (const BsrMat<m> &A) {
+    taucs_ccs_matrix At;
+    At.n = At.m = A.n*m;
+    At.flags = TAUCS_DOUBLE | TAUCS_SYMMETRIC | TAUCS_LOWER;
+    At.colptr = const_cast<int*>(&A.colptr[0]);
+    At.rowind = const_cast<int*>(&A.rowind[0]);
+    At.values.d = const_cast<double*>(&A.values[0]);
+    return At;
+}
+
+template <int m> vector< Vec<m> > taucs_ccs_solve
+    (taucs_ccs_matrix *Ataucs, const vector< Vec<m> > &b) {
     vector< Vec<m> > x(b.size());
     char *options[] = {(char*)"taucs.factor.LLT=true", NULL};
     int retval = taucs_linsolve(Ataucs, NULL, 1, &x[0], (double*)&b[0], options, NULL);
@@ -223,9 +306,116 @@ template <int m> vector< Vec<m> > taucs_linear_solve
 	int * a;
 	*a = 1;
     }
+    return x;
+}
+
+template <int m> vector< Vec<m> > taucs_linear_solve
+    (const SpMat< Mat<m,m> > &A, const vector< Vec<m> > &b) {
+    if (b.size() < 6) 
+        return alglib_linear_solve_vec(A,b);
+    
+    // taucs_logfile("stdout");
+    taucs_ccs_matrix *Ataucs = sparse_to_taucs(A);
+    vector< Vec<m> > x = taucs_ccs_solve(Ataucs, b);
     taucs_ccs_free(Ataucs);
     return x;
 }
 
+template <int m> vector< Vec<m> > taucs_linear_solve
+    (const BsrMat<m> &A, const vector< Vec<m> > &b) {
+    if (b.size() < 6) 
+        return alglib_linear_solve_vec(A,b);
+
+    taucs_ccs_matrix Ataucs = bsr_to_taucs(A);
+    return taucs_ccs_solve(&Ataucs, b);
+}
+
+#ifndef NO_TAUCS
+TaucsFactor::TaucsFactor (): matrix(0), version(0), perm(0), invperm(0),
+                             PA(0), L(0), factored(false) {}
+
+TaucsFactor::~TaucsFactor () {
+    clear();
+}
+
+void TaucsFactor::clear () {
+    if (L)
+        taucs_supernodal_factor_free(L);
+    if (PA)
+        taucs_ccs_free((taucs_ccs_matrix*)PA);
+    if (perm)
+        taucs_free(perm);
+    if (invperm)
+        taucs_free(invperm);
+    matrix = 0;
+    perm = invperm = 0;
+    PA = L = 0;
+    value_map.clear();
+    factored = false;
+}
+
+bool TaucsFactor::solve (const BsrMat<3> &A, const vector<Vec3> &b,
+                         vector<Vec3> &x) {
+    taucs_ccs_matrix At = bsr_to_taucs(A);
+    int n = At.n, nnz = A.values.size();
+    if (matrix != &A || version != A.version || !L) {
+        clear();
+        timers[Analyze].tick();
+        taucs_ccs_order(&At, &perm, &invperm, (char*)"metis");
+        // permute entry numbers instead of values once, which gives the
+        // map that refills the permuted matrix on later steps
+        vector<double> index(nnz);
+        for (int i = 0; i < nnz; i++)
+            index[i] = i;
+        taucs_ccs_matrix Ai = At;
+        Ai.values.d = &index[0];
+        taucs_ccs_matrix *Ap = perm ? taucs_ccs_permute_symmetrically(&Ai, perm, invperm) : 0;
+        if (Ap) {
+            value_map.resize(nnz);
+            for (int i = 0; i < nnz; i++)
+                value_map[i] = (int)Ap->values.d[i];
+            L = taucs_ccs_factor_llt_symbolic(Ap);
+        }
+        PA = Ap;
+        timers[Analyze].tock();
+        counts[Analyze]++;
+        if (!L) {
+            cerr << "Error: TAUCS symbolic factorization failed" << endl;
+            clear();
+            return false;
+        }
+        matrix = &A;
+        version = A.version;
+    }
+
+    timers[Factorize].tick();
+    taucs_ccs_matrix *Ap = (taucs_ccs_matrix*)PA;
+    for (int i = 0; i < nnz; i++)
+        Ap->values.d[i] = A.values[value_map[i]];
+    if (factored)
+        taucs_supernodal_factor_free_numeric(L);
+    factored = taucs_ccs_factor_llt_numeric(Ap, L) == TAUCS_SUCCESS;
+    timers[Factorize].tock();
+    counts[Factorize]++;
+    if (!factored)
+        return false;
+
+    timers[Solve].tick();
+    vector<double> pb(n), px(n);
+    x.resize(b.size());
+    taucs_vec_permute(n, TAUCS_DOUBLE, (double*)&b[0], &pb[0], perm);
+    taucs_supernodal_solve_llt(L, &px[0], &pb[0]);
+    taucs_vec_ipermute(n, TAUCS_DOUBLE, &px[0], (double*)&x[0], perm);
+    timers[Solve].tock();
+    counts[Solve]++;
+    return true;
+}
+
+#endif
+
 template vector<Vec3> taucs_linear_solve (const SpMat<Mat3x3> &A,
                                           const vector<Vec3> &b);
+template vector<Vec3> taucs_linear_solve (const BsrMat<3> &A,
+                                          const vector<Vec3> &b);
+template vector<Vec3> alglib_linear_solve_vec (const BsrMat<3> &A,
+                                               const vector<Vec3> &b);
@@ -27,8 +27,7 @@
 #ifndef TAUCS_H
 #define TAUCS_H
 
-#include "sparse.hpp"
-#include "vectors.h"
+#include "linear_solver.h"
 
 std::vector<double> taucs_linear_solve (const SpMat<double> &A,
                                         const std::vector<double> &b);
@@ -36,4 +35,33 @@ std::vector<double> taucs_linear_solve (const SpMat<double> &A,
 template <int m> std::vector< Vec<m> > taucs_linear_solve
     (const SpMat< Mat<m,m> > &A, const std::vector< Vec<m> > &b);
 
+template <int m> std::vector< Vec<m> > taucs_linear_solve
+    (const BsrMat<m> &A, const std::vector< Vec<m> > &b);
+
+template <int m> std::vector< Vec<m> > alglib_linear_solve_vec
+    (const BsrMat<m> &A, const std::vector< Vec<m> > &b);
+
+#ifndef NO_TAUCS
+// Sparse Cholesky factor of a BsrMat kept between solves. The fill-reducing
+// ordering and the symbolic factor depend only on the pattern, so they are
+// recomputed only after set_pattern(); other solves refactor numerically.
+struct TaucsFactor: public LinearSolver {
+    TaucsFactor ();
+    ~TaucsFactor ();
+    const char *name () const {return "taucs";}
+    void clear ();
+    // false if A is not positive definite
+    bool solve (const BsrMat<3> &A, const std::vector<Vec3> &b,
+                std::vector<Vec3> &x);
+private:
+    const void *matrix; // pattern the symbolic factor was built for
+    int version;
+    int *perm, *invperm;
+    void *PA; // permuted matrix, refilled through value_map
+    std::vector<int> value_map;
+    void *L; // supernodal factor
+    bool factored;
+};
+#endif
+
 #endif
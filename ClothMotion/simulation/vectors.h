@@ -32,9 +32,19 @@
 #include <cmath>
 #include <iostream>
 
+#ifdef _MSC_VER
 #define __align(sz) __declspec(align(sz))
 inline void* malloc_align(size_t size, size_t alignment = 32) { return _aligned_malloc(size, alignment); }
 inline void aligned_free(void *ptr)    { _aligned_free(ptr); }
+#else
+#include <cstdlib>
+#define __align(sz) __attribute__((aligned(sz)))
+inline void* malloc_align(size_t size, size_t alignment = 32) {
+    void *ptr = 0;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : 0;
+}
+inline void aligned_free(void *ptr)    { free(ptr); }
+#endif
 
 inline double sq (double x) {return x*x;}
 
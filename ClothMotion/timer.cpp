@@ -1,17 +1,40 @@
-#include "Timer.h"
+#include "timer.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 Timer::Timer (): last(0), total(0) {
 	tick();
 }
 
 void Timer::tick () {
-	time(&then);
+	then = now();
 }
 
 void Timer::tock () {
-	time_t now;
-	time(&now);
-	last = static_cast<double>(now - then);
+	double t = now();
+	last = t - then;
 	total += last;
-	then = now;
-}
\ No newline at end of file
+	then = t;
+}
+
+double Timer::now () {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER count;
+	QueryPerformanceCounter(&count);
+	return static_cast<double>(count.QuadPart) / frequency.QuadPart;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
@@ -2,12 +2,12 @@
 #ifndef __TIMER_H
 #define __TIMER_H
 
-#include <time.h>
-
 struct Timer {
-	time_t then;
+	double then;
 	double last, total;
 	Timer ();
 	void tick (), tock ();
+	// seconds since an arbitrary fixed origin, from the performance counter
+	static double now ();
 };
 #endif
@@ -1,6 +1,8 @@
 #include "animation.h"
 
 #include <cmath>
+#include <cctype>
+#include <cstring>
 #include <fstream>
 #include <QFileInfo>
 #include <QMimeData>
@@ -195,88 +197,6 @@ Animation::Animation( const aiAnimation* pAnimation, Avatar* luke )
 	}
 }
 
-void Animation::addKeyframes( const ChannelList& cl, int start_time, int length,  double ticks_per_sec, double play_speed, double weight )
-{
-	// λת-->
-	ticks_per_second = ticks_per_sec;
-	double offset_ticks = start_time * 0.001 * ticks_per_second;
-
-	// ״ӹؼ֡ 򵥵ظƹؼ֡
-	if (channels.isEmpty())
-	{
-		channels = cl;
-		for(int channel_index = 0; channel_index < cl.size(); ++channel_index) 
-		{
-			// ƽ
-			for (int key_index = 0; key_index < cl[channel_index].position_keys.size(); ++key_index) 
-			{
-				VectorKey& key = channels[channel_index].position_keys[key_index];
-				key.time += offset_ticks;
-				key.value *= weight;
-			}
-			// ת
-			for (int key_index = 0; key_index < cl[channel_index].rotation_keys.size(); ++key_index) 
-			{
-				QuaternionKey& key = channels[channel_index].rotation_keys[key_index];
-				key.time += offset_ticks;
-				key.value *= weight;
-			}
-			// 
-			for (int key_index = 0; key_index < cl[channel_index].scaling_keys.size(); ++key_index) 
-			{
-				VectorKey& key = channels[channel_index].scaling_keys[key_index];
-				key.time += offset_ticks;
-				key.value *= weight;
-			}
-		}
-	}
-	else 
-	{
-		for(int channel_index = 0; channel_index < cl.size(); ++channel_index) 
-		{
-			// ѹؼ֡ݷŵӦͨ
-			auto it = channels.begin();
-			while (it != channels.end()) 
-			{
-				if (it->joint->name == cl[channel_index].joint->name)
-					break;
-
-				++it;
-			}
-
-			Q_ASSERT(it != channels.end());
-			// ƽ
-			for (int key_index = 0; key_index < cl[channel_index].position_keys.size(); ++key_index) 
-			{
-				VectorKey key = cl[channel_index].position_keys[key_index];
-				key.time += offset_ticks;
-				key.value *= weight;
-				it->position_keys.push_back(key);
-			}
-			// ת
-			for (int key_index = 0; key_index < cl[channel_index].rotation_keys.size(); ++key_index) 
-			{
-				QuaternionKey key = cl[channel_index].rotation_keys[key_index];
-				key.time += offset_ticks;
-				key.value *= weight;
-				it->rotation_keys.push_back(key);
-			}
-			// 
-			for (int key_index = 0; key_index < cl[channel_index].scaling_keys.size(); ++key_index) 
-			{
-				VectorKey key = cl[channel_index].scaling_keys[key_index];
-				key.time += offset_ticks;
-				key.value *= weight;
-				it->scaling_keys.push_back(key);
-			}
-		}
-	}
-
-
-	double tmp = (start_time + length) * 0.001 * ticks_per_second;
-	ticks = qMax(ticks, tmp);
-}
-
 void Animation::clear()
 {
 	ai_anim = nullptr;
@@ -446,6 +366,11 @@ int AnimationClip::endTime() const
 	return startTime() + length_;
 }
 
+const Animation* AnimationClip::animation() const
+{
+	return animation_;
+}
+
 const ChannelList& AnimationClip::channelList() const
 {
 	return animation_->channels;
@@ -785,16 +710,22 @@ Joint* SkeletonTreeModel::itemFromIndex( const QModelIndex &index ) const
 /************************************************************************/
 /*                                                              */
 /************************************************************************/
-Avatar::Avatar(const aiScene* pScene, const QString& filename)
+Avatar::Avatar(const aiScene* pScene, const QString& filename, bool headless)
 	: SceneNode(),
 	ai_scene_(pScene), 
 	root_(nullptr),
+	joint_pos_buffer_(nullptr),
+	bone_pos_buffer_(nullptr),
+	joint_vao_(nullptr),
+	bone_vao_(nullptr),
 	has_materials_(ai_scene_->HasMaterials()),
 	has_animations_(ai_scene_->HasAnimations()),
 	bindposed_( true ),
+	headless_(headless),
 	//gpu_skinning_(false),
 	file_dir_(QFileInfo(filename).absolutePath()),
 	asfamc_importer_(nullptr),
+	bvh_importer_(nullptr),
 	scale_factor_(1.f),
 	xtranslate_(0.f),
 	ytranslate_(0.f),
@@ -827,8 +758,11 @@ Avatar::Avatar(const aiScene* pScene, const QString& filename)
 	skeleton_tree_model_ = new SkeletonTreeModel(root_);
 	makeSkinCache();
 	createBoundings(); // Χ ײ ʰȡ Ӧ
-	createSkinVBO();
-	createSkeletonVBO();
+	if (!headless_)
+	{
+		createSkinVBO();
+		createSkeletonVBO();
+	}
 	if (has_materials_)
 	{
 		loadDiffuseTexture();
@@ -843,7 +777,8 @@ Avatar::Avatar(const aiScene* pScene, const QString& filename)
 	// ʾûȱٶ Ƿ붯
 	else 
 	{
-		QMessageBox::warning(NULL, "VirtualStudio", "The avatar has no animations. You can import mocap data as animation.\n", QMessageBox::Ok);
+		if (!headless_)
+			QMessageBox::warning(NULL, "VirtualStudio", "The avatar has no animations. You can import mocap data as animation.\n", QMessageBox::Ok);
 		loadMH2CMUJointMap();
 	}
 
@@ -868,6 +803,8 @@ Avatar::~Avatar()
 	}
 	qDeleteAll(bones_.begin(), bones_.end());
 	bones_.clear();
+	delete asfamc_importer_;
+	delete bvh_importer_;
 }
 
 Joint* Avatar::buildSkeleton( aiNode* pNode, Joint* pParent )
@@ -965,105 +902,21 @@ void Avatar::updateAnimation( const Animation* animation, int elapsed_time )
 	if (time_in_tick > animation->ticks) 
 		return;
 
-	if (transforms_.size() != animation->channels.size())
-		transforms_.resize(animation->channels.size());
-
 	// channel֮任
-	for (int channel_index = 0; channel_index < animation->channels.size();  ++channel_index) 
-	{
-		const AnimationChannel& channel = animation->channels.at(channel_index);
-		/************************************************************************/
-		/* λ                                                                 */
-		/************************************************************************/
-		QVector3D present_position(0, 0, 0);
-		if (!channel.position_keys.empty()) 
-		{
-			int frame = 0;
-			while (frame < channel.position_keys.size() - 1) 
-			{
-				if (time_in_tick < channel.position_keys[frame+1].time)
-					break;
-				++frame;
-			}
-
-			// ؼֵ֮֡
-			uint next_frame = (frame+1) % channel.position_keys.size();
-			const VectorKey& key = channel.position_keys[frame];
-			const VectorKey& next_key = channel.position_keys[next_frame];
-			double diff_time = next_key.time - key.time;
-			if (diff_time < 0.0)
-				diff_time += animation->ticks;
-			if (diff_time > 0) 
-			{
-				float factor =  static_cast<float>((time_in_tick - key.time) / diff_time);
-				present_position = key.value + (next_key.value - key.value) * factor;
-			} 
-			else 
-			{
-				present_position = key.value;
-			}
-		}
-
-		/************************************************************************/
-		/* ת                                                                 */
-		/************************************************************************/
-		QQuaternion present_rotation(1, 0, 0, 0);
-		if (!channel.rotation_keys.empty()) 
-		{
-			int frame = 0;
-			while (frame < channel.rotation_keys.size() - 1) 
-			{
-				if (time_in_tick < channel.rotation_keys[frame+1].time)
-					break;
-				++frame;
-			}
-
-			// SLERP
-			unsigned int next_frame = (frame+1) % channel.rotation_keys.size();
-			const QuaternionKey& key = channel.rotation_keys[frame];
-			const QuaternionKey& next_key = channel.rotation_keys[next_frame];
-			double diff_time = next_key.time - key.time;
-			if (diff_time < 0)
-				diff_time += animation->ticks;
-			if (diff_time > 0) 
-			{
-				float factor =  static_cast<float>((time_in_tick - key.time) / diff_time);
-				present_rotation = QQuaternion::slerp(key.value, next_key.value, factor);
-			} 
-			else 
-			{
-				present_rotation = key.value;
-			}
-		}
-
-		/************************************************************************/
-		/*                                                                  */
-		/************************************************************************/
-		QVector3D present_scaling(1, 1, 1);
-		if (!channel.scaling_keys.empty()) 
-		{
-			int frame = 0;
-			while (frame < channel.scaling_keys.size() - 1) 
-			{
-				if (time_in_tick < channel.scaling_keys[frame+1].time)
-					break;
-				++frame;
-			}
-
-			present_scaling = channel.scaling_keys[frame].value;
-		}
+	pose_sampler_.sample(animation, time_in_tick, transforms_);
+	updatePose();
+}
 
-		/************************************************************************/
-		/* 任                                                          */
-		/************************************************************************/
-		// Matrix Pallette
-		QMatrix4x4& mat = transforms_[channel_index];
-		mat.setToIdentity();
-		mat.translate(present_position);
-		mat.rotate(present_rotation);
-		mat.scale(present_scaling);
-	}
+void Avatar::setPose( const QMatrix4x4* transforms, int channel_count )
+{
+	if (transforms_.size() != channel_count)
+		transforms_.resize(channel_count);
+	std::copy(transforms, transforms + channel_count, transforms_.begin());
+	updatePose();
+}
 
+void Avatar::updatePose()
+{
 	updateTransforms(root_, transforms_);
 	updateJointMatrices();
 	updateJointDualQuaternions();
@@ -1086,6 +939,13 @@ void Avatar::makeSkinCache()
 		new_skin.joint_indices_.resize(pMesh->mNumVertices);
 		new_skin.joint_weights_.resize(pMesh->mNumVertices);
 		new_skin.texid = pMesh->mMaterialIndex;
+		new_skin.position_buffer_ = nullptr;
+		new_skin.normal_buffer_ = nullptr;
+		new_skin.texcoords_buffer_ = nullptr;
+		new_skin.index_buffer_ = nullptr;
+		new_skin.joint_weights_buffer_ = nullptr;
+		new_skin.joint_indices_buffer_ = nullptr;
+		new_skin.vao_ = nullptr;
 
 		// ƤϢ
 		for (uint bone_index = 0; bone_index < pMesh->mNumBones; ++bone_index) 
@@ -1214,47 +1074,45 @@ void Avatar::createBoundings()
 	bounding_aabb_.pt_max = pt_max;
 }
 
- void Avatar::skinning()
- {
-	 //if (gpu_skinning_) 
-	 //{
-	 //    // transform feedback
-	 //}
-	// else 
-	 {
-		 for (auto skin_it = skins_.begin(); skin_it != skins_.end(); ++skin_it) 
-		 {
-			 for (int info_index = 0; info_index < skin_it->skininfo.size(); ++info_index) 
-			 {
-				 VertexInfo& info = skin_it->skininfo[info_index];
-				 QVector4D position;
-				 QVector4D normal;
- 
-				 for (auto jw_it = info.joint_weights.begin(); jw_it != info.joint_weights.end(); ++jw_it) 
-				 {
-					 Joint* joint = jw_it->first;
-					 float weight = jw_it->second;
- 
-					 QMatrix4x4 transform;
-					 transform = joint->global_transform * joint->inverse_bindpose_matrix;
-					 QVector4D pos(skin_it->bindpose_pos[info_index], 1.0);
-					 position += transform * pos * weight;
-					 // ߱任
-					 QVector4D norm(skin_it->bindpose_norm[info_index]);
-					 normal += transform * norm * weight;
-				 }
- 
-				 skin_it->positions[info_index].setX(position.x() * scale_factor_ + xtranslate_);
-				 skin_it->positions[info_index].setY(position.y() * scale_factor_ + ytranslate_);
-				 skin_it->positions[info_index].setZ(position.z() * scale_factor_ + ztranslate_);
- 
-				 skin_it->normals[info_index].setX(normal.x());
-				 skin_it->normals[info_index].setY(normal.y());
-				 skin_it->normals[info_index].setZ(normal.z());
-			 }
-		 }
-	 }
- }
+void Avatar::skinning(bool dual_quaternion)
+{
+	updateSkinningPalette();
+
+	SkinningKernel::Method method = dual_quaternion ? SkinningKernel::DQS : SkinningKernel::LBS;
+	QVector3D translate(xtranslate_, ytranslate_, ztranslate_);
+	for (auto skin_it = skins_.begin(); skin_it != skins_.end(); ++skin_it) 
+	{
+		skinning_kernel_.skin(method, skin_it->bindpose_pos.size(),
+			skin_it->bindpose_pos.constData(), skin_it->bindpose_norm.constData(),
+			skin_it->joint_indices_.constData(), skin_it->joint_weights_.constData(),
+			scale_factor_, translate,
+			skin_it->positions.data(), skin_it->normals.data(), nullptr);
+	}
+}
+
+void Avatar::skinningToSimulation(int skin_index, double* sim_positions, bool dual_quaternion)
+{
+	updateSkinningPalette();
+
+	const Skin& skin = skins_.at(skin_index);
+	SkinningKernel::Method method = dual_quaternion ? SkinningKernel::DQS : SkinningKernel::LBS;
+	skinning_kernel_.skin(method, skin.bindpose_pos.size(),
+		skin.bindpose_pos.constData(), skin.bindpose_norm.constData(),
+		skin.joint_indices_.constData(), skin.joint_weights_.constData(),
+		scale_factor_, QVector3D(xtranslate_, ytranslate_, ztranslate_),
+		nullptr, nullptr, sim_positions);
+}
+
+void Avatar::updateSkinningPalette()
+{
+	// ɫÿֻ̬һ updateAnimation()µĹؽھ
+	if (joint_matrices_.size() != joints_.size())
+	{
+		updateJointMatrices();
+		updateJointDualQuaternions();
+	}
+	skinning_kernel_.setPalette(joint_matrices_, joint_dual_quaternions_);
+}
 
 Joint* Avatar::finddJointByName( const QString& name ) const
 {
@@ -1414,6 +1272,9 @@ bool Avatar::bindposed() const
 
 void Avatar::updateSkinVBO()
 {
+	if (headless_)
+		return;
+
 	for (auto skin_it = skins_.begin(); skin_it != skins_.end(); ++skin_it) 
 	{
 		skin_it->position_buffer_->bind();
@@ -1462,6 +1323,9 @@ void Avatar::updateJointDualQuaternions()
 
 void Avatar::updateSkeletonVBO()
 {
+	if (headless_)
+		return;
+
 	// ¹ؽVBO
 	for(int joint_index = 0; joint_index < joints_.size(); ++joint_index)
 	{
@@ -1545,18 +1409,35 @@ bool Avatar::loadMH2CMUJointMap()
 	return true;
 }
 
-void Avatar::importMocap(QString& asf, QString& amc)
+bool Avatar::importMocap(QString& asf, QString& amc)
 {
-	asfamc_importer_->load(asf);
-	asfamc_importer_->loadMotion(amc);
-	addAnimation(asfamc_importer_->animation_);
+	MocapImporter* importer = nullptr;
+	if (asf.endsWith(".bvh", Qt::CaseInsensitive))
+	{
+		if (!bvh_importer_)
+			bvh_importer_ = new BVHImporter;
+		if (!bvh_importer_->load(asf))
+			return false;
+		importer = bvh_importer_;
+	}
+	else
+	{
+		if (!asfamc_importer_)
+			asfamc_importer_ = new ASFAMCImporter;
+		if (!asfamc_importer_->load(asf) || !asfamc_importer_->loadMotion(amc))
+			return false;
+		importer = asfamc_importer_;
+	}
+
 	// Ϊӿٶ ֱӽMakehuman-->CMU mocapĶͨӳ
 	mh2cmu_channel_map_.clear();
 	for (auto it = mh2cmu_joint_map_.begin(); it != mh2cmu_joint_map_.end(); ++it)
 	{
-		int cmu_channel_index = asfamc_importer_->name_id_[it.value()];
+		int cmu_channel_index = importer->jointIndex(it.value());
 		mh2cmu_channel_map_.insert(it.key(), cmu_channel_index);
 	}
+	addAnimation(importer->animation());
+	return true;
 }
 
 void Avatar::addAnimation(const Animation& anim)
@@ -1567,7 +1448,7 @@ void Avatar::addAnimation(const Animation& anim)
 
 	has_animations_ = true;
 	animations_.append(anim);
-	name_animation_.insert(asfamc_importer_->motion_name_, &animations_.back()); 
+	name_animation_.insert(anim.name, &animations_.back()); 
 }
 
 //---------------------------------------------------------------------------------------
@@ -1575,16 +1456,78 @@ void Avatar::addAnimation(const Animation& anim)
 MocapImporter::MocapImporter(void) :
 	frame_number_(0), 
 	frame_time_(0),
-	joint_count_(0)
+	joint_count_(0),
+	root_(nullptr)
 {
 }
 
 MocapImporter::~MocapImporter(void)
 {
+	MocapImporter::clear();
+}
+
+void MocapImporter::clear()
+{
+	name_id_.clear();
+	joints_.clear();
+	joint_names_.clear();
+	dofs_.clear();
+	delete root_; // ɾĳؽʱ ݹɾӹؽ
+	root_ = nullptr;
+	animation_.clear();
+	motion_name_ = "";
+	frame_number_ = 0;
+	frame_time_ = 0;
+	joint_count_ = 0;
+}
+
+int MocapImporter::findJoint(const char* name, int length, int hint) const
+{
+	if (hint >= 0 && hint < joint_names_.size() && 
+		joint_names_[hint].size() == length && memcmp(joint_names_[hint].constData(), name, length) == 0)
+	{
+		return hint;
+	}
+	for (int i = 0; i < joint_names_.size(); ++i)
+	{
+		if (joint_names_[i].size() == length && memcmp(joint_names_[i].constData(), name, length) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void MocapImporter::fillEmptyChannels()
+{
+	for (int i = 0; i < animation_.channels.size(); ++i)
+	{
+		AnimationChannel& channel = animation_.channels[i];
+		if (channel.position_keys.isEmpty())
+			appendMocapKeys(channel, MocapDofs(), nullptr, 0.0, joints_[i]->local_transform.column(3).toVector3D(), kASFSCALE);
+	}
 }
 
+// ɶ --> ͨ
+static bool parseDof(const char* token, int length, MocapDofs::Channel& channel)
+{
+	static const char* const kNames[] = { "tx", "ty", "tz", "rx", "ry", "rz" };
+	if (length != 2)
+		return false;
+	for (int i = 0; i < 6; ++i)
+	{
+		if (tolower(token[0]) == kNames[i][0] && tolower(token[1]) == kNames[i][1])
+		{
+			channel = static_cast<MocapDofs::Channel>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+static const uint kDofBits[] = { DOF_TX, DOF_TY, DOF_TZ, DOF_RX, DOF_RY, DOF_RZ };
+
 // Acclaim ASF/AMC importer
 ASFAMCImporter::ASFAMCImporter()
+	: amc_loaded_(false)
 {
 
 }
@@ -1597,267 +1540,499 @@ ASFAMCImporter::~ASFAMCImporter()
 bool ASFAMCImporter::load(QString& filename)
 {
 	clear();
-	QTextStream in(&filename, QIODevice::ReadOnly);
-
-	QString keyword;
-	QString junk;
-	double x, y, z, rx, ry, rz;
+	file_name_ = filename;
+	MocapTokenizer in;
+	if (!in.open(filename))
+		return false;
 
 	// create root
 	// Ĭroot order TX TY TZ RX RY RZ axis XYZ
 	root_ = new Joint("root");
+	root_->index = 0;
+	root_->dof = DOF_TR;
+	joints_.append(root_);
+	joint_names_.append("root");
+	dofs_.resize(1);
+	for (int c = MocapDofs::TX; c <= MocapDofs::RZ; ++c)
+		dofs_[0].append(static_cast<MocapDofs::Channel>(c));
 	name_id_["root"] = 0;
-	in >> keyword;
-	while (keyword != ":bonedata")
+
+	QVector<QVector3D> bone_vectors(1);	// * ӹؽԱؽڵƫ
+	QVector<QVector3D> axes(1);			// ؽھֲ XYZ˳ŷ
+	QVector3D root_position;
+
+	enum { SECTION_OTHER, SECTION_ROOT, SECTION_BONEDATA, SECTION_HIERARCHY } section = SECTION_OTHER;
+	const char* token;
+	int length;
+	while (in.next(token, length))
 	{
-		if (keyword == "position")
-		{  
-			in >> x >> y >> z;
-			root_->local_transform.translate(x, y, z);
-		}
-		else if (keyword == "orientation")
+		if (token[0] == ':')
 		{
-			in >> rx >> ry >> rz; 
-			root_->local_transform.rotate(rx, 1.0, 0.0, 0.0);
-			root_->local_transform.rotate(ry, 0.0, 1.0, 0.0);
-			root_->local_transform.rotate(rz, 0.0, 0.0, 1.0);
+			if (MocapTokenizer::equals(token, length, ":root"))
+				section = SECTION_ROOT;
+			else if (MocapTokenizer::equals(token, length, ":bonedata"))
+				section = SECTION_BONEDATA;
+			else if (MocapTokenizer::equals(token, length, ":hierarchy"))
+				section = SECTION_HIERARCHY;
+			else
+				section = SECTION_OTHER;
+			continue;
 		}
-	}
-	joints_.append(root_);
 
-	// parse the other joints
-	in >> keyword;
-	while (!in.atEnd() && keyword != ":hierarchy")
-	{
-		in >> keyword;
-		if (keyword == "begin")
+		if (section == SECTION_ROOT)
 		{
-			Joint* new_joint = new Joint("foo");
-
-			in >> keyword;
-			while (keyword != "end")
+			if (MocapTokenizer::equals(token, length, "order"))
 			{
-				in >> keyword;
-				if (keyword == "id")
+				dofs_[0] = MocapDofs();
+				MocapDofs::Channel channel;
+				while (in.nextInLine(token, length))
 				{
-					in >> new_joint->index;
+					if (parseDof(token, length, channel))
+						dofs_[0].append(channel);
 				}
-				else if (keyword == "name")
+			}
+			else if (MocapTokenizer::equals(token, length, "position"))
+			{
+				root_position[0] = in.nextDouble();
+				root_position[1] = in.nextDouble();
+				root_position[2] = in.nextDouble();
+			}
+			else if (MocapTokenizer::equals(token, length, "orientation"))
+			{
+				axes[0][0] = in.nextDouble();
+				axes[0][1] = in.nextDouble();
+				axes[0][2] = in.nextDouble();
+			}
+			else
+			{
+				in.skipLine(); // axis XYZ
+			}
+		}
+		else if (section == SECTION_BONEDATA && MocapTokenizer::equals(token, length, "begin"))
+		{
+			// һؽ ֱend
+			Joint* new_joint = new Joint("foo");
+			new_joint->index = joints_.size();
+			new_joint->parent = root_;	// ݹڸؽ hierarchyʱٵ ʱؽһɾ
+			root_->children.append(new_joint);
+			joints_.append(new_joint);
+			joint_names_.append(QByteArray());
+			dofs_.append(MocapDofs());
+			axes.append(QVector3D());
+			MocapDofs& dofs = dofs_.back();
+
+			QVector3D direction;
+			double bone_length = 0.0;
+			while (in.next(token, length) && !MocapTokenizer::equals(token, length, "end"))
+			{
+				if (MocapTokenizer::equals(token, length, "name") && in.next(token, length))
 				{
-					in >> new_joint->name;
+					joint_names_.back() = QByteArray(token, length);
+					new_joint->name = QString::fromLatin1(token, length);
 					name_id_[new_joint->name] = new_joint->index;
 				}
-				else if (keyword == "direction")
+				else if (MocapTokenizer::equals(token, length, "direction"))
 				{
-					in >> x >> y >> z;
-					new_joint->local_transform.translate(x, y, z);
-					new_joint->local_transform.translate(x, y, z);
-					new_joint->local_transform.translate(x, y, z);
+					direction[0] = in.nextDouble();
+					direction[1] = in.nextDouble();
+					direction[2] = in.nextDouble();
 				}
-				else if (keyword == "length")
+				else if (MocapTokenizer::equals(token, length, "length"))
 				{
-					//in >> new_joint->length;
+					bone_length = in.nextDouble();
 				}
-				else if (keyword == "axis")
+				else if (MocapTokenizer::equals(token, length, "axis"))
 				{
-					in >> x >> y >> z >> junk;
-					new_joint->local_transform.rotate(rx, 1.0, 0.0, 0.0);
-					new_joint->local_transform.rotate(ry, 0.0, 1.0, 0.0);
-					new_joint->local_transform.rotate(rz, 0.0, 0.0, 1.0);
+					axes.back()[0] = in.nextDouble();
+					axes.back()[1] = in.nextDouble();
+					axes.back()[2] = in.nextDouble();
+					in.skipLine(); // XYZ
 				}
-				else if (keyword == "dof")
+				else if (MocapTokenizer::equals(token, length, "dof"))
 				{
-					QString freedom;
-					int dof_count = 0;
-					bool rx = false, ry = false, rz = false;
-					in >> freedom;
-					while (freedom != "limits")
+					MocapDofs::Channel channel;
+					while (in.nextInLine(token, length))
 					{
-						if (freedom == "rx")
-						{
-							rx = true;
-							++dof_count;
-							new_joint->dof += DOF_RX;
-						}
-						else if (freedom == "ry")
-						{
-							ry = true;
-							++dof_count;
-							new_joint->dof += DOF_RY;
-						}
-						else if (freedom == "rz")
+						if (parseDof(token, length, channel))
 						{
-							rz = true;
-							++dof_count;
-							new_joint->dof += DOF_RZ;
+							dofs.append(channel);
+							new_joint->dof |= kDofBits[channel];
 						}
 					}
-
-					// read limits
-					QString s1, s2;
-					while (dof_count--)
+				}
+				else if (MocapTokenizer::equals(token, length, "limits"))
+				{
+					// ÿɶһ ˳ͬdof
+					for (int i = 0; i < dofs.count; ++i)
 					{
-						in >> s1 >> s2;
-						s1.remove(QChar('(')); // eliminate "("
-						s2.remove(QChar(')')); // eliminate ")"
-						double start = s1.toDouble();
-						double end = s2.toDouble();
-						if (rx)
+						double start = in.nextDouble();
+						double end = in.nextDouble();
+						switch (dofs.order[i])
 						{
+						case MocapDofs::RX:
 							new_joint->min_rx = start;
 							new_joint->max_rx = end;
-						}
-						else if (ry)
-						{
+							break;
+						case MocapDofs::RY:
 							new_joint->min_ry = start;
 							new_joint->max_ry = end;
-						}
-						else if (rz)
-						{
+							break;
+						case MocapDofs::RZ:
 							new_joint->min_rz = start;
 							new_joint->max_rz = end;
+							break;
+						default:
+							break;
 						}
 					}
 				}
+				else
+				{
+					in.skipLine(); // id õ
+				}
+			}
+			bone_vectors.append(direction * bone_length * kASFSCALE);
+		}
+		else if (section == SECTION_HIERARCHY && MocapTokenizer::equals(token, length, "begin"))
+		{
+			// ÿ: ؽ ӹؽ...
+			in.skipLine();
+			while (in.next(token, length) && !MocapTokenizer::equals(token, length, "end"))
+			{
+				int parent_index = findJoint(token, length, -1);
+				if (parent_index < 0)
+				{
+					clear();
+					return false;
+				}
+				Joint* parent = joints_[parent_index];
+				while (in.nextInLine(token, length))
+				{
+					int child_index = findJoint(token, length, -1);
+					if (child_index <= 0)
+					{
+						clear();
+						return false;
+					}
+					Joint* child = joints_[child_index];
+					child->parent->children.remove(child->parent->children.indexOf(child));
+					parent->children.append(child);
+					child->parent = parent;
+				}
 			}
+			section = SECTION_OTHER;
 		}
 	}
 
-	// parse hierarchy
-	in >> keyword; // this keyword should be "begin"
-	Q_ASSERT(keyword == "begin");
-	while (!in.atEnd() && keyword != "end")
+	if (in.failed())
 	{
-		QString link;
-		in.readLine();
-		QStringList joints = link.split(" ", QString::SkipEmptyParts);
-		int parent_index = name_id_.find(joints[0]).value();
-		Joint* parent = joints_[parent_index];
-		for (int i = 1; i < joints.size(); ++i)
-		{
-			int child_index = name_id_.find(joints[i]).value();
-			Joint* child = joints_[child_index];
-			parent->children.append(child);
-			child->parent = parent;
-		}
+		clear();
+		return false;
 	}
 
-	// build channels
+	// ֲ任: ƽƵĩ תؽ
 	for (int i = 0; i < joints_.size(); ++i)
 	{
-		channels_.append(AnimationChannel(joints_[i]));
+		Joint* joint = joints_[i];
+		QMatrix4x4& local = joint->local_transform;
+		local.setToIdentity();
+		local.translate(i == 0 ? root_position * kASFSCALE : bone_vectors[joint->parent->index]);
+		local.rotate(axes[i][0], 1.0, 0.0, 0.0);
+		local.rotate(axes[i][1], 0.0, 1.0, 0.0);
+		local.rotate(axes[i][2], 0.0, 0.0, 1.0);
 	}
-
+	joint_count_ = joints_.size();
 	return true;
 }
 
 bool ASFAMCImporter::loadMotion(QString& filename)
 {
+	if (joints_.isEmpty())
+		return false;
+
+	animation_.clear();
 	motion_name_ = filename;
-	QTextStream in(&filename, QIODevice::ReadOnly);
+	amc_loaded_ = MocapClipCache::load(filename, joints_, dofs_, animation_, frame_number_, frame_time_);
+	if (!amc_loaded_)
+	{
+		amc_loaded_ = parseMotion(filename);
+		if (amc_loaded_)
+			MocapClipCache::save(filename, dofs_, animation_, frame_number_, frame_time_);
+	}
+	animation_.name = motion_name_;
+	return amc_loaded_;
+}
+
+bool ASFAMCImporter::parseMotion(const QString& filename)
+{
+	MocapTokenizer in;
+	if (!in.open(filename))
+		return false;
 
-	QString str;
-	double x, y, z, rx, ry, rz;
-	x = y = z = rx = ry = rz = 0;
-	// ignore comments
-	str = in.readLine();
-	while (str.startsWith(QChar('#')) || str.startsWith(QChar(':')))
+	// ֡Ŷռһ ݴԤͨؼ֡ռ ʱ
+	const int frame_estimate = in.countLinesStartingWithDigit();
+	ChannelList& channels = animation_.channels;
+	channels.resize(joints_.size());
+	QVector<QVector3D> offsets(joints_.size());
+	for (int i = 0; i < joints_.size(); ++i)
 	{
-		in.readLine();
+		channels[i].joint = joints_[i];
+		offsets[i] = joints_[i]->local_transform.column(3).toVector3D();
+		if (dofs_[i].count > 0)
+		{
+			channels[i].position_keys.reserve(frame_estimate);
+			channels[i].rotation_keys.reserve(frame_estimate);
+			channels[i].scaling_keys.reserve(frame_estimate);
+		}
 	}
-	// should be reading frame 1 now
-	int next_frame_number = 2;
-	in >> str;
-	while (str != QString::number(next_frame_number))
+
+	// ÿ֡ؽе˳ͬ ÿؽ֮Ĺؽ ʱ
+	const int frame_start = joints_.size();
+	QVector<int> successors(joints_.size() + 1, 0);
+	int previous = frame_start;
+
+	double values[6];
+	double time = 0.0;
+	uint frame_count = 0;
+	const char* token;
+	int length;
+	while (in.next(token, length))
 	{
-		int joint_index = name_id_.find(str).value();
-		int dof = joints_[joint_index]->dof;
-		switch (dof)
+		if (token[0] == '#' || token[0] == ':')
 		{
-		case DOF_NONE:
-			break;
-		case DOF_RXY:
-			in >> rx >> ry;
-			break;
-		case DOF_RYZ:
-			in >> ry >> rz;
-			break;
-		case DOF_RXZ:
-			in >> rx >> rz;
-			break;
-		case DOF_R:
-			in >> rx >> ry >> rz;
-			break; 
-		case DOF_TX:
-			in >> x;
-			break;
-		case DOF_TY:
-			in >> y;
-			break;
-		case DOF_TZ:
-			in >> z;
-			break;
-		case DOF_RX:
-			in >> rx;
-			break;
-		case DOF_RY:
-			in >> ry;
-			break;
-		case DOF_RZ:
-			in >> rz;
-			break;
-		case DOF_TXY:
-			in >> x >> y;
-			break;
-		case DOF_TYZ:
-			in >> y >> z;
-			break;
-		case DOF_TXZ:
-			in >> x >> z;
-			break;
-		case DOF_T:
-			in >> x >> y >> z;
-			break;
-		case DOF_TR:
-			break;
-		default:
-			break;
+			in.skipLine(); // ע :FULLY-SPECIFIED :DEGREES
+			continue;
+		}
+		if (token[0] >= '0' && token[0] <= '9')
+		{
+			int frame = 0;
+			for (int i = 0; i < length && token[i] >= '0' && token[i] <= '9'; ++i)
+				frame = frame * 10 + (token[i] - '0');
+			time = (frame - 1) * AnimationClip::SAMPLE_SLICE;
+			previous = frame_start;
+			++frame_count;
+			continue;
 		}
 
-		animation_.channels = channels_;
-		animation_.name = motion_name_;
-		VectorKey pk;
-		pk.time = (next_frame_number-1) * AnimationClip::SAMPLE_SLICE;
-		pk.value = QVector3D(x, y, z);
+		int joint_index = frame_count ? findJoint(token, length, successors[previous]) : -1;
+		if (joint_index < 0)
+		{
+			in.skipLine();
+			continue;
+		}
+		successors[previous] = joint_index;
+		previous = joint_index;
 
-		QuaternionKey qk;
-		qk.time = pk.time;
-		QQuaternion qkx = QQuaternion::fromAxisAndAngle(1.0, 0.0, 0.0, rx);
-		QQuaternion qky = QQuaternion::fromAxisAndAngle(0.0, 1.0, 0.0, ry);
-		QQuaternion qkz = QQuaternion::fromAxisAndAngle(0.0, 0.0, 1.0, rz);
-		qk.value = qkx * qky * qkz;
+		const MocapDofs& dofs = dofs_[joint_index];
+		for (int i = 0; i < dofs.count; ++i)
+			values[i] = in.nextDouble();
+		appendMocapKeys(channels[joint_index], dofs, values, time, offsets[joint_index], kASFSCALE);
+	}
+	if (in.failed() || frame_count == 0)
+	{
+		animation_.clear();
+		return false;
+	}
 
-		VectorKey sk;
-		sk.time = pk.time;
-		sk.value = QVector3D(kASFSCALE, kASFSCALE, kASFSCALE);
+	frame_number_ = frame_count;
+	frame_time_ = AnimationClip::SAMPLE_SLICE * 0.001;
+	animation_.ticks_per_second = 1000.0; // ؼ֡ʱ䵥λΪ
+	animation_.ticks = time;
+	fillEmptyChannels();
+	return true;
+}
 
-		animation_.channels[joint_index].position_keys.append(pk);
-		animation_.channels[joint_index].rotation_keys.append(qk);
-		animation_.channels[joint_index].scaling_keys.append(sk);
+void ASFAMCImporter::clear()
+{
+	MocapImporter::clear();
+	amc_loaded_ = false;
+}
 
-		++next_frame_number;
+// Biovision BVH importer
+// CMUתBVH(MotionBuilder)ؽ --> ASFؽ Ա㹲makehuman --> cmuؽӳ
+static const char* const kBVHToCMUJoints[][2] = {
+	{ "Hips", "root" },
+	{ "LHipJoint", "lhipjoint" }, { "RHipJoint", "rhipjoint" },
+	{ "LowerBack", "lowerback" }, { "Spine", "upperback" }, { "Spine1", "thorax" },
+	{ "Neck", "lowerneck" }, { "Neck1", "upperneck" }, { "Head", "head" },
+	{ "LeftShoulder", "lclavicle" }, { "LeftArm", "lhumerus" }, { "LeftForeArm", "lradius" },
+	{ "LeftHand", "lwrist" }, { "LeftFingerBase", "lhand" }, { "LeftHandIndex1", "lfingers" }, { "LThumb", "lthumb" },
+	{ "RightShoulder", "rclavicle" }, { "RightArm", "rhumerus" }, { "RightForeArm", "rradius" },
+	{ "RightHand", "rwrist" }, { "RightFingerBase", "rhand" }, { "RightHandIndex1", "rfingers" }, { "RThumb", "rthumb" },
+	{ "LeftUpLeg", "lfemur" }, { "LeftLeg", "ltibia" }, { "LeftFoot", "lfoot" }, { "LeftToeBase", "ltoes" },
+	{ "RightUpLeg", "rfemur" }, { "RightLeg", "rtibia" }, { "RightFoot", "rfoot" }, { "RightToeBase", "rtoes" }
+};
+
+BVHImporter::BVHImporter()
+{
+}
+
+BVHImporter::~BVHImporter()
+{
+}
+
+bool BVHImporter::load(QString& filename)
+{
+	clear();
+	file_name_ = filename;
+	MocapTokenizer in;
+	if (!in.open(filename) || !in.nextIs("HIERARCHY") || !in.nextIs("ROOT") || !parseJoint(in, nullptr) || !in.nextIs("MOTION"))
+	{
+		clear();
+		return false;
 	}
-	amc_loaded_ = true;
-	return amc_loaded_;
+	joint_count_ = joints_.size();
+
+	motion_name_ = filename;
+	bool loaded = MocapClipCache::load(filename, joints_, dofs_, animation_, frame_number_, frame_time_);
+	if (!loaded)
+	{
+		loaded = parseMotion(in);
+		if (loaded)
+			MocapClipCache::save(filename, dofs_, animation_, frame_number_, frame_time_);
+	}
+	if (!loaded)
+	{
+		clear();
+		return false;
+	}
+	animation_.name = motion_name_;
+	return true;
 }
 
-void ASFAMCImporter::clear()
+// ѶROOT/JOINT Žؽ{}
+bool BVHImporter::parseJoint(MocapTokenizer& in, Joint* parent)
 {
-	name_id_.clear();
-	joints_.clear();
-	delete root_; // ɾĳؽʱ ݹɾӹؽ
-	channels_.clear();
-	animation_.clear();
-	motion_name_ = "";
-	amc_loaded_ = false;
+	const char* token;
+	int length;
+	if (!in.next(token, length))
+		return false;
+
+	const QByteArray name(token, length);
+	Joint* joint = new Joint(name.constData());
+	joint->index = joints_.size();
+	joint->parent = parent;
+	if (parent)
+		parent->children.append(joint);
+	else
+		root_ = joint;
+	joints_.append(joint);
+	joint_names_.append(name);
+	dofs_.append(MocapDofs());
+	name_id_[joint->name] = joint->index;
+	for (size_t i = 0; i < sizeof(kBVHToCMUJoints) / sizeof(kBVHToCMUJoints[0]); ++i)
+	{
+		if (name == kBVHToCMUJoints[i][0])
+			name_id_.insert(kBVHToCMUJoints[i][1], joint->index);
+	}
+
+	if (!in.nextIs("{"))
+		return false;
+	while (in.next(token, length))
+	{
+		if (MocapTokenizer::equals(token, length, "}"))
+			return !in.failed();
+
+		if (MocapTokenizer::equals(token, length, "OFFSET"))
+		{
+			double x = in.nextDouble();
+			double y = in.nextDouble();
+			double z = in.nextDouble();
+			joint->local_transform.setToIdentity();
+			joint->local_transform.translate(QVector3D(x, y, z) * kASFSCALE);
+		}
+		else if (MocapTokenizer::equals(token, length, "CHANNELS"))
+		{
+			// Xposition Yposition Zposition Xrotation Yrotation Zrotation ˳
+			MocapDofs& dofs = dofs_[joint->index];
+			int count = in.nextInt();
+			for (int i = 0; i < count; ++i)
+			{
+				if (!in.next(token, length) || length != 9)
+					return false;
+				int axis = token[0] - 'X';
+				bool rotation = MocapTokenizer::equals(token + 1, length - 1, "rotation");
+				if (axis < 0 || axis > 2 || (!rotation && !MocapTokenizer::equals(token + 1, length - 1, "position")))
+					return false;
+				MocapDofs::Channel channel = static_cast<MocapDofs::Channel>((rotation ? MocapDofs::RX : MocapDofs::TX) + axis);
+				dofs.append(channel);
+				joint->dof |= kDofBits[channel];
+			}
+		}
+		else if (MocapTokenizer::equals(token, length, "JOINT"))
+		{
+			if (!parseJoint(in, joint))
+				return false;
+		}
+		else if (MocapTokenizer::equals(token, length, "End"))
+		{
+			// End Siteֻĩƫ ûͨ ؽ
+			if (!in.nextIs("Site") || !in.nextIs("{") || !in.nextIs("OFFSET"))
+				return false;
+			in.nextDouble();
+			in.nextDouble();
+			in.nextDouble();
+			if (!in.nextIs("}"))
+				return false;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return false;
+}
+
+// ѶMOTION ÿ֡һ ؽڳ˳иֵͨ
+bool BVHImporter::parseMotion(MocapTokenizer& in)
+{
+	if (!in.nextIs("Frames:"))
+		return false;
+	const int frame_count = in.nextInt();
+	if (!in.nextIs("Frame") || !in.nextIs("Time:"))
+		return false;
+	const double frame_time = in.nextDouble();
+	if (in.failed() || frame_count <= 0 || frame_time <= 0.0)
+		return false;
+
+	ChannelList& channels = animation_.channels;
+	channels.resize(joints_.size());
+	QVector<QVector3D> offsets(joints_.size());
+	for (int i = 0; i < joints_.size(); ++i)
+	{
+		channels[i].joint = joints_[i];
+		offsets[i] = joints_[i]->local_transform.column(3).toVector3D();
+		if (dofs_[i].count > 0)
+		{
+			channels[i].position_keys.reserve(frame_count);
+			channels[i].rotation_keys.reserve(frame_count);
+			channels[i].scaling_keys.reserve(frame_count);
+		}
+	}
+
+	double values[6];
+	for (int frame = 0; frame < frame_count; ++frame)
+	{
+		const double time = frame * frame_time * 1000.0;
+		for (int i = 0; i < joints_.size(); ++i)
+		{
+			const MocapDofs& dofs = dofs_[i];
+			for (int c = 0; c < dofs.count; ++c)
+				values[c] = in.nextDouble();
+			if (dofs.count > 0)
+				appendMocapKeys(channels[i], dofs, values, time, offsets[i], kASFSCALE);
+		}
+		if (in.failed())
+		{
+			animation_.clear();
+			return false;
+		}
+	}
+
+	frame_number_ = frame_count;
+	frame_time_ = frame_time;
+	animation_.ticks_per_second = 1000.0; // ؼ֡ʱ䵥λΪ
+	animation_.ticks = (frame_count - 1) * frame_time * 1000.0;
+	fillEmptyChannels();
+	return true;
 }
\ No newline at end of file
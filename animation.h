@@ -23,6 +23,9 @@
 #include "material.h"
 #include "bounding_volume.h"
 #include "scene_node.h"
+#include "skinning.h"
+#include "pose_sampler.h"
+#include "mocap_parser.h"
 
 // ɶ
 #define DOF_NONE 0
@@ -238,7 +241,6 @@ public:
 
 	Animation(const aiAnimation* pAnimation, Avatar* luke);	// ¬ˣʹԭ ע;ͲȤô
 
-	void addKeyframes(const ChannelList& cl, int start_time, int length, double ticks_per_sec, double play_speed, double weight);	// ӹؼ֡ ʼʱ䣺λ
     void clear();   // 
 
 	const aiAnimation*	ai_anim;	// ԭʼASSIMP	
@@ -280,6 +282,7 @@ public:
     int startTime() const;
     int length() const;
     int endTime() const;
+    const Animation* animation() const;
     const ChannelList& channelList() const;
     double ticksPerSecond() const;
     qreal delta() const;
@@ -420,11 +423,28 @@ public:
     double frameTime() const { return frame_time_; }
     uint jointCount() const { return joint_count_; }
 
+    const Animation& animation() const { return animation_; }
+    const QString& motionName() const { return motion_name_; }
+    int jointIndex(const QString& name) const { return name_id_.value(name, -1); } // ޴˹ؽʱ-1
+
 protected:
+    virtual void clear();
+    int findJoint(const char* name, int length, int hint) const; // Ʋؽ hint
+    void fillEmptyChannels(); // δֵĹؽڲһ̬ؼ֡ ʱԽ
+
     QString file_name_;
     uint frame_number_;
     double frame_time_;
     uint joint_count_;
+
+    QVector<Joint*> joints_;        // id ͨ
+    QVector<QByteArray> joint_names_; // joints_Ӧ ʱȥQString
+    QVector<MocapDofs> dofs_;       // joints_Ӧ
+    Joint* root_;
+
+    QMap<QString, int> name_id_; // joint name to id
+    QString motion_name_;
+    Animation animation_;
 };
 
 const float kASFSCALE = 1.0f;
@@ -433,25 +453,34 @@ const float kASFSCALE = 1.0f;
 /************************************************************************/
 class ASFAMCImporter : public MocapImporter
 {
-    friend class Avatar;
 public:
     ASFAMCImporter();
     ~ASFAMCImporter();
 
     virtual bool load(QString& filename); // ASFļ
-    bool loadMotion(QString& filename); // AMCļ
+    bool loadMotion(QString& filename); // AMCļ ȶȡƻ
 
 private:
-    void clear();
+    virtual void clear();
+    bool parseMotion(const QString& filename);
 
-    QVector<Joint*> joints_;
-    Joint* root_;
-
-    QMap<QString, int> name_id_; // joint name to id
     bool amc_loaded_;
-    QString motion_name_;
-    ChannelList channels_; 
-    Animation animation_;
+};
+
+/************************************************************************/
+/* Biovision BVH ʽݵ                                      */
+/************************************************************************/
+class BVHImporter : public MocapImporter
+{
+public:
+    BVHImporter();
+    ~BVHImporter();
+
+    virtual bool load(QString& filename); // عǼ붯 ȶȡƻ
+
+private:
+    bool parseJoint(MocapTokenizer& in, Joint* parent);
+    bool parseMotion(MocapTokenizer& in);
 };
 // aiNode-joint ӳ
 typedef QMap<const aiNode*, Joint*> NodeToJointMap;
@@ -475,13 +504,18 @@ class Scene;
 class Avatar : public SceneNode
 {
 	friend Scene;
+	friend class BatchSimulator;
+	friend class ObstacleBake;
 public:
-	Avatar(const aiScene* pScene, const QString& filename);
+	Avatar(const aiScene* pScene, const QString& filename, bool headless = false); // headless: OpenGL VBO ģ
 	~Avatar();
 
 	Joint* finddJointByName(const QString& name) const;
 	void updateAnimation(const Animation* animation, int elapsed_time);
-	void skinning();	     //ѷϳ ĿǰȫGPUƤ                                       
+	void setPose(const QMatrix4x4* transforms, int channel_count);	// ֱʹԤȲĸֲͨ任 PoseSampler::sampleRange
+	void skinning(bool dual_quaternion = false); // CPUƤ ʾõpositions/normals
+	// ֻƤλ(ƽ ÿxyz) ֱдⲿ ģϰؼ̬ ζԤȺ決ObstacleBake
+	void skinningToSimulation(int skin_index, double* sim_positions, bool dual_quaternion = false);
 
 	bool hasAnimations() const;
 	bool hasMaterials() const;
@@ -493,7 +527,7 @@ public:
 	bool bindposed() const;
 	void setBindposed(bool val);
 
-    void importMocap(QString& asf, QString& amc);
+    bool importMocap(QString& asf, QString& amc); // asfΪ.bvhļʱamc
     void addAnimation(const Animation& anim);
     //void addAnimations(const AnimList& anims);
 
@@ -505,6 +539,8 @@ private:
 	void updateTransforms(Joint* pJoint, const QVector<QMatrix4x4>& vTransforms);	// Ըؽʵʩ任
 	void updateJointMatrices();                                                     // matrix palette
     void updateJointDualQuaternions();                                              // ˫Ԫ
+	void updateSkinningPalette();                                                   // ɹؽھ˫ԪCPUƤɫ
+	void updatePose();                                                              // ɸֲͨ任¹ؽ matrix palette ˫Ԫ
     void updateSkeletonVBO();                                                       // ¹ؽں͹VBO
 	void makeAnimationCache();														// ASSIMPصĶ	
 	void makeSkinCache();															// Ƥ	
@@ -524,6 +560,8 @@ private:
 	QVector<QMatrix4x4>		transforms_;    // ؽڵľֲ任
 	QVector<QMatrix4x4>		joint_matrices_;// matrix palette(ؽȫֱ任 * ̬)
     QVector<QVector4D>      joint_dual_quaternions_;    // ˫Ԫ
+    SkinningKernel          skinning_kernel_;           // CPUƤ
+    PoseSampler             pose_sampler_;              // ؼ֡α
 	SkinList				skins_;			// Ƥ
 
     QVector<Bone*>              bones_;
@@ -540,6 +578,7 @@ private:
 	bool    has_animations_;// Ƿж
 	//bool    gpu_skinning_;  // ǷGPUƤ ѷϳ ʼղGPUƤ
 	bool    bindposed_;     // Ƿڰ̬
+	bool    headless_;      // ǷOpenGL
 	QString	file_dir_;		// ģļĿ¼
 
 	//std::vector<std::tuple<uint, uint, uint> > last_playheads_;	// ¼һβŵĹؼ֡λ
@@ -560,6 +599,7 @@ private:
     QMap<QString, QString>  mh2cmu_joint_map_;  // makehuman --> cmu mocapؽӳ
     QMap<QString, int>      mh2cmu_channel_map_;
     ASFAMCImporter*         asfamc_importer_;
+    BVHImporter*            bvh_importer_;
 
 	// ӵģλݣ㷨ҪضģģԼԭλ
 	double scale_factor_;
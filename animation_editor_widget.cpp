@@ -1,10 +1,12 @@
 #include "animation_editor_widget.h"
 
 #include <algorithm>
+#include <limits>
 
 #include <QtGui>
 #include <QGraphicsSceneDragDropEvent>
 #include <QApplication>
+#include <QVarLengthArray>
 #include <QtWidgets/QtWidgets>
 
 #include <qcustomplot.h>
@@ -258,51 +260,305 @@ void AnimationTrackScene::setNameAnimationMap(NameToAnimMap* name_anim)
     name_animation_ = name_anim;
 }
 
-void AnimationTrackScene::updateSyntheticAnim(float play_speed/* = 1.0f*/)
+// ϳɶһؼ֡ɸƬεĹؼ֡ʱ鲢
+// ׸ؼ֡ǵڶؼ֡0ʱ̵ĸ
+template <typename Key>
+struct KeySource
 {
-    synthetic_animation_->clear();
-    foreach(AnimationTrack* track, tracks_) 
+    const QVector<Key>* keys;   // ԭʼͨĹؼ֡ Ѱʱ
+    double offset;              // Ƭʼʱ λ
+    double weight;
+};
+
+template <typename Key>
+struct KeyTimeBefore    // ƽƺĹؼ֡ʱtime
+{
+    double offset;
+    bool operator()(const Key& key, double time) const { return key.time + offset < time; }
+};
+
+template <typename Key>
+struct KeyTimeAfter     // ƽƺĹؼ֡ʱtime
+{
+    double offset;
+    bool operator()(double time, const Key& key) const { return time < key.time + offset; }
+};
+
+// ɾȥ[from, to]ڵĹؼ֡ ٰѸԴʱڵĹؼ֡鲢 ؼֲ֡
+template <typename Key>
+static void remergeKeys(QVector<Key>& keys, const KeySource<Key>* sources, int source_count, double from, double to)
+{
+    QVarLengthArray<const Key*, 8> cur(source_count), last(source_count);
+    int total = 0;
+    for (int s = 0; s < source_count; ++s)
     {
-        if (!track->isEmpty()) 
+        const Key* first = sources[s].keys->constData();
+        const Key* end = first + sources[s].keys->size();
+        KeyTimeBefore<Key> before = { sources[s].offset };
+        KeyTimeAfter<Key> after = { sources[s].offset };
+        cur[s] = std::lower_bound(first, end, from, before);
+        last[s] = std::upper_bound(cur[s], end, to, after);
+        total += static_cast<int>(last[s] - cur[s]);
+    }
+
+    // Դڲ ÿȡʱ ͬһʱ̰ Ƭ˳
+    QVector<Key> merged;
+    merged.reserve(total);
+    for (;;)
+    {
+        int best = -1;
+        double best_time = 0.0;
+        for (int s = 0; s < source_count; ++s)
         {
-            foreach(AnimationClip* clip, track->clips_)
+            if (cur[s] == last[s])
+                continue;
+            double time = cur[s]->time + sources[s].offset;
+            if (best < 0 || time < best_time)
             {
-                 synthetic_animation_->addKeyframes(clip->channelList(), 
-                     clip->startTime(), 
-                     clip->length(), 
-                     clip->ticksPerSecond(),
-                     play_speed, 
-                     track->weight_);
+                best = s;
+                best_time = time;
             }
         }
+        if (best < 0)
+            break;
+
+        Key key = *cur[best]++;
+        key.time = best_time;
+        key.value *= sources[best].weight;
+        merged.append(key);
     }
-    // ʱ˳йؼ֡ ֡
-    for(AnimationChannel& channel : synthetic_animation_->channels)
-    {  
-        if (!channel.position_keys.isEmpty())
+
+    if (keys.isEmpty())
+    {
+        if (!merged.isEmpty())
         {
-            qSort(channel.position_keys.begin(), channel.position_keys.end(), vecKeyCmp);
-            channel.position_keys.prepend(channel.position_keys[0]);
-            channel.position_keys[0].time = 0;
-        }       
+            keys.reserve(merged.size() + 1);
+            keys.append(merged.first());
+            keys[0].time = 0;
+            keys += merged;
+        }
+        return;
+    }
 
-        if (!channel.rotation_keys.isEmpty())
+    // ԭеιؼ֡(0ʱ̸)
+    Key* first = keys.data() + 1;
+    Key* end = keys.data() + keys.size();
+    KeyTimeBefore<Key> before = { 0.0 };
+    KeyTimeAfter<Key> after = { 0.0 };
+    Key* lo = std::lower_bound(first, end, from, before);
+    Key* hi = std::upper_bound(lo, end, to, after);
+    const int lo_index = static_cast<int>(lo - keys.data());
+    const int hi_index = static_cast<int>(hi - keys.data());
+
+    const int delta = merged.size() - (hi_index - lo_index);
+    if (delta > 0)
+        keys.insert(hi_index, delta, Key());
+    else if (delta < 0)
+        keys.remove(lo_index, -delta);
+    std::copy(merged.constBegin(), merged.constEnd(), keys.begin() + lo_index);
+
+    // ˢ0ʱ̸
+    if (keys.size() > 1)
+    {
+        keys[0] = keys[1];
+        keys[0].time = 0;
+    }
+    else
+    {
+        keys.clear();
+    }
+}
+
+void AnimationTrackScene::updateSyntheticAnim(float play_speed/* = 1.0f*/)
+{
+    Q_UNUSED(play_speed);
+
+    // ȡһƬε
+    double ticks_per_second = synthetic_animation_->ticks_per_second;
+    QVector<const AnimationClip*> clips;
+    QVector<ClipSource> sources;
+    foreach(AnimationTrack* track, tracks_) 
+    {
+        foreach(AnimationClip* clip, track->clips_)
         {
-            qSort(channel.rotation_keys.begin(), channel.rotation_keys.end(), quatKeyCmp);
-            channel.rotation_keys.prepend(channel.rotation_keys[0]);
-            channel.rotation_keys[0].time = 0;
-        }       
+            ClipSource source;
+            source.animation = clip->animation();
+            source.weight = track->weight_;
+            clips.append(clip);
+            sources.append(source);
+            ticks_per_second = clip->ticksPerSecond();
+        }
+    }
+
+    if (clips.isEmpty())
+    {
+        synthetic_animation_->clear();
+        clip_sources_.clear();
+        source_order_.clear();
+        source_channels_.clear();
+        synthetic_channel_ids_.clear();
+        emit syntheticAnimationUpdated();
+        return;
+    }
+
+    // ϳɶͨ״γֵ˳ Ƭӹؼ֡ʱһ
+    // ֻ¶ԭж֮ʱֱ׷ͨ (ʱ仯 ĳѲʹ)ؽ
+    QVector<const Animation*> source_order;
+    for (int i = 0; i < sources.size(); ++i)
+    {
+        if (source_order.indexOf(sources[i].animation) < 0)
+            source_order.append(sources[i].animation);
+    }
+    bool rebuild = ticks_per_second != synthetic_animation_->ticks_per_second || 
+        source_order.size() < source_order_.size() ||
+        source_order.mid(0, source_order_.size()) != source_order_;
+    if (rebuild)
+    {
+        synthetic_animation_->clear();
+        clip_sources_.clear();
+        source_order_.clear();
+        source_channels_.clear();
+        synthetic_channel_ids_.clear();
+        synthetic_animation_->ticks_per_second = ticks_per_second;
+    }
+    for (int i = source_order_.size(); i < source_order.size(); ++i)
+        resolveChannels(source_order[i]);
+    source_order_ = source_order;
+
+    QMap<const AnimationClip*, ClipSource> clip_sources;
+    double ticks = 0.0;
+    for (int i = 0; i < clips.size(); ++i)
+    {
+        ClipSource& source = sources[i];
+        const SourceChannels& channels = source_channels_[source.animation];
+        source.offset = clips[i]->startTime() * 0.001 * ticks_per_second;
+        source.begin = source.offset + channels.first;
+        source.end = source.offset + channels.last;
+        clip_sources.insert(clips[i], source);
+        ticks = qMax(ticks, (clips[i]->startTime() + clips[i]->length()) * 0.001 * ticks_per_second);
+    }
 
-        if (channel.scaling_keys.isEmpty())
+    // Ҫ¹鲢ʱ:  ɾƶƬǰ󸲸ǵķΧ
+    QVector<QPair<double, double> > windows;
+    for (int i = 0; i < clips.size(); ++i)
+    {
+        const ClipSource& source = sources[i];
+        auto it = clip_sources_.constFind(clips[i]);
+        if (it != clip_sources_.constEnd() && 
+            it->animation == source.animation && it->offset == source.offset && it->weight == source.weight)
         {
-            qSort(channel.scaling_keys.begin(), channel.scaling_keys.end(), vecKeyCmp);
-            channel.scaling_keys.prepend(channel.scaling_keys[0]);
-            channel.scaling_keys[0].time = 0;
-        } 
-    }    
+            continue;
+        }
+        if (it != clip_sources_.constEnd())
+            windows.append(qMakePair(it->begin, it->end));
+        windows.append(qMakePair(source.begin, source.end));
+    }
+    for (auto it = clip_sources_.constBegin(); it != clip_sources_.constEnd(); ++it)
+    {
+        if (!clip_sources.contains(it.key()))
+            windows.append(qMakePair(it->begin, it->end));
+    }
+
+    // ϲཻʱκι鲢
+    std::sort(windows.begin(), windows.end());
+    for (int i = 0; i < windows.size(); )
+    {
+        double from = windows[i].first;
+        double to = windows[i].second;
+        for (++i; i < windows.size() && windows[i].first <= to; ++i)
+            to = qMax(to, windows[i].second);
+        remergeKeyframes(sources, from, to);
+    }
+
+    clip_sources_ = clip_sources;
+    synthetic_animation_->ticks = ticks;
     emit syntheticAnimationUpdated();
 }
 
+void AnimationTrackScene::resolveChannels(const Animation* anim)
+{
+    ChannelList& channels = synthetic_animation_->channels;
+    SourceChannels& source = source_channels_[anim];
+    source.first = std::numeric_limits<double>::max();
+    source.last = -std::numeric_limits<double>::max();
+    for (int s = 0; s < anim->channels.size(); ++s)
+    {
+        const AnimationChannel& channel = anim->channels[s];
+        int c = synthetic_channel_ids_.value(channel.joint->name, -1);
+        if (c < 0)
+        {
+            c = channels.size();
+            channels.append(AnimationChannel(channel.joint));
+            synthetic_channel_ids_.insert(channel.joint->name, c);
+        }
+        while (source.source_of.size() <= c)
+            source.source_of.append(-1);
+        source.source_of[c] = s;
+
+        if (!channel.position_keys.isEmpty())
+        {
+            source.first = qMin(source.first, channel.position_keys.first().time);
+            source.last = qMax(source.last, channel.position_keys.last().time);
+        }
+        if (!channel.rotation_keys.isEmpty())
+        {
+            source.first = qMin(source.first, channel.rotation_keys.first().time);
+            source.last = qMax(source.last, channel.rotation_keys.last().time);
+        }
+        if (!channel.scaling_keys.isEmpty())
+        {
+            source.first = qMin(source.first, channel.scaling_keys.first().time);
+            source.last = qMax(source.last, channel.scaling_keys.last().time);
+        }
+    }
+    if (source.first > source.last)
+        source.first = source.last = 0.0;
+}
+
+void AnimationTrackScene::remergeKeyframes(const QVector<ClipSource>& sources, double from, double to)
+{
+    // ʱƬ
+    QVector<const ClipSource*> overlapping;
+    QVector<const SourceChannels*> overlapping_channels;
+    for (int i = 0; i < sources.size(); ++i)
+    {
+        if (sources[i].begin <= to && sources[i].end >= from)
+        {
+            overlapping.append(&sources[i]);
+            overlapping_channels.append(&source_channels_.find(sources[i].animation).value());
+        }
+    }
+
+    // з дͨʱٴ
+    AnimationChannel* channels = synthetic_animation_->channels.data();
+    const int channel_count = synthetic_animation_->channels.size();
+
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < channel_count; ++c)
+    {
+        QVarLengthArray<KeySource<VectorKey>, 8> positions, scalings;
+        QVarLengthArray<KeySource<QuaternionKey>, 8> rotations;
+        for (int k = 0; k < overlapping.size(); ++k)
+        {
+            const QVector<int>& source_of = overlapping_channels[k]->source_of;
+            const int s = c < source_of.size() ? source_of[c] : -1;
+            if (s < 0)
+                continue;
+            const ClipSource& source = *overlapping[k];
+            const AnimationChannel& channel = source.animation->channels[s];
+            KeySource<VectorKey> position = { &channel.position_keys, source.offset, source.weight };
+            KeySource<QuaternionKey> rotation = { &channel.rotation_keys, source.offset, source.weight };
+            KeySource<VectorKey> scaling = { &channel.scaling_keys, source.offset, source.weight };
+            positions.append(position);
+            rotations.append(rotation);
+            scalings.append(scaling);
+        }
+        remergeKeys(channels[c].position_keys, positions.constData(), positions.size(), from, to);
+        remergeKeys(channels[c].rotation_keys, rotations.constData(), rotations.size(), from, to);
+        remergeKeys(channels[c].scaling_keys, scalings.constData(), scalings.size(), from, to);
+    }
+}
+
 AnimationTrack* AnimationTrackScene::addTrack()
 {
     AnimationTrack* new_track = new AnimationTrack(this);
@@ -426,6 +682,10 @@ void AnimationTrackScene::reset()
     setSceneRect(0, 0, INITIAL_WIDTH, INITIAL_HEIGHT);
     
     synthetic_animation_->clear();
+    clip_sources_.clear();
+    source_order_.clear();
+    source_channels_.clear();
+    synthetic_channel_ids_.clear();
 }
 
 void AnimationTrackScene::createContextMenu()
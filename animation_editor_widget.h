@@ -86,6 +86,24 @@ private:
     void updateCurTrack();  // µǰ
     void adjustSize();      // ༭С
 
+    // Ƭںϳɶеλ
+    struct ClipSource
+    {
+        const Animation* animation;
+        double offset;      // ʼʱ λ
+        double weight;      // ڹȨ
+        double begin, end;  // ؼ֡ǵʱ䷶Χ λ
+    };
+    // ԭʼ --> ϳɶͨӦϵ
+    struct SourceChannels
+    {
+        QVector<int> source_of; // ϳɶͨӦԭʼͨ -1Խʾû
+        double first, last;     // ԭʼؼ֡ʱ䷶Χ λ
+    };
+
+    void resolveChannels(const Animation* anim);    // ؽƽͨӦϵ ȱٵͨ׷ӵϳɶ
+    void remergeKeyframes(const QVector<ClipSource>& sources, double from, double to);  // ¹鲢[from, to]ڵĹؼ֡
+
 private:
     RemixerWidget* remixer_;    // ϲ
 
@@ -103,6 +121,11 @@ private:
 	NameToAnimMap*          name_animation_;	    // -ӳ
     Animation*              synthetic_animation_;	// ϳɶ
 
+    QMap<const AnimationClip*, ClipSource>  clip_sources_;          // ϴκϳʱƬελ
+    QVector<const Animation*>               source_order_;          // ״γ ϳɶͨ˳
+    QMap<const Animation*, SourceChannels>  source_channels_;       // ԭʼͨӦϵ
+    QMap<QString, int>                      synthetic_channel_ids_; // ؽ --> ϳɶͨ
+
     QAction* delete_clip_action_;
     QMenu*   context_menu_;
 };
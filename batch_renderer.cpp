@@ -0,0 +1,361 @@
+#include "batch_renderer.h"
+
+#include <iostream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QImage>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+
+#include "scene.h"
+#include "frame_capture.h"
+
+/************************************************************************/
+/* дͼһӽǵͼƬ                                              */
+/************************************************************************/
+class ViewImageWriter : public QRunnable
+{
+public:
+	ViewImageWriter(const QImage& atlas, const QRect& rect, const QString& file_name, QSemaphore* slots, QAtomicInt* failed)
+		: atlas_(atlas), rect_(rect), file_name_(file_name), slots_(slots), failed_(failed)
+	{
+	}
+
+	void run()
+	{
+		if (!atlas_.copy(rect_).save(file_name_))
+			failed_->store(1);
+		slots_->release();
+	}
+
+private:
+	QImage		atlas_;		// ӽʽ
+	QRect		rect_;
+	QString		file_name_;
+	QSemaphore*	slots_;
+	QAtomicInt*	failed_;
+};
+
+/************************************************************************/
+/* ѻضͼ֡ӽз ̳߳д                                 */
+/* ӽvλڵv/columns(϶) v%columns                         */
+/************************************************************************/
+class ViewAtlasEncoder : public FrameEncoder
+{
+public:
+	ViewAtlasEncoder(const QString& output_dir, const QString& format, const QVector<int>& frames,
+		int view_count, int columns, int view_width, int view_height, int threads)
+		: output_dir_(output_dir), format_(format), frames_(frames),
+		view_count_(view_count), columns_(columns), view_width_(view_width), view_height_(view_height),
+		slots_(4 * view_count), index_(0)
+	{
+		pool_.setMaxThreadCount(qMax(threads, 1));
+	}
+
+	bool open(int width, int height, int fps)
+	{
+		width_ = width;
+		height_ = height;
+		return true;
+	}
+
+	bool write(const unsigned char* rgba)
+	{
+		// ÿӽռһ дͼȾʱڴ˵ȴ ໺4֡ͼ
+		slots_.acquire(view_count_);
+		QImage atlas = QImage(rgba, width_, height_, width_ * 4, QImage::Format_RGBA8888).mirrored().convertToFormat(QImage::Format_RGB888);
+		const int frame = frames_[index_++];
+		for (int v = 0; v < view_count_; ++v)
+		{
+			QRect rect((v % columns_) * view_width_, (v / columns_) * view_height_, view_width_, view_height_);
+			QString file_name = QString("%1/frame%2_view%3.%4").arg(output_dir_)
+				.arg(frame, 5, 10, QChar('0')).arg(v, 2, 10, QChar('0')).arg(format_);
+			pool_.start(new ViewImageWriter(atlas, rect, file_name, &slots_, &failed_));
+		}
+		return failed_.load() == 0;
+	}
+
+	void close()
+	{
+		pool_.waitForDone();
+	}
+
+private:
+	QString			output_dir_;
+	QString			format_;
+	QVector<int>	frames_;
+	int				view_count_;
+	int				columns_;
+	int				view_width_;
+	int				view_height_;
+	int				width_;
+	int				height_;
+	QThreadPool		pool_;
+	QSemaphore		slots_;
+	QAtomicInt		failed_;
+	int				index_;
+};
+
+BatchRenderer::BatchRenderer()
+	: output_dir_("render"),
+	format_("png"),
+	first_frame_(0),
+	last_frame_(-1),
+	frame_step_(1),
+	view_count_(8),
+	pitch_(0),
+	width_(512),
+	height_(512),
+	threads_(QThread::idealThreadCount()),
+	anim_(nullptr)
+{
+}
+
+bool BatchRenderer::isRenderCommand(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (QString(argv[i]) == "-render")
+			return true;
+	}
+	return false;
+}
+
+int BatchRenderer::exec(int argc, char *argv[])
+{
+	QStringList args;
+	for (int i = 1; i < argc; ++i)
+		args << QString::fromLocal8Bit(argv[i]);
+
+	if (!parseArguments(args))
+	{
+		std::cerr << "usage: VirtualStudio -render -avatar <file> -cloth <obj> [-cloth <obj> ...] -cache <cm> [-anim <name>] [-output <dir>]"
+			" [-poses <file> | -frames <first> <last> <step>] [-views <count>] [-pitch <degrees>] [-size <width> <height>]"
+			" [-format png|jpg|bmp] [-threads <count>]" << std::endl;
+		return RENDER_BAD_ARGUMENTS;
+	}
+
+	// SimulationWindowͬ زFrameCaptureFBO
+	QSurfaceFormat format;
+	format.setDepthBufferSize(24);
+	format.setMajorVersion(4);
+	format.setMinorVersion(0);
+	format.setProfile(QSurfaceFormat::CoreProfile);
+
+	QOffscreenSurface surface;
+	surface.setFormat(format);
+	surface.create();
+
+	QOpenGLContext context;
+	context.setFormat(format);
+	if (!context.create() || !context.makeCurrent(&surface) || context.format().version() < qMakePair(4, 0))
+	{
+		std::cerr << "failed to create an OpenGL 4.0 core context" << std::endl;
+		return RENDER_GL_FAILED;
+	}
+
+	int exit_code;
+	{
+		// OpenGLԴΪǰʱͷ
+		Scene scene;
+		scene.setContext(&context);
+		scene.initialize();
+		exit_code = loadScene(scene) ? render(scene) : RENDER_LOAD_FAILED;
+	}
+	context.doneCurrent();
+	return exit_code;
+}
+
+bool BatchRenderer::parseArguments(const QStringList& args)
+{
+	for (int i = 0; i < args.size(); ++i)
+	{
+		const QString& arg = args[i];
+		bool has_value = i + 1 < args.size();
+		if (arg == "-render")
+			continue;
+		else if (arg == "-avatar" && has_value)
+			avatar_file_ = args[++i];
+		else if (arg == "-cloth" && has_value)
+			cloth_files_ << args[++i];
+		else if (arg == "-cache" && has_value)
+			cache_file_ = args[++i];
+		else if (arg == "-anim" && has_value)
+			anim_name_ = args[++i];
+		else if (arg == "-output" && has_value)
+			output_dir_ = args[++i];
+		else if (arg == "-poses" && has_value)
+			poses_file_ = args[++i];
+		else if (arg == "-format" && has_value)
+			format_ = args[++i].toLower();
+		else if (arg == "-views" && has_value)
+			view_count_ = args[++i].toInt();
+		else if (arg == "-pitch" && has_value)
+			pitch_ = args[++i].toFloat();
+		else if (arg == "-threads" && has_value)
+			threads_ = args[++i].toInt();
+		else if (arg == "-frames" && i + 3 < args.size())
+		{
+			first_frame_ = args[++i].toInt();
+			last_frame_ = args[++i].toInt();
+			frame_step_ = args[++i].toInt();
+		}
+		else if (arg == "-size" && i + 2 < args.size())
+		{
+			width_ = args[++i].toInt();
+			height_ = args[++i].toInt();
+		}
+		else
+		{
+			std::cerr << "unknown argument: " << arg.toLocal8Bit().constData() << std::endl;
+			return false;
+		}
+	}
+	return !avatar_file_.isEmpty() && !cloth_files_.isEmpty() && !cache_file_.isEmpty()
+		&& view_count_ > 0 && width_ > 0 && height_ > 0 && first_frame_ >= 0 && frame_step_ > 0
+		&& (format_ == "png" || format_ == "jpg" || format_ == "bmp");
+}
+
+bool BatchRenderer::loadScene(Scene& scene)
+{
+	if (!QFileInfo(avatar_file_).exists())
+	{
+		std::cerr << "avatar not found: " << avatar_file_.toLocal8Bit().constData() << std::endl;
+		return false;
+	}
+	scene.importAvatar(avatar_file_);
+
+	const NameToAnimMap* animations = scene.avatarNameAnimationMap();
+	if (animations->isEmpty())
+	{
+		std::cerr << "avatar has no animations" << std::endl;
+		return false;
+	}
+	anim_ = anim_name_.isEmpty() ? animations->begin().value() : animations->value(anim_name_, nullptr);
+	if (!anim_)
+	{
+		std::cerr << "animation not found: " << anim_name_.toLocal8Bit().constData() << std::endl;
+		return false;
+	}
+
+	for (int i = 0; i < cloth_files_.size(); ++i)
+	{
+		if (!QFileInfo(cloth_files_[i]).exists())
+		{
+			std::cerr << "cloth not found: " << cloth_files_[i].toLocal8Bit().constData() << std::endl;
+			return false;
+		}
+		scene.importCloth(cloth_files_[i]);
+	}
+
+	if (!scene.loadReplay(cache_file_))
+	{
+		std::cerr << "failed to load cloth motion cache " << cache_file_.toLocal8Bit().constData()
+			<< " (it must hold the same clothes in the same order)" << std::endl;
+		return false;
+	}
+	return loadPoses(scene.replayFrameCount());
+}
+
+bool BatchRenderer::loadPoses(int frame_count)
+{
+	if (poses_file_.isEmpty())
+	{
+		int last_frame = last_frame_ < 0 ? frame_count - 1 : qMin(last_frame_, frame_count - 1);
+		for (int frame = first_frame_; frame <= last_frame; frame += frame_step_)
+			frames_.append(frame);
+	}
+	else
+	{
+		QFile file(poses_file_);
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+		{
+			std::cerr << "failed to open pose list " << poses_file_.toLocal8Bit().constData() << std::endl;
+			return false;
+		}
+		QTextStream in(&file);
+		while (!in.atEnd())
+		{
+			QString line = in.readLine().trimmed();
+			if (line.isEmpty() || line.startsWith('#'))
+				continue;
+			bool ok;
+			int frame = line.toInt(&ok);
+			if (!ok || frame < 0 || frame >= frame_count)
+			{
+				std::cerr << "bad frame in pose list: " << line.toLocal8Bit().constData() << std::endl;
+				return false;
+			}
+			frames_.append(frame);
+		}
+	}
+
+	if (frames_.isEmpty())
+	{
+		std::cerr << "no frames to render" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int BatchRenderer::render(Scene& scene)
+{
+	QDir().mkpath(output_dir_);
+
+	// ӽųɽεͼ OpenGLӿ¶ 0
+	int columns = 1;
+	while (columns * columns < view_count_)
+		++columns;
+	const int rows = (view_count_ + columns - 1) / columns;
+
+	QVector<QRect> viewports;
+	QVector<QPointF> angles;
+	for (int v = 0; v < view_count_; ++v)
+	{
+		viewports.append(QRect((v % columns) * width_, (rows - 1 - v / columns) * height_, width_, height_));
+		angles.append(QPointF(360.0 * v / view_count_, pitch_));
+	}
+
+	ViewAtlasEncoder* encoder = new ViewAtlasEncoder(output_dir_, format_, frames_, view_count_, columns, width_, height_, threads_);
+	FrameCapture capture(encoder);
+	if (!capture.begin(columns * width_, rows * height_, 1000 / AnimationClip::SAMPLE_SLICE))
+	{
+		std::cerr << "failed to create a " << columns * width_ << "x" << rows * height_ << " render target" << std::endl;
+		return RENDER_GL_FAILED;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	int exit_code = RENDER_OK;
+	for (int i = 0; i < frames_.size(); ++i)
+	{
+		scene.updateAvatarAnimation(anim_, frames_[i] * AnimationClip::SAMPLE_SLICE);
+		scene.updateClothAnimation(frames_[i]);
+		capture.bindTarget();
+		scene.renderViews(viewports, angles);
+		if (!capture.capture())
+		{
+			exit_code = RENDER_WRITE_FAILED;
+			break;
+		}
+	}
+	if (!capture.finish())
+		exit_code = RENDER_WRITE_FAILED;
+
+	double total_time = timer.nsecsElapsed() * 1e-6;
+	std::cout << "frames: " << frames_.size() << "  views: " << view_count_
+		<< "  total: " << total_time * 0.001 << " s"
+		<< "  average: " << total_time / frames_.size() << " ms/frame" << std::endl;
+	if (exit_code != RENDER_OK)
+		std::cerr << "failed to write images to " << output_dir_.toLocal8Bit().constData() << std::endl;
+	return exit_code;
+}
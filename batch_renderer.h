@@ -0,0 +1,74 @@
+#ifndef BATCH_RENDERER_H
+#define BATCH_RENDERER_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class Scene;
+class Animation;
+
+/************************************************************************/
+/* Ⱦ ڷװĿ¼ͼƬ                                          */
+/*  QOffscreenSurfaceϵĺFBOScene::render          */
+/* 尴̬ װģ⻺(*.cm)ط                                 */
+/* ÷: VirtualStudio -render -avatar <ģ> -cloth <װobj> [-cloth ...] */
+/*       -cache <ģ⻺> [-anim <>] [-output <Ŀ¼>]            */
+/*       [-poses <֡бļ> | -frames <ʼ> <> <>]             */
+/*       [-views <ӽ>] [-pitch <>] [-size <> <>]             */
+/*       [-format png|jpg|bmp] [-threads <дͼ߳>]                     */
+/* ֡бļÿһ֡ ȱʡȾе֡                      */
+/* ÿֻ֡һͷװ ӽǵȷ360 ΪͼеһһȾͻض   */
+/* ̳߳зд <Ŀ¼>/frame<֡>_view<ӽ>.<ʽ>               */
+/* ʾLinuxQT_QPA_PLATFORM=offscreen(eglfs)              */
+/* ûGPUʱMesaȾ LIBGL_ALWAYS_SOFTWARE=1                      */
+/************************************************************************/
+class BatchRenderer
+{
+public:
+	// ˳
+	enum ExitCode
+	{
+		RENDER_OK = 0,
+		RENDER_BAD_ARGUMENTS = 1,
+		RENDER_LOAD_FAILED = 2,
+		RENDER_GL_FAILED = 3,		// ޷OpenGL 4.0
+		RENDER_WRITE_FAILED = 4
+	};
+
+	BatchRenderer();
+
+	static bool isRenderCommand(int argc, char *argv[]);
+	int exec(int argc, char *argv[]);
+
+private:
+	// uncopyable
+	BatchRenderer(const BatchRenderer&);
+	BatchRenderer& operator=(const BatchRenderer&);
+
+	bool parseArguments(const QStringList& args);
+	bool loadScene(Scene& scene);
+	bool loadPoses(int frame_count);
+	int  render(Scene& scene);
+
+	QString			avatar_file_;
+	QStringList		cloth_files_;
+	QString			cache_file_;
+	QString			anim_name_;
+	QString			output_dir_;
+	QString			poses_file_;
+	QString			format_;
+	int				first_frame_;
+	int				last_frame_;		// -1Ϊһ֡
+	int				frame_step_;
+	int				view_count_;
+	float			pitch_;
+	int				width_;
+	int				height_;
+	int				threads_;
+
+	const Animation*	anim_;
+	QVector<int>		frames_;		// ȾĲ֡
+};
+
+#endif // BATCH_RENDERER_H
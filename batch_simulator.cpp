@@ -0,0 +1,433 @@
+#include "batch_simulator.h"
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+#include <QDir>
+#include <QFileInfo>
+#include <QElapsedTimer>
+
+#include "animation.h"
+#include "obstacle_bake.h"
+#include "ClothMotion/simulation/geometry.h"
+#include "ClothMotion/simulation/mesh.h"
+#include "ClothMotion/simulation/physics.h"
+#include "ClothMotion/simulation/profile.h"
+#include "ClothMotion/simulation/simulation.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+
+#pragma comment ( lib, "psapi.lib")
+#else
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+BatchSimulator::BatchSimulator()
+	: output_dir_("output"),
+	profile_(false),
+	kernel_repetitions_(0),
+	avatar_(nullptr),
+	anim_(nullptr),
+	cloth_handler_(new ClothHandler()),
+	obstacle_bake_(nullptr),
+	total_time_(0)
+{
+}
+
+BatchSimulator::~BatchSimulator()
+{
+	delete obstacle_bake_;
+	delete avatar_;
+	delete cloth_handler_;
+}
+
+bool BatchSimulator::isBatchCommand(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (QString(argv[i]) == "-batch")
+			return true;
+	}
+	return false;
+}
+
+int BatchSimulator::exec(int argc, char *argv[])
+{
+	QStringList args;
+	for (int i = 1; i < argc; ++i)
+		args << QString::fromLocal8Bit(argv[i]);
+
+	if (!parseArguments(args))
+	{
+		std::cerr << "usage: VirtualStudio -batch -avatar <file> -cloth <obj> [-cloth <obj> ...] [-anim <name>] [-output <dir>] [-profile] [-proxy <cell> <margin>]" << std::endl;
+		std::cerr << "       VirtualStudio -batch -cloth <obj> [-cloth <obj> ...] -kernels <repetitions>" << std::endl;
+		return BATCH_BAD_ARGUMENTS;
+	}
+
+	// ʱƬģʱƬ Scene::initialize()ȡͬһļ
+	std::ifstream ifs("parameters/sample_parameter.txt");
+	std::string label;
+	if (ifs.is_open())
+	{
+		ifs >> label >> AnimationClip::SAMPLE_SLICE;
+		ifs >> label >> AnimationClip::SIM_SLICE;
+	}
+	ifs.close();
+
+	if (kernel_repetitions_ > 0)
+	{
+		if (!loadClothes())
+			return BATCH_LOAD_FAILED;
+		return benchmarkKernels();
+	}
+
+	QDir().mkpath(output_dir_);
+
+	if (!loadAvatar() || !loadClothes())
+	{
+		report(BATCH_LOAD_FAILED);
+		return BATCH_LOAD_FAILED;
+	}
+
+	int exit_code = simulate();
+	report(exit_code);
+	return exit_code;
+}
+
+bool BatchSimulator::parseArguments(const QStringList& args)
+{
+	for (int i = 0; i < args.size(); ++i)
+	{
+		const QString& arg = args[i];
+		bool has_value = i + 1 < args.size();
+		if (arg == "-batch")
+			continue;
+		else if (arg == "-avatar" && has_value)
+			avatar_file_ = args[++i];
+		else if (arg == "-cloth" && has_value)
+			cloth_files_ << args[++i];
+		else if (arg == "-anim" && has_value)
+			anim_name_ = args[++i];
+		else if (arg == "-output" && has_value)
+			output_dir_ = args[++i];
+		else if (arg == "-profile")
+			profile_ = true;
+		else if (arg == "-proxy" && i + 2 < args.size())
+		{
+			double cell = args[++i].toDouble();
+			double margin = args[++i].toDouble();
+			cloth_handler_->set_obstacle_proxy(cell, margin);
+		}
+		else if (arg == "-kernels" && has_value)
+			kernel_repetitions_ = args[++i].toInt();
+		else
+		{
+			std::cerr << "unknown argument: " << arg.toLocal8Bit().constData() << std::endl;
+			return false;
+		}
+	}
+	if (kernel_repetitions_ > 0)
+		return !cloth_files_.isEmpty();
+	return !avatar_file_.isEmpty() && !cloth_files_.isEmpty();
+}
+
+bool BatchSimulator::loadAvatar()
+{
+	// Scene::importAvatar()ͬĺѡ
+	const aiScene* ai_scene = aiImportFile(avatar_file_.toStdString().c_str(),
+		aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_LimitBoneWeights);
+	if (!ai_scene)
+	{
+		std::cerr << "failed to load avatar " << avatar_file_.toLocal8Bit().constData() << ": " << aiGetErrorString() << std::endl;
+		return false;
+	}
+	avatar_ = new Avatar(ai_scene, avatar_file_, true);
+	aiReleaseImport(ai_scene);
+
+	if (avatar_->name_animation_.isEmpty())
+	{
+		std::cerr << "avatar has no animations" << std::endl;
+		return false;
+	}
+	if (anim_name_.isEmpty())
+		anim_ = avatar_->name_animation_.begin().value();
+	else if (avatar_->name_animation_.contains(anim_name_))
+		anim_ = avatar_->name_animation_.value(anim_name_);
+	else
+	{
+		std::cerr << "animation not found: " << anim_name_.toLocal8Bit().constData() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool BatchSimulator::loadClothes()
+{
+	for (int i = 0; i < cloth_files_.size(); ++i)
+	{
+		if (!QFileInfo(cloth_files_[i]).exists())
+		{
+			std::cerr << "cloth not found: " << cloth_files_[i].toLocal8Bit().constData() << std::endl;
+			return false;
+		}
+		SmtClothPtr cloth = ClothHandler::load_cloth_from_obj(cloth_files_[i].toStdString().c_str());
+		cloth_handler_->add_clothes_to_handler(cloth.get());
+		clothes_.push_back(cloth);
+	}
+	return true;
+}
+
+void BatchSimulator::initAvatar2Simulation()
+{
+	const Skin & skin = avatar_->skins().at(0);
+
+	std::vector<double> position(obstacle_bake_->vertexCount() * 3);
+	obstacle_bake_->copyFrame(0, &position[0]);
+
+	std::vector<double> texcoord(skin.texcoords.size() * 2);
+	for (int i = 0; i < skin.texcoords.size(); ++i)
+		for (int j = 0; j < 2; ++j)
+			texcoord[i * 2 + j] = skin.texcoords[i][j];
+
+	std::vector<int> indices(skin.indices.begin(), skin.indices.end());
+
+	cloth_handler_->init_avatars_to_handler(&position[0], &texcoord[0], &indices[0], skin.positions.size(), skin.num_triangles);
+}
+
+void BatchSimulator::updateAvatar2Simulation(int step)
+{
+	// ̬֡ȡԺ決 ֱдģϰؼ̬ ģⲽǰؼֵ̬
+	int factor = AnimationClip::SAMPLE_SLICE / AnimationClip::SIM_SLICE;
+	int offset = (step - 1) % factor + 1;
+	if (offset == 1)
+		obstacle_bake_->copyFrame((step - 1) / factor + 1, cloth_handler_->next_avatar_key());
+	cloth_handler_->update_avatars_to_handler(static_cast<double>(offset) / factor);
+}
+
+int BatchSimulator::simulate()
+{
+	double length;
+	if (anim_->ticks_per_second)
+		length = (anim_->ticks / anim_->ticks_per_second) * 1000; // ʱ
+	else
+		length = anim_->ticks * 1000;
+
+	int total_frame = static_cast<int>(length / AnimationClip::SIM_SLICE);
+	int factor = AnimationClip::SAMPLE_SLICE / AnimationClip::SIM_SLICE;
+
+	QElapsedTimer total_timer, frame_timer;
+	total_timer.start();
+	frame_timer.start();
+
+	// ں̨߳ģ決֡λ
+	obstacle_bake_ = new ObstacleBake(avatar_, anim_, 0, AnimationClip::SAMPLE_SLICE, total_frame / factor + 2, false);
+	obstacle_bake_->start();
+
+	cloth_handler_->set_cmfile(QString("%1/cloth_motion.cm").arg(output_dir_).toLocal8Bit().constData());
+	enable_profile(profile_);
+
+	int exit_code = BATCH_OK;
+	for (int i = 0; i <= total_frame; ++i)
+	{
+		if (i == 0)
+		{
+			initAvatar2Simulation();
+			if (!cloth_handler_->begin_simulate())
+			{
+				exit_code = BATCH_INIT_FAILED;
+				break;
+			}
+		}
+		else
+		{
+			updateAvatar2Simulation(i);
+			if (!cloth_handler_->sim_next_step())
+			{
+				exit_code = BATCH_COLLISION_FAILED;
+				break;
+			}
+		}
+
+		if (i % factor == 0)
+		{
+			writeFrame(i / factor);
+			recordFrameStat(i / factor, frame_timer.nsecsElapsed() * 1e-6);
+			frame_timer.restart();
+		}
+	}
+	cloth_handler_->save_cmfile();
+	total_time_ = total_timer.nsecsElapsed() * 1e-6;
+
+	if (profile_)
+	{
+		enable_profile(false);
+		write_profile_csv(QString("%1/profile.csv").arg(output_dir_).toLocal8Bit().constData());
+		write_profile_json(QString("%1/profile.json").arg(output_dir_).toLocal8Bit().constData());
+		write_profile_trace(QString("%1/profile_trace.json").arg(output_dir_).toLocal8Bit().constData());
+	}
+	return exit_code;
+}
+
+int BatchSimulator::benchmarkKernels()
+{
+	// ̼߳ʱ ÿװֱͳ ʱΪȫԪһεƽֵ
+	double dt = AnimationClip::SIM_SLICE * 0.001;
+	std::cout << std::fixed;
+	for (size_t c = 0; c < clothes_.size(); ++c)
+	{
+		SimCloth & cloth = *clothes_[c];
+		Mesh & mesh = cloth.mesh;
+		// prepare()ͬ ָƬʺͱߵĳʼ
+		for (size_t f = 0; f < mesh.faces.size(); ++f)
+			mesh.faces[f]->material = cloth.materials[mesh.faces[f]->flag];
+		for (size_t e = 0; e < mesh.edges.size(); ++e)
+			mesh.edges[e]->theta_ideal = dihedral_angle<MS>(mesh.edges[e]);
+
+		KernelBenchmark bench = benchmark_internal_forces(mesh.faces, mesh.edges, dt, kernel_repetitions_);
+		std::cout << "cloth " << c << ": " << bench.faces << " faces, " << bench.hinges << " hinges" << std::endl;
+		std::cout << std::setprecision(3)
+			<< "  stretching  reference " << bench.stretching_reference * 1e3 << " ms"
+			<< "  batched " << bench.stretching_batched * 1e3 << " ms"
+			<< std::scientific << std::setprecision(2)
+			<< "  error " << bench.stretching_error << std::fixed << std::endl;
+		std::cout << std::setprecision(3)
+			<< "  bending     reference " << bench.bending_reference * 1e3 << " ms"
+			<< "  batched " << bench.bending_batched * 1e3 << " ms"
+			<< std::scientific << std::setprecision(2)
+			<< "  error " << bench.bending_error << std::fixed << std::endl;
+	}
+	return BATCH_OK;
+}
+
+void BatchSimulator::writeFrame(int frame)
+{
+	cloth_handler_->write_frame(frame);
+
+	for (size_t c = 0; c < clothes_.size(); ++c)
+	{
+		Mesh & mesh = clothes_[c]->mesh;
+		set_indices(mesh);
+
+		QString file_name = QString("%1/cloth%2_%3.obj").arg(output_dir_).arg(c).arg(frame, 5, 10, QChar('0'));
+		std::ofstream ofs(file_name.toLocal8Bit().constData());
+		for (size_t v = 0; v < mesh.verts.size(); ++v)
+		{
+			const Vec3 & u = mesh.verts[v]->u;
+			ofs << "vt " << u[0] << " " << u[1] << "\n";
+		}
+		for (size_t n = 0; n < mesh.nodes.size(); ++n)
+		{
+			const Vec3 & x = mesh.nodes[n]->x;
+			const Vec3 & nrm = mesh.nodes[n]->n;
+			ofs << "v " << x[0] << " " << x[1] << " " << x[2] << "\n";
+			ofs << "vn " << nrm[0] << " " << nrm[1] << " " << nrm[2] << "\n";
+		}
+		for (size_t f = 0; f < mesh.faces.size(); ++f)
+		{
+			const Face * face = mesh.faces[f];
+			ofs << "f";
+			for (int i = 0; i < 3; ++i)
+			{
+				int n = face->v[i]->node->index + 1;
+				ofs << " " << n << "/" << face->v[i]->index + 1 << "/" << n;
+			}
+			ofs << "\n";
+		}
+	}
+}
+
+void BatchSimulator::recordFrameStat(int frame, double wall_time)
+{
+	FrameStat stat;
+	stat.frame = frame;
+	stat.wall_time = wall_time;
+	stat.working_set = 0;
+	stat.peak_working_set = 0;
+
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+	{
+		stat.working_set = pmc.WorkingSetSize;
+		stat.peak_working_set = pmc.PeakWorkingSetSize;
+	}
+#else
+	// פȡ/proc/self/statm(ҳ) ֵȡgetrusage(LinuxKB)
+	long size = 0, resident = 0;
+	if (FILE* statm = fopen("/proc/self/statm", "r"))
+	{
+		if (fscanf(statm, "%ld %ld", &size, &resident) == 2)
+			stat.working_set = static_cast<size_t>(resident) * sysconf(_SC_PAGESIZE);
+		fclose(statm);
+	}
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		stat.peak_working_set = static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+	frame_stats_.push_back(stat);
+}
+
+void BatchSimulator::report(int exit_code) const
+{
+	const double MB = 1024.0 * 1024.0;
+	std::ostringstream out;
+
+	out << std::fixed << std::setprecision(2);
+	out << "frame\twall(ms)\tmemory(MB)\tpeak(MB)" << std::endl;
+	for (size_t i = 0; i < frame_stats_.size(); ++i)
+	{
+		const FrameStat & stat = frame_stats_[i];
+		out << stat.frame << "\t" << stat.wall_time << "\t"
+			<< stat.working_set / MB << "\t" << stat.peak_working_set / MB << std::endl;
+	}
+
+	double average = frame_stats_.empty() ? 0 : total_time_ / frame_stats_.size();
+	out << "frames: " << frame_stats_.size()
+		<< "  total: " << total_time_ * 0.001 << " s"
+		<< "  average: " << average << " ms/frame" << std::endl;
+
+	// ׶εĵôʱ
+	const char * phases[LinearSolver::nPhases] = { "analyze", "factorize", "solve" };
+	for (size_t c = 0; c < clothes_.size(); ++c)
+	{
+		const ImplicitSystem & system = clothes_[c]->system;
+		const LinearSolver * solvers[2] = { system.solver, system.fallback };
+		for (int s = 0; s < 2; ++s)
+		{
+			if (!solvers[s])
+				continue;
+			out << "cloth" << c << " " << solvers[s]->name();
+			for (int p = 0; p < LinearSolver::nPhases; ++p)
+				out << "  " << phases[p] << ": " << solvers[s]->counts[p] << "x " << solvers[s]->timers[p].total << " s";
+			out << std::endl;
+		}
+	}
+
+	// ģۼƺʱ
+	out << "modules";
+	for (int m = 0; m < Simulation::nModules; ++m)
+		out << "  " << module_name(m) << ": " << sim.timers[m].total << " s";
+	out << std::endl;
+
+	switch (exit_code)
+	{
+	case BATCH_OK: out << "simulation finished" << std::endl; break;
+	case BATCH_LOAD_FAILED: out << "failed to load avatar or clothes" << std::endl; break;
+	case BATCH_INIT_FAILED: out << "initial separation or relaxation failed to converge" << std::endl; break;
+	case BATCH_COLLISION_FAILED: out << "collision resolution failed to converge" << std::endl; break;
+	default: break;
+	}
+
+	// ͬʱдĿ¼ ֵк鿴
+	std::cout << out.str();
+	std::ofstream ofs(QString("%1/report.txt").arg(output_dir_).toLocal8Bit().constData());
+	ofs << out.str();
+}
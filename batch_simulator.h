@@ -0,0 +1,83 @@
+#ifndef BATCH_SIMULATOR_H
+#define BATCH_SIMULATOR_H
+
+#include <vector>
+#include <QString>
+#include <QStringList>
+#include "ClothMotion/cloth_motion.h"
+
+class Avatar;
+class Animation;
+class ObstacleBake;
+
+/************************************************************************/
+/* ģ ںOpenGL ģֱ֡д                  */
+/* ÷: VirtualStudio -batch -avatar <ģ> -cloth <װobj> [-cloth ...] */
+/*       [-anim <>] [-output <Ŀ¼>] [-profile]                 */
+/*       [-proxy <ߴ> <߾>]                                       */
+/*       VirtualStudio -batch -cloth <װobj> [-cloth ...] -kernels <> */
+/* -profile Ŀ¼д𲽸ģʱ (csv/json/chrome trace)    */
+/* -proxy װΧг߾ Ϊײ     */
+/* -kernels ģ ֻڸװϱȽԪ˵Ĳοʵʵ     */
+/************************************************************************/
+class BatchSimulator
+{
+public:
+	// ˳
+	enum ExitCode
+	{
+		BATCH_OK = 0,
+		BATCH_BAD_ARGUMENTS = 1,
+		BATCH_LOAD_FAILED = 2,
+		BATCH_INIT_FAILED = 3,      // ʼɳδ
+		BATCH_COLLISION_FAILED = 4  // ײӦδ
+	};
+
+	BatchSimulator();
+	~BatchSimulator();
+
+	static bool isBatchCommand(int argc, char *argv[]);
+	int exec(int argc, char *argv[]);
+
+private:
+	// uncopyable
+	BatchSimulator(const BatchSimulator&);
+	BatchSimulator& operator=(const BatchSimulator&);
+
+	// ÿ֡ͳϢ
+	struct FrameStat
+	{
+		int		frame;
+		double	wall_time;          // ǽʱ 
+		size_t	working_set;        // ̹ ֽ
+		size_t	peak_working_set;   // ֵ ֽ
+	};
+
+	bool parseArguments(const QStringList& args);
+	bool loadAvatar();
+	bool loadClothes();
+	void initAvatar2Simulation();
+	void updateAvatar2Simulation(int step);
+	int  simulate();
+	int  benchmarkKernels();
+	void writeFrame(int frame);
+	void recordFrameStat(int frame, double wall_time);
+	void report(int exit_code) const;
+
+	QString			avatar_file_;
+	QStringList		cloth_files_;
+	QString			anim_name_;
+	QString			output_dir_;
+	bool			profile_;
+	int				kernel_repetitions_;	// >0ʱֻеԪ˻׼
+
+	Avatar*				avatar_;
+	const Animation*	anim_;
+	ClothHandler*		cloth_handler_;
+	ObstacleBake*		obstacle_bake_;	// ֡λ
+	std::vector<SmtClothPtr>	clothes_;
+	std::vector<FrameStat>		frame_stats_;
+	double				total_time_;
+};
+
+#endif // BATCH_SIMULATOR_H
@@ -1,16 +1,34 @@
 #include "cloth.h"
 #include <QOpenGLBuffer>
+#include <QOpenGLVertexArrayObject>
 
-Cloth::Cloth(void) : cloth_(NULL), position_buffer_(NULL), normal_buffer_(NULL), texcoord_buffer_(NULL), vao_(NULL)
+Cloth::Cloth(void) : cloth_(NULL), vertex_buffer_(NULL), texcoord_buffer_(NULL), index_buffer_(NULL), vao_(NULL),
+	vertex_capacity_(0), texcoord_capacity_(0), index_capacity_(0)
 {
 }
 
-Cloth::Cloth(SmtClothPtr cloth) : cloth_(cloth), position_buffer_(NULL), normal_buffer_(NULL), texcoord_buffer_(NULL), vao_(NULL)
+Cloth::Cloth(SmtClothPtr cloth) : cloth_(cloth), vertex_buffer_(NULL), texcoord_buffer_(NULL), index_buffer_(NULL), vao_(NULL),
+	vertex_capacity_(0), texcoord_capacity_(0), index_capacity_(0)
 {
 }
 
 Cloth::~Cloth(void)
 {
+	delete vertex_buffer_;
+	delete texcoord_buffer_;
+	delete index_buffer_;
+}
+
+/************************************************************************/
+/* ֻ ʱԤһ ÿʷּܶ· */
+/* ǰbuffer                                                  */
+/************************************************************************/
+static void reserveBuffer(QOpenGLBuffer * buffer, int & capacity, int bytes)
+{
+	if(bytes <= capacity)
+		return;
+	capacity = bytes + bytes / 2;
+	buffer->allocate(capacity);
 }
 
 void Cloth::cloth_init_buffer()
@@ -18,60 +36,71 @@ void Cloth::cloth_init_buffer()
 	if(!cloth_)
 		return;
 	
-	position_buffer_ = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
-	position_buffer_->create();
-	position_buffer_->setUsagePattern(QOpenGLBuffer::StaticDraw);
-
-	normal_buffer_ = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
-	normal_buffer_->create();
-	normal_buffer_->setUsagePattern(QOpenGLBuffer::StaticDraw);
+	vertex_buffer_ = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+	vertex_buffer_->create();
+	vertex_buffer_->setUsagePattern(QOpenGLBuffer::DynamicDraw);
 
 	texcoord_buffer_ = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
 	texcoord_buffer_->create();
 	texcoord_buffer_->setUsagePattern(QOpenGLBuffer::StaticDraw);
 
+	index_buffer_ = new QOpenGLBuffer(QOpenGLBuffer::IndexBuffer);
+	index_buffer_->create();
+	index_buffer_->setUsagePattern(QOpenGLBuffer::StaticDraw);
+
 	cloth_update_buffer();
 }
 
 void Cloth::cloth_update_buffer()
 {
-	if(!cloth_)
+	if(!cloth_ || !vertex_buffer_)
 		return;
 
-	cloth_position_buffer_.clear();
-	cloth_normal_buffer_.clear();
-	cloth_texcoord_buffer_.clear();
-
-	Mesh & mesh = cloth_->mesh;
-	for(auto face_it = mesh.faces.begin(); face_it != mesh.faces.end(); ++face_it)
+	const Mesh & mesh = cloth_->mesh;
+	if(vertex_stream_.update_topology(mesh))
 	{
-		Face * face = *face_it;
-		for(int i = 0; i < 3; ++i)
-		{
-			for(int j = 0; j < 3; ++j)
-			{
-				cloth_position_buffer_.push_back(static_cast<float>(face->v[i]->node->x[j]));	
-				cloth_normal_buffer_.push_back(static_cast<float>(face->v[i]->node->n[j]));
-			}
-			for(int j = 0; j < 2; ++j)
-				cloth_texcoord_buffer_.push_back(static_cast<float>(face->v[i]->u[j]));
-		}
-	}
-	
-	position_buffer_->bind();
-	position_buffer_->allocate(&cloth_position_buffer_[0], static_cast<int>(cloth_position_buffer_.size() * sizeof(float)));
-	position_buffer_->release();
+		// ״ϴʷ֮Ҫ
+		const std::vector<float> & texcoords = vertex_stream_.texcoords();
+		const int texcoord_bytes = static_cast<int>(texcoords.size() * sizeof(float));
+		texcoord_buffer_->bind();
+		reserveBuffer(texcoord_buffer_, texcoord_capacity_, texcoord_bytes);
+		if(texcoord_bytes)
+			texcoord_buffer_->write(0, &texcoords[0], texcoord_bytes);
+		texcoord_buffer_->release();
 
-	normal_buffer_->bind();
-	normal_buffer_->allocate(&cloth_normal_buffer_[0], static_cast<int>(cloth_normal_buffer_.size() * sizeof(float)));
-	normal_buffer_->release();
+		// İVAO״̬ VAOʱϴ Ҳrelease
+		const std::vector<unsigned int> & indices = vertex_stream_.indices();
+		const int index_bytes = static_cast<int>(indices.size() * sizeof(unsigned int));
+		QOpenGLVertexArrayObject::Binder binder(vao_);
+		index_buffer_->bind();
+		reserveBuffer(index_buffer_, index_capacity_, index_bytes);
+		if(index_bytes)
+			index_buffer_->write(0, &indices[0], index_bytes);
+	}
 
-	texcoord_buffer_->bind();
-	texcoord_buffer_->allocate(&cloth_texcoord_buffer_[0], static_cast<int>(cloth_texcoord_buffer_.size() * sizeof(float)));
-	texcoord_buffer_->release();
+	// λ뷨ÿ֡д InvalidateBufferʽӳ ֱӻµĴ洢orphaning
+	// صȴһ֡Ļ ClothVertexStreamֱдӳԴ
+	const int bytes = static_cast<int>(vertex_stream_.vertex_count() * ClothVertexStream::VertexFloats * sizeof(float));
+	if(!bytes)
+		return;
+	vertex_buffer_->bind();
+	reserveBuffer(vertex_buffer_, vertex_capacity_, bytes);
+	void * data = vertex_buffer_->mapRange(0, bytes, QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer);
+	if(data)
+	{
+		vertex_stream_.write_vertices(mesh, static_cast<float *>(data));
+		vertex_buffer_->unmap();
+	}
+	else
+	{
+		staging_buffer_.resize(bytes / sizeof(float));
+		vertex_stream_.write_vertices(mesh, &staging_buffer_[0]);
+		vertex_buffer_->write(0, &staging_buffer_[0], bytes);
+	}
+	vertex_buffer_->release();
 }
 
 size_t Cloth::face_count() 
 { 
 	return cloth_->mesh.faces.size(); 
-}
\ No newline at end of file
+}
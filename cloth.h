@@ -4,7 +4,8 @@
 #include <QVector3D>
 #include <memory>
 #include "scene_node.h"
-#include "ClothMotion\cloth_motion.h"
+#include "ClothMotion/cloth_motion.h"
+#include "ClothMotion/cloth_vertex_stream.h"
 
 // 
 const double DAMPING = 0.01;							// 
@@ -116,12 +117,15 @@ public:
 	Cloth(SmtClothPtr cloth);
 	~Cloth(void);
 
-	QOpenGLBuffer* position_buffer() { return position_buffer_; }
-	QOpenGLBuffer* normal_buffer() { return normal_buffer_; }
+	// 㻺彻λ뷨ߣClothVertexStream 
+	QOpenGLBuffer* vertex_buffer() { return vertex_buffer_; }
 	QOpenGLBuffer* texcoord_buffer() { return texcoord_buffer_; }
+	QOpenGLBuffer* index_buffer() { return index_buffer_; }
 	QOpenGLVertexArrayObject* vao() { return vao_; }
+	// pvaocreate ϴ
 	void setVAO(QOpenGLVertexArrayObject* pvao) { vao_ = pvao; cloth_init_buffer(); }
 	size_t face_count();
+	int index_count() const { return static_cast<int>(vertex_stream_.indices().size()); }
 	void update(const float * trans) { cloth_update_buffer(); }
 	void loadFrame(int frame) { cloth_update_buffer(); }
 	void cloth_update_buffer();
@@ -133,13 +137,17 @@ private:
 	const SmtClothPtr cloth_;
 
 	// wunfķװ
-	QOpenGLBuffer*	position_buffer_;
-	QOpenGLBuffer*	normal_buffer_;
+	QOpenGLBuffer*	vertex_buffer_;
 	QOpenGLBuffer*	texcoord_buffer_;
+	QOpenGLBuffer*	index_buffer_;
 	QOpenGLVertexArrayObject* vao_;
 
-	std::vector<float> cloth_position_buffer_;
-	std::vector<float> cloth_normal_buffer_;
-	std::vector<float> cloth_texcoord_buffer_;
+	// ѷֽ ֻʱ
+	int vertex_capacity_;
+	int texcoord_capacity_;
+	int index_capacity_;
+
+	ClothVertexStream vertex_stream_;
+	std::vector<float> staging_buffer_;	// ޷ӳ䶥㻺ʱת
 };
 #endif // CLOTH_H
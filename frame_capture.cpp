@@ -0,0 +1,386 @@
+#include "frame_capture.h"
+
+#include <QThread>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QOpenGLBuffer>
+#include <QOpenGLFramebufferObject>
+#include <string.h>
+
+#ifdef _WIN32
+#include "AVIGenerator.h"
+#endif
+
+/************************************************************************/
+/* ͼ name.pngдΪname_00000.png name_00001.png ...            */
+/************************************************************************/
+class ImageSequenceEncoder : public FrameEncoder
+{
+public:
+	explicit ImageSequenceEncoder(const QString& file_name)
+	{
+		QFileInfo info(file_name);
+		base_ = info.path() + "/" + info.completeBaseName() + "_";
+		suffix_ = "." + info.suffix();
+	}
+
+	bool open(int width, int height, int fps)
+	{
+		width_ = width;
+		height_ = height;
+		frame_ = 0;
+		return true;
+	}
+
+	bool write(const unsigned char* rgba)
+	{
+		QImage image(rgba, width_, height_, width_ * 4, QImage::Format_RGBA8888);
+		QString name = base_ + QString("%1").arg(frame_++, 5, 10, QChar('0')) + suffix_;
+		return image.mirrored().convertToFormat(QImage::Format_RGB888).save(name);
+	}
+
+	void close() {}
+
+private:
+	QString base_;
+	QString suffix_;
+	int width_;
+	int height_;
+	int frame_;
+};
+
+/************************************************************************/
+/* YUV4MPEG2ԭʼ 4:2:0 ȫΧBT.601(C420jpeg) ȡż               */
+/* : ffmpeg -i record.y4m -c:v libx264 record.mp4                     */
+/************************************************************************/
+class Y4MEncoder : public FrameEncoder
+{
+public:
+	explicit Y4MEncoder(const QString& file_name) : file_(file_name) {}
+
+	bool open(int width, int height, int fps)
+	{
+		src_width_ = width;
+		width_ = width & ~1;
+		height_ = height & ~1;
+		if (!width_ || !height_ || !file_.open(QIODevice::WriteOnly))
+			return false;
+		planes_.resize(width_ * height_ * 3 / 2);
+		QByteArray header = QString("YUV4MPEG2 W%1 H%2 F%3:1 Ip A1:1 C420jpeg\n").arg(width_).arg(height_).arg(fps).toLatin1();
+		return file_.write(header) == header.size();
+	}
+
+	bool write(const unsigned char* rgba)
+	{
+		uchar* y_plane = reinterpret_cast<uchar*>(planes_.data());
+		uchar* u_plane = y_plane + width_ * height_;
+		uchar* v_plane = u_plane + width_ * height_ / 4;
+		const int stride = src_width_ * 4;
+		for (int row = 0; row < height_; row += 2)
+		{
+			// ضͼ¶ ϶
+			const uchar* src0 = rgba + (height_ - 1 - row) * stride;
+			const uchar* src1 = src0 - stride;
+			uchar* y0 = y_plane + row * width_;
+			uchar* y1 = y0 + width_;
+			for (int col = 0; col < width_; col += 2)
+			{
+				int r = 0, g = 0, b = 0;
+				for (int k = 0; k < 2; ++k)
+				{
+					const uchar* p0 = src0 + (col + k) * 4;
+					const uchar* p1 = src1 + (col + k) * 4;
+					y0[col + k] = luma(p0[0], p0[1], p0[2]);
+					y1[col + k] = luma(p1[0], p1[1], p1[2]);
+					r += p0[0] + p1[0];
+					g += p0[1] + p1[1];
+					b += p0[2] + p1[2];
+				}
+				r = (r + 2) >> 2;
+				g = (g + 2) >> 2;
+				b = (b + 2) >> 2;
+				const int chroma = (row / 2) * (width_ / 2) + col / 2;
+				u_plane[chroma] = static_cast<uchar>(qMin((-43 * r - 85 * g + 128 * b + 32896) >> 8, 255));
+				v_plane[chroma] = static_cast<uchar>(qMin((128 * r - 107 * g - 21 * b + 32896) >> 8, 255));
+			}
+		}
+		return file_.write("FRAME\n", 6) == 6 && file_.write(planes_) == planes_.size();
+	}
+
+	void close() { file_.close(); }
+
+private:
+	static uchar luma(int r, int g, int b) { return static_cast<uchar>((77 * r + 150 * g + 29 * b + 128) >> 8); }
+
+	QFile file_;
+	QByteArray planes_;
+	int src_width_;
+	int width_;
+	int height_;
+};
+
+#ifdef _WIN32
+/************************************************************************/
+/* Video for Windows ȡ4ı                                       */
+/* InitEngineᵯѹʽԻ openڽ߳е                */
+/************************************************************************/
+class AVIFrameEncoder : public FrameEncoder
+{
+public:
+	explicit AVIFrameEncoder(const QString& file_name) : file_name_(file_name.toLocal8Bit()), opened_(false) {}
+	~AVIFrameEncoder() { close(); }
+
+	bool open(int width, int height, int fps)
+	{
+		src_width_ = width;
+		generator_.SetRate(fps);
+		generator_.SetBitmapHeader(width, height);
+		generator_.SetFileName(file_name_.constData());
+		bits_.resize(generator_.GetBitmapHeader()->biSizeImage);
+		opened_ = true;
+		return SUCCEEDED(generator_.InitEngine());
+	}
+
+	bool write(const unsigned char* rgba)
+	{
+		// DIBضͼͬΪ¶ ÿBGR
+		const LPBITMAPINFOHEADER lpbih = generator_.GetBitmapHeader();
+		BYTE* dst = reinterpret_cast<BYTE*>(bits_.data());
+		for (int row = 0; row < lpbih->biHeight; ++row)
+		{
+			const uchar* src = rgba + row * src_width_ * 4;
+			for (int col = 0; col < lpbih->biWidth; ++col, src += 4, dst += 3)
+			{
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+			}
+		}
+		return SUCCEEDED(generator_.AddFrame(reinterpret_cast<BYTE*>(bits_.data())));
+	}
+
+	void close()
+	{
+		if (opened_)
+			generator_.ReleaseEngine();
+		opened_ = false;
+	}
+
+private:
+	AVIGenerator generator_;
+	QByteArray file_name_;
+	QByteArray bits_;
+	int src_width_;
+	bool opened_;
+};
+#endif
+
+FrameEncoder* FrameEncoder::create(const QString& file_name)
+{
+	QString suffix = QFileInfo(file_name).suffix().toLower();
+	if (suffix == "y4m")
+		return new Y4MEncoder(file_name);
+	if (suffix == "png" || suffix == "jpg" || suffix == "bmp")
+		return new ImageSequenceEncoder(file_name);
+#ifdef _WIN32
+	if (suffix == "avi")
+		return new AVIFrameEncoder(file_name);
+#endif
+	return nullptr;
+}
+
+QString FrameEncoder::fileFilters()
+{
+	QString filters = "Y4M video (*.y4m);;PNG sequence (*.png);;JPEG sequence (*.jpg);;BMP sequence (*.bmp)";
+#ifdef _WIN32
+	filters += ";;AVI files (*.avi)";
+#endif
+	return filters;
+}
+
+class FrameEncodeThread : public QThread
+{
+public:
+	explicit FrameEncodeThread(FrameCapture* capture) : capture_(capture) {}
+
+protected:
+	void run() { capture_->encodeLoop(); }
+
+private:
+	FrameCapture* capture_;
+};
+
+FrameCapture::FrameCapture(FrameEncoder* encoder, int ring_size, int max_queued)
+	: encoder_(encoder),
+	ring_size_(qMax(ring_size, 1)),
+	max_queued_(qMax(max_queued, 1)),
+	width_(0),
+	height_(0),
+	render_fbo_(nullptr),
+	resolve_fbo_(nullptr),
+	issued_(0),
+	collected_(0),
+	finishing_(false),
+	failed_(false),
+	thread_(nullptr)
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+	if (thread_)
+	{
+		mutex_.lock();
+		finishing_ = true;
+		frame_queued_.wakeAll();
+		mutex_.unlock();
+		thread_->wait();
+		delete thread_;
+		encoder_->close();
+	}
+	qDeleteAll(pbos_);
+	delete render_fbo_;
+	delete resolve_fbo_;
+	delete encoder_;
+}
+
+bool FrameCapture::begin(int width, int height, int fps)
+{
+	if (thread_ || !encoder_ || width <= 0 || height <= 0 || !encoder_->open(width, height, fps))
+		return false;
+	width_ = width;
+	height_ = height;
+
+	QOpenGLFramebufferObjectFormat format;
+	format.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
+	format.setSamples(4);
+	render_fbo_ = new QOpenGLFramebufferObject(width_, height_, format);
+	resolve_fbo_ = new QOpenGLFramebufferObject(width_, height_);
+	if (!render_fbo_->isValid() || !resolve_fbo_->isValid())
+		return false;	// GL_MAX_RENDERBUFFER_SIZE
+
+	for (int i = 0; i < ring_size_; ++i)
+	{
+		QOpenGLBuffer* pbo = new QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+		pbo->create();
+		pbo->setUsagePattern(QOpenGLBuffer::StreamRead);
+		pbo->bind();
+		pbo->allocate(width_ * height_ * 4);
+		pbo->release();
+		pbos_.append(pbo);
+	}
+
+	thread_ = new FrameEncodeThread(this);
+	thread_->start();
+	return true;
+}
+
+void FrameCapture::bindTarget()
+{
+	render_fbo_->bind();
+}
+
+bool FrameCapture::capture()
+{
+	// زһPBOض glReadPixels
+	QOpenGLFramebufferObject::blitFramebuffer(resolve_fbo_, render_fbo_);
+	resolve_fbo_->bind();
+	QOpenGLBuffer* pbo = pbos_[issued_ % ring_size_];
+	pbo->bind();
+	glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	pbo->release();
+	++issued_;
+
+	// PBOڻضʱȡһ ѷring_size-1֡ ͨ
+	if (issued_ - collected_ == ring_size_)
+		collect();
+
+	QMutexLocker locker(&mutex_);
+	return !failed_;
+}
+
+void FrameCapture::collect()
+{
+	const int bytes = width_ * height_ * 4;
+	QByteArray frame;
+	mutex_.lock();
+	while (queued_.size() >= max_queued_ && !failed_)
+		frame_encoded_.wait(&mutex_);
+	if (!free_frames_.isEmpty())
+		frame = free_frames_.takeLast();
+	mutex_.unlock();
+	if (frame.size() != bytes)
+		frame.resize(bytes);
+
+	QOpenGLBuffer* pbo = pbos_[collected_ % ring_size_];
+	pbo->bind();
+	const void* pixels = pbo->map(QOpenGLBuffer::ReadOnly);
+	if (pixels)
+	{
+		memcpy(frame.data(), pixels, bytes);
+		pbo->unmap();
+	}
+	pbo->release();
+	++collected_;
+
+	QMutexLocker locker(&mutex_);
+	if (!pixels)
+	{
+		failed_ = true;
+		return;
+	}
+	queued_.enqueue(frame);
+	frame_queued_.wakeOne();
+}
+
+void FrameCapture::encodeLoop()
+{
+	forever
+	{
+		mutex_.lock();
+		while (queued_.isEmpty() && !finishing_)
+			frame_queued_.wait(&mutex_);
+		if (queued_.isEmpty() || failed_)
+		{
+			mutex_.unlock();
+			break;
+		}
+		QByteArray frame = queued_.dequeue();
+		mutex_.unlock();
+
+		bool written = encoder_->write(reinterpret_cast<const unsigned char*>(frame.constData()));
+
+		QMutexLocker locker(&mutex_);
+		if (!written)
+		{
+			failed_ = true;
+			queued_.clear();
+		}
+		free_frames_.append(frame);
+		frame_encoded_.wakeAll();
+		if (failed_)
+			break;
+	}
+}
+
+bool FrameCapture::finish()
+{
+	if (!thread_)
+		return false;
+
+	while (collected_ < issued_)
+		collect();
+
+	mutex_.lock();
+	finishing_ = true;
+	frame_queued_.wakeAll();
+	mutex_.unlock();
+	thread_->wait();
+	delete thread_;
+	thread_ = nullptr;
+	encoder_->close();
+
+	QOpenGLFramebufferObject::bindDefault();
+	return !failed_;
+}
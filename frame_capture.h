@@ -0,0 +1,93 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <QByteArray>
+#include <QQueue>
+#include <QVector>
+#include <QString>
+#include <QMutex>
+#include <QWaitCondition>
+
+class QThread;
+class QOpenGLBuffer;
+class QOpenGLFramebufferObject;
+
+/************************************************************************/
+/* ֡                                                              */
+/* opencloseڵFrameCapture߳н writeڱ߳н        */
+/* ֡Ϊ¶дŵRGBA ÿwidth*4ֽ                         */
+/************************************************************************/
+class FrameEncoder
+{
+public:
+	virtual ~FrameEncoder() {}
+
+	virtual bool open(int width, int height, int fps) = 0;
+	virtual bool write(const unsigned char* rgba) = 0;
+	virtual void close() = 0;
+
+	// չ .y4mΪYUV4MPEG2ԭʼ(ɽffmpegȱ)
+	// .png .jpg .bmpΪͼ ļ׷֡ .aviWindows ֧ʱnullptr
+	static FrameEncoder* create(const QString& file_name);
+	// ԻʹõĹ
+	static QString fileFilters();
+};
+
+/************************************************************************/
+/* 첽֡                                                            */
+/* ȾֱָʵFBO 봰ڴСǷɼ޹                  */
+/* ضring_sizeػ(PBO) ӳring_size-1֡ȡ      */
+/* GPUˮͣȴ ȡص֡ɺ̨̱߳                     */
+/* еͬһGLĵǰʱ                              */
+/************************************************************************/
+class FrameCapture
+{
+public:
+	// ӹencoder max_queued֡ȴ ʱcaptureȴ߳
+	explicit FrameCapture(FrameEncoder* encoder, int ring_size = 3, int max_queued = 8);
+	~FrameCapture();
+
+	// 򿪱 FBOPBO ߳
+	bool begin(int width, int height, int fps);
+	// FBO ֮Ⱦһ֡captureȡ
+	void bindTarget();
+	// ǰ֡첽ض ضһ֡߳ 󷵻false
+	bool capture();
+	// ȡµ֡ ȴɲرձ ָĬ֡ ȫɹʱtrue
+	bool finish();
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+
+private:
+	// uncopyable
+	FrameCapture(const FrameCapture&);
+	FrameCapture& operator=(const FrameCapture&);
+
+	void collect();		// ӳ緢ضPBO ƺ
+	void encodeLoop();
+
+	friend class FrameEncodeThread;
+
+	FrameEncoder*				encoder_;
+	int							ring_size_;
+	int							max_queued_;
+	int							width_;
+	int							height_;
+	QOpenGLFramebufferObject*	render_fbo_;	// ز
+	QOpenGLFramebufferObject*	resolve_fbo_;
+	QVector<QOpenGLBuffer*>		pbos_;
+	int							issued_;		// ѷض֡
+	int							collected_;		// ȡص֡
+
+	QQueue<QByteArray>			queued_;		// ȴ֡
+	QVector<QByteArray>			free_frames_;	// Ͽɸõ֡
+	bool						finishing_;
+	bool						failed_;
+	QMutex						mutex_;
+	QWaitCondition				frame_queued_;
+	QWaitCondition				frame_encoded_;
+	QThread*					thread_;
+};
+
+#endif // FRAME_CAPTURE_H
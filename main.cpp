@@ -1,15 +1,20 @@
 #include "mainwindow.h"
+#include "batch_simulator.h"
+#include "batch_renderer.h"
 
 #include <QtGui>
 #include <QApplication>
+#ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
+#endif
 
 // error code
 #define OPENGL_NOT_SUPPORTED -1
 
 int main(int argc, char *argv[])
 {
+#ifdef _WIN32
 	if ( AllocConsole() )
 	{
 		int hCrt = _open_osfhandle((long)
@@ -19,6 +24,23 @@ int main(int argc, char *argv[])
 		*stderr = *(::_fdopen(hCrt, "w"));
 		::setvbuf(stderr, NULL, _IONBF, 0);
 	}
+#endif
+
+	// ģʽ 
+	if (BatchSimulator::isBatchCommand(argc, argv))
+	{
+		QCoreApplication app(argc, argv);
+		BatchSimulator batch;
+		return batch.exec(argc, argv);
+	}
+
+	// Ⱦ  ҪQGuiApplicationṩsurface
+	if (BatchRenderer::isRenderCommand(argc, argv))
+	{
+		QGuiApplication app(argc, argv);
+		BatchRenderer renderer;
+		return renderer.exec(argc, argv);
+	}
 
 	QApplication app(argc, argv);
 
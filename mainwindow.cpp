@@ -306,15 +306,14 @@ void MainWindow::updateAnimation(int frame)
 
 void MainWindow::importMocap(QString& asf_file, QString& amc_file)
 {
-	if (scene_->avatar())
+	if (scene_->avatar() && scene_->avatar()->importMocap(asf_file, amc_file))
 	{
-		scene_->avatar()->importMocap(asf_file, amc_file);
 		QMessageBox::information(this, "Mocap import", 
 			QString("Mocap data from file %1 and %2!").arg(asf_file).arg(amc_file), QMessageBox::Ok);
 	}
 	else
 	{
-		QMessageBox::critical(this, "Failed to import %1 and %2", QString("").arg(asf_file).arg(amc_file), QMessageBox::Ok);
+		QMessageBox::critical(this, "Mocap import", QString("Failed to import %1 and %2!").arg(asf_file).arg(amc_file), QMessageBox::Ok);
 	}
 }
 
@@ -7,14 +7,14 @@ MocapImportDialog::MocapImportDialog(QWidget* parent /*= 0*/)
 {
     setupUi(this);
     buttonBox->button(QDialogButtonBox::Ok)->setEnabled(false);
-    connect(asfLineEdit, SIGNAL(editingFinished()), this, SLOT(on_lineEditTextChanged()));
+    connect(asfLineEdit, SIGNAL(textChanged(const QString &)), this, SLOT(on_lineEdit_textChanged()));
     connect(amcLineEdit, SIGNAL(textChanged(const QString &)), this, SLOT(on_lineEdit_textChanged()));
     connect(this, SIGNAL(accepted()), this, SLOT(on_accepted()));
 }
 
 void MocapImportDialog::on_browseASFButton_clicked()
 {
-    QString str = QFileDialog::getOpenFileName(this, tr("Import ASF"),  ".", tr("Acclaim ASF files (*.asf)"));
+    QString str = QFileDialog::getOpenFileName(this, tr("Import ASF"),  ".", tr("Acclaim ASF files (*.asf);;Biovision BVH files (*.bvh)"));
     asfLineEdit->setText(str);
 }
 
@@ -26,10 +26,12 @@ void MocapImportDialog::on_browseAMCButton_clicked()
 
 void MocapImportDialog::on_lineEdit_textChanged()
 {
+    // BVHļԴ AMC
+    bool bvh = asfLineEdit->text().endsWith(".bvh", Qt::CaseInsensitive);
     buttonBox->button(QDialogButtonBox::Ok)->setEnabled(QFileInfo(asfLineEdit->text()).exists() &&
         QFileInfo(asfLineEdit->text()).isFile() && 
-        QFileInfo(amcLineEdit->text()).exists() && 
-        QFileInfo(amcLineEdit->text()).isFile());
+        (bvh || (QFileInfo(amcLineEdit->text()).exists() && 
+        QFileInfo(amcLineEdit->text()).isFile())));
     asf_filename = asfLineEdit->text();
     amc_filename = amcLineEdit->text();
 }
@@ -0,0 +1,493 @@
+#include "mocap_parser.h"
+#include "animation.h"
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <cstring>
+#include <cmath>
+#include <locale>
+#include <sstream>
+#include <string>
+
+static inline bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '(' || c == ')';
+}
+
+static inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/************************************************************************/
+/* ļɨ                                                       */
+/************************************************************************/
+MocapTokenizer::MocapTokenizer()
+	: mapped_(nullptr),
+	cur_(nullptr),
+	end_(nullptr),
+	failed_(false)
+{
+}
+
+MocapTokenizer::~MocapTokenizer()
+{
+	close();
+}
+
+bool MocapTokenizer::open(const QString& filename)
+{
+	close();
+	file_.setFileName(filename);
+	if (!file_.open(QIODevice::ReadOnly))
+		return false;
+
+	const qint64 size = file_.size();
+	if (size > 0)
+		mapped_ = file_.map(0, size);
+	if (mapped_)
+	{
+		cur_ = reinterpret_cast<const char*>(mapped_);
+		end_ = cur_ + size;
+	}
+	else
+	{
+		buffer_ = file_.readAll();
+		cur_ = buffer_.constData();
+		end_ = cur_ + buffer_.size();
+	}
+	return true;
+}
+
+void MocapTokenizer::close()
+{
+	if (mapped_)
+		file_.unmap(mapped_);
+	mapped_ = nullptr;
+	if (file_.isOpen())
+		file_.close();
+	buffer_.clear();
+	cur_ = end_ = nullptr;
+	failed_ = false;
+}
+
+void MocapTokenizer::skipBlank()
+{
+	while (cur_ < end_ && isBlank(*cur_))
+		++cur_;
+}
+
+void MocapTokenizer::skipBlankInLine()
+{
+	while (cur_ < end_ && *cur_ != '\n' && isBlank(*cur_))
+		++cur_;
+}
+
+bool MocapTokenizer::atEnd()
+{
+	skipBlank();
+	return cur_ >= end_;
+}
+
+bool MocapTokenizer::next(const char*& token, int& length)
+{
+	skipBlank();
+	if (cur_ >= end_)
+		return false;
+	token = cur_;
+	while (cur_ < end_ && !isBlank(*cur_))
+		++cur_;
+	length = static_cast<int>(cur_ - token);
+	return true;
+}
+
+bool MocapTokenizer::nextInLine(const char*& token, int& length)
+{
+	skipBlankInLine();
+	if (cur_ >= end_ || *cur_ == '\n')
+		return false;
+	return next(token, length);
+}
+
+bool MocapTokenizer::nextIs(const char* keyword)
+{
+	const char* token;
+	int length;
+	return next(token, length) && equals(token, length, keyword);
+}
+
+bool MocapTokenizer::equals(const char* token, int length, const char* keyword)
+{
+	return static_cast<int>(strlen(keyword)) == length && memcmp(token, keyword, length) == 0;
+}
+
+// β2^53ָ22ʱ һγ˳10ݼɵõȷĽ
+// (λָ ļкټ)׼ⰴC locale
+double MocapTokenizer::nextDouble()
+{
+	static const double kPow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	skipBlank();
+	const char* start = cur_;
+	const char* p = cur_;
+	bool negative = false;
+	if (p < end_ && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	quint64 mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	bool any = false;
+	for (; p < end_ && isDigit(*p); ++p, any = true)
+	{
+		if (digits < 18)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa)
+				++digits;
+		}
+		else
+			++exponent;
+	}
+	if (p < end_ && *p == '.')
+	{
+		for (++p; p < end_ && isDigit(*p); ++p, any = true)
+		{
+			if (digits < 18)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa)
+					++digits;
+				--exponent;
+			}
+		}
+	}
+	if (any && p < end_ && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool negative_exp = false;
+		if (q < end_ && (*q == '-' || *q == '+'))
+			negative_exp = (*q++ == '-');
+		if (q < end_ && isDigit(*q))
+		{
+			int e = 0;
+			for (; q < end_ && isDigit(*q); ++q)
+				if (e < 10000)
+					e = e * 10 + (*q - '0');
+			exponent += negative_exp ? -e : e;
+			p = q;
+		}
+	}
+
+	// ʣµӦǷָ ֵ
+	if (!any || (p < end_ && !isBlank(*p)))
+	{
+		failed_ = true;
+		while (cur_ < end_ && !isBlank(*cur_))
+			++cur_;
+		return 0.0;
+	}
+	cur_ = p;
+
+	if (mantissa > (Q_UINT64_C(1) << 53) || exponent > 22 || exponent < -22)
+	{
+		std::istringstream in(std::string(start, p));
+		in.imbue(std::locale::classic());
+		double value = 0.0;
+		in >> value;
+		return value;
+	}
+
+	double value = static_cast<double>(mantissa);
+	if (exponent >= 0)
+		value *= kPow10[exponent];
+	else
+		value /= kPow10[-exponent];
+	return negative ? -value : value;
+}
+
+int MocapTokenizer::nextInt()
+{
+	skipBlank();
+	const char* p = cur_;
+	bool negative = false;
+	if (p < end_ && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+	int value = 0;
+	const char* first = p;
+	for (; p < end_ && isDigit(*p); ++p)
+		value = value * 10 + (*p - '0');
+	if (p == first || (p < end_ && !isBlank(*p)))
+	{
+		failed_ = true;
+		while (cur_ < end_ && !isBlank(*cur_))
+			++cur_;
+		return 0;
+	}
+	cur_ = p;
+	return negative ? -value : value;
+}
+
+void MocapTokenizer::skipLine()
+{
+	const void* eol = cur_ < end_ ? memchr(cur_, '\n', end_ - cur_) : nullptr;
+	cur_ = eol ? static_cast<const char*>(eol) + 1 : end_;
+}
+
+int MocapTokenizer::countLinesStartingWithDigit() const
+{
+	int count = 0;
+	const char* p = cur_;
+	while (p < end_)
+	{
+		while (p < end_ && (*p == ' ' || *p == '\t'))
+			++p;
+		if (p < end_ && isDigit(*p))
+			++count;
+		const void* eol = p < end_ ? memchr(p, '\n', end_ - p) : nullptr;
+		p = eol ? static_cast<const char*>(eol) + 1 : end_;
+	}
+	return count;
+}
+
+/************************************************************************/
+/* ֵͨ --> ؼ֡                                                    */
+/************************************************************************/
+void appendMocapKeys(AnimationChannel& channel, const MocapDofs& dofs, const double* values, double time, const QVector3D& offset, float scale)
+{
+	static const QVector3D kAxes[3] = { QVector3D(1, 0, 0), QVector3D(0, 1, 0), QVector3D(0, 0, 1) };
+
+	VectorKey pk;
+	pk.time = time;
+	pk.value = offset;
+
+	QuaternionKey qk;
+	qk.time = time;
+
+	for (int i = 0; i < dofs.count; ++i)
+	{
+		const int c = dofs.order[i];
+		if (c <= MocapDofs::TZ)
+			pk.value[c] = values[i] * scale;
+		else
+			qk.value = qk.value * QQuaternion::fromAxisAndAngle(kAxes[c - MocapDofs::RX], values[i]);
+	}
+
+	VectorKey sk;
+	sk.time = time;
+	sk.value = QVector3D(kASFSCALE, kASFSCALE, kASFSCALE);
+
+	channel.position_keys.append(pk);
+	channel.rotation_keys.append(qk);
+	channel.scaling_keys.append(sk);
+}
+
+/************************************************************************/
+/* Ƭζƻ                                                   */
+/* : ļͷ | ÿͨ: ؽ ؽ Ǽܼ¼                  */
+/*       ֹؼ֡ ؼ֡                                      */
+/* λƹؼ֡йؽƫ ͨк Ǽܼ¼ֽڱȽ               */
+/* ͬһAMC(Ĺ)ASFʱʧЧ                                 */
+/* ؼ֡ڴ沼ԭ ͷм¼С ֲͬʱԶʧЧ    */
+/************************************************************************/
+namespace
+{
+	const quint32 kClipMagic = 0x4c434d56;	// "VMCL"
+	const quint32 kClipVersion = 2;
+
+	struct ClipHeader
+	{
+		quint32 magic;
+		quint32 version;
+		quint32 vector_key_size;
+		quint32 quaternion_key_size;
+		qint64  source_size;
+		qint64  source_time;	// Դļ޸ʱ 1970ĺ
+		quint32 frame_number;
+		quint32 channel_count;
+		double  frame_time;
+		double  ticks_per_second;
+		double  ticks;
+		float   scale;			// ؼ֡ʱkASFSCALE
+		quint32 reserved;
+	};
+
+	// ؼ֡ĹؽڹǼ
+	struct ClipJoint
+	{
+		float   offset[3];		// Ըؽڵƫ local_transformƽ
+		quint32 dof_count;
+		uchar   dof_order[6];
+		uchar   reserved[2];
+	};
+
+	// ζӳĻļ Խ缴Ϊ
+	struct ClipReader
+	{
+		const uchar* cur;
+		const uchar* end;
+
+		bool read(void* dst, qint64 size)
+		{
+			if (size < 0 || end - cur < size)
+				return false;
+			memcpy(dst, cur, size);
+			cur += size;
+			return true;
+		}
+
+		template <typename Key>
+		bool readKeys(QVector<Key>& keys, quint32 count)
+		{
+			if (static_cast<quint64>(end - cur) < static_cast<quint64>(count) * sizeof(Key))
+				return false;
+			keys.resize(count);
+			return read(keys.data(), static_cast<qint64>(count) * sizeof(Key));
+		}
+	};
+
+	void fillHeader(ClipHeader& header, const QFileInfo& source)
+	{
+		memset(&header, 0, sizeof(header));
+		header.magic = kClipMagic;
+		header.version = kClipVersion;
+		header.vector_key_size = sizeof(VectorKey);
+		header.quaternion_key_size = sizeof(QuaternionKey);
+		header.source_size = source.size();
+		header.source_time = source.lastModified().toMSecsSinceEpoch();
+		header.scale = kASFSCALE;
+	}
+
+	void fillJoint(ClipJoint& record, const Joint* joint, const MocapDofs& dofs)
+	{
+		memset(&record, 0, sizeof(record));
+		if (joint)
+		{
+			const QVector4D offset = joint->local_transform.column(3);
+			record.offset[0] = offset.x();
+			record.offset[1] = offset.y();
+			record.offset[2] = offset.z();
+		}
+		record.dof_count = dofs.count;
+		memcpy(record.dof_order, dofs.order, dofs.count);
+	}
+}
+
+QString MocapClipCache::cacheFileName(const QString& source)
+{
+	return source + ".clip";
+}
+
+bool MocapClipCache::load(const QString& source, const QVector<Joint*>& joints, const QVector<MocapDofs>& dofs, Animation& anim, uint& frame_number, double& frame_time)
+{
+	QFileInfo source_info(source);
+	QFile file(cacheFileName(source));
+	if (joints.size() != dofs.size() || !source_info.exists() || !file.open(QIODevice::ReadOnly) || file.size() < static_cast<qint64>(sizeof(ClipHeader)))
+		return false;
+	const uchar* data = file.map(0, file.size());
+	if (!data)
+		return false;
+
+	ClipReader reader = { data, data + file.size() };
+	ClipHeader header, expected;
+	fillHeader(expected, source_info);
+	reader.read(&header, sizeof(header));
+	if (header.magic != expected.magic ||
+		header.version != expected.version ||
+		header.vector_key_size != expected.vector_key_size ||
+		header.quaternion_key_size != expected.quaternion_key_size ||
+		header.source_size != expected.source_size ||
+		header.source_time != expected.source_time ||
+		header.scale != expected.scale ||
+		header.channel_count != static_cast<quint32>(joints.size()))
+	{
+		return false;
+	}
+
+	ChannelList channels(joints.size());
+	bool ok = true;
+	for (int i = 0; ok && i < channels.size(); ++i)
+	{
+		AnimationChannel& channel = channels[i];
+		channel.joint = joints[i];
+
+		quint32 name_length = 0;
+		ok = reader.read(&name_length, sizeof(name_length)) && name_length <= static_cast<quint32>(reader.end - reader.cur);
+		if (ok)
+		{
+			const QByteArray name = joints[i]->name.toUtf8();
+			ok = name.size() == static_cast<int>(name_length) && memcmp(reader.cur, name.constData(), name_length) == 0;
+			reader.cur += name_length;
+		}
+
+		ClipJoint record, expected_record;
+		fillJoint(expected_record, joints[i], dofs[i]);
+		ok = ok && reader.read(&record, sizeof(record)) && memcmp(&record, &expected_record, sizeof(record)) == 0;
+
+		quint32 counts[3] = { 0, 0, 0 };
+		ok = ok && reader.read(counts, sizeof(counts)) &&
+			reader.readKeys(channel.position_keys, counts[0]) &&
+			reader.readKeys(channel.rotation_keys, counts[1]) &&
+			reader.readKeys(channel.scaling_keys, counts[2]);
+	}
+	if (!ok)
+		return false;
+
+	anim.channels = channels;
+	anim.ticks_per_second = header.ticks_per_second;
+	anim.ticks = header.ticks;
+	frame_number = header.frame_number;
+	frame_time = header.frame_time;
+	return true;
+}
+
+bool MocapClipCache::save(const QString& source, const QVector<MocapDofs>& dofs, const Animation& anim, uint frame_number, double frame_time)
+{
+	QFileInfo source_info(source);
+	QFile file(cacheFileName(source));
+	if (anim.channels.size() != dofs.size() || !source_info.exists() || !file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+
+	ClipHeader header;
+	fillHeader(header, source_info);
+	header.frame_number = frame_number;
+	header.channel_count = anim.channels.size();
+	header.frame_time = frame_time;
+	header.ticks_per_second = anim.ticks_per_second;
+	header.ticks = anim.ticks;
+
+	bool ok = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == sizeof(header);
+	for (int i = 0; ok && i < anim.channels.size(); ++i)
+	{
+		const AnimationChannel& channel = anim.channels[i];
+		const QByteArray name = channel.joint ? channel.joint->name.toUtf8() : QByteArray();
+		const quint32 name_length = name.size();
+		const quint32 counts[3] = { 
+			static_cast<quint32>(channel.position_keys.size()), 
+			static_cast<quint32>(channel.rotation_keys.size()), 
+			static_cast<quint32>(channel.scaling_keys.size()) 
+		};
+		const qint64 position_bytes = counts[0] * sizeof(VectorKey);
+		const qint64 rotation_bytes = counts[1] * sizeof(QuaternionKey);
+		const qint64 scaling_bytes = counts[2] * sizeof(VectorKey);
+		ClipJoint record;
+		fillJoint(record, channel.joint, dofs[i]);
+
+		ok = file.write(reinterpret_cast<const char*>(&name_length), sizeof(name_length)) == sizeof(name_length) &&
+			file.write(name) == name.size() &&
+			file.write(reinterpret_cast<const char*>(&record), sizeof(record)) == sizeof(record) &&
+			file.write(reinterpret_cast<const char*>(counts), sizeof(counts)) == sizeof(counts) &&
+			file.write(reinterpret_cast<const char*>(channel.position_keys.constData()), position_bytes) == position_bytes &&
+			file.write(reinterpret_cast<const char*>(channel.rotation_keys.constData()), rotation_bytes) == rotation_bytes &&
+			file.write(reinterpret_cast<const char*>(channel.scaling_keys.constData()), scaling_bytes) == scaling_bytes;
+	}
+	file.close();
+
+	// дʧ(Ŀ¼ֻ)ʱ²ȱĻ
+	if (!ok)
+		file.remove();
+	return ok;
+}
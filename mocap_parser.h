@@ -0,0 +1,89 @@
+#ifndef MOCAP_PARSER_H
+#define MOCAP_PARSER_H
+
+#include <QFile>
+#include <QByteArray>
+#include <QVector>
+#include <QVector3D>
+
+class Animation;
+struct AnimationChannel;
+struct Joint;
+
+/************************************************************************/
+/* ļɨ                                                       */
+/* ֱڴӳļɨ ʱַ                        */
+/* հžΪָ(ASFlimitsд"(-160.0 20.0)")                 */
+/************************************************************************/
+class MocapTokenizer
+{
+public:
+	MocapTokenizer();
+	~MocapTokenizer();
+
+	bool open(const QString& filename);	// ӳʧ(Դļ)ʱ˻һԶ
+	void close();
+
+	bool atEnd();									// հ׺Ƿѵļβ
+	bool next(const char*& token, int& length);		// һ
+	bool nextInLine(const char*& token, int& length);	// еһ ޴ʱfalse
+	bool nextIs(const char* keyword);				// һʲkeywordȽ
+	double nextDouble();
+	int nextInt();
+	void skipLine();								// һ
+	int countLinesStartingWithDigit() const;		// Եǰλֿͷ Ԥ֡
+
+	bool failed() const { return failed_; }	// Ƿ޷ֵļβ
+
+	static bool equals(const char* token, int length, const char* keyword);
+
+private:
+	void skipBlank();
+	void skipBlankInLine();
+
+	QFile		file_;
+	QByteArray	buffer_;	// ޷ӳʱļ
+	uchar*		mapped_;
+	const char*	cur_;
+	const char*	end_;
+	bool		failed_;
+};
+
+/************************************************************************/
+/* ؽڵɶͨ AMCdof/BVHCHANNELS                      */
+/* תͨ˳ ԭASFAMCImporterqx * qy * qzһ            */
+/************************************************************************/
+struct MocapDofs
+{
+	enum Channel { TX, TY, TZ, RX, RY, RZ };
+
+	int count;
+	uchar order[6];
+
+	MocapDofs() : count(0) {}
+
+	void append(Channel c) { if (count < 6) order[count++] = c; }
+};
+
+// һ֡ĳؽڵֵͨvalues(ǶȵλΪ)׷Ϊͨtimeʱ̵Ĺؼ֡
+// λoffset(ؽԸؽڵƫ)Ϊ ֵλͨǶӦ
+void appendMocapKeys(AnimationChannel& channel, const MocapDofs& dofs, const double* values, double time, const QVector3D& offset, float scale);
+
+/************************************************************************/
+/* Ƭζƻ                                                   */
+/* ״νѸͨؼ֡ԭдԴļԵ.clipļ                   */
+/* ԴļС ޸ʱ Ǽܹؽ ؽƫ ͨлŲʱΪʧЧ   */
+/* ½                                                             */
+/************************************************************************/
+class MocapClipCache
+{
+public:
+	static QString cacheFileName(const QString& source);
+
+	// joints˳ָͨ ɹʱanim.channels ticks ticks_per_second
+	// dofsjointsӦ ʱõͨ
+	static bool load(const QString& source, const QVector<Joint*>& joints, const QVector<MocapDofs>& dofs, Animation& anim, uint& frame_number, double& frame_time);
+	static bool save(const QString& source, const QVector<MocapDofs>& dofs, const Animation& anim, uint frame_number, double frame_time);
+};
+
+#endif // MOCAP_PARSER_H
@@ -0,0 +1,214 @@
+#include "obstacle_bake.h"
+
+#include <QThread>
+
+class ObstacleBakeThread : public QThread
+{
+public:
+	explicit ObstacleBakeThread(ObstacleBake* bake) : bake_(bake) {}
+
+protected:
+	void run() { bake_->bakeInOrder(); }
+
+private:
+	ObstacleBake* bake_;
+};
+
+ObstacleBake::ObstacleBake(const Avatar* avatar, const Animation* animation, int skin_index, int interval, int frame_count, bool dual_quaternion)
+	: avatar_(avatar),
+	channels_(animation->channels),
+	ticks_per_second_(animation->ticks_per_second),
+	ticks_(animation->ticks),
+	interval_(interval),
+	frame_count_(frame_count),
+	dual_quaternion_(dual_quaternion),
+	palette_size_(avatar->joints_.size()),
+	scale_factor_(avatar->scale_factor_),
+	translate_(avatar->xtranslate_, avatar->ytranslate_, avatar->ztranslate_),
+	baked_(0),
+	baking_(false),
+	cancel_(false),
+	thread_(nullptr)
+{
+	addJoint(avatar->root_, -1, avatar->joints_);
+
+	const Skin& skin = avatar->skins_.at(skin_index);
+	bindpose_pos_ = skin.bindpose_pos;
+	bindpose_norm_ = skin.bindpose_norm;
+	joint_indices_ = skin.joint_indices_;
+	joint_weights_ = skin.joint_weights_;
+	vertex_count_ = bindpose_pos_.size();
+
+	positions_.resize(frame_count_ * vertex_count_ * 3);
+}
+
+ObstacleBake::~ObstacleBake()
+{
+	if (thread_)
+	{
+		mutex_.lock();
+		cancel_ = true;
+		mutex_.unlock();
+		thread_->wait();
+		delete thread_;
+	}
+}
+
+void ObstacleBake::addJoint(const Joint* joint, int parent, const QVector<Joint*>& palette_joints)
+{
+	BakeJoint baked;
+	baked.parent = parent;
+	baked.channel = joint->channel_index;
+	baked.palette = palette_joints.indexOf(const_cast<Joint*>(joint));
+	baked.frozen = (parent >= 0 && joints_[parent].frozen) || joint->channel_index >= channels_.size();
+	baked.local_transform = joint->local_transform;
+	baked.global_transform = joint->global_transform;
+	baked.inverse_bindpose_matrix = joint->inverse_bindpose_matrix;
+	joints_.append(baked);
+
+	int index = joints_.size() - 1;
+	for (auto it = joint->children.begin(); it != joint->children.end(); ++it)
+		addJoint(*it, index, palette_joints);
+}
+
+bool ObstacleBake::matches(const Avatar* avatar, const Animation* animation, int interval, int frame_count, bool dual_quaternion) const
+{
+	return avatar == avatar_ 
+		&& animation->channels.constData() == channels_.constData()
+		&& animation->ticks_per_second == ticks_per_second_
+		&& animation->ticks == ticks_
+		&& interval == interval_ 
+		&& frame_count == frame_count_ 
+		&& dual_quaternion == dual_quaternion_;
+}
+
+void ObstacleBake::bakeFrame(const QMatrix4x4* transforms, SkinningKernel& kernel, double* positions, float* baked)
+{
+	// Avatar::updateTransforms updateJointMatrices updateJointDualQuaternionsͬ ֻǲ޸Avatar
+	QVector<QMatrix4x4> globals(joints_.size());
+	QVector<QMatrix4x4> joint_matrices(palette_size_);
+	QVector<QVector4D> joint_dual_quaternions(palette_size_ * 2);
+	for (int j = 0; j < joints_.size(); ++j)
+	{
+		const BakeJoint& joint = joints_[j];
+		if (joint.frozen)
+		{
+			globals[j] = joint.global_transform;
+		}
+		else
+		{
+			const QMatrix4x4& local = joint.channel != -1 ? transforms[joint.channel] : joint.local_transform;
+			globals[j] = joint.parent >= 0 ? globals[joint.parent] * local : local;
+		}
+		if (joint.palette < 0)
+			continue;
+
+		QMatrix4x4& mat = joint_matrices[joint.palette];
+		mat = globals[j] * joint.inverse_bindpose_matrix;
+		DualQuaternion dq = quatTransToUnitDualQuaternion(matToQuat(mat), mat.column(3).toVector3D());
+		joint_dual_quaternions[joint.palette * 2 + 0] = dq.ordinary.toVector4D();
+		joint_dual_quaternions[joint.palette * 2 + 1] = dq.dual.toVector4D();
+	}
+
+	kernel.setPalette(joint_matrices, joint_dual_quaternions);
+	kernel.skin(dual_quaternion_ ? SkinningKernel::DQS : SkinningKernel::LBS, vertex_count_,
+		bindpose_pos_.constData(), bindpose_norm_.constData(),
+		joint_indices_.constData(), joint_weights_.constData(),
+		scale_factor_, translate_, nullptr, nullptr, positions);
+
+	for (int i = 0; i < vertex_count_ * 3; ++i)
+		baked[i] = static_cast<float>(positions[i]);
+}
+
+void ObstacleBake::bake()
+{
+	if (thread_)
+	{
+		thread_->wait();
+		return;
+	}
+
+	Animation animation;
+	animation.channels = channels_;
+	animation.ticks_per_second = ticks_per_second_;
+	animation.ticks = ticks_;
+	QVector<QMatrix4x4> poses;
+	PoseSampler::sampleRange(&animation, 0, interval_, frame_count_, poses);
+
+	const int channel_count = channels_.size();
+	float* baked = positions_.data();
+#pragma omp parallel
+	{
+		SkinningKernel kernel;
+		QVector<double> positions(vertex_count_ * 3);
+#pragma omp for schedule(dynamic)
+		for (int frame = 0; frame < frame_count_; ++frame)
+			bakeFrame(poses.constData() + frame * channel_count, kernel, positions.data(), baked + frame * vertex_count_ * 3);
+	}
+
+	mutex_.lock();
+	baked_ = frame_count_;
+	mutex_.unlock();
+}
+
+void ObstacleBake::start()
+{
+	if (thread_ || baked_ == frame_count_)
+		return;
+	baking_ = true;
+	thread_ = new ObstacleBakeThread(this);
+	thread_->start();
+}
+
+void ObstacleBake::bakeInOrder()
+{
+	Animation animation;
+	animation.channels = channels_;
+	animation.ticks_per_second = ticks_per_second_;
+	animation.ticks = ticks_;
+
+	PoseSampler sampler;
+	SkinningKernel kernel;
+	QVector<QMatrix4x4> transforms;
+	QVector<double> positions(vertex_count_ * 3);
+	float* baked = positions_.data();
+	for (int frame = 0; frame < frame_count_; ++frame)
+	{
+		// ȵ̬֡
+		double time_in_tick = frame * interval_ * 0.001 * ticks_per_second_;
+		sampler.sample(&animation, qMin(time_in_tick, ticks_), transforms);
+		bakeFrame(transforms.constData(), kernel, positions.data(), baked + frame * vertex_count_ * 3);
+
+		QMutexLocker locker(&mutex_);
+		baked_ = frame + 1;
+		frame_baked_.wakeAll();
+		if (cancel_)
+			break;
+	}
+
+	QMutexLocker locker(&mutex_);
+	baking_ = false;
+	frame_baked_.wakeAll();
+}
+
+bool ObstacleBake::copyFrame(int frame, double* positions)
+{
+	Q_ASSERT(frame >= 0 && frame < frame_count_);
+	frame = qBound(0, frame, frame_count_ - 1);
+	start();
+
+	mutex_.lock();
+	while (baked_ <= frame && baking_)
+		frame_baked_.wait(&mutex_);
+	bool baked = baked_ > frame;
+	if (!baked)
+		frame = baked_ - 1;
+	mutex_.unlock();
+	if (frame < 0)
+		return false;
+
+	const float* src = positions_.constData() + frame * vertex_count_ * 3;
+	for (int i = 0; i < vertex_count_ * 3; ++i)
+		positions[i] = src[i];
+	return baked;
+}
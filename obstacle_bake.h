@@ -0,0 +1,92 @@
+#ifndef OBSTACLE_BAKE_H
+#define OBSTACLE_BAKE_H
+
+#include <QVector>
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <QVector4D>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include "animation.h"
+
+class QThread;
+
+/************************************************************************/
+/* ϰ̬決                                                        */
+/* ģǰ֡Ƥλ Ϊյ֡鹩ģʹ        */
+/* ʱƹǼ ƤͶ ֮ٷAvatar OpenGLͽ          */
+/* ں̨߳ģ決 ͬһģװʱظʹ         */
+/************************************************************************/
+class ObstacleBake
+{
+public:
+	// 決0ʱÿinterval빲frame_count֡ skin_indexƤλ
+	ObstacleBake(const Avatar* avatar, const Animation* animation, int skin_index, int interval, int frame_count, bool dual_quaternion);
+	~ObstacleBake();
+
+	// Ƿͬ Ͳʽ決 (༭ͬ)
+	bool matches(const Avatar* avatar, const Animation* animation, int interval, int frame_count, bool dual_quaternion) const;
+
+	void bake();	// ڵǰ߳вк決֡
+	void start();	// ں̨߳а֡決 ѿʼ
+
+	int frameCount() const { return frame_count_; }
+	int vertexCount() const { return vertex_count_; }
+
+	// ȡframe֡λ(ƽ ÿxyz) ̨δ決֡ʱȴ δʼ決ں̨ʼ
+	// ̨ڸ֮֡ǰѽ(ȡ)ʱȡѺ決һ֡false һ֡Ҳûʱдpositions
+	bool copyFrame(int frame, double* positions);
+
+private:
+	// uncopyable
+	ObstacleBake(const ObstacleBake&);
+	ObstacleBake& operator=(const ObstacleBake&);
+
+	// ؽǰ˳չĹǼ
+	struct BakeJoint
+	{
+		int parent;					// ؽjoints_еλ Ϊ-1
+		int channel;				// ͨ ͨΪ-1
+		int palette;				// Avatar::joints_е ƤΪ-1
+		bool frozen;				// ͨԽ Avatar::updateTransformsһ±ԭ任
+		QMatrix4x4 local_transform;
+		QMatrix4x4 global_transform;
+		QMatrix4x4 inverse_bindpose_matrix;
+	};
+
+	void addJoint(const Joint* joint, int parent, const QVector<Joint*>& palette_joints);
+	// ɸֲͨ任Ƥ positionsΪ˫ʱ дbaked
+	void bakeFrame(const QMatrix4x4* transforms, SkinningKernel& kernel, double* positions, float* baked);
+	void bakeInOrder();
+
+	friend class ObstacleBakeThread;
+
+	const Avatar*		avatar_;
+	ChannelList			channels_;		// 붯ʽ ޸ʱ߷
+	double				ticks_per_second_;
+	double				ticks_;
+	int					interval_;
+	int					frame_count_;
+	bool				dual_quaternion_;
+
+	QVector<BakeJoint>	joints_;
+	int					palette_size_;
+	QVector<QVector3D>	bindpose_pos_;
+	QVector<QVector3D>	bindpose_norm_;
+	QVector<QVector4D>	joint_indices_;
+	QVector<QVector4D>	joint_weights_;
+	double				scale_factor_;
+	QVector3D			translate_;
+	int					vertex_count_;
+
+	QVector<float>		positions_;		// ֡ ÿxyz
+	int					baked_;			// Ѱ֡決ɵ֡
+	bool				baking_;		// ̨߳ں決
+	bool				cancel_;
+	QMutex				mutex_;
+	QWaitCondition		frame_baked_;
+	QThread*			thread_;
+};
+
+#endif // OBSTACLE_BAKE_H
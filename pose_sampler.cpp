@@ -0,0 +1,142 @@
+#include "pose_sampler.h"
+#include "animation.h"
+
+#include <algorithm>
+
+// αԲҵ öֲ
+static const int kMaxCursorSteps = 4;
+
+template <typename Key>
+static bool keyTimeLess(double time, const Key& key)
+{
+	return time < key.time;
+}
+
+// timeڵĹؼ֡: һʱ䲻timeĹؼ֡(Ϊ0֡)
+// ӵ0֡ʼԲһ
+template <typename Key>
+static int findKey(const QVector<Key>& keys, double time, int& cursor)
+{
+	const int last = keys.size() - 1;
+	if (cursor < 0 || cursor > last || (cursor > 0 && time < keys[cursor].time))
+		cursor = 0;
+
+	int steps = 0;
+	while (cursor < last && time >= keys[cursor + 1].time)
+	{
+		if (++steps > kMaxCursorSteps)
+		{
+			const Key* first = keys.constData() + cursor + 1;
+			const Key* end = keys.constData() + last + 1;
+			cursor = std::upper_bound(first, end, time, keyTimeLess<Key>) - keys.constData() - 1;
+			break;
+		}
+		++cursor;
+	}
+	return cursor;
+}
+
+// һͨtime_in_tickʱ̵ľֲ任 ֵʽԭAvatar::updateAnimationһ
+static void sampleChannel(const AnimationChannel& channel, double ticks, double time_in_tick, PoseSampler::Cursor& cursor, QMatrix4x4& mat)
+{
+	// λ
+	QVector3D present_position(0, 0, 0);
+	if (!channel.position_keys.empty()) 
+	{
+		int frame = findKey(channel.position_keys, time_in_tick, cursor.position);
+
+		// ؼֵ֮֡
+		int next_frame = (frame + 1) % channel.position_keys.size();
+		const VectorKey& key = channel.position_keys[frame];
+		const VectorKey& next_key = channel.position_keys[next_frame];
+		double diff_time = next_key.time - key.time;
+		if (diff_time < 0.0)
+			diff_time += ticks;
+		if (diff_time > 0) 
+		{
+			float factor = static_cast<float>((time_in_tick - key.time) / diff_time);
+			present_position = key.value + (next_key.value - key.value) * factor;
+		} 
+		else 
+		{
+			present_position = key.value;
+		}
+	}
+
+	// ת SLERP
+	QQuaternion present_rotation(1, 0, 0, 0);
+	if (!channel.rotation_keys.empty()) 
+	{
+		int frame = findKey(channel.rotation_keys, time_in_tick, cursor.rotation);
+
+		int next_frame = (frame + 1) % channel.rotation_keys.size();
+		const QuaternionKey& key = channel.rotation_keys[frame];
+		const QuaternionKey& next_key = channel.rotation_keys[next_frame];
+		double diff_time = next_key.time - key.time;
+		if (diff_time < 0)
+			diff_time += ticks;
+		if (diff_time > 0) 
+		{
+			float factor = static_cast<float>((time_in_tick - key.time) / diff_time);
+			present_rotation = QQuaternion::slerp(key.value, next_key.value, factor);
+		} 
+		else 
+		{
+			present_rotation = key.value;
+		}
+	}
+
+	// 
+	QVector3D present_scaling(1, 1, 1);
+	if (!channel.scaling_keys.empty()) 
+		present_scaling = channel.scaling_keys[findKey(channel.scaling_keys, time_in_tick, cursor.scaling)].value;
+
+	// 任
+	mat.setToIdentity();
+	mat.translate(present_position);
+	mat.rotate(present_rotation);
+	mat.scale(present_scaling);
+}
+
+void PoseSampler::sample(const Animation* animation, double time_in_tick, QVector<QMatrix4x4>& transforms)
+{
+	const int channel_count = animation->channels.size();
+	if (animation_ != animation || cursors_.size() != channel_count)
+	{
+		// ˶ αͷʼ
+		animation_ = animation;
+		cursors_.fill(Cursor(), channel_count);
+	}
+	if (transforms.size() != channel_count)
+		transforms.resize(channel_count);
+
+	const AnimationChannel* channels = animation->channels.constData();
+	Cursor* cursors = cursors_.data();
+	QMatrix4x4* mats = transforms.data();
+#pragma omp parallel for
+	for (int channel_index = 0; channel_index < channel_count; ++channel_index)
+		sampleChannel(channels[channel_index], animation->ticks, time_in_tick, cursors[channel_index], mats[channel_index]);
+}
+
+void PoseSampler::sampleRange(const Animation* animation, int start_time, int interval, int count, QVector<QMatrix4x4>& poses)
+{
+	const int channel_count = animation->channels.size();
+	poses.resize(count * channel_count);
+
+	const AnimationChannel* channels = animation->channels.constData();
+	QMatrix4x4* mats = poses.data();
+#pragma omp parallel
+	{
+		// ÿ̴߳һʱ άα
+		QVector<Cursor> cursors(channel_count);
+#pragma omp for schedule(static)
+		for (int i = 0; i < count; ++i)
+		{
+			// ȵʱ̱̬
+			double time_in_tick = (start_time + i * interval) * 0.001 * animation->ticks_per_second;
+			time_in_tick = std::min(time_in_tick, animation->ticks);
+			for (int c = 0; c < channel_count; ++c)
+				sampleChannel(channels[c], animation->ticks, time_in_tick, cursors[c], mats[i * channel_count + c]);
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef POSE_SAMPLER_H
+#define POSE_SAMPLER_H
+
+#include <QVector>
+#include <QMatrix4x4>
+
+class Animation;
+
+/************************************************************************/
+/* ̬                                                           */
+/* ÿͨסϴڵĹؼ֡ ˳򲥷ʱӸô                  */
+/* ʱ䵹˻ԾԶ(϶)ʱöֲ                             */
+/************************************************************************/
+class PoseSampler
+{
+public:
+	PoseSampler() : animation_(nullptr) {}
+
+	// ͨtime_in_tickʱ̵ľֲ任 ͨм
+	void sample(const Animation* animation, double time_in_tick, QVector<QMatrix4x4>& transforms);
+
+	// ԤȲstart_timeÿinterval빲countʱ̵̬ λ
+	// ʱposes iʱ̵cͨλposes[i * ͨ + c]
+	static void sampleRange(const Animation* animation, int start_time, int interval, int count, QVector<QMatrix4x4>& poses);
+
+	// ÿͨλ ת ŹϴڵĹؼ֡
+	struct Cursor
+	{
+		int position, rotation, scaling;
+		Cursor() : position(0), rotation(0), scaling(0) {}
+	};
+
+private:
+	const Animation*	animation_;
+	QVector<Cursor>		cursors_;
+};
+
+#endif // POSE_SAMPLER_H
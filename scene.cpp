@@ -17,6 +17,7 @@
 #include "gadget.h"
 #include "bounding_volume.h"
 #include "pattern.h"
+#include "obstacle_bake.h"
 
 /************************************************************************/
 /* 泡                                                              */
@@ -37,8 +38,10 @@ Scene::Scene( QObject* parent )
 	  is_dual_quaternion_skinning_(true),
 	  is_joint_label_visible_(false),
 	  cloth_handler_(new ClothHandler()),
+	  obstacle_bake_(nullptr),
 	  gpu_skinning_(false),
-	  replay_(false)
+	  replay_(false),
+	  hold_cloth_buffers_(false)
 {
 	model_matrix_.setToIdentity();
 
@@ -58,6 +61,7 @@ Scene::~Scene()
 	for (int i = 0; i < lights_.size(); ++i)
 		delete lights_[i];
 
+	delete obstacle_bake_;
 	delete avatar_;
 
 	for (int i = 0; i < clothes_.size(); ++i)
@@ -292,6 +296,8 @@ void Scene::importAvatar( const QString& filename )
 {
 	ai_scene_ = aiImportFile(filename.toStdString().c_str(),
 		aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_LimitBoneWeights); // ǻ ƽ ÿؽ4Ȩ
+	delete obstacle_bake_;
+	obstacle_bake_ = nullptr;
 	delete avatar_;
 	avatar_ = new Avatar(ai_scene_, filename);
 	//scaleAvatar();
@@ -343,9 +349,10 @@ void Scene::renderClothes(QOpenGLShaderProgramPtr & shader) const
 		{
 			cloth_textures_[i]->bind();
 		}
-		clothes_[i]->cloth_update_buffer();
+		if(!hold_cloth_buffers_)
+			clothes_[i]->cloth_update_buffer();
 		QOpenGLVertexArrayObject::Binder binder( clothes_[i]->vao() );
-		glDrawArrays(GL_TRIANGLES, 0, clothes_[i]->face_count() * 3);
+		glDrawElements(GL_TRIANGLES, clothes_[i]->index_count(), GL_UNSIGNED_INT, 0);
 	}
 }
 
@@ -358,7 +365,7 @@ void Scene::renderClothesForPick(QOpenGLShaderProgramPtr & shader) const
 		shader->setUniformValue("Color", color);
 		clothes_[i]->cloth_update_buffer();
 		QOpenGLVertexArrayObject::Binder binder( clothes_[i]->vao() );
-		glDrawArrays(GL_TRIANGLES, 0, clothes_[i]->face_count() * 3);
+		glDrawElements(GL_TRIANGLES, clothes_[i]->index_count(), GL_UNSIGNED_INT, 0);
 	}
 }
 
@@ -404,7 +411,7 @@ void Scene::updateAvatarAnimation(const Animation* anim, int elapsed_time)
 		avatar_->updateAnimation(anim, elapsed_time);
 		if(!gpu_skinning_)
 		{
-			avatar_->skinning();
+			avatar_->skinning(is_dual_quaternion_skinning_);
 			avatar_->updateSkinVBO();
 		}
 	}
@@ -485,23 +492,26 @@ void Scene::prepareCloth()
 	{
 		if(!(*cloth_it)->vao())
 		{
-			(*cloth_it)->setVAO(new QOpenGLVertexArrayObject(this));
-			(*cloth_it)->vao()->create();
-			QOpenGLVertexArrayObject::Binder binder( (*cloth_it)->vao() );
+			QOpenGLVertexArrayObject * vao = new QOpenGLVertexArrayObject(this);
+			vao->create();
+			(*cloth_it)->setVAO(vao);
+			QOpenGLVertexArrayObject::Binder binder( vao );
 			QOpenGLShaderProgramPtr shading_display_shader = shading_display_material_->shader();
 			shading_display_shader->bind();
 
-			(*cloth_it)->position_buffer()->bind();
+			// λ뷨߽ͬһ
+			const int stride = ClothVertexStream::VertexFloats * sizeof(float);
+			(*cloth_it)->vertex_buffer()->bind();
 			shading_display_shader->enableAttributeArray( "VertexPosition" );
-			shading_display_shader->setAttributeBuffer( "VertexPosition", GL_FLOAT, 0, 3 );	
-
-			(*cloth_it)->normal_buffer()->bind();
+			shading_display_shader->setAttributeBuffer( "VertexPosition", GL_FLOAT, 0, 3, stride );	
 			shading_display_shader->enableAttributeArray( "VertexNormal" );
-			shading_display_shader->setAttributeBuffer( "VertexNormal", GL_FLOAT, 0, 3 );
+			shading_display_shader->setAttributeBuffer( "VertexNormal", GL_FLOAT, 3 * sizeof(float), 3, stride );
 
 			(*cloth_it)->texcoord_buffer()->bind();
 			shading_display_shader->enableAttributeArray( "VertexTexCoord" );
 			shading_display_shader->setAttributeBuffer( "VertexTexCoord", GL_FLOAT, 0, 2 );
+
+			(*cloth_it)->index_buffer()->bind();
 		}
 	}
 }
@@ -790,18 +800,21 @@ void Scene::pickCloth(BYTE red, bool hover)
 		hover_cloth_index_ = -1;
 }
 
-void Scene::initAvatar2Simulation()
+void Scene::initAvatar2Simulation(const Animation* anim, int frame_count)
 {
+	// ͬһģװʱеĺ決
+	if (!obstacle_bake_ || !obstacle_bake_->matches(avatar_, anim, AnimationClip::SAMPLE_SLICE, frame_count, is_dual_quaternion_skinning_))
+	{
+		delete obstacle_bake_;
+		obstacle_bake_ = new ObstacleBake(avatar_, anim, 0, AnimationClip::SAMPLE_SLICE, frame_count, is_dual_quaternion_skinning_);
+	}
+	obstacle_bake_->start();
+
 	const Skin & skin = avatar_->skins().at(0);
 
-	size_t size = skin.positions.size();
+	size_t size = obstacle_bake_->vertexCount();
 	double * position = new double[size * 3];
-	for(size_t i = 0; i < size; ++i)
-	{
-		const QVector3D & point = skin.positions[i];
-		for(int j = 0; j < 3; ++j)
-			position[i * 3 + j] = point[j];
-	}
+	obstacle_bake_->copyFrame(0, position);
 
 	size = skin.texcoords.size();
 	double * texcoord = new double[size * 2];
@@ -824,6 +837,7 @@ void Scene::initAvatar2Simulation()
 		position, 
 		texcoord, 
 		indices, 
+		skin.positions.size(),
 		skin.num_triangles);
 
 	delete[] position;
@@ -831,21 +845,14 @@ void Scene::initAvatar2Simulation()
 	delete[] indices;
 }
 
-void Scene::updateAvatar2Simulation()
+void Scene::updateAvatar2Simulation(int step)
 {
-	const Skin & skin = avatar_->skins().at(0);
-
-	size_t size = skin.positions.size();
-	double * position = new double[size * 3];
-	for(size_t i = 0; i < size; ++i)
-	{
-		const QVector3D & point = skin.positions[i];
-		for(int j = 0; j < 3; ++j)
-			position[i * 3 + j] = point[j];
-	}
-
-	cloth_handler_->update_avatars_to_handler(position);
-	delete[] position;
+	// ̬֡ȡԺ決 ֱдģϰؼ̬ ģⲽǰؼֵ̬
+	int factor = AnimationClip::SAMPLE_SLICE / AnimationClip::SIM_SLICE;
+	int offset = (step - 1) % factor + 1;
+	if (offset == 1)
+		obstacle_bake_->copyFrame((step - 1) / factor + 1, cloth_handler_->next_avatar_key());
+	cloth_handler_->update_avatars_to_handler(static_cast<double>(offset) / factor);
 }
 
 bool Scene::startSimulate()
@@ -865,7 +872,52 @@ void Scene::writeAFrame(int frame)
 
 void Scene::finishedSimulate()
 {
-	replay_ = true;
+	cloth_handler_->save_cmfile();
+	replay_ = cloth_handler_->load_cmfile_to_replay(cloth_handler_->cmfile_name().c_str());
+}
+
+bool Scene::loadReplay(const QString& file_name)
+{
+	replay_ = cloth_handler_->load_cmfile_to_replay(file_name.toLocal8Bit().constData());
+	return replay_;
+}
+
+int Scene::replayFrameCount() const
+{
+	return replay_ ? cloth_handler_->replay_frame_count() : 0;
+}
+
+void Scene::renderViews(const QVector<QRect>& viewports, const QVector<QPointF>& angles)
+{
+	for(int i = 0; i < clothes_.size(); ++i)
+		clothes_[i]->cloth_update_buffer();
+	hold_cloth_buffers_ = true;
+
+	// ת̨Χת fitBoundingSphere׼һ
+	QVector3D center = avatar_ ? Sphere(avatar_->bounding_aabb_).c : QVector3D();
+	QMatrix4x4 model_matrix = model_matrix_;
+
+	// üʹrender()еglClearֻӽǵ
+	glEnable(GL_SCISSOR_TEST);
+	for(int i = 0; i < viewports.size(); ++i)
+	{
+		const QRect& viewport = viewports[i];
+		glViewport(viewport.x(), viewport.y(), viewport.width(), viewport.height());
+		glScissor(viewport.x(), viewport.y(), viewport.width(), viewport.height());
+		camera_->setViewportWidth(viewport.width());
+		camera_->setViewportHeight(viewport.height());
+
+		model_matrix_.setToIdentity();
+		model_matrix_.translate(center);
+		model_matrix_.rotate(angles[i].y(), 1.0f, 0.0f, 0.0f);
+		model_matrix_.rotate(angles[i].x(), 0.0f, 1.0f, 0.0f);
+		model_matrix_.translate(-center);
+		render();
+	}
+	glDisable(GL_SCISSOR_TEST);
+
+	model_matrix_ = model_matrix;
+	hold_cloth_buffers_ = false;
 }
 
 void Scene::setClothTexture(QString texture_name)
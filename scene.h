@@ -11,6 +11,8 @@
 #include <QColor>
 #include <QStringList>
 #include <QTreeWidget>
+#include <QRect>
+#include <QPointF>
 
 #include "abstractscene.h"
 #include "material.h"
@@ -22,6 +24,7 @@ class Light;
 struct DecorativeObject;
 class QOpenGLFunctions_4_0_Core;
 class ClothHandler;
+class ObstacleBake;
 class Line;
 /************************************************************************/
 /* 泡                                                              */
@@ -52,7 +55,7 @@ public:
 
 	void updateAvatarAnimation(const Animation* anim, int elapsed_time);	// avatar
 	void updateClothAnimation(int frame);
-	void updateAvatar2Simulation();
+	void updateAvatar2Simulation(int step);	// ֡ϰؼ̬ ģⲽֵ
 	void restoreToBindpose();						                // л̬
 
 	void renderFloor() const;
@@ -63,13 +66,18 @@ public:
 
 	bool pick(const QPoint& pt);    // ʰȡе
 	void pickCloth(BYTE red, bool hover);
-	void initAvatar2Simulation();
+	void initAvatar2Simulation(const Animation* anim, int frame_count);	// 決frame_count֡λ
 	bool startSimulate();
 	bool simulateStep();
 	void writeAFrame(int frame);
 	void finishedSimulate();
 
 	bool isReplay() {return replay_;}
+	bool loadReplay(const QString& file_name);	// ģ⻺ط װ뻺еһ
+	int replayFrameCount() const;
+	// ͬһ֡ĶӽǷֱȾǰ֡Ĳͬ װֻϴһ
+	// anglesΪӽĵת̨Ƕ(ƫ, ) λΪ
+	void renderViews(const QVector<QRect>& viewports, const QVector<QPointF>& angles);
 	void setClothColor(QVector4D color) { color_[cur_cloth_index_] = color; cloth_textures_[cur_cloth_index_].clear(); }
 	void setClothTexture(QString texture_name);
 
@@ -160,8 +168,10 @@ private:
 	// wnfӣװģ⹦ģ
 	typedef size_t ClothIndex;
 	ClothHandler * cloth_handler_;
+	ObstacleBake * obstacle_bake_;	// ֡λ ͬһϿظʹ
 	QVector<QVector4D> color_;
 	bool replay_;
+	bool hold_cloth_buffers_;	// ӽȾʱװ
 	static const QVector4D ori_color_[4];
 	ClothIndex cur_cloth_index_;
 	ClothIndex hover_cloth_index_;
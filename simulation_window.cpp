@@ -1,6 +1,7 @@
 #include "simulation_window.h"
 
 #include "scene.h"
+#include "frame_capture.h"
 #include <QtGui>
 #include <QtWidgets/QtWidgets>
 #include <QOpenGLShaderProgram>
@@ -194,12 +195,17 @@ void SimulationWindow::wheelEvent( QWheelEvent *event )
 // }
 
 void SimulationWindow::updateAnimation(const Animation* anim, int frame)
+{
+	setAnimationFrame(anim, frame);
+	paintGL();
+}
+
+void SimulationWindow::setAnimationFrame(const Animation* anim, int frame)
 {
 	// AvatarCloth
 	scene_->updateAvatarAnimation(anim, frame * AnimationClip::SAMPLE_SLICE);
 	if(scene_->isReplay())
 		scene_->updateClothAnimation(frame);
-	paintGL();
 }
 
 void SimulationWindow::restoreToBindpose()
@@ -223,7 +229,7 @@ void SimulationWindow::paintForPick()
 
 unsigned char SimulationWindow::pickColor(QPoint pos)
 {
-	BYTE data[3];
+	unsigned char data[3];
 	paintForPick();
 	glReadBuffer(GL_BACK);
 	glReadPixels(pos.x(), height() - pos.y(), 1, 1, GL_RGB,GL_UNSIGNED_BYTE, data);
@@ -259,63 +265,60 @@ void SimulationWindow::startSimulate(const Animation* anim)
 			break;  
 		if(!inited)
 		{
-			scene_->updateAvatarAnimation(anim, 0);
-			scene_->initAvatar2Simulation();
+			scene_->initAvatar2Simulation(anim, total_frame / factor + 2);
 			if(!scene_->startSimulate()) {
 				process.cancel();
+				QMessageBox::critical(NULL, "error", "Initial separation or relaxation failed to converge!");
 				break;
 			}
 			inited = true;
 		}
 		else
 		{
-			scene_->updateAvatarAnimation(anim, i * AnimationClip::SIM_SLICE);
-			scene_->updateAvatar2Simulation();
+			scene_->updateAvatar2Simulation(i);
 			if(!scene_->simulateStep()) {
 				process.cancel();
+				QMessageBox::critical(NULL, "error", "Collision resolution failed to converge!");
 				break;
 			}
 		}
 
+		// ֻڲ֡ʾ ģλѾ決
 		if(i % factor == 0)
+		{
 			scene_->writeAFrame(i / factor);
-		paintGL();
+			scene_->updateAvatarAnimation(anim, i * AnimationClip::SIM_SLICE);
+			paintGL();
+		}
 	}
 	scene_->finishedSimulate();
 
 	QMessageBox::information(NULL, "Simulation finished", "Simulation finished.", QMessageBox::Ok);
 }
 
-void SimulationWindow::record(const Animation* anim)
+void SimulationWindow::record(const Animation* anim, const QSize& size)
 {
-	QString file_name = QFileDialog::getSaveFileName(NULL, tr("Save As AVI"),  ".", tr("AVI files (*.avi)"));
-
-	AviGen = new AVIGenerator;
-
-	// set 15fps
-	AviGen->SetRate(15);
-	
-	// give info about bitmap
-	AviGen->SetBitmapHeader(width(), height());		
-
-	// set filename, extension ".avi" is appended if necessary
-	AviGen->SetFileName(file_name.toLocal8Bit().constData());
-
-	// retreiving size of image
-	lpbih=AviGen->GetBitmapHeader();
+	QString file_name = QFileDialog::getSaveFileName(NULL, tr("Record"),  ".", FrameEncoder::fileFilters());
+	if (file_name.isEmpty())
+		return;
 
-	// allocating memory
-	bmBits=new BYTE[lpbih->biSizeImage];
+	FrameEncoder* encoder = FrameEncoder::create(file_name);
+	if (!encoder)
+	{
+		QMessageBox::critical(0, "error", "Unsupported output format!");
+		return;
+	}
 
-	HRESULT hr=AviGen->InitEngine();
-	if (FAILED(hr))
+	// ȾFBO ֱ봰޹ ضͱ붼첽
+	const QSize frame_size = size.isValid() ? size : this->size();
+	context_->makeCurrent(this);
+	FrameCapture capture(encoder);
+	if (!capture.begin(frame_size.width(), frame_size.height(), 1000 / AnimationClip::SAMPLE_SLICE))
 	{
-		QMessageBox::critical(0, "error", "InitEngine error!");
-		AviGen->ReleaseEngine();
-		delete[] bmBits;
-		delete AviGen;
+		QMessageBox::critical(0, "error", "Failed to open output!");
 		return;
 	}
+	scene_->resize(frame_size.width(), frame_size.height());
 
 	double length;
 	if (anim->ticks_per_second) {
@@ -333,30 +336,31 @@ void SimulationWindow::record(const Animation* anim)
 	process.setModal(true);  
 	process.setCancelButtonText(tr("cancel"));
 
+	bool succeeded = true;
 	for(int i = 0; i < total_frame; ++i)
 	{
-		updateAnimation(anim, i);
 		process.setValue(i + 1);
 		if(process.wasCanceled())  
 			break;
 
-		glReadBuffer(GL_BACK);
-		glReadPixels(0,0,lpbih->biWidth,lpbih->biHeight,GL_BGR_EXT,GL_UNSIGNED_BYTE,bmBits); 
-		// send to avi engine
-		HRESULT hr=AviGen->AddFrame(bmBits);
-		if (FAILED(hr))
+		context_->makeCurrent(this);
+		setAnimationFrame(anim, i);
+		capture.bindTarget();
+		scene_->render();
+		if (!capture.capture())
 		{
-			QMessageBox::critical(0, "error", "AddFrame error!");
-			AviGen->ReleaseEngine();
-			delete[] bmBits;
-			delete AviGen;
-			return;
+			succeeded = false;
+			break;
 		}
-		glReadBuffer(GL_FRONT);
 	}
-	
-	AviGen->ReleaseEngine();
-	delete[] bmBits;
-	delete AviGen;
-	QMessageBox::information(NULL, "Record finished", "Record finished.", QMessageBox::Ok);
-}
\ No newline at end of file
+
+	context_->makeCurrent(this);
+	succeeded = capture.finish() && succeeded;
+	scene_->resize(width(), height());
+	paintGL();
+
+	if (!succeeded)
+		QMessageBox::critical(0, "error", "Encoding error!");
+	else
+		QMessageBox::information(NULL, "Record finished", "Record finished.", QMessageBox::Ok);
+}
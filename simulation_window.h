@@ -3,7 +3,6 @@
 
 #include <QWindow>
 #include <QTime>
-#include "AVIGenerator.h"
 
 class Scene;
 class Animation;
@@ -18,7 +17,8 @@ public:
 	void initializeGL();
 	void paintGL();
 	void paintForPick();
-	void record(const Animation* anim);
+	// ֡Ⱦ sizeЧʱȡڴС
+	void record(const Animation* anim, const QSize& size = QSize());
 
 public slots:
 	void updateAnimation(const Animation* anim, int frame);
@@ -33,6 +33,7 @@ protected:
 	void mouseMoveEvent( QMouseEvent *event );
 	void wheelEvent( QWheelEvent *event );
 	unsigned char pickColor(QPoint pos);
+	void setAnimationFrame(const Animation* anim, int frame);
 
 //     void keyPressEvent( QKeyEvent* e );
 //     void keyReleaseEvent( QKeyEvent* e );
@@ -44,10 +45,6 @@ private:
 	bool m_leftButtonPressed;
 	QPoint cur_pos_;
 	QPoint prev_pos_;
-
-	AVIGenerator * AviGen;
-	LPBITMAPINFOHEADER lpbih;
-	BYTE * bmBits;
 };
 
 #endif // SIMULATION_WINDOW_H
@@ -0,0 +1,139 @@
+#include "skinning.h"
+
+#include <xmmintrin.h>
+
+// С ÿ߳һδĶ
+static const int kBlockSize = 256;
+
+void SkinningKernel::setPalette(const QVector<QMatrix4x4>& joint_matrices, const QVector<QVector4D>& joint_dual_quaternions)
+{
+	matrices_.resize(joint_matrices.size() * 12);
+	for (int j = 0; j < joint_matrices.size(); ++j)
+		for (int row = 0; row < 3; ++row)
+			for (int col = 0; col < 4; ++col)
+				matrices_[j * 12 + row * 4 + col] = joint_matrices[j](row, col);
+
+	dual_quaternions_.resize(joint_dual_quaternions.size() * 4);
+	for (int j = 0; j < joint_dual_quaternions.size(); ++j)
+		for (int k = 0; k < 4; ++k)
+			dual_quaternions_[j * 4 + k] = joint_dual_quaternions[j][k];
+}
+
+// skinning.vertһ ĸȨȡ1ȥǰ֮
+static inline void blendWeights(const QVector4D& joint_indices, const QVector4D& joint_weights, int index[4], float weight[4])
+{
+	for (int k = 0; k < 4; ++k)
+		index[k] = static_cast<int>(joint_indices[k]);
+	weight[0] = joint_weights.x();
+	weight[1] = joint_weights.y();
+	weight[2] = joint_weights.z();
+	weight[3] = 1.0f - (weight[0] + weight[1] + weight[2]);
+}
+
+// Ϻ3x4дc0..c3 c3Ϊƽ
+static inline void blendMatrices(const float* palette, const int index[4], const float weight[4],
+	__m128& c0, __m128& c1, __m128& c2, __m128& c3)
+{
+	__m128 r0 = _mm_setzero_ps(), r1 = _mm_setzero_ps(), r2 = _mm_setzero_ps(), r3 = _mm_setzero_ps();
+	for (int k = 0; k < 4; ++k)
+	{
+		if (weight[k] == 0.0f)
+			continue;
+		const float* m = palette + index[k] * 12;
+		__m128 w = _mm_set1_ps(weight[k]);
+		r0 = _mm_add_ps(r0, _mm_mul_ps(w, _mm_loadu_ps(m)));
+		r1 = _mm_add_ps(r1, _mm_mul_ps(w, _mm_loadu_ps(m + 4)));
+		r2 = _mm_add_ps(r2, _mm_mul_ps(w, _mm_loadu_ps(m + 8)));
+	}
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	c0 = r0; c1 = r1; c2 = r2; c3 = r3;
+}
+
+// ˫ԪתΪblendMatricesͬʽ skinning.vertdualQuatToMatrix
+static inline void blendDualQuaternions(const float* palette, const int index[4], const float weight[4],
+	__m128& c0, __m128& c1, __m128& c2, __m128& c3)
+{
+	__m128 first = _mm_loadu_ps(palette + index[0] * 8);
+	__m128 qn = _mm_setzero_ps(), qd = _mm_setzero_ps();
+	for (int k = 0; k < 4; ++k)
+	{
+		if (weight[k] == 0.0f)
+			continue;
+		const float* dq = palette + index[k] * 8;
+		__m128 ordinary = _mm_loadu_ps(dq);
+		// һؽڵʵ෴ʱȡ ֤·ֵ
+		__m128 d = _mm_mul_ps(first, ordinary);
+		float dot[4];
+		_mm_storeu_ps(dot, d);
+		float sign = (dot[0] + dot[1] + dot[2] + dot[3] < 0.0f) ? -weight[k] : weight[k];
+		__m128 w = _mm_set1_ps(sign);
+		qn = _mm_add_ps(qn, _mm_mul_ps(w, ordinary));
+		qd = _mm_add_ps(qd, _mm_mul_ps(w, _mm_loadu_ps(dq + 4)));
+	}
+
+	float n[4], t[4];
+	_mm_storeu_ps(n, qn);
+	_mm_storeu_ps(t, qd);
+	float x = n[0], y = n[1], z = n[2], w = n[3];
+	float t0 = t[3], t1 = t[0], t2 = t[1], t3 = t[2];
+	float inv = 1.0f / (w*w + x*x + y*y + z*z);
+
+	c0 = _mm_mul_ps(_mm_setr_ps(w*w + x*x - y*y - z*z, 2*x*y + 2*w*z, 2*x*z - 2*w*y, 0), _mm_set1_ps(inv));
+	c1 = _mm_mul_ps(_mm_setr_ps(2*x*y - 2*w*z, w*w + y*y - x*x - z*z, 2*y*z + 2*w*x, 0), _mm_set1_ps(inv));
+	c2 = _mm_mul_ps(_mm_setr_ps(2*x*z + 2*w*y, 2*y*z - 2*w*x, w*w + z*z - x*x - y*y, 0), _mm_set1_ps(inv));
+	c3 = _mm_mul_ps(_mm_setr_ps(-2*t0*x + 2*w*t1 - 2*t2*z + 2*y*t3,
+		-2*t0*y + 2*t1*z - 2*x*t3 + 2*w*t2,
+		-2*t0*z + 2*x*t2 + 2*w*t3 - 2*t1*y, 0), _mm_set1_ps(inv));
+}
+
+void SkinningKernel::skin(Method method, int vertex_count,
+	const QVector3D* bind_positions, const QVector3D* bind_normals,
+	const QVector4D* joint_indices, const QVector4D* joint_weights,
+	double scale, const QVector3D& translate,
+	QVector3D* positions, QVector3D* normals, double* sim_positions) const
+{
+	if (vertex_count <= 0 || matrices_.isEmpty())
+		return;
+
+	const float* palette = (method == DQS) ? dual_quaternions_.constData() : matrices_.constData();
+	int block_count = (vertex_count + kBlockSize - 1) / kBlockSize;
+
+#pragma omp parallel for schedule(dynamic)
+	for (int block = 0; block < block_count; ++block)
+	{
+		int begin = block * kBlockSize;
+		int end = qMin(begin + kBlockSize, vertex_count);
+		for (int v = begin; v < end; ++v)
+		{
+			int index[4];
+			float weight[4];
+			blendWeights(joint_indices[v], joint_weights[v], index, weight);
+
+			__m128 c0, c1, c2, c3;
+			if (method == DQS)
+				blendDualQuaternions(palette, index, weight, c0, c1, c2, c3);
+			else
+				blendMatrices(palette, index, weight, c0, c1, c2, c3);
+
+			const QVector3D& p = bind_positions[v];
+			const QVector3D& n = bind_normals[v];
+			__m128 position = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(p.x())), _mm_mul_ps(c1, _mm_set1_ps(p.y()))),
+				_mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(p.z())), c3));
+			__m128 normal = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(n.x())), _mm_mul_ps(c1, _mm_set1_ps(n.y()))),
+				_mm_mul_ps(c2, _mm_set1_ps(n.z())));
+
+			float out[4];
+			_mm_storeu_ps(out, position);
+			if (positions)
+				positions[v] = QVector3D(out[0] * scale + translate.x(), out[1] * scale + translate.y(), out[2] * scale + translate.z());
+			if (sim_positions)
+				for (int k = 0; k < 3; ++k)
+					sim_positions[v * 3 + k] = out[k] * scale + translate[k];
+			if (normals)
+			{
+				_mm_storeu_ps(out, normal);
+				normals[v] = QVector3D(out[0], out[1], out[2]);
+			}
+		}
+	}
+}
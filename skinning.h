@@ -0,0 +1,36 @@
+#ifndef SKINNING_H
+#define SKINNING_H
+
+#include <QVector>
+#include <QVector3D>
+#include <QVector4D>
+#include <QMatrix4x4>
+
+/************************************************************************/
+/* CPUƤ                                                             */
+/* ÿ̬ɹؽھ/˫Ԫһνյĵɫ ֮󰴶鲢Ƥ   */
+/* ӰؽȡSkin::joint_indices_/joint_weights_ skinning.vertһ     */
+/************************************************************************/
+class SkinningKernel
+{
+public:
+	enum Method { LBS, DQS };	// ԻƤ ˫ԪƤ
+
+	// joint_matrices: ؽȫֱ任 * ̬
+	// joint_dual_quaternions: ÿؽQVector4D (ʵ ż)
+	void setPalette(const QVector<QMatrix4x4>& joint_matrices, const QVector<QVector4D>& joint_dual_quaternions);
+
+	// Ƥдpositions/normals λƽƺдsim_positions(ÿxyz)
+	// Ϊ
+	void skin(Method method, int vertex_count,
+		const QVector3D* bind_positions, const QVector3D* bind_normals,
+		const QVector4D* joint_indices, const QVector4D* joint_weights,
+		double scale, const QVector3D& translate,
+		QVector3D* positions, QVector3D* normals, double* sim_positions) const;
+
+private:
+	QVector<float> matrices_;			// ÿؽ3x4
+	QVector<float> dual_quaternions_;	// ÿؽ8 ʵxyzw żxyzw
+};
+
+#endif // SKINNING_H